@@ -48,6 +48,7 @@ static void __attribute__((format(__printf__, 4, 5))) update_status(
 	status.type = type;
 	status.backlog = false;
 	status.boot_active = type == STATUS_INFO;
+	status.progress = false;
 
 	pb_debug("boot status: [%d] %s\n", type, status.message);
 
@@ -56,24 +57,120 @@ static void __attribute__((format(__printf__, 4, 5))) update_status(
 	talloc_free(status.message);
 }
 
+static void boot_finish(struct boot_task *task, int rc);
+static void cleanup_cancellations(struct boot_task *task,
+		struct load_url_result *cur_result);
+
+/* kexec load actions, in the order that we try them */
+static const char *kexec_load_args[] = { "-l", "-s" };
+
+static void kexec_load_exit(struct process *process);
+
+/* Start the kexec load, using the first of the remaining load actions that
+ * we can. Returns non-zero if there are none left. */
+static int kexec_load_start(struct boot_task *boot_task)
+{
+	const struct system_info *sysinfo;
+	const char **argv = boot_task->kexec_argv;
+	struct process *process;
+
+	sysinfo = system_info_get();
+
+	for (; boot_task->kexec_load_idx < ARRAY_SIZE(kexec_load_args);
+			boot_task->kexec_load_idx++) {
+		/* our first argument is the action: -s or -l */
+		argv[1] = kexec_load_args[boot_task->kexec_load_idx];
+
+		/* if we're enforcing, we know a -l load will fail; skip */
+		if (sysinfo->stb_os_enforcing && argv[1][1] == 'l')
+			continue;
+
+		process = process_create(boot_task);
+		if (!process) {
+			pb_log_fn("failed to create process\n");
+			continue;
+		}
+
+		process->path = pb_system_apps.kexec;
+		process->argv = argv;
+		process->keep_stdout = true;
+		process->add_stderr = true;
+		process->exit_cb = kexec_load_exit;
+		process->data = boot_task;
+
+		if (process_run_async_job(process, PROCESS_JOB_BOOT)) {
+			pb_log_fn("failed to run process\n");
+			process_release(process);
+			continue;
+		}
+
+		boot_task->kexec_process = process;
+		return 0;
+	}
+
+	return -1;
+}
+
+static void kexec_load_exit(struct process *process)
+{
+	struct boot_task *boot_task = process->data;
+	char *err_buf = NULL;
+	int result = 0;
+
+	boot_task->kexec_process = NULL;
+
+	if (boot_task->cancelled) {
+		process_release(process);
+		validate_boot_files_cleanup(boot_task);
+		cleanup_cancellations(boot_task, NULL);
+		return;
+	}
+
+	if (!process_exit_ok(process)) {
+		result = -1;
+
+		if (process->stdout_len)
+			err_buf = talloc_strndup(boot_task, process->stdout_buf,
+					process->stdout_len);
+
+		pb_log_fn("kexec load (%s) failed (rc %d): %s\n",
+				process->argv[1],
+				WEXITSTATUS(process->exit_status),
+				err_buf ?: "");
+	}
+
+	process_release(process);
+
+	if (result) {
+		/* try the next load action, if there is one */
+		boot_task->kexec_load_idx++;
+		if (!kexec_load_start(boot_task))
+			return;
+
+		update_status(boot_task->status_fn, boot_task->status_arg,
+				STATUS_ERROR, _("kexec load failed: %s"),
+				err_buf ?: "(no output)");
+	}
+
+	validate_boot_files_cleanup(boot_task);
+
+	boot_finish(boot_task, result);
+}
+
 /**
  * kexec_load - kexec load helper.
+ *
+ * Starts the kexec load; the boot is continued from kexec_load_exit()
+ * once it completes. Returns non-zero if the load could not be started.
  */
 static int kexec_load(struct boot_task *boot_task)
 {
-	const char *load_args[] = {"-l", "-s"};
-	const struct system_info *sysinfo;
-	struct process *process;
 	char *s_initrd = NULL;
 	char *s_args = NULL;
-	const char *argv[8];
+	const char **argv;
 	char *s_dtb = NULL;
 	const char **p;
-	char *err_buf;
 	int result;
-	size_t i;
-
-	sysinfo = system_info_get();
 
 	boot_task->local_initrd_override = NULL;
 	boot_task->local_dtb_override = NULL;
@@ -114,7 +211,12 @@ static int kexec_load(struct boot_task *boot_task)
 	const char* local_image = (boot_task->local_image_override) ?
 		boot_task->local_image_override : boot_task->local_image;
 
-	/* set up process arguments */
+	/* set up process arguments; these need to outlive this function, as
+	 * the load actions are run asynchronously */
+	argv = talloc_zero_array(boot_task, const char *, 8);
+	boot_task->kexec_argv = argv;
+	boot_task->kexec_load_idx = 0;
+
 	p = argv;
 	*p++ = pb_system_apps.kexec;	/* 1 */
 	*p++ = NULL;			/* 2; modified below */
@@ -145,58 +247,13 @@ static int kexec_load(struct boot_task *boot_task)
 	*p++ = local_image;		/* 7 */
 	*p++ = NULL;			/* 8 */
 
-	err_buf = NULL;
-
-	for (i = 0; i < ARRAY_SIZE(load_args); i++) {
-		/* our first argument is the action: -s or -l */
-		argv[1] = load_args[i];
-
-		/* if we're enforcing, we know a -l load will fail; skip */
-		if (sysinfo->stb_os_enforcing && argv[1][1] == 'l')
-			continue;
-
-		process = process_create(boot_task);
-		if (!process) {
-			result = -1;
-			pb_log_fn("failed to create process\n");
-			continue;
-		}
-
-		process->path = pb_system_apps.kexec;
-		process->argv = argv;
-		process->keep_stdout = true;
-		process->add_stderr = true;
-
-		result = process_run_sync(process);
-		if (result) {
-			pb_log_fn("failed to run process\n");
-			continue;
-		}
-
-		result = 0;
-
-		if (process_exit_ok(process))
-			break;
-
-		result = -1;
-
-		if (process->stdout_len)
-			err_buf = talloc_strndup(boot_task, process->stdout_buf,
-					process->stdout_len);
-
-		pb_log_fn("kexec load (%s) failed (rc %d): %s\n", argv[1],
-				WEXITSTATUS(process->exit_status),
-				err_buf ?: "");
-
-		process_release(process);
-	}
-
-	if (result)
+	result = kexec_load_start(boot_task);
+	if (result) {
 		update_status(boot_task->status_fn, boot_task->status_arg,
 				STATUS_ERROR, _("kexec load failed: %s"),
-				err_buf ?: "(no output)");
-
-	validate_boot_files_cleanup(boot_task);
+				"(no output)");
+		validate_boot_files_cleanup(boot_task);
+	}
 
 	return result;
 }
@@ -444,6 +501,13 @@ static void cleanup_cancellations(struct boot_task *task,
 		}
 	}
 
+	/* the kexec load may be in progress too; kexec_load_exit() will
+	 * call us again once it has stopped */
+	if (task->kexec_process) {
+		process_stop_async(task->kexec_process);
+		pending = true;
+	}
+
 	if (!pending)
 		talloc_free(task);
 }
@@ -496,8 +560,19 @@ static void boot_process(struct load_url_result *result, void *data)
 			_("Performing kexec load"));
 
 	rc = kexec_load(task);
+	if (!rc)
+		return;
 
 no_load:
+	boot_finish(task, rc);
+}
+
+/* Complete the boot, once all of the resources are loaded and the kexec
+ * load has finished (or either has failed) */
+static void boot_finish(struct boot_task *task, int rc)
+{
+	struct boot_resource *resource;
+
 	list_for_each_entry(&task->resources, resource, list)
 		cleanup_load(resource->result);
 
@@ -521,8 +596,8 @@ static int start_url_load(struct boot_task *task, struct boot_resource *res)
 	if (!res)
 		return 0;
 
-	res->result = load_url_async(task, res->url, boot_process,
-				 task, NULL, task->status_arg);
+	res->result = load_url_async_job(task, res->url, PROCESS_JOB_BOOT,
+				 boot_process, task, NULL, task->status_arg);
 	if (!res->result) {
 		pb_log("Error starting load for %s at %s\n",
 				res->name, pb_url_to_string(res->url));
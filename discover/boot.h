@@ -6,6 +6,7 @@
 
 struct boot_option;
 struct boot_command;
+struct process;
 
 typedef void (*boot_status_fn)(void *arg, struct status *);
 
@@ -35,6 +36,9 @@ struct boot_task {
 	const char *local_dtb_signature;
 	const char *local_cmdline_signature;
 	struct list resources;
+	const char **kexec_argv;
+	unsigned int kexec_load_idx;
+	struct process *kexec_process;
 };
 
 struct boot_resource {
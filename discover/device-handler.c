@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <mntent.h>
 #include <locale.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
@@ -20,6 +21,8 @@
 #include <url/url.h>
 #include <i18n/i18n.h>
 #include <pb-config/pb-config.h>
+#include <util/util.h>
+#include <worker/worker.h>
 
 #include <sys/sysmacros.h>
 #include <sys/types.h>
@@ -41,6 +44,9 @@
 #include "udev.h"
 #include "network.h"
 #include "ipmi.h"
+#include "option-cache.h"
+#include "device-index.h"
+#include "resolve-queue.h"
 
 enum default_priority {
 	DEFAULT_PRIORITY_TEMP_USER	= 1,
@@ -51,6 +57,8 @@ enum default_priority {
 };
 
 static int default_rescan_timeout = 5 * 60; /* seconds */
+static unsigned int discover_workers = 4;
+static const char *option_cache_path;
 
 struct progress_info {
 	unsigned int			percentage;
@@ -77,6 +85,7 @@ struct device_handler {
 
 	struct discover_device	**devices;
 	unsigned int		n_devices;
+	struct device_index	*device_index;
 
 	struct ramdisk_device	**ramdisks;
 	unsigned int		n_ramdisks;
@@ -92,6 +101,7 @@ struct device_handler {
 	int			default_boot_option_priority;
 
 	struct list		unresolved_boot_options;
+	struct resolve_queue	*resolve_queue;
 
 	struct boot_task	*pending_boot;
 	bool			pending_boot_is_default;
@@ -104,13 +114,70 @@ struct device_handler {
 	bool			plugin_installing;
 
 	struct list		crypt_devices;
+
+	struct workqueue	*workqueue;
+	struct list		discover_jobs;
+	unsigned int		n_parsing;
+
+	/* Parsers running in a worker look devices up without the main loop,
+	 * so changes to the devices array and index are made under this lock.
+	 * Devices removed while any parsers are running are kept on
+	 * removed_devices until they finish. */
+	pthread_rwlock_t	devices_lock;
+	void			*removed_devices;
+
+	struct option_cache	*option_cache;
 };
 
+/* Discovery of a single hotplugged device, when mounting and parsing in
+ * worker threads. Jobs are kept in the handler's discover_jobs list in the
+ * order that they were started, and their results are committed in that
+ * order too. The paths and fs type are copied here, as the mount worker
+ * can't safely access the device itself.
+ *
+ * While the parsers run in a worker, they only use the job's private
+ * context, and status messages are held in the job's statuses list until
+ * the parse completes on the main loop.
+ */
+struct discover_job {
+	struct device_handler	*handler;
+	struct discover_device	*device;
+	struct discover_context	*ctx;
+	struct list_item	list;
+	struct list		statuses;
+	bool			complete;
+	bool			failed;
+	bool			retried;
+
+	char			*device_path;
+	char			*mount_path;
+	char			*fstype;
+	bool			have_snapshot;
+	int			rc;
+	int			err;
+};
+
+struct discover_job_status {
+	struct list_item	list;
+	enum status_type	type;
+	char			*message;
+};
+
+/* the job whose parsers are running in this thread, if any */
+static __thread struct discover_job *parse_job;
+
 static int mount_device(struct discover_device *dev);
+static int mount_device_async(struct discover_job *job);
 static int umount_device(struct discover_device *dev);
+static void device_handler_plugin_scan_device(struct device_handler *handler,
+		struct discover_device *dev);
+static void discover_context_parse(struct device_handler *handler,
+		struct discover_context *ctx);
 
 static int device_handler_init_sources(struct device_handler *handler);
 static void device_handler_reinit_sources(struct device_handler *handler);
+static void device_handler_reconfigure(struct device_handler *handler,
+		const struct config *old_config);
 
 static void device_handler_update_lang(const char *lang);
 
@@ -187,46 +254,20 @@ struct discover_boot_option *discover_boot_option_create(
 	return opt;
 }
 
-static int device_match_uuid(struct discover_device *dev, const char *uuid)
-{
-	return dev->uuid && !strcmp(dev->uuid, uuid);
-}
-
-static int device_match_label(struct discover_device *dev, const char *label)
-{
-	return dev->label && !strcmp(dev->label, label);
-}
-
-static int device_match_id(struct discover_device *dev, const char *id)
-{
-	return !strcmp(dev->device->id, id);
-}
-
-static int device_match_serial(struct discover_device *dev, const char *serial)
-{
-	const char *val = discover_device_get_param(dev, "ID_SERIAL");
-	return val && !strcmp(val, serial);
-}
-
 static struct discover_device *device_lookup(
 		struct device_handler *device_handler,
-		int (match_fn)(struct discover_device *, const char *),
-		const char *str)
+		enum device_index_key key, const char *str)
 {
 	struct discover_device *dev;
-	unsigned int i;
 
 	if (!str)
 		return NULL;
 
-	for (i = 0; i < device_handler->n_devices; i++) {
-		dev = device_handler->devices[i];
-
-		if (match_fn(dev, str))
-			return dev;
-	}
+	pthread_rwlock_rdlock(&device_handler->devices_lock);
+	dev = device_index_lookup(device_handler->device_index, key, str);
+	pthread_rwlock_unlock(&device_handler->devices_lock);
 
-	return NULL;
+	return dev;
 }
 
 struct discover_device *device_lookup_by_name(struct device_handler *handler,
@@ -242,32 +283,34 @@ struct discover_device *device_lookup_by_uuid(
 		struct device_handler *device_handler,
 		const char *uuid)
 {
-	return device_lookup(device_handler, device_match_uuid, uuid);
+	return device_lookup(device_handler, DEVICE_INDEX_UUID, uuid);
 }
 
 struct discover_device *device_lookup_by_label(
 		struct device_handler *device_handler,
 		const char *label)
 {
-	return device_lookup(device_handler, device_match_label, label);
+	return device_lookup(device_handler, DEVICE_INDEX_LABEL, label);
 }
 
 struct discover_device *device_lookup_by_id(
 		struct device_handler *device_handler,
 		const char *id)
 {
-	return device_lookup(device_handler, device_match_id, id);
+	return device_lookup(device_handler, DEVICE_INDEX_ID, id);
 }
 
 struct discover_device *device_lookup_by_serial(
 		struct device_handler *device_handler,
 		const char *serial)
 {
-	return device_lookup(device_handler, device_match_serial, serial);
+	return device_lookup(device_handler, DEVICE_INDEX_SERIAL, serial);
 }
 
 void device_handler_destroy(struct device_handler *handler)
 {
+	/* wait for the workers before freeing any of their jobs */
+	talloc_free(handler->workqueue);
 	talloc_free(handler);
 }
 
@@ -276,6 +319,19 @@ static int destroy_device(void *arg)
 	struct discover_device *dev = arg;
 	struct process *p;
 
+	/* any mount in progress is cleaned up when it completes */
+	if (dev->discover_job) {
+		dev->discover_job->device = NULL;
+		dev->discover_job = NULL;
+	}
+
+	if (dev->plugin_scan) {
+		dev->plugin_scan->exit_cb = NULL;
+		process_stop_async(dev->plugin_scan);
+		process_release(dev->plugin_scan);
+		dev->plugin_scan = NULL;
+	}
+
 	umount_device(dev);
 
 	devmapper_destroy_snapshot(dev);
@@ -402,11 +458,15 @@ struct device_handler *device_handler_init(struct discover_server *server,
 	handler->waitset = waitset;
 	handler->dry_run = dry_run;
 	handler->autoboot_enabled = config_autoboot_active(config_get());
+	handler->device_index = device_index_create(handler);
 
 	list_init(&handler->unresolved_boot_options);
+	handler->resolve_queue = resolve_queue_create(handler, handler);
 
 	list_init(&handler->progress);
 	list_init(&handler->crypt_devices);
+	list_init(&handler->discover_jobs);
+	pthread_rwlock_init(&handler->devices_lock, NULL);
 
 	/* set up our mount point base */
 	pb_mkdir_recursive(mount_base());
@@ -427,13 +487,35 @@ struct device_handler *device_handler_init(struct discover_server *server,
 	return handler;
 }
 
+/* Free a device that is no longer in the devices array. Parsers running in
+ * a worker may still be using it after a lookup, so while any are in flight
+ * it is kept until they have all finished. */
+static void device_handler_free_device(struct device_handler *handler,
+		struct discover_device *device)
+{
+	if (device->discover_job) {
+		device->discover_job->device = NULL;
+		device->discover_job = NULL;
+	}
+
+	if (!handler->n_parsing) {
+		talloc_free(device);
+		return;
+	}
+
+	if (!handler->removed_devices)
+		handler->removed_devices = talloc_new(handler);
+	talloc_steal(handler->removed_devices, device);
+}
+
 void device_handler_reinit(struct device_handler *handler)
 {
 	struct discover_boot_option *opt, *tmp;
 	struct crypt_info *crypt, *c;
+	struct discover_device **devices;
 	struct ramdisk_device *ramdisk;
+	unsigned int i, n_devices;
 	struct config *config;
-	unsigned int i;
 
 	device_handler_cancel_default(handler);
 	/* Cancel any pending non-default boot */
@@ -454,20 +536,28 @@ void device_handler_reinit(struct device_handler *handler)
 	list_init(&handler->unresolved_boot_options);
 
 	/* drop all devices */
-	for (i = 0; i < handler->n_devices; i++) {
-		struct discover_device *device = handler->devices[i];
+	pthread_rwlock_wrlock(&handler->devices_lock);
+	devices = handler->devices;
+	n_devices = handler->n_devices;
+	handler->devices = NULL;
+	handler->n_devices = 0;
+	device_index_clear(handler->device_index);
+	pthread_rwlock_unlock(&handler->devices_lock);
+
+	for (i = 0; i < n_devices; i++) {
+		struct discover_device *device = devices[i];
 		discover_server_notify_device_remove(handler->server,
 				device->device);
-		ramdisk = device->ramdisk;
 		if (device->requery_waiter)
 			waiter_remove(device->requery_waiter);
-		talloc_free(device);
-		talloc_free(ramdisk);
+		/* the snapshot is torn down when the device is freed */
+		ramdisk = device->ramdisk;
+		if (ramdisk)
+			talloc_steal(device, ramdisk);
+		device_handler_free_device(handler, device);
 	}
 
-	talloc_free(handler->devices);
-	handler->devices = NULL;
-	handler->n_devices = 0;
+	talloc_free(devices);
 	talloc_free(handler->ramdisks);
 	handler->ramdisks = NULL;
 	handler->n_ramdisks = 0;
@@ -544,17 +634,21 @@ void device_handler_remove(struct device_handler *handler,
 	if (device->device->type == DEVICE_TYPE_NETWORK)
 		network_unregister_device(handler->network, device);
 
+	pthread_rwlock_wrlock(&handler->devices_lock);
+	device_index_remove(handler->device_index, device);
+
 	handler->n_devices--;
 	memmove(&handler->devices[i], &handler->devices[i + 1],
 		(handler->n_devices - i) * sizeof(handler->devices[0]));
 	handler->devices = talloc_realloc(handler, handler->devices,
 		struct discover_device *, handler->n_devices);
+	pthread_rwlock_unlock(&handler->devices_lock);
 
 	if (device->notified)
 		discover_server_notify_device_remove(handler->server,
 							device->device);
 
-	talloc_free(device);
+	device_handler_free_device(handler, device);
 }
 
 void device_handler_status(struct device_handler *handler,
@@ -567,12 +661,23 @@ void device_handler_status(struct device_handler *handler,
 static void _device_handler_vstatus(struct device_handler *handler,
 		enum status_type type, const char *fmt, va_list ap)
 {
+	struct discover_job_status *job_status;
 	struct status status;
 
+	/* we're in a worker; hold this until the job's parse completes */
+	if (parse_job) {
+		job_status = talloc(parse_job, struct discover_job_status);
+		job_status->type = type;
+		job_status->message = talloc_vasprintf(job_status, fmt, ap);
+		list_add_tail(&parse_job->statuses, &job_status->list);
+		return;
+	}
+
 	status.type = type;
 	status.message = talloc_vasprintf(handler, fmt, ap);
 	status.backlog = false;
 	status.boot_active = false;
+	status.progress = false;
 
 	device_handler_status(handler, &status);
 
@@ -585,8 +690,8 @@ static void _device_handler_vdevstatus(struct device_handler *handler,
 {
 	char *msg;
 
-	msg = talloc_asprintf(handler, "[%s] %s",
-			device ? device->device->id : "unknown", fmt);
+	msg = talloc_asprintf(parse_job ? (void *)parse_job : handler,
+			"[%s] %s", device ? device->device->id : "unknown", fmt);
 	_device_handler_vstatus(handler, type, msg, ap);
 	talloc_free(msg);
 }
@@ -637,6 +742,7 @@ void device_handler_status_download(struct device_handler *handler,
 {
 	struct progress_info *p, *progress = NULL;
 	uint64_t current_converted, current = 0;
+	struct status status;
 	const char *units = " kMGTP";
 	unsigned long size_bytes;
 	char *update = NULL;
@@ -716,25 +822,18 @@ void device_handler_status_download(struct device_handler *handler,
 
 	if (!update) {
 		pb_log_fn("failed to allocate new status\n");
-	} else {
-		device_handler_status_info(handler, "%s\n", update);
-		talloc_free(update);
+		return;
 	}
-}
 
-static void device_handler_plugin_scan_device(struct device_handler *handler,
-		struct discover_device *dev)
-{
-	int rc;
+	status.type = STATUS_INFO;
+	status.message = talloc_asprintf_append(update, "\n");
+	status.backlog = false;
+	status.boot_active = false;
+	status.progress = true;
 
-	pb_debug("Scanning %s for plugin files\n", dev->device->id);
+	device_handler_status(handler, &status);
 
-	rc = process_run_simple(handler, pb_system_apps.pb_plugin,
-				"scan", dev->mount_path,
-				NULL);
-	if (rc)
-		pb_log("Error from pb-plugin scan %s\n",
-				dev->mount_path);
+	talloc_free(status.message);
 }
 
 void device_handler_status_download_remove(struct device_handler *handler,
@@ -775,6 +874,7 @@ static void countdown_status(struct device_handler *handler,
 			_("Booting in %d sec: [%s] %s"), sec,
 			opt->device->device->id, opt->option->name);
 	status.backlog = false;
+	status.progress = true;
 
 	device_handler_status(handler, &status);
 
@@ -1126,30 +1226,68 @@ static void notify_boot_option(struct device_handler *handler,
 		discover_server_notify_device_add(handler->server,
 						  opt->device->device);
 	dev->notified = true;
-	discover_server_notify_boot_option_add(handler->server, opt->option);
+	discover_server_notify_boot_option_add(handler->server,
+			dev->device, opt->option);
+}
+
+/* The id, uuid or label of the device that the option's first unresolved
+ * resource is waiting for, or NULL if the parser can't tell us */
+static const char *boot_option_dependency(struct discover_boot_option *opt)
+{
+	struct resource *resources[] = {
+		opt->boot_image, opt->initrd, opt->dtb, opt->args_sig_file,
+		opt->icon,
+	};
+	unsigned int i;
+
+	if (!opt->source->resource_dependency)
+		return NULL;
+
+	for (i = 0; i < ARRAY_SIZE(resources); i++)
+		if (!resource_is_resolved(resources[i]))
+			return opt->source->resource_dependency(resources[i]);
+
+	return NULL;
 }
 
+/* Retry resolution for the unresolved options that are waiting for devices
+ * added since the last run */
 static void process_boot_option_queue(struct device_handler *handler)
 {
-	struct discover_boot_option *opt, *tmp;
+	struct discover_boot_option *opt, **opts;
+	int i, n;
 
-	list_for_each_entry_safe(&handler->unresolved_boot_options,
-			opt, tmp, list) {
+	n = resolve_queue_take_woken(handler->resolve_queue, handler, &opts);
+
+	for (i = 0; i < n; i++) {
+		opt = opts[i];
 
 		pb_debug("queue: attempting resolution for %s\n",
 				opt->option->id);
 
-		if (!boot_option_resolve(opt, handler))
+		if (!boot_option_resolve(opt, handler)) {
+			resolve_queue_add(handler->resolve_queue, opt,
+					boot_option_dependency(opt));
 			continue;
+		}
 
 		pb_debug("\tresolved!\n");
 
+		resolve_queue_remove(handler->resolve_queue, opt);
 		list_remove(&opt->list);
 		list_add_tail(&opt->device->boot_options, &opt->list);
 		talloc_steal(opt->device, opt);
 		boot_option_finalise(handler, opt);
 		notify_boot_option(handler, opt);
 	}
+
+	talloc_free(opts);
+}
+
+char *device_handler_resolve_stats_dump(void *ctx,
+		struct device_handler *handler)
+{
+	return resolve_queue_stats_dump(ctx, handler->resolve_queue);
 }
 
 struct discover_context *device_handler_discover_context_create(
@@ -1169,13 +1307,31 @@ struct discover_context *device_handler_discover_context_create(
 void device_handler_add_device(struct device_handler *handler,
 		struct discover_device *device)
 {
+	/* this may set the device's uuid, so do it before indexing */
+	if (device->device->type == DEVICE_TYPE_NETWORK)
+		network_register_device(handler->network, device);
+
+	pthread_rwlock_wrlock(&handler->devices_lock);
 	handler->n_devices++;
 	handler->devices = talloc_realloc(handler, handler->devices,
 				struct discover_device *, handler->n_devices);
 	handler->devices[handler->n_devices - 1] = device;
+	device_index_add(handler->device_index, device);
+	pthread_rwlock_unlock(&handler->devices_lock);
 
-	if (device->device->type == DEVICE_TYPE_NETWORK)
-		network_register_device(handler->network, device);
+	resolve_queue_wake(handler->resolve_queue, device);
+}
+
+/* Update the device index after changing a device's id, uuid, label or
+ * serial */
+void device_handler_reindex_device(struct device_handler *handler,
+		struct discover_device *device)
+{
+	pthread_rwlock_wrlock(&handler->devices_lock);
+	device_index_remove(handler->device_index, device);
+	device_index_add(handler->device_index, device);
+	pthread_rwlock_unlock(&handler->devices_lock);
+	resolve_queue_wake(handler->resolve_queue, device);
 }
 
 void device_handler_add_ramdisk(struct device_handler *handler,
@@ -1377,6 +1533,173 @@ void device_handler_add_encrypted_dev(struct device_handler *handler,
 		device_handler_add_device(handler, dev);
 }
 
+/* Commit the results of any completed discover jobs, stopping at the first
+ * that is still mounting or parsing, so that boot options are added in the
+ * same order as they would be without workers.
+ */
+static void device_handler_commit_discover_jobs(struct device_handler *handler)
+{
+	struct discover_job *job, *tmp;
+
+	list_for_each_entry_safe(&handler->discover_jobs, job, tmp, list) {
+		if (!job->complete)
+			break;
+
+		list_remove(&job->list);
+
+		if (job->device) {
+			job->device->discover_job = NULL;
+
+			if (!job->failed) {
+				device_handler_discover_context_commit(handler,
+						job->ctx);
+				process_boot_option_queue(handler);
+				device_handler_plugin_scan_device(handler,
+						job->device);
+			}
+		}
+
+		talloc_unlink(handler, job->ctx);
+		talloc_free(job);
+	}
+}
+
+static void discover_job_complete(struct discover_job *job, bool failed)
+{
+	job->failed = failed || !job->device;
+	job->complete = true;
+
+	device_handler_commit_discover_jobs(job->handler);
+}
+
+/* Send the status messages queued while the job's parsers were running */
+static void discover_job_flush_status(struct discover_job *job)
+{
+	struct discover_job_status *job_status, *tmp;
+	struct status status;
+
+	list_for_each_entry_safe(&job->statuses, job_status, tmp, list) {
+		status.type = job_status->type;
+		status.message = job_status->message;
+		status.backlog = false;
+		status.boot_active = false;
+		status.progress = false;
+
+		device_handler_status(job->handler, &status);
+
+		list_remove(&job_status->list);
+		talloc_free(job_status);
+	}
+}
+
+/* Called from a worker thread. The parsers only use the job's own context,
+ * and take the devices lock to look up other devices. Their status messages
+ * are held on the job until the parse completes. */
+static void discover_context_parse_work(void *arg)
+{
+	struct discover_job *job = arg;
+
+	parse_job = job;
+	iterate_parsers(job->ctx);
+	parse_job = NULL;
+}
+
+static void discover_context_parse_work_complete(void *arg)
+{
+	struct discover_job *job = arg;
+	struct device_handler *handler = job->handler;
+
+	discover_job_flush_status(job);
+
+	if (job->device && handler->option_cache)
+		option_cache_update(handler->option_cache, job->ctx);
+
+	/* nothing can be using the removed devices now */
+	if (!--handler->n_parsing) {
+		talloc_free(handler->removed_devices);
+		handler->removed_devices = NULL;
+	}
+
+	discover_job_complete(job, false);
+}
+
+/* Run the parsers for a mounted device in a worker thread. Returns 1 if the
+ * parse has been queued, otherwise 0 once the options have been found
+ * here. */
+static int discover_context_parse_async(struct discover_job *job)
+{
+	struct device_handler *handler = job->handler;
+
+	if (handler->option_cache &&
+			option_cache_replay(handler->option_cache, job->ctx))
+		return 0;
+
+	handler->n_parsing++;
+	if (!workqueue_queue(handler->workqueue, discover_context_parse_work,
+				discover_context_parse_work_complete, job))
+		return 1;
+	handler->n_parsing--;
+
+	iterate_parsers(job->ctx);
+
+	if (handler->option_cache)
+		option_cache_update(handler->option_cache, job->ctx);
+
+	return 0;
+}
+
+static void discover_job_mounted(struct discover_job *job, int rc)
+{
+	struct discover_device *dev = job->device;
+
+	if (rc || !dev) {
+		discover_job_complete(job, true);
+		return;
+	}
+
+	/* add this device to our system info */
+	system_info_register_blockdev(dev->device->id, dev->uuid,
+			dev->mount_path);
+
+	/* a positive return means that the parsers are running in a worker,
+	 * and the job will be completed from there */
+	rc = discover_context_parse_async(job);
+	if (rc <= 0)
+		discover_job_complete(job, false);
+}
+
+static void device_handler_discover_job(struct device_handler *handler,
+		struct discover_device *dev)
+{
+	struct discover_job *job;
+	int rc;
+
+	job = talloc_zero(handler, struct discover_job);
+	job->handler = handler;
+	job->device = dev;
+	job->ctx = device_handler_discover_context_create(handler, dev);
+	list_init(&job->statuses);
+	dev->discover_job = job;
+
+	list_add_tail(&handler->discover_jobs, &job->list);
+
+	/* a positive return means that the mount is running in a worker, and
+	 * we'll be called back through discover_job_mounted() */
+	rc = mount_device_async(job);
+	if (rc <= 0)
+		discover_job_mounted(job, rc);
+}
+
+void device_handler_set_discover_workers(unsigned int n_workers)
+{
+	discover_workers = n_workers;
+}
+
+void device_handler_set_option_cache(const char *path)
+{
+	option_cache_path = path;
+}
+
 /* Start discovery on a hotplugged device. The device will be in our devices
  * array, but has only just been initialised by the hotplug source.
  */
@@ -1395,6 +1718,11 @@ int device_handler_discover(struct device_handler *handler,
 		_("Processing new %s device"),
 		device_type_display_name(dev->device->type));
 
+	if (handler->workqueue) {
+		device_handler_discover_job(handler, dev);
+		return 0;
+	}
+
 	/* create our context */
 	ctx = device_handler_discover_context_create(handler, dev);
 
@@ -1407,7 +1735,7 @@ int device_handler_discover(struct device_handler *handler,
 			dev->mount_path);
 
 	/* run the parsers. This will populate the ctx's boot_option list. */
-	iterate_parsers(ctx);
+	discover_context_parse(handler, ctx);
 
 	/* add discovered stuff to the handler */
 	device_handler_discover_context_commit(handler, ctx);
@@ -1661,18 +1989,23 @@ void device_handler_cancel_default(struct device_handler *handler)
 void device_handler_update_config(struct device_handler *handler,
 		struct config *config)
 {
+	struct config *old_config;
 	int rc;
 
+	old_config = config_copy(handler, config_get());
+
 	rc = config_set(config);
 	if (rc) {
 		device_handler_status_err(handler,
 				"Failed to update configuration!");
+		talloc_free(old_config);
 		return;
 	}
 
 	discover_server_notify_config(handler->server, config);
 	device_handler_update_lang(config->lang);
-	device_handler_reinit(handler);
+	device_handler_reconfigure(handler, old_config);
+	talloc_free(old_config);
 }
 
 static char *device_from_addr(void *ctx, struct pb_url *url)
@@ -1923,6 +2256,50 @@ void device_handler_install_plugin(struct device_handler *handler,
 
 #ifndef PETITBOOT_TEST
 
+static void plugin_scan_exit(struct process *process)
+{
+	struct discover_device *dev = process->data;
+
+	if (!process_exit_ok(process))
+		pb_log("Error from pb-plugin scan %s\n", dev->mount_path);
+
+	dev->plugin_scan = NULL;
+	process_release(process);
+}
+
+static void device_handler_plugin_scan_device(struct device_handler *handler,
+		struct discover_device *dev)
+{
+	const char *argv[] = {
+		pb_system_apps.pb_plugin,
+		"scan",
+		dev->mount_path,
+		NULL,
+	};
+	struct process *p;
+
+	/* pb-plugin reports any plugins it finds through user events, so we
+	 * only need to track the process itself */
+	if (dev->plugin_scan)
+		return;
+
+	pb_debug("Scanning %s for plugin files\n", dev->device->id);
+
+	p = process_create(handler);
+	p->path = pb_system_apps.pb_plugin;
+	p->argv = argv;
+	p->exit_cb = plugin_scan_exit;
+	p->data = dev;
+
+	if (process_run_async_job(p, PROCESS_JOB_PLUGIN)) {
+		pb_log("Failed to run pb-plugin scan %s\n", dev->mount_path);
+		process_release(p);
+		return;
+	}
+
+	dev->plugin_scan = p;
+}
+
 /**
  * context_commit - Commit a temporary discovery context to the handler,
  * and notify the clients about any new options / devices
@@ -1970,6 +2347,8 @@ void device_handler_discover_context_commit(struct device_handler *handler,
 				list_add(&handler->unresolved_boot_options,
 						&opt->list);
 				talloc_steal(handler, opt);
+				resolve_queue_add(handler->resolve_queue, opt,
+						boot_option_dependency(opt));
 			}
 		}
 	}
@@ -2030,6 +2409,20 @@ static int device_handler_init_sources(struct device_handler *handler)
 	if (!handler->network)
 		return -1;
 
+	if (option_cache_path && !handler->option_cache)
+		handler->option_cache = option_cache_init(handler,
+				handler->waitset, option_cache_path);
+
+	/* start our mount workers before udev starts adding devices. Without
+	 * them, we just mount and parse each device in turn. */
+	if (discover_workers && !handler->workqueue) {
+		handler->workqueue = workqueue_create(handler,
+				handler->waitset, discover_workers);
+		if (!handler->workqueue)
+			pb_log("Couldn't start discover workers, "
+					"mounting devices serially\n");
+	}
+
 	handler->udev = udev_init(handler, handler->waitset);
 	if (!handler->udev)
 		return -1;
@@ -2055,6 +2448,39 @@ static void device_handler_reinit_sources(struct device_handler *handler)
 	udev_reinit(handler->udev);
 }
 
+/* Apply a config change without rediscovering what it doesn't affect. Of
+ * our devices, only the network interfaces, and the options found through
+ * them, depend on the config; block devices are only rediscovered if the
+ * change affects how we mount them.
+ */
+static void device_handler_reconfigure(struct device_handler *handler,
+		const struct config *old_config)
+{
+	const struct config *config = config_get();
+	bool proxy_changed;
+
+	if (old_config->safe_mode || !handler->network ||
+			old_config->disable_snapshots !=
+				config->disable_snapshots) {
+		device_handler_reinit(handler);
+		return;
+	}
+
+	/* as with a full reinit, a new config ends any pending autoboot */
+	device_handler_cancel_default(handler);
+
+	/* remote options are fetched through the proxy, so need reloading
+	 * if it changes */
+	proxy_changed = !streq_null(old_config->http_proxy,
+				config->http_proxy) ||
+		!streq_null(old_config->https_proxy,
+				config->https_proxy);
+
+	set_env_variables(config);
+
+	network_reconfigure(handler->network, old_config, proxy_changed);
+}
+
 static inline const char *get_device_path(struct discover_device *dev)
 {
 	return dev->ramdisk ? dev->ramdisk->snapshot : dev->device_path;
@@ -2187,10 +2613,12 @@ static int try_mount(const char *device_path, const char *mount_path,
 	return mount(device_path, mount_path, fs, flags, safe_opts);
 }
 
-static int mount_device(struct discover_device *dev)
+/* Set up a device for mounting. Returns 1 if the device needs to be mounted
+ * at dev->mount_path, 0 if there's nothing more to do, and -1 on failure.
+ */
+static int mount_device_prepare(struct discover_device *dev)
 {
-	const char *fstype, *device_path;
-	int rc;
+	const char *fstype;
 
 	if (!dev->device_path)
 		return -1;
@@ -2211,9 +2639,44 @@ static int mount_device(struct discover_device *dev)
 	if (pb_mkdir_recursive(dev->mount_path)) {
 		pb_log("couldn't create mount directory %s: %s\n",
 				dev->mount_path, strerror(errno));
-		goto err_free;
+		talloc_free(dev->mount_path);
+		dev->mount_path = NULL;
+		return -1;
+	}
+
+	return 1;
+}
+
+static int mount_device_finish(struct discover_device *dev,
+		const char *device_path, int rc, int err)
+{
+	if (!rc) {
+		dev->mounted = true;
+		dev->mounted_rw = false;
+		dev->unmount = true;
+		dev->root_path = check_subvols(dev);
+		return 0;
 	}
 
+	pb_log("couldn't mount device %s: mount failed: %s\n",
+			device_path, strerror(err));
+
+	pb_rmdir_recursive(mount_base(), dev->mount_path);
+	talloc_free(dev->mount_path);
+	dev->mount_path = NULL;
+	return -1;
+}
+
+static int mount_device(struct discover_device *dev)
+{
+	const char *fstype, *device_path;
+	int rc;
+
+	rc = mount_device_prepare(dev);
+	if (rc <= 0)
+		return rc;
+
+	fstype = discover_device_get_param(dev, "ID_FS_TYPE");
 	device_path = get_device_path(dev);
 
 	pb_log("mounting device %s read-only\n", dev->device_path);
@@ -2234,22 +2697,91 @@ static int mount_device(struct discover_device *dev)
 			       MS_RDONLY | MS_SILENT, dev->ramdisk);
 	}
 
-	if (!rc) {
-		dev->mounted = true;
-		dev->mounted_rw = false;
-		dev->unmount = true;
-		dev->root_path = check_subvols(dev);
-		return 0;
+	return mount_device_finish(dev, device_path, rc, errno);
+}
+
+/* Called from a worker thread; only the job's own copies of the device
+ * details may be used here. */
+static void mount_device_work(void *arg)
+{
+	struct discover_job *job = arg;
+
+	job->rc = try_mount(job->device_path, job->mount_path, job->fstype,
+			MS_RDONLY | MS_SILENT, job->have_snapshot);
+	job->err = errno;
+}
+
+static void mount_device_work_complete(void *arg);
+
+static int mount_device_queue(struct discover_job *job)
+{
+	struct discover_device *dev = job->device;
+
+	talloc_free(job->device_path);
+	job->device_path = talloc_strdup(job, get_device_path(dev));
+	job->have_snapshot = !!dev->ramdisk;
+
+	pb_log("mounting device %s read-only\n", dev->device_path);
+
+	return workqueue_queue(job->handler->workqueue, mount_device_work,
+			mount_device_work_complete, job);
+}
+
+static void mount_device_work_complete(void *arg)
+{
+	struct discover_job *job = arg;
+	struct discover_device *dev = job->device;
+	int rc;
+
+	/* the device has been removed while we were mounting it */
+	if (!dev) {
+		if (!job->rc)
+			umount(job->mount_path);
+		pb_rmdir_recursive(mount_base(), job->mount_path);
+		discover_job_mounted(job, -1);
+		return;
 	}
 
-	pb_log("couldn't mount device %s: mount failed: %s\n",
-			device_path, strerror(errno));
+	/* If mount fails clean up any snapshot and try again */
+	if (job->rc && job->have_snapshot && !job->retried) {
+		pb_log("couldn't mount snapshot for %s: mount failed: %s\n",
+				job->device_path, strerror(job->err));
+		pb_log("falling back to actual device\n");
 
-	pb_rmdir_recursive(mount_base(), dev->mount_path);
-err_free:
-	talloc_free(dev->mount_path);
-	dev->mount_path = NULL;
-	return -1;
+		devmapper_destroy_snapshot(dev);
+
+		job->retried = true;
+		if (!mount_device_queue(job))
+			return;
+	}
+
+	rc = mount_device_finish(dev, job->device_path, job->rc, job->err);
+	discover_job_mounted(job, rc);
+}
+
+/* Start mounting a device in a worker thread. Returns 1 if the mount has
+ * been queued, otherwise the result of mounting the device here. */
+static int mount_device_async(struct discover_job *job)
+{
+	struct discover_device *dev = job->device;
+	int rc;
+
+	rc = mount_device_prepare(dev);
+	if (rc <= 0)
+		return rc;
+
+	job->mount_path = talloc_strdup(job, dev->mount_path);
+	job->fstype = talloc_strdup(job,
+			discover_device_get_param(dev, "ID_FS_TYPE"));
+
+	if (mount_device_queue(job)) {
+		pb_rmdir_recursive(mount_base(), dev->mount_path);
+		talloc_free(dev->mount_path);
+		dev->mount_path = NULL;
+		return -1;
+	}
+
+	return 1;
 }
 
 static int umount_device(struct discover_device *dev)
@@ -2397,6 +2929,21 @@ void device_sync_snapshots(struct device_handler *handler, const char *device)
 	}
 }
 
+/* Run the parsers over a newly-mounted device, unless we have options from
+ * an earlier parse that are still valid */
+static void discover_context_parse(struct device_handler *handler,
+		struct discover_context *ctx)
+{
+	if (handler->option_cache &&
+			option_cache_replay(handler->option_cache, ctx))
+		return;
+
+	iterate_parsers(ctx);
+
+	if (handler->option_cache)
+		option_cache_update(handler->option_cache, ctx);
+}
+
 #else
 
 void device_handler_discover_context_commit(
@@ -2410,9 +2957,14 @@ static void device_handler_update_lang(const char *lang __attribute__((unused)))
 {
 }
 
-static int device_handler_init_sources(
-		struct device_handler *handler __attribute__((unused)))
+static int device_handler_init_sources(struct device_handler *handler)
 {
+	/* test cases that give us a waitset can discover devices through
+	 * the workers */
+	if (discover_workers && handler->waitset)
+		handler->workqueue = workqueue_create(handler,
+				handler->waitset, discover_workers);
+
 	return 0;
 }
 
@@ -2421,6 +2973,12 @@ static void device_handler_reinit_sources(
 {
 }
 
+static void device_handler_reconfigure(struct device_handler *handler,
+		const struct config *old_config __attribute__((unused)))
+{
+	device_handler_reinit(handler);
+}
+
 static int umount_device(struct discover_device *dev __attribute__((unused)))
 {
 	return 0;
@@ -2432,6 +2990,25 @@ static int __attribute__((unused)) mount_device(
 	return 0;
 }
 
+static int mount_device_async(
+		struct discover_job *job __attribute__((unused)))
+{
+	return 0;
+}
+
+static void device_handler_plugin_scan_device(
+		struct device_handler *handler __attribute__((unused)),
+		struct discover_device *dev __attribute__((unused)))
+{
+}
+
+static void discover_context_parse(
+		struct device_handler *handler __attribute__((unused)),
+		struct discover_context *ctx)
+{
+	iterate_parsers(ctx);
+}
+
 int device_request_write(struct discover_device *dev __attribute__((unused)),
 		bool *release)
 {
@@ -16,6 +16,8 @@ struct event;
 struct device;
 struct waitset;
 struct config;
+struct discover_job;
+struct resolve_queue_entry;
 
 struct discover_device {
 	struct device		*device;
@@ -41,6 +43,8 @@ struct discover_device {
 	struct list		params;
 
 	struct waiter		*requery_waiter;
+	struct process		*plugin_scan;
+	struct discover_job	*discover_job;
 };
 
 struct discover_boot_option {
@@ -55,9 +59,14 @@ struct discover_boot_option {
 	struct resource		*dtb;
 	struct resource		*args_sig_file;
 	struct resource		*icon;
+
+	/* our entry in the handler's resolve queue, while unresolved */
+	struct resolve_queue_entry *queue_entry;
 };
 
 
+struct parser_file_cache;
+
 struct discover_context {
 	struct device_handler	*handler;
 	struct parser		*parser;
@@ -66,6 +75,8 @@ struct discover_context {
 	struct list		boot_options;
 	struct pb_url		*conf_url;
 	void			*test_data;
+	/* files read by parsers, created on first use */
+	struct parser_file_cache *file_cache;
 };
 
 struct ramdisk_device {
@@ -76,6 +87,9 @@ struct ramdisk_device {
 	uint64_t	sectors;
 };
 
+void device_handler_set_discover_workers(unsigned int n_workers);
+void device_handler_set_option_cache(const char *path);
+
 struct device_handler *device_handler_init(struct discover_server *server,
 		struct waitset *waitset, int dry_run);
 
@@ -90,6 +104,10 @@ const struct plugin_option *device_handler_get_plugin(
 struct network *device_handler_get_network(
 		const struct device_handler *handler);
 
+/* Returns a talloc-ed summary of the unresolved boot option queue */
+char *device_handler_resolve_stats_dump(void *ctx,
+		struct device_handler *handler);
+
 bool device_handler_found_crypt_device(struct device_handler *handler,
 		const char *name);
 
@@ -97,6 +115,8 @@ struct discover_device *discover_device_create(struct device_handler *handler,
 		const char *uuid, const char *id);
 void device_handler_add_device(struct device_handler *handler,
 		struct discover_device *device);
+void device_handler_reindex_device(struct device_handler *handler,
+		struct discover_device *device);
 void device_handler_add_ramdisk(struct device_handler *handler,
 		const char *path);
 struct ramdisk_device *device_handler_get_ramdisk(
@@ -0,0 +1,249 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <talloc/talloc.h>
+#include <util/util.h>
+
+#include "device-handler.h"
+#include "device-index.h"
+
+#define INDEX_INITIAL_BUCKETS	64
+
+/* A chained hash table, growing to keep about one node per bucket. Nodes
+ * are appended to their chain, so nodes with equal keys stay in the order
+ * they were added.
+ */
+struct index_node {
+	struct index_node	*next;
+	unsigned int		hash;
+};
+
+struct index_table {
+	struct index_node	**buckets;
+	unsigned int		n_buckets;
+	unsigned int		n_nodes;
+};
+
+/* One key of one device */
+struct device_index_entry {
+	struct index_node	node;
+	struct discover_device	*dev;
+	char			*str;
+};
+
+/* The entries for a device, found by the device pointer, so that we can
+ * remove them using the keys the device had when it was added */
+struct device_index_record {
+	struct index_node		node;
+	struct discover_device		*dev;
+	struct device_index_entry	*entries[DEVICE_INDEX_N_KEYS];
+};
+
+struct device_index {
+	void			*pool;
+	struct index_table	keys[DEVICE_INDEX_N_KEYS];
+	struct index_table	devices;
+};
+
+static unsigned int hash_ptr(const void *ptr)
+{
+	uintptr_t val = (uintptr_t)ptr;
+
+	return (unsigned int)((val >> 4) ^ ((uint64_t)val >> 32)) * 2654435761u;
+}
+
+static struct index_node **table_bucket(struct index_table *table,
+		unsigned int hash)
+{
+	return &table->buckets[hash & (table->n_buckets - 1)];
+}
+
+static void table_append(struct index_table *table, struct index_node *node)
+{
+	struct index_node **pos;
+
+	node->next = NULL;
+	for (pos = table_bucket(table, node->hash); *pos; pos = &(*pos)->next)
+		;
+	*pos = node;
+}
+
+static void table_resize(void *ctx, struct index_table *table,
+		unsigned int n_buckets)
+{
+	struct index_node **old = table->buckets, *node, *next;
+	unsigned int i, n_old = table->n_buckets;
+
+	table->buckets = talloc_zero_array(ctx, struct index_node *,
+			n_buckets);
+	table->n_buckets = n_buckets;
+
+	for (i = 0; i < n_old; i++) {
+		for (node = old[i]; node; node = next) {
+			next = node->next;
+			table_append(table, node);
+		}
+	}
+
+	talloc_free(old);
+}
+
+static void table_insert(void *ctx, struct index_table *table,
+		struct index_node *node)
+{
+	if (!table->n_buckets)
+		table_resize(ctx, table, INDEX_INITIAL_BUCKETS);
+	else if (table->n_nodes >= table->n_buckets)
+		table_resize(ctx, table, table->n_buckets * 2);
+
+	table_append(table, node);
+	table->n_nodes++;
+}
+
+static void table_unlink(struct index_table *table, struct index_node *node)
+{
+	struct index_node **pos;
+
+	for (pos = table_bucket(table, node->hash); *pos; pos = &(*pos)->next) {
+		if (*pos == node) {
+			*pos = node->next;
+			table->n_nodes--;
+			return;
+		}
+	}
+}
+
+static const char *device_key(struct discover_device *dev,
+		enum device_index_key key)
+{
+	switch (key) {
+	case DEVICE_INDEX_ID:
+		return dev->device->id;
+	case DEVICE_INDEX_UUID:
+		return dev->uuid;
+	case DEVICE_INDEX_LABEL:
+		return dev->label;
+	case DEVICE_INDEX_SERIAL:
+		return discover_device_get_param(dev, "ID_SERIAL");
+	default:
+		return NULL;
+	}
+}
+
+static struct device_index_record *device_index_find_record(
+		struct device_index *index, struct discover_device *dev)
+{
+	unsigned int hash = hash_ptr(dev);
+	struct index_node *node;
+
+	if (!index->devices.n_buckets)
+		return NULL;
+
+	for (node = *table_bucket(&index->devices, hash); node;
+			node = node->next) {
+		struct device_index_record *record =
+			(struct device_index_record *)node;
+
+		if (record->dev == dev)
+			return record;
+	}
+
+	return NULL;
+}
+
+struct device_index *device_index_create(void *ctx)
+{
+	struct device_index *index;
+
+	index = talloc_zero(ctx, struct device_index);
+	index->pool = talloc_new(index);
+
+	return index;
+}
+
+void device_index_add(struct device_index *index,
+		struct discover_device *dev)
+{
+	struct device_index_record *record;
+	struct device_index_entry *entry;
+	const char *str;
+	int key;
+
+	if (device_index_find_record(index, dev))
+		return;
+
+	record = talloc_zero(index->pool, struct device_index_record);
+	record->dev = dev;
+	record->node.hash = hash_ptr(dev);
+	table_insert(index->pool, &index->devices, &record->node);
+
+	for (key = 0; key < DEVICE_INDEX_N_KEYS; key++) {
+		str = device_key(dev, key);
+		if (!str)
+			continue;
+
+		entry = talloc_zero(record, struct device_index_entry);
+		entry->dev = dev;
+		entry->str = talloc_strdup(entry, str);
+		entry->node.hash = str_hash(str);
+		table_insert(index->pool, &index->keys[key], &entry->node);
+		record->entries[key] = entry;
+	}
+}
+
+void device_index_remove(struct device_index *index,
+		struct discover_device *dev)
+{
+	struct device_index_record *record;
+	int key;
+
+	record = device_index_find_record(index, dev);
+	if (!record)
+		return;
+
+	for (key = 0; key < DEVICE_INDEX_N_KEYS; key++)
+		if (record->entries[key])
+			table_unlink(&index->keys[key],
+					&record->entries[key]->node);
+
+	table_unlink(&index->devices, &record->node);
+	talloc_free(record);
+}
+
+void device_index_clear(struct device_index *index)
+{
+	talloc_free(index->pool);
+	memset(index->keys, 0, sizeof(index->keys));
+	memset(&index->devices, 0, sizeof(index->devices));
+	index->pool = talloc_new(index);
+}
+
+struct discover_device *device_index_lookup(struct device_index *index,
+		enum device_index_key key, const char *str)
+{
+	struct index_table *table = &index->keys[key];
+	struct index_node *node;
+	unsigned int hash;
+	const char *cur;
+
+	if (!table->n_buckets)
+		return NULL;
+
+	hash = str_hash(str);
+
+	for (node = *table_bucket(table, hash); node; node = node->next) {
+		struct device_index_entry *entry =
+			(struct device_index_entry *)node;
+
+		if (node->hash != hash || strcmp(entry->str, str))
+			continue;
+
+		/* skip entries for a key that has changed since the device
+		 * was added */
+		cur = device_key(entry->dev, key);
+		if (cur && !strcmp(cur, str))
+			return entry->dev;
+	}
+
+	return NULL;
+}
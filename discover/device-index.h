@@ -0,0 +1,30 @@
+#ifndef DEVICE_INDEX_H
+#define DEVICE_INDEX_H
+
+struct discover_device;
+struct device_index;
+
+enum device_index_key {
+	DEVICE_INDEX_ID,
+	DEVICE_INDEX_UUID,
+	DEVICE_INDEX_LABEL,
+	DEVICE_INDEX_SERIAL,
+	DEVICE_INDEX_N_KEYS,
+};
+
+/* Hash indexes of the handler's devices, by each of the keys above.
+ * Where devices share a key (eg. partitions sharing a disk serial), lookups
+ * return the first-added device, as a scan of the devices array would.
+ */
+struct device_index *device_index_create(void *ctx);
+
+void device_index_add(struct device_index *index,
+		struct discover_device *dev);
+void device_index_remove(struct device_index *index,
+		struct discover_device *dev);
+void device_index_clear(struct device_index *index);
+
+struct discover_device *device_index_lookup(struct device_index *index,
+		enum device_index_key key, const char *str);
+
+#endif /* DEVICE_INDEX_H */
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
 #include <errno.h>
 #include <assert.h>
 #include <string.h>
@@ -17,6 +19,7 @@
 #include <pb-config/pb-config.h>
 #include <talloc/talloc.h>
 #include <waiter/waiter.h>
+#include <process/process.h>
 #include <log/log.h>
 #include <crypt/crypt.h>
 #include <i18n/i18n.h>
@@ -27,16 +30,101 @@
 #include "device-handler.h"
 #include "discover-server.h"
 #include "platform.h"
+#include "state-export.h"
 #include "sysinfo.h"
 
+/* Once a client's output queue reaches CLIENT_QUEUE_COALESCE_BYTES, only
+ * the most recent unsent progress update is kept. If the client still falls
+ * behind to CLIENT_QUEUE_MAX_BYTES, it is disconnected. */
+#define CLIENT_QUEUE_COALESCE_BYTES	(256 * 1024)
+#define CLIENT_QUEUE_MAX_BYTES		(4 * 1024 * 1024)
+
+/* Maximum number of queued messages to send in one sendmsg() call */
+#define CLIENT_WRITE_IOVS		64
+
+/* Number of status messages kept to replay to new clients. Once full, the
+ * oldest are dropped. */
+#define STATUS_BACKLOG_SIZE		256
+
+/* Broadcast events kept for resuming client sessions. Once either limit
+ * is reached, the oldest are dropped. A client that we disconnect for
+ * falling behind has up to CLIENT_QUEUE_MAX_BYTES of events unsent, so we
+ * keep at least that much, and enough entries to hold it in typical
+ * (a few hundred byte) events, to let it resume. */
+#define JOURNAL_SIZE			16384
+#define JOURNAL_MAX_BYTES		CLIENT_QUEUE_MAX_BYTES
+
+/* Changes to our state are batched up for this long before being written
+ * to the state export */
+#define STATE_EXPORT_DELAY_MS		100
+
+/* Newer clients start with a HELLO, which tells us how they'd like our
+ * current state sent. Clients that send nothing are waited on for this long
+ * before getting it as individual messages. */
+#define CLIENT_SYNC_DELAY_MS		250
+
 struct discover_server {
 	int socket;
 	struct waitset *waitset;
 	struct waiter *waiter;
 	struct list clients;
-	struct list status;
 	struct device_handler *device_handler;
 	bool restrict_clients;
+	unsigned long n_dropped_clients;
+
+	/* broadcast messages are built here, then copied for the journal */
+	struct pb_protocol_encoder *encoder;
+
+	/* ring of status messages, oldest at status_head */
+	struct status *status[STATUS_BACKLOG_SIZE];
+	unsigned int status_head;
+	unsigned int n_status;
+	unsigned long n_status_dropped;
+	unsigned long n_status_merged;
+
+	/* each broadcast event gets the next sequence number in this
+	 * session; recent events are kept in a ring, oldest at
+	 * journal_head */
+	uint32_t session;
+	uint64_t seq;
+	struct journal_entry *journal[JOURNAL_SIZE];
+	unsigned int journal_head;
+	unsigned int n_journal;
+	unsigned int journal_bytes;
+
+	/* notifications that departed clients may resume sessions for, so
+	 * must be journalled even if no connected client is subscribed to
+	 * them. For each bit, *_seq holds our sequence number when the last
+	 * such client left; once the journal no longer goes back that far,
+	 * the bit is cleared. */
+	unsigned int resume_classes;
+	unsigned int resume_device_types;
+	uint64_t resume_class_seq[32];
+	uint64_t resume_device_type_seq[32];
+
+	/* shared memory copy of our state, if enabled */
+	struct state_export *state_export;
+	struct waiter *state_export_waiter;
+};
+
+struct journal_entry {
+	uint64_t seq;
+	void *buf;
+	unsigned int len;
+	unsigned int payload_len;
+	bool coalesce;
+	unsigned int class;
+	int device_type;
+};
+
+/* Queued messages are encoded for the wire, and may be shared between
+ * clients' queues; each client_message holds a talloc reference. */
+struct client_message {
+	void *buf;
+	unsigned int len;
+	unsigned int pos;
+	bool coalesce;
+	struct list_item list;
 };
 
 struct client {
@@ -44,9 +132,35 @@ struct client {
 	struct list_item list;
 	struct waiter *waiter;
 	int fd;
+	struct pb_protocol_reader *reader;
 	bool remote_closed;
 	bool can_modify;
 	struct waiter *auth_waiter;
+
+	/* clients only get notifications once they've been sent our current
+	 * state */
+	bool synced;
+	struct waiter *sync_waiter;
+	unsigned int capabilities;
+	unsigned int max_payload;
+
+	/* the notifications that the client wants: a mask of
+	 * enum pb_protocol_subscription_class, and for devices, of
+	 * PB_PROTOCOL_DEVICE_TYPE() bits */
+	unsigned int subscriptions;
+	unsigned int device_types;
+
+	/* messages to this client alone are built here, and sent straight
+	 * from it when nothing is queued */
+	struct pb_protocol_encoder *encoder;
+
+	/* messages waiting for the client's socket to become writable */
+	struct list out_queue;
+	struct waiter *out_waiter;
+	unsigned int n_queued;
+	unsigned int queued_bytes;
+	unsigned int max_queued_bytes;
+	unsigned long n_coalesced;
 };
 
 
@@ -57,16 +171,25 @@ static int server_destructor(void *arg)
 	if (server->waiter)
 		waiter_remove(server->waiter);
 
+	if (server->state_export_waiter)
+		waiter_remove(server->state_export_waiter);
+
 	if (server->socket >= 0)
 		close(server->socket);
 
 	return 0;
 }
 
+static void resume_note_client(struct discover_server *server,
+		struct client *client);
+
 static int client_destructor(void *arg)
 {
 	struct client *client = arg;
 
+	if (client->synced && client->capabilities & PB_PROTOCOL_CAP_SEQUENCE)
+		resume_note_client(client->server, client);
+
 	if (client->fd >= 0)
 		close(client->fd);
 
@@ -76,6 +199,13 @@ static int client_destructor(void *arg)
 	if (client->auth_waiter)
 		waiter_remove(client->auth_waiter);
 
+	if (client->sync_waiter)
+		waiter_remove(client->sync_waiter);
+
+	if (client->out_waiter)
+		waiter_remove(client->out_waiter);
+
+
 	list_remove(&client->list);
 
 	return 0;
@@ -99,316 +229,1344 @@ static void print_clients(struct discover_server *server)
 				client->fd);
 }
 
-static int client_write_message(
-		struct discover_server *server __attribute__((unused)),
-		struct client *client, struct pb_protocol_message *message)
+static void client_dequeue_message(struct client *client,
+		struct client_message *msg)
+{
+	list_remove(&msg->list);
+	client->n_queued--;
+	client->queued_bytes -= msg->len;
+	talloc_free(msg);
+}
+
+/* Stop sending to a client that has gone away or fallen too far behind. We
+ * can't free the client here, as we may be iterating the client list; the
+ * shutdown will wake its read waiter, which does the free. */
+static void client_drop(struct client *client)
+{
+	struct client_message *msg, *tmp;
+
+	client->remote_closed = true;
+
+	list_for_each_entry_safe(&client->out_queue, msg, tmp, list)
+		client_dequeue_message(client, msg);
+
+	if (client->out_waiter) {
+		waiter_remove(client->out_waiter);
+		client->out_waiter = NULL;
+	}
+
+	shutdown(client->fd, SHUT_RDWR);
+}
+
+/* Write as much of the client's queue as the socket will accept. Returns
+ * non-zero if the client can't be written to. */
+static int client_write_queue(struct client *client)
+{
+	struct iovec iov[CLIENT_WRITE_IOVS];
+	struct client_message *msg, *tmp;
+	struct msghdr hdr;
+	unsigned int len;
+	ssize_t rc;
+	size_t n;
+	int i;
+
+	while (client->n_queued) {
+		i = 0;
+		list_for_each_entry(&client->out_queue, msg, list) {
+			iov[i].iov_base = (char *)msg->buf + msg->pos;
+			iov[i].iov_len = msg->len - msg->pos;
+			if (++i == CLIENT_WRITE_IOVS)
+				break;
+		}
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = iov;
+		hdr.msg_iovlen = i;
+
+		rc = sendmsg(client->fd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			pb_log_fn("failed: %s\n", strerror(errno));
+			return -1;
+		}
+
+		/* retire the messages that have been completely sent */
+		n = rc;
+		list_for_each_entry_safe(&client->out_queue, msg, tmp, list) {
+			len = msg->len - msg->pos;
+			if (n < len) {
+				msg->pos += n;
+				break;
+			}
+			n -= len;
+			client_dequeue_message(client, msg);
+		}
+	}
+
+	return 0;
+}
+
+static int client_write_ready(void *arg)
+{
+	struct client *client = arg;
+
+	if (client_write_queue(client)) {
+		client_drop(client);
+		return 1;
+	}
+
+	if (client->n_queued)
+		return 0;
+
+	client->out_waiter = NULL;
+	return 1;
+}
+
+/* Drop any unsent progress updates; the new one supersedes them */
+static void client_coalesce_status(struct client *client)
+{
+	struct client_message *msg, *tmp;
+
+	list_for_each_entry_safe(&client->out_queue, msg, tmp, list) {
+		if (!msg->coalesce || msg->pos)
+			continue;
+		client_dequeue_message(client, msg);
+		client->n_coalesced++;
+	}
+}
+
+/* Queue an encoded message to a client, which takes a reference to it. If
+ * coalesce is set (for progress updates), this message may be dropped in
+ * favour of a later coalescable one, if the client is falling behind */
+static int client_queue_message(struct discover_server *server,
+		struct client *client, void *buf, unsigned int len,
+		unsigned int payload_len, bool coalesce)
+{
+	struct client_message *msg;
+
+	if (client->remote_closed)
+		return -1;
+
+	if (payload_len > client->max_payload) {
+		pb_log("message too large for client %d (%u/%u bytes)\n",
+				client->fd, payload_len, client->max_payload);
+		return -1;
+	}
+
+	if (coalesce && client->queued_bytes >= CLIENT_QUEUE_COALESCE_BYTES)
+		client_coalesce_status(client);
+
+	if (client->queued_bytes >= CLIENT_QUEUE_MAX_BYTES) {
+		pb_log("client %d is not reading messages, disconnecting\n",
+				client->fd);
+		server->n_dropped_clients++;
+		client_drop(client);
+		return -1;
+	}
+
+	msg = talloc(client, struct client_message);
+	msg->buf = talloc_reference(msg, buf);
+	msg->len = len;
+	msg->pos = 0;
+	msg->coalesce = coalesce;
+
+	list_add_tail(&client->out_queue, &msg->list);
+	client->n_queued++;
+	client->queued_bytes += msg->len;
+	if (client->queued_bytes > client->max_queued_bytes)
+		client->max_queued_bytes = client->queued_bytes;
+
+	/* if we're already waiting for the socket, this will be sent in
+	 * turn. Otherwise, try to send it now */
+	if (client->out_waiter)
+		return 0;
+
+	if (client_write_queue(client)) {
+		client_drop(client);
+		return -1;
+	}
+
+	if (client->n_queued)
+		client->out_waiter = waiter_register_io(server->waitset,
+				client->fd, WAIT_OUT, client_write_ready,
+				client);
+
+	return 0;
+}
+
+/* Write a single-frame message to a client with nothing queued, straight
+ * from the caller's buffer. Only the part that the socket doesn't take is
+ * copied, and queued. */
+static int client_send_direct(struct discover_server *server,
+		struct client *client, struct pb_protocol_message *message,
+		bool coalesce)
 {
+	unsigned int len, payload_len;
+	ssize_t sent;
+	void *buf;
 	int rc;
 
 	if (client->remote_closed)
 		return -1;
 
-	rc = pb_protocol_write_message(client->fd, message);
-	if (rc)
-		client->remote_closed = true;
+	payload_len = message->payload_len;
+	if (payload_len > client->max_payload) {
+		pb_log("message too large for client %d (%u/%u bytes)\n",
+				client->fd, payload_len, client->max_payload);
+		return -1;
+	}
+
+	len = pb_protocol_finalise_message(message);
+
+	do {
+		sent = send(client->fd, message, len,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (sent < 0 && errno == EINTR);
+
+	if (sent < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			pb_log_fn("failed: %s\n", strerror(errno));
+			client_drop(client);
+			return -1;
+		}
+		sent = 0;
+	}
+
+	if ((unsigned int)sent == len)
+		return 0;
+
+	buf = talloc_memdup(client, (char *)message + sent, len - sent);
+	if (!buf)
+		return -1;
+
+	/* a partly-sent message can't be coalesced away */
+	rc = client_queue_message(server, client, buf, len - sent,
+			payload_len, coalesce && !sent);
+	talloc_unlink(client, buf);
 
 	return rc;
 }
 
-static int write_device_add_message(struct discover_server *server,
-		struct client *client, const struct device *dev)
+/* Send a message to a single client. The message stays with the caller;
+ * it is usually in the client's encoder. */
+static int client_send_message(struct discover_server *server,
+		struct client *client, struct pb_protocol_message *message,
+		bool coalesce)
 {
-	struct pb_protocol_message *message;
-	int len;
+	unsigned int len, payload_len;
+	void *buf;
+	int rc;
+
+	if (!message)
+		return -1;
+
+	payload_len = message->payload_len;
 
-	len = pb_protocol_device_len(dev);
+	if (!client->n_queued && payload_len <= PB_PROTOCOL_MAX_PAYLOAD_SIZE)
+		return client_send_direct(server, client, message, coalesce);
 
-	message = pb_protocol_create_message(client,
-			PB_PROTOCOL_ACTION_DEVICE_ADD, len);
+	message = talloc_memdup(client, message,
+			sizeof(*message) + payload_len);
 	if (!message)
 		return -1;
 
-	pb_protocol_serialise_device(dev, message->payload, len);
+	buf = pb_protocol_encode_message(client, message, &len);
+	if (!buf)
+		return -1;
 
-	return client_write_message(server, client, message);
+	rc = client_queue_message(server, client, buf, len, payload_len,
+			coalesce);
+	talloc_unlink(client, buf);
+
+	return rc;
 }
 
-static int write_boot_option_add_message(struct discover_server *server,
-		struct client *client, const struct boot_option *opt)
+static int client_write_message(struct discover_server *server,
+		struct client *client, struct pb_protocol_message *message)
 {
-	struct pb_protocol_message *message;
-	int len;
+	return client_send_message(server, client, message, false);
+}
 
-	len = pb_protocol_boot_option_len(opt);
+/* Does the client want a notification of this class? device_type is only
+ * used for PB_PROTOCOL_SUB_DEVICES. */
+static bool client_subscribed(struct client *client, unsigned int class,
+		int device_type)
+{
+	if (!(client->subscriptions & class))
+		return false;
 
-	message = pb_protocol_create_message(client,
-			PB_PROTOCOL_ACTION_BOOT_OPTION_ADD, len);
-	if (!message)
-		return -1;
+	if (class != PB_PROTOCOL_SUB_DEVICES || device_type < 0)
+		return true;
 
-	pb_protocol_serialise_boot_option(opt, message->payload, len);
+	return client->device_types & PB_PROTOCOL_DEVICE_TYPE(device_type);
+}
 
-	return client_write_message(server, client, message);
+/* Does any client want a notification of this class? If not, we can skip
+ * creating it altogether. */
+static bool server_subscribed(struct discover_server *server,
+		unsigned int class, int device_type)
+{
+	struct client *client;
+
+	if (server->resume_classes & class && (class != PB_PROTOCOL_SUB_DEVICES
+			|| device_type < 0 || server->resume_device_types &
+				PB_PROTOCOL_DEVICE_TYPE(device_type)))
+		return true;
+
+	list_for_each_entry(&server->clients, client, list) {
+		if (client->synced &&
+				client_subscribed(client, class, device_type))
+			return true;
+	}
+
+	return false;
 }
 
-static int write_plugin_option_add_message(struct discover_server *server,
-		struct client *client, const struct plugin_option *opt)
+/* Can a client that has seen events up to seq catch up from the journal? */
+static bool journal_can_resume(struct discover_server *server,
+		uint32_t session, uint64_t seq)
 {
-	struct pb_protocol_message *message;
-	int len;
+	if (session != server->session || seq > server->seq)
+		return false;
 
-	len = pb_protocol_plugin_option_len(opt);
+	if (seq == server->seq)
+		return true;
 
-	message = pb_protocol_create_message(client,
-			PB_PROTOCOL_ACTION_PLUGIN_OPTION_ADD, len);
-	if (!message)
-		return -1;
+	return server->n_journal &&
+		server->journal[server->journal_head]->seq <= seq + 1;
+}
 
-	pb_protocol_serialise_plugin_option(opt, message->payload, len);
+static void resume_note(uint64_t *seqs, unsigned int mask, uint64_t seq)
+{
+	unsigned int i;
 
-	return client_write_message(server, client, message);
+	for (i = 0; i < 32; i++)
+		if (mask & (1u << i))
+			seqs[i] = seq;
 }
 
-static int write_plugins_remove_message(struct discover_server *server,
+/* A client that may come back to resume its session has left; keep
+ * journalling the notifications it wants for as long as it could */
+static void resume_note_client(struct discover_server *server,
 		struct client *client)
+{
+	resume_note(server->resume_class_seq, client->subscriptions,
+			server->seq);
+	server->resume_classes |= client->subscriptions;
+
+	if (!(client->subscriptions & PB_PROTOCOL_SUB_DEVICES))
+		return;
+
+	resume_note(server->resume_device_type_seq, client->device_types,
+			server->seq);
+	server->resume_device_types |= client->device_types;
+}
+
+static unsigned int resume_expire_mask(struct discover_server *server,
+		unsigned int mask, const uint64_t *seqs)
+{
+	unsigned int i;
+
+	for (i = 0; i < 32; i++)
+		if (mask & (1u << i) && !journal_can_resume(server,
+					server->session, seqs[i]))
+			mask &= ~(1u << i);
+
+	return mask;
+}
+
+/* The journal has moved on; forget the notifications of departed clients
+ * that can no longer resume from it */
+static void resume_expire(struct discover_server *server)
+{
+	server->resume_classes = resume_expire_mask(server,
+			server->resume_classes, server->resume_class_seq);
+	server->resume_device_types = resume_expire_mask(server,
+			server->resume_device_types,
+			server->resume_device_type_seq);
+}
+
+static void journal_drop_oldest(struct discover_server *server)
+{
+	struct journal_entry *entry = server->journal[server->journal_head];
+
+	server->journal_bytes -= entry->len;
+	server->journal_head = (server->journal_head + 1) % JOURNAL_SIZE;
+	server->n_journal--;
+	talloc_free(entry);
+}
+
+static void journal_add(struct discover_server *server, uint64_t seq,
+		void *buf, unsigned int len, unsigned int payload_len,
+		bool coalesce, unsigned int class, int device_type)
+{
+	struct journal_entry *entry;
+	bool dropped = false;
+	unsigned int i;
+
+	while (server->n_journal && (server->n_journal == JOURNAL_SIZE ||
+			server->journal_bytes + len > JOURNAL_MAX_BYTES)) {
+		journal_drop_oldest(server);
+		dropped = true;
+	}
+
+	/* too large to keep; resuming from before this will need a full
+	 * sync */
+	if (len > JOURNAL_MAX_BYTES)
+		goto out;
+
+	entry = talloc(server, struct journal_entry);
+	if (!entry)
+		goto out;
+
+	entry->seq = seq;
+	entry->buf = talloc_reference(entry, buf);
+	entry->len = len;
+	entry->payload_len = payload_len;
+	entry->coalesce = coalesce;
+	entry->class = class;
+	entry->device_type = device_type;
+
+	i = (server->journal_head + server->n_journal) % JOURNAL_SIZE;
+	server->journal[i] = entry;
+	server->n_journal++;
+	server->journal_bytes += len;
+
+out:
+	/* with this event in the journal, as it may be the next one that a
+	 * departed client needs */
+	if (dropped)
+		resume_expire(server);
+}
+
+static void *sequence_message(void *ctx, uint64_t seq, unsigned int *len)
 {
 	struct pb_protocol_message *message;
+	int payload_len;
+
+	payload_len = pb_protocol_sequence_len();
 
-	message = pb_protocol_create_message(client,
-			PB_PROTOCOL_ACTION_PLUGINS_REMOVE, 0);
+	message = pb_protocol_create_message(ctx,
+			PB_PROTOCOL_ACTION_SEQUENCE, payload_len);
 	if (!message)
-		return -1;
+		return NULL;
 
-	/* No payload so nothing to serialise */
+	pb_protocol_serialise_sequence(seq, message->payload, payload_len);
 
-	return client_write_message(server, client, message);
+	return pb_protocol_encode_message(ctx, message, len);
 }
 
-static int write_device_remove_message(struct discover_server *server,
-		struct client *client, char *dev_id)
+/* Queue an event to a client, followed by its sequence number if the
+ * client wants them. The sequence message is created in ctx if *seq_buf
+ * is NULL, so that it can be shared by other clients. */
+static int client_queue_event(struct discover_server *server,
+		struct client *client, void *ctx, uint64_t seq,
+		void *buf, unsigned int len, unsigned int payload_len,
+		bool coalesce, void **seq_buf, unsigned int *seq_len)
 {
-	struct pb_protocol_message *message;
-	int len;
+	int rc;
+
+	rc = client_queue_message(server, client, buf, len, payload_len,
+			coalesce);
+	if (rc)
+		return rc;
+
+	if (!(client->capabilities & PB_PROTOCOL_CAP_SEQUENCE))
+		return 0;
+
+	if (!*seq_buf) {
+		*seq_buf = sequence_message(ctx, seq, seq_len);
+		if (!*seq_buf)
+			return -1;
+	}
+
+	/* the sequence message is dropped along with a coalesced status */
+	return client_queue_message(server, client, *seq_buf, *seq_len,
+			pb_protocol_sequence_len(), coalesce);
+}
 
-	len = strlen(dev_id) + sizeof(uint32_t);
+/* Send a message to every client that has been sent our initial state, and
+ * is subscribed to the message's class. The message stays with the caller
+ * (usually the server's encoder); it is copied once, in the server's
+ * context, and shared between the clients' queues and the journal. */
+static void broadcast_message(struct discover_server *server,
+		unsigned int class, int device_type,
+		struct pb_protocol_message *message, bool coalesce)
+{
+	unsigned int len, payload_len, seq_len;
+	struct client *client;
+	void *buf, *seq_buf;
+	uint64_t seq;
 
-	message = pb_protocol_create_message(client,
-			PB_PROTOCOL_ACTION_DEVICE_REMOVE, len);
 	if (!message)
-		return -1;
+		return;
 
-	pb_protocol_serialise_string(message->payload, dev_id);
+	payload_len = message->payload_len;
 
-	return client_write_message(server, client, message);
+	message = talloc_memdup(server, message,
+			sizeof(*message) + payload_len);
+	if (!message)
+		return;
+
+	buf = pb_protocol_encode_message(server, message, &len);
+	if (!buf)
+		return;
+
+	seq = ++server->seq;
+	journal_add(server, seq, buf, len, payload_len, coalesce,
+			class, device_type);
+
+	seq_buf = NULL;
+	seq_len = 0;
+
+	list_for_each_entry(&server->clients, client, list) {
+		if (client->synced &&
+				client_subscribed(client, class, device_type))
+			client_queue_event(server, client, server, seq,
+					buf, len, payload_len, coalesce,
+					&seq_buf, &seq_len);
+	}
+
+	talloc_unlink(server, buf);
+	if (seq_buf)
+		talloc_unlink(server, seq_buf);
+}
+
+static struct pb_protocol_message *device_add_message(
+		struct pb_protocol_encoder *enc, const struct device *dev)
+{
+	pb_protocol_encoder_start(enc, PB_PROTOCOL_ACTION_DEVICE_ADD);
+	pb_protocol_encode_device(enc, dev);
+
+	return pb_protocol_encoder_message(enc);
+}
+
+static int write_device_add_message(struct discover_server *server,
+		struct client *client, const struct device *dev)
+{
+	return client_write_message(server, client,
+			device_add_message(client->encoder, dev));
+}
+
+static struct pb_protocol_message *boot_option_add_message(
+		struct pb_protocol_encoder *enc, const struct boot_option *opt)
+{
+	pb_protocol_encoder_start(enc, PB_PROTOCOL_ACTION_BOOT_OPTION_ADD);
+	pb_protocol_encode_boot_option(enc, opt);
+
+	return pb_protocol_encoder_message(enc);
+}
+
+static int write_boot_option_add_message(struct discover_server *server,
+		struct client *client, const struct boot_option *opt)
+{
+	return client_write_message(server, client,
+			boot_option_add_message(client->encoder, opt));
+}
+
+static struct pb_protocol_message *plugin_option_add_message(
+		struct pb_protocol_encoder *enc, const struct plugin_option *opt)
+{
+	pb_protocol_encoder_start(enc, PB_PROTOCOL_ACTION_PLUGIN_OPTION_ADD);
+	pb_protocol_encode_plugin_option(enc, opt);
+
+	return pb_protocol_encoder_message(enc);
+}
+
+static int write_plugin_option_add_message(struct discover_server *server,
+		struct client *client, const struct plugin_option *opt)
+{
+	return client_write_message(server, client,
+			plugin_option_add_message(client->encoder, opt));
+}
+
+
+static struct pb_protocol_message *device_remove_message(
+		struct pb_protocol_encoder *enc, char *dev_id)
+{
+	pb_protocol_encoder_start(enc, PB_PROTOCOL_ACTION_DEVICE_REMOVE);
+	pb_protocol_encode_string(enc, dev_id);
+
+	return pb_protocol_encoder_message(enc);
+}
+
+static struct pb_protocol_message *boot_status_message(
+		struct pb_protocol_encoder *enc, const struct status *status)
+{
+	pb_protocol_encoder_start(enc, PB_PROTOCOL_ACTION_STATUS);
+	pb_protocol_encode_boot_status(enc, status);
+
+	return pb_protocol_encoder_message(enc);
 }
 
 static int write_boot_status_message(struct discover_server *server,
 		struct client *client, const struct status *status)
 {
-	struct pb_protocol_message *message;
-	int len;
+	/* live progress updates supersede each other, but the backlog is
+	 * already bounded, and is sent in full */
+	return client_send_message(server, client,
+			boot_status_message(client->encoder, status),
+			status->progress && !status->backlog);
+}
 
-	len = pb_protocol_boot_status_len(status);
+static struct pb_protocol_message *system_info_message(
+		struct pb_protocol_encoder *enc,
+		const struct system_info *sysinfo)
+{
+	pb_protocol_encoder_start(enc, PB_PROTOCOL_ACTION_SYSTEM_INFO);
+	pb_protocol_encode_system_info(enc, sysinfo);
 
-	message = pb_protocol_create_message(client,
-			PB_PROTOCOL_ACTION_STATUS, len);
-	if (!message)
-		return -1;
+	return pb_protocol_encoder_message(enc);
+}
+
+static int write_system_info_message(struct discover_server *server,
+		struct client *client, const struct system_info *sysinfo)
+{
+	return client_write_message(server, client,
+			system_info_message(client->encoder, sysinfo));
+}
+
+static struct pb_protocol_message *config_message(
+		struct pb_protocol_encoder *enc, const struct config *config)
+{
+	pb_protocol_encoder_start(enc, PB_PROTOCOL_ACTION_CONFIG);
+	pb_protocol_encode_config(enc, config);
+
+	return pb_protocol_encoder_message(enc);
+}
+
+static int write_config_message(struct discover_server *server,
+		struct client *client, const struct config *config)
+{
+	return client_write_message(server, client,
+			config_message(client->encoder, config));
+}
+
+static int write_authenticate_message(struct discover_server *server,
+		struct client *client)
+{
+	struct auth_message auth_msg;
+
+	auth_msg.op = AUTH_MSG_RESPONSE;
+	auth_msg.authenticated = client->can_modify;
+
+	pb_protocol_encoder_start(client->encoder,
+			PB_PROTOCOL_ACTION_AUTHENTICATE);
+	pb_protocol_encode_authenticate(client->encoder, &auth_msg);
+
+	return client_write_message(server, client,
+			pb_protocol_encoder_message(client->encoder));
+}
+
+static char *client_queue_stats_dump(void *ctx,
+		struct discover_server *server)
+{
+	struct client *client;
+	char *str;
+
+	str = talloc_asprintf(ctx, "status backlog: %u/%d entries, "
+			"%lu dropped, %lu merged\n"
+			"journal: %u/%d entries, %u bytes, seq %" PRIu64 "\n"
+			"clients: %lu dropped\n"
+			"%-6s %8s %10s %10s %10s\n",
+			server->n_status, STATUS_BACKLOG_SIZE,
+			server->n_status_dropped, server->n_status_merged,
+			server->n_journal, JOURNAL_SIZE,
+			server->journal_bytes, server->seq,
+			server->n_dropped_clients,
+			"fd", "queued", "bytes", "max bytes", "coalesced");
+
+	list_for_each_entry(&server->clients, client, list)
+		str = talloc_asprintf_append(str,
+				"%-6d %8u %10u %10u %10lu\n",
+				client->fd, client->n_queued,
+				client->queued_bytes,
+				client->max_queued_bytes,
+				client->n_coalesced);
+
+	return str;
+}
+
+static int write_loop_stats_message(struct discover_server *server,
+		struct client *client)
+{
+	struct pb_protocol_message *message;
+	char *stats, *jobs;
+
+	stats = waitset_stats_dump(client, server->waitset);
+	if (!stats)
+		return -1;
+
+	jobs = process_job_stats_dump(stats);
+	if (jobs)
+		stats = talloc_asprintf_append(stats, "\n%s", jobs);
+
+	stats = talloc_asprintf_append(stats, "\n%s",
+			client_queue_stats_dump(stats, server));
+
+	stats = talloc_asprintf_append(stats, "\n%s",
+			device_handler_resolve_stats_dump(stats,
+				server->device_handler));
+
+	pb_protocol_encoder_start(client->encoder,
+			PB_PROTOCOL_ACTION_LOOP_STATS);
+	pb_protocol_encode_string(client->encoder, stats);
+	message = pb_protocol_encoder_message(client->encoder);
+	talloc_free(stats);
+
+	return client_write_message(server, client, message);
+}
+
+static int client_auth_timeout(void *arg)
+{
+	struct client *client = arg;
+	int rc;
+
+	client->auth_waiter = NULL;
+	client->can_modify = false;
+
+	rc = write_authenticate_message(client->server, client);
+	if (rc)
+		pb_log("failed to send client auth timeout\n");
+
+	return 0;
+}
+
+static int discover_server_handle_auth_message(struct client *client,
+		struct auth_message *auth_msg)
+{
+	struct status *status;
+	char *hash;
+	int rc = 0;
+
+	status = talloc_zero(client, struct status);
+
+	switch (auth_msg->op) {
+	case AUTH_MSG_REQUEST:
+		if (!crypt_check_password(auth_msg->password)) {
+			rc = -1;
+			pb_log("Client failed to authenticate\n");
+			status->type = STATUS_ERROR;
+			status->message = talloc_asprintf(status,
+					_("Password incorrect"));
+		} else {
+			client->can_modify = true;
+			rc = write_authenticate_message(client->server,
+					client);
+			if (client->auth_waiter)
+				waiter_remove(client->auth_waiter);
+			client->auth_waiter = waiter_register_timeout(
+					client->server->waitset,
+					300000, /* 5 min */
+					client_auth_timeout, client);
+			pb_log("Client authenticated\n");
+			status->type = STATUS_INFO;
+			status->message = talloc_asprintf(status,
+					_("Authenticated successfully"));
+		}
+		break;
+	case AUTH_MSG_SET:
+		if (client->server->restrict_clients) {
+			if (!crypt_check_password(auth_msg->set_password.password)) {
+				rc = -1;
+				pb_log("Wrong password for set request\n");
+				status->type = STATUS_ERROR;
+				status->message = talloc_asprintf(status,
+						_("Password incorrect"));
+				break;
+			}
+		}
+
+		rc = crypt_set_password(auth_msg,
+				auth_msg->set_password.new_password);
+		if (rc) {
+			pb_log("Failed to set password\n");
+			status->type = STATUS_ERROR;
+			status->message = talloc_asprintf(status,
+					_("Error setting password"));
+		} else {
+			if (!auth_msg->set_password.new_password ||
+				!strlen(auth_msg->set_password.new_password)) {
+				platform_set_password("");
+				discover_server_set_auth_mode(client->server,
+						false);
+				pb_log("Password cleared\n");
+			} else {
+				hash = crypt_get_hash(auth_msg);
+				platform_set_password(hash);
+				talloc_free(hash);
+				discover_server_set_auth_mode(client->server,
+						true);
+			}
+			pb_log("System password changed\n");
+			status->type = STATUS_ERROR;
+			status->message = talloc_asprintf(status,
+					_("Password updated successfully"));
+		}
+		break;
+	case AUTH_MSG_DECRYPT:
+		if (!client->can_modify) {
+			pb_log("Unauthenticated client tried to open encrypted device %s\n",
+					auth_msg->decrypt_dev.device_id);
+			rc = -1;
+			status->type = STATUS_ERROR;
+			status->message = talloc_asprintf(status,
+					_("Must authenticate before opening encrypted device"));
+			break;
+		}
+
+		device_handler_open_encrypted_dev(client->server->device_handler,
+				auth_msg->decrypt_dev.password,
+				auth_msg->decrypt_dev.device_id);
+		break;
+	default:
+		pb_log("%s: unknown op\n", __func__);
+		rc = -1;
+		break;
+	}
+
+	if (status->message)
+		write_boot_status_message(client->server, client, status);
+	talloc_free(status);
+
+	return rc;
+}
+
+static struct status *status_backlog_get(struct discover_server *server,
+		unsigned int i)
+{
+	return server->status[(server->status_head + i) % STATUS_BACKLOG_SIZE];
+}
+
+/* A note for the start of the replayed backlog, if we've lost anything
+ * from it */
+static struct status *status_backlog_note(struct discover_server *server,
+		void *ctx)
+{
+	unsigned long n = server->n_status_dropped + server->n_status_merged;
+	struct status *status;
+
+	if (!n)
+		return NULL;
+
+	status = talloc_zero(ctx, struct status);
+	status->type = STATUS_INFO;
+	status->backlog = true;
+	status->message = talloc_asprintf(status,
+			_("(%lu earlier status messages not shown)"), n);
+
+	return status;
+}
+
+static void status_backlog_add(struct discover_server *server,
+		const struct status *status)
+{
+	struct status *entry, *last = NULL;
+	unsigned int i;
+
+	if (server->n_status)
+		last = status_backlog_get(server, server->n_status - 1);
+
+	/* a progress update replaces the previous one */
+	if (last && last->progress && status->progress) {
+		talloc_free(last->message);
+		last->type = status->type;
+		last->message = talloc_strdup(last, status->message);
+		server->n_status_merged++;
+		return;
+	}
+
+	entry = talloc_zero(server, struct status);
+	if (!entry) {
+		pb_log("Failed to allocated saved status!\n");
+		return;
+	}
+
+	entry->type = status->type;
+	entry->message = talloc_strdup(entry, status->message);
+	entry->backlog = true;
+	entry->progress = status->progress;
+
+	if (server->n_status == STATUS_BACKLOG_SIZE) {
+		talloc_free(server->status[server->status_head]);
+		server->status[server->status_head] = entry;
+		server->status_head = (server->status_head + 1) %
+						STATUS_BACKLOG_SIZE;
+		server->n_status_dropped++;
+		return;
+	}
+
+	i = (server->status_head + server->n_status) % STATUS_BACKLOG_SIZE;
+	server->status[i] = entry;
+	server->n_status++;
+}
+
+/* Send our current state to a new client, one message per item */
+static int client_send_state(struct discover_server *server,
+		struct client *client)
+{
+	struct status *status;
+	int rc, i, n_devices, n_plugins;
+
+	/* send sysinfo to client */
+	if (client_subscribed(client, PB_PROTOCOL_SUB_SYSINFO, -1)) {
+		rc = write_system_info_message(server, client,
+				system_info_get());
+		if (rc)
+			return rc;
+	}
+
+	/* send config to client */
+	if (client_subscribed(client, PB_PROTOCOL_SUB_CONFIG, -1)) {
+		rc = write_config_message(server, client, config_get());
+		if (rc)
+			return rc;
+	}
+
+	/* send existing devices to client */
+	n_devices = device_handler_get_device_count(server->device_handler);
+	for (i = 0; i < n_devices; i++) {
+		const struct discover_boot_option *opt;
+		const struct discover_device *device;
+
+		device = device_handler_get_device(server->device_handler, i);
+		if (!client_subscribed(client, PB_PROTOCOL_SUB_DEVICES,
+					device->device->type))
+			continue;
+
+		rc = write_device_add_message(server, client, device->device);
+		if (rc)
+			return rc;
+
+		list_for_each_entry(&device->boot_options, opt, list) {
+			rc = write_boot_option_add_message(server, client,
+					opt->option);
+			if (rc)
+				return rc;
+		}
+	}
+
+	/* send status backlog to client */
+	if (client_subscribed(client, PB_PROTOCOL_SUB_STATUS, -1)) {
+		status = status_backlog_note(server, client);
+		if (status) {
+			write_boot_status_message(server, client, status);
+			talloc_free(status);
+		}
+
+		for (i = 0; i < (int)server->n_status; i++)
+			write_boot_status_message(server, client,
+					status_backlog_get(server, i));
+	}
+
+	/* send installed plugins to client */
+	if (!client_subscribed(client, PB_PROTOCOL_SUB_PLUGINS, -1))
+		return 0;
+
+	n_plugins = device_handler_get_plugin_count(server->device_handler);
+	for (i = 0; i < n_plugins; i++) {
+		const struct plugin_option *plugin;
+
+		plugin = device_handler_get_plugin(server->device_handler, i);
+		write_plugin_option_add_message(server, client, plugin);
+	}
+
+	return 0;
+}
+
+struct snapshot {
+	struct discover_server		*server;
+	struct client			*client;
+	struct pb_protocol_message	*message;
+	int				rc;
+};
+
+static void snapshot_flush(struct snapshot *snap)
+{
+	if (!snap->message)
+		return;
+
+	if (!snap->rc)
+		snap->rc = client_write_message(snap->server, snap->client,
+				snap->message);
+
+	talloc_free(snap->message);
+	snap->message = NULL;
+}
+
+/* Get a buffer for the payload of the next snapshot record, starting a
+ * new snapshot message if the current one is full. Returns NULL if the
+ * record is too large to fit in any snapshot message. */
+static char *snapshot_reserve(struct snapshot *snap,
+		enum pb_protocol_action action, int len)
+{
+	char *buf;
+
+	if (snap->message) {
+		buf = pb_protocol_snapshot_reserve(snap->message, action, len);
+		if (buf)
+			return buf;
+		snapshot_flush(snap);
+	}
+
+	snap->message = pb_protocol_create_snapshot(snap->client);
+	if (!snap->message)
+		return NULL;
+
+	buf = pb_protocol_snapshot_reserve(snap->message, action, len);
+
+	/* sent separately, after the records so far */
+	if (!buf) {
+		talloc_free(snap->message);
+		snap->message = NULL;
+	}
+
+	return buf;
+}
+
+/* Add a record, encoded as a message in the client's encoder, to the
+ * snapshot. A record that is too large for a snapshot is sent as a
+ * separate message instead. */
+static void snapshot_add(struct snapshot *snap,
+		struct pb_protocol_message *record)
+{
+	char *buf;
+
+	if (snap->rc)
+		return;
+
+	if (!record) {
+		snap->rc = -1;
+		return;
+	}
+
+	buf = snapshot_reserve(snap, record->action, record->payload_len);
+	if (buf)
+		memcpy(buf, record->payload, record->payload_len);
+	else
+		snap->rc = client_write_message(snap->server, snap->client,
+				record);
+}
+
+/* Send our current state to a new client as a stream of snapshot
+ * messages. The records are in the same order as client_send_state(), and
+ * any that are too large for a snapshot are sent as separate messages. */
+static int client_send_snapshot(struct discover_server *server,
+		struct client *client)
+{
+	const struct system_info *sysinfo = system_info_get();
+	const struct config *config = config_get();
+	struct pb_protocol_encoder *enc = client->encoder;
+	struct status *status, *note;
+	struct snapshot snap;
+	int i, n_devices, n_plugins, n_status;
+
+	snap.server = server;
+	snap.client = client;
+	snap.message = NULL;
+	snap.rc = 0;
+
+	if (client_subscribed(client, PB_PROTOCOL_SUB_SYSINFO, -1))
+		snapshot_add(&snap, system_info_message(enc, sysinfo));
+
+	if (client_subscribed(client, PB_PROTOCOL_SUB_CONFIG, -1))
+		snapshot_add(&snap, config_message(enc, config));
+
+	n_devices = device_handler_get_device_count(server->device_handler);
+	for (i = 0; i < n_devices && !snap.rc; i++) {
+		const struct discover_boot_option *opt;
+		const struct discover_device *device;
+
+		device = device_handler_get_device(server->device_handler, i);
+		if (!client_subscribed(client, PB_PROTOCOL_SUB_DEVICES,
+					device->device->type))
+			continue;
+
+		snapshot_add(&snap, device_add_message(enc, device->device));
+
+		list_for_each_entry(&device->boot_options, opt, list)
+			snapshot_add(&snap,
+				boot_option_add_message(enc, opt->option));
+	}
+
+	note = NULL;
+	n_status = 0;
+	if (client_subscribed(client, PB_PROTOCOL_SUB_STATUS, -1)) {
+		note = status_backlog_note(server, client);
+		n_status = server->n_status;
+	}
+
+	for (i = note ? -1 : 0; i < n_status && !snap.rc; i++) {
+		status = i < 0 ? note : status_backlog_get(server, i);
+		snapshot_add(&snap, boot_status_message(enc, status));
+	}
+
+	talloc_free(note);
+
+	n_plugins = 0;
+	if (client_subscribed(client, PB_PROTOCOL_SUB_PLUGINS, -1))
+		n_plugins = device_handler_get_plugin_count(
+				server->device_handler);
+	for (i = 0; i < n_plugins && !snap.rc; i++) {
+		const struct plugin_option *plugin;
+
+		plugin = device_handler_get_plugin(server->device_handler, i);
+		snapshot_add(&snap, plugin_option_add_message(enc, plugin));
+	}
+
+	snapshot_flush(&snap);
+
+	return snap.rc;
+}
+
+/* Write our state to the state export, as a single snapshot payload */
+static int state_export_update(void *arg)
+{
+	struct discover_server *server = arg;
+	const struct system_info *sysinfo = system_info_get();
+	struct pb_protocol_encoder *enc = server->encoder;
+	struct pb_protocol_message *snapshot, *record;
+	struct status *status, *note;
+	int i, n_devices;
+
+	server->state_export_waiter = NULL;
+
+	snapshot = pb_protocol_create_snapshot(server);
+	if (!snapshot)
+		return 0;
+
+	if (sysinfo) {
+		record = system_info_message(enc, sysinfo);
+		if (!record || pb_protocol_snapshot_append_message(&snapshot,
+					record))
+			goto out;
+	}
+
+	n_devices = server->device_handler ?
+		device_handler_get_device_count(server->device_handler) : 0;
+
+	for (i = 0; i < n_devices; i++) {
+		const struct discover_boot_option *opt;
+		const struct discover_device *device;
+
+		device = device_handler_get_device(server->device_handler, i);
+
+		record = device_add_message(enc, device->device);
+		if (!record || pb_protocol_snapshot_append_message(&snapshot,
+					record))
+			goto out;
+
+		list_for_each_entry(&device->boot_options, opt, list) {
+			record = boot_option_add_message(enc, opt->option);
+			if (!record || pb_protocol_snapshot_append_message(
+						&snapshot, record))
+				goto out;
+		}
+	}
+
+	note = status_backlog_note(server, snapshot);
+
+	for (i = note ? -1 : 0; i < (int)server->n_status; i++) {
+		status = i < 0 ? note : status_backlog_get(server, i);
+
+		record = boot_status_message(enc, status);
+		if (!record || pb_protocol_snapshot_append_message(&snapshot,
+					record))
+			goto out;
+	}
 
-	pb_protocol_serialise_boot_status(status, message->payload, len);
+	state_export_write(server->state_export, snapshot->payload,
+			snapshot->payload_len);
 
-	return client_write_message(server, client, message);
+out:
+	talloc_free(snapshot);
+	return 0;
 }
 
-static int write_system_info_message(struct discover_server *server,
-		struct client *client, const struct system_info *sysinfo)
+/* Our state has changed; update the export once things settle */
+static void state_export_changed(struct discover_server *server)
 {
-	struct pb_protocol_message *message;
-	int len;
-
-	len = pb_protocol_system_info_len(sysinfo);
+	if (!server->state_export || server->state_export_waiter)
+		return;
 
-	message = pb_protocol_create_message(client,
-			PB_PROTOCOL_ACTION_SYSTEM_INFO, len);
-	if (!message)
-		return -1;
+	server->state_export_waiter = waiter_register_timeout(server->waitset,
+			STATE_EXPORT_DELAY_MS, state_export_update, server);
+}
 
-	pb_protocol_serialise_system_info(sysinfo, message->payload, len);
+static void client_set_synced(struct client *client)
+{
+	client->synced = true;
 
-	return client_write_message(server, client, message);
+	if (client->sync_waiter) {
+		waiter_remove(client->sync_waiter);
+		client->sync_waiter = NULL;
+	}
 }
 
-static int write_config_message(struct discover_server *server,
-		struct client *client, const struct config *config)
+static void client_sync(struct client *client)
 {
-	struct pb_protocol_message *message;
-	int len;
-
-	len = pb_protocol_config_len(config);
+	struct discover_server *server = client->server;
 
-	message = pb_protocol_create_message(client,
-			PB_PROTOCOL_ACTION_CONFIG, len);
-	if (!message)
-		return -1;
+	if (client->synced)
+		return;
 
-	pb_protocol_serialise_config(config, message->payload, len);
+	client_set_synced(client);
 
-	return client_write_message(server, client, message);
+	if (client->capabilities & PB_PROTOCOL_CAP_SNAPSHOT)
+		client_send_snapshot(server, client);
+	else
+		client_send_state(server, client);
 }
 
-static int write_authenticate_message(struct discover_server *server,
-		struct client *client)
+static int write_hello_message(struct discover_server *server,
+		struct client *client, uint64_t seq)
 {
-	struct pb_protocol_message *message;
-	struct auth_message auth_msg;
-	int len;
-
-	auth_msg.op = AUTH_MSG_RESPONSE;
-	auth_msg.authenticated = client->can_modify;
+	struct pb_protocol_hello hello;
 
-	len = pb_protocol_authenticate_len(&auth_msg);
-
-	message = pb_protocol_create_message(client,
-			PB_PROTOCOL_ACTION_AUTHENTICATE, len);
-	if (!message)
-		return -1;
+	hello.capabilities = PB_PROTOCOL_CAP_SNAPSHOT |
+			PB_PROTOCOL_CAP_CHUNKED |
+			PB_PROTOCOL_CAP_SEQUENCE;
+	hello.max_payload = PB_PROTOCOL_MAX_PAYLOAD_SIZE;
+	hello.session = server->session;
+	hello.seq = seq;
 
-	pb_protocol_serialise_authenticate(&auth_msg, message->payload, len);
+	pb_protocol_encoder_start(client->encoder, PB_PROTOCOL_ACTION_HELLO);
+	pb_protocol_encode_hello(client->encoder, &hello);
 
-	return client_write_message(server, client, message);
+	return client_write_message(server, client,
+			pb_protocol_encoder_message(client->encoder));
 }
 
-static int client_auth_timeout(void *arg)
+static int client_sync_timeout(void *arg)
 {
 	struct client *client = arg;
-	int rc;
 
-	client->auth_waiter = NULL;
-	client->can_modify = false;
-
-	rc = write_authenticate_message(client->server, client);
-	if (rc)
-		pb_log("failed to send client auth timeout\n");
+	client->sync_waiter = NULL;
+	client_sync(client);
 
 	return 0;
 }
 
-static int discover_server_handle_auth_message(struct client *client,
-		struct auth_message *auth_msg)
+/* Send a reconnecting client the events it has missed, from the journal */
+static void client_resume(struct client *client, uint64_t seq)
 {
-	struct status *status;
-	char *hash;
-	int rc = 0;
+	struct discover_server *server = client->server;
+	struct journal_entry *entry;
+	unsigned int i, seq_len;
+	void *seq_buf;
+
+	client_set_synced(client);
+
+	for (i = 0; i < server->n_journal; i++) {
+		entry = server->journal[(server->journal_head + i) %
+						JOURNAL_SIZE];
+		if (entry->seq <= seq || !client_subscribed(client,
+					entry->class, entry->device_type))
+			continue;
+
+		seq_buf = NULL;
+		client_queue_event(server, client, client, entry->seq,
+				entry->buf, entry->len, entry->payload_len,
+				entry->coalesce, &seq_buf, &seq_len);
+		if (seq_buf)
+			talloc_unlink(client, seq_buf);
+	}
+}
 
-	status = talloc_zero(client, struct status);
+static void client_hello(struct client *client,
+		const struct pb_protocol_message *message)
+{
+	struct discover_server *server = client->server;
+	struct pb_protocol_hello hello;
+	bool resume = false;
+	int rc;
 
-	switch (auth_msg->op) {
-	case AUTH_MSG_REQUEST:
-		if (!crypt_check_password(auth_msg->password)) {
-			rc = -1;
-			pb_log("Client failed to authenticate\n");
-			status->type = STATUS_ERROR;
-			status->message = talloc_asprintf(status,
-					_("Password incorrect"));
-		} else {
-			client->can_modify = true;
-			rc = write_authenticate_message(client->server,
-					client);
-			if (client->auth_waiter)
-				waiter_remove(client->auth_waiter);
-			client->auth_waiter = waiter_register_timeout(
-					client->server->waitset,
-					300000, /* 5 min */
-					client_auth_timeout, client);
-			pb_log("Client authenticated\n");
-			status->type = STATUS_INFO;
-			status->message = talloc_asprintf(status,
-					_("Authenticated successfully"));
-		}
-		break;
-	case AUTH_MSG_SET:
-		if (client->server->restrict_clients) {
-			if (!crypt_check_password(auth_msg->set_password.password)) {
-				rc = -1;
-				pb_log("Wrong password for set request\n");
-				status->type = STATUS_ERROR;
-				status->message = talloc_asprintf(status,
-						_("Password incorrect"));
-				break;
-			}
-		}
+	rc = pb_protocol_deserialise_hello(&hello, message);
+	if (rc) {
+		pb_log_fn("invalid hello message?\n");
+		hello.capabilities = 0;
+	}
 
-		rc = crypt_set_password(auth_msg,
-				auth_msg->set_password.new_password);
-		if (rc) {
-			pb_log("Failed to set password\n");
-			status->type = STATUS_ERROR;
-			status->message = talloc_asprintf(status,
-					_("Error setting password"));
-		} else {
-			if (!auth_msg->set_password.new_password ||
-				!strlen(auth_msg->set_password.new_password)) {
-				platform_set_password("");
-				discover_server_set_auth_mode(client->server,
-						false);
-				pb_log("Password cleared\n");
-			} else {
-				hash = crypt_get_hash(auth_msg);
-				platform_set_password(hash);
-				talloc_free(hash);
-				discover_server_set_auth_mode(client->server,
-						true);
-			}
-			pb_log("System password changed\n");
-			status->type = STATUS_ERROR;
-			status->message = talloc_asprintf(status,
-					_("Password updated successfully"));
-		}
-		break;
-	case AUTH_MSG_DECRYPT:
-		if (!client->can_modify) {
-			pb_log("Unauthenticated client tried to open encrypted device %s\n",
-					auth_msg->decrypt_dev.device_id);
-			rc = -1;
-			status->type = STATUS_ERROR;
-			status->message = talloc_asprintf(status,
-					_("Must authenticate before opening encrypted device"));
-			break;
-		}
+	client->capabilities = hello.capabilities;
 
-		device_handler_open_encrypted_dev(client->server->device_handler,
-				auth_msg->decrypt_dev.password,
-				auth_msg->decrypt_dev.device_id);
-		break;
-	default:
-		pb_log("%s: unknown op\n", __func__);
-		rc = -1;
-		break;
+	if (client->capabilities & PB_PROTOCOL_CAP_CHUNKED) {
+		client->max_payload = hello.max_payload;
+		if (client->max_payload > PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE)
+			client->max_payload =
+				PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE;
+		if (client->max_payload < PB_PROTOCOL_MAX_PAYLOAD_SIZE)
+			client->max_payload = PB_PROTOCOL_MAX_PAYLOAD_SIZE;
+
+		/* Nothing a client sends us needs to be large, so we still
+		 * don't take more than we would in a single frame */
+		pb_protocol_reader_set_chunked_max(client->reader,
+				PB_PROTOCOL_MAX_PAYLOAD_SIZE);
 	}
 
-	if (status->message)
-		write_boot_status_message(client->server, client, status);
-	talloc_free(status);
+	/* A HELLO that arrives after we've replayed our state only upgrades
+	 * the rest of the connection; the client has everything up to our
+	 * current sequence number. */
+	if (client->capabilities & PB_PROTOCOL_CAP_SEQUENCE)
+		resume = !client->synced && journal_can_resume(server,
+				hello.session, hello.seq);
+
+	/* Clients that can reassemble chunked messages, or want sequence
+	 * numbers, get our HELLO in reply. This tells them the largest
+	 * message we'll accept, and where their state is at. */
+	if (client->capabilities & (PB_PROTOCOL_CAP_CHUNKED |
+				PB_PROTOCOL_CAP_SEQUENCE))
+		write_hello_message(server, client,
+				resume ? hello.seq : server->seq);
+
+	if (resume) {
+		pb_debug("client %d resuming from %" PRIu64 "/%" PRIu64 "\n",
+				client->fd, hello.seq, server->seq);
+		client_resume(client, hello.seq);
+	} else {
+		client_sync(client);
+	}
+}
 
-	return rc;
+static void client_subscribe(struct client *client,
+		const struct pb_protocol_message *message)
+{
+	struct pb_protocol_subscription sub;
+	int rc;
+
+	rc = pb_protocol_deserialise_subscription(&sub, message);
+	if (rc) {
+		pb_log_fn("invalid subscribe message?\n");
+		return;
+	}
+
+	pb_debug("client %d subscribed to 0x%x, device types 0x%x\n",
+			client->fd, sub.classes, sub.device_types);
+
+	client->subscriptions = sub.classes;
+	client->device_types = sub.device_types;
 }
 
-static int discover_server_process_message(void *arg)
+static int discover_server_handle_message(struct client *client,
+		struct pb_protocol_message *message)
 {
 	struct autoboot_option *autoboot_opt;
-	struct pb_protocol_message *message;
 	struct boot_command *boot_command;
 	struct auth_message *auth_msg;
 	struct status *status;
-	struct client *client = arg;
 	struct config *config;
 	char *url;
 	int rc = 0;
 
-	message = pb_protocol_read_message(client, client->fd);
+	if (message->action == PB_PROTOCOL_ACTION_HELLO) {
+		client_hello(client, message);
+		return 0;
+	}
 
-	if (!message) {
-		talloc_free(client);
+	if (message->action == PB_PROTOCOL_ACTION_SUBSCRIBE) {
+		client_subscribe(client, message);
 		return 0;
 	}
 
@@ -540,6 +1698,11 @@ static int discover_server_process_message(void *arg)
 		discover_server_handle_auth_message(client, auth_msg);
 		talloc_free(auth_msg);
 		break;
+
+	case PB_PROTOCOL_ACTION_LOOP_STATS:
+		write_loop_stats_message(client->server, client);
+		break;
+
 	default:
 		pb_log_fn("invalid action %d\n", message->action);
 		return 0;
@@ -549,6 +1712,42 @@ static int discover_server_process_message(void *arg)
 	return 0;
 }
 
+static int discover_server_process_message(void *arg)
+{
+	struct pb_protocol_message *message;
+	struct client *client = arg;
+	bool sync = false;
+	int rc;
+
+	rc = pb_protocol_reader_fill(client->reader);
+	if (rc) {
+		talloc_free(client);
+		return 0;
+	}
+
+	/* handle all of the complete messages we have. A SUBSCRIBE is always
+	 * followed by a HELLO, so doesn't sync the client. */
+	while (!(rc = pb_protocol_reader_next(client->reader, &message))) {
+		if (message->action != PB_PROTOCOL_ACTION_SUBSCRIBE)
+			sync = true;
+		rc = discover_server_handle_message(client, message);
+		if (rc)
+			return rc;
+	}
+
+	if (rc < 0) {
+		talloc_free(client);
+		return 0;
+	}
+
+	/* clients that didn't start with a HELLO get our state as individual
+	 * messages */
+	if (sync)
+		client_sync(client);
+
+	return 0;
+}
+
 void discover_server_set_auth_mode(struct discover_server *server,
 		bool restrict_clients)
 {
@@ -565,10 +1764,9 @@ void discover_server_set_auth_mode(struct discover_server *server,
 static int discover_server_process_connection(void *arg)
 {
 	struct discover_server *server = arg;
-	struct statuslog_entry *entry;
-	int fd, rc, i, n_devices, n_plugins;
 	struct client *client;
 	struct ucred ucred;
+	int fd, rc;
 	socklen_t len;
 
 	/* accept the incoming connection */
@@ -586,6 +1784,18 @@ static int discover_server_process_connection(void *arg)
 
 	client->fd = fd;
 	client->server = server;
+	client->max_payload = PB_PROTOCOL_MAX_PAYLOAD_SIZE;
+	client->subscriptions = PB_PROTOCOL_SUB_ALL;
+	client->device_types = PB_PROTOCOL_DEVICE_TYPES_ALL;
+	list_init(&client->out_queue);
+
+	client->reader = pb_protocol_reader_create(client, fd);
+	client->encoder = pb_protocol_encoder_create(client);
+	if (!client->reader || !client->encoder) {
+		talloc_free(client);
+		return 0;
+	}
+
 	client->waiter = waiter_register_io(server->waitset, client->fd,
 				WAIT_IN, discover_server_process_message,
 				client);
@@ -614,47 +1824,11 @@ static int discover_server_process_connection(void *arg)
 	if (rc)
 		return 0;
 
-	/* send sysinfo to client */
-	rc = write_system_info_message(server, client, system_info_get());
-	if (rc)
-		return 0;
-
-	/* send config to client */
-	rc = write_config_message(server, client, config_get());
-	if (rc)
-		return 0;
-
-	/* send existing devices to client */
-	n_devices = device_handler_get_device_count(server->device_handler);
-	for (i = 0; i < n_devices; i++) {
-		const struct discover_boot_option *opt;
-		const struct discover_device *device;
-
-		device = device_handler_get_device(server->device_handler, i);
-		rc = write_device_add_message(server, client, device->device);
-		if (rc)
-			return 0;
-
-		list_for_each_entry(&device->boot_options, opt, list) {
-			rc = write_boot_option_add_message(server, client,
-					opt->option);
-			if (rc)
-				return 0;
-		}
-	}
-
-	/* send status backlog to client */
-	list_for_each_entry(&server->status, entry, list)
-		write_boot_status_message(server, client, entry->status);
-
-	/* send installed plugins to client */
-	n_plugins = device_handler_get_plugin_count(server->device_handler);
-	for (i = 0; i < n_plugins; i++) {
-		const struct plugin_option *plugin;
-
-		plugin = device_handler_get_plugin(server->device_handler, i);
-		write_plugin_option_add_message(server, client, plugin);
-	}
+	/* we sync the client once we've read its first message, or, if
+	 * it's an older client that doesn't send one, once we've waited
+	 * for it */
+	client->sync_waiter = waiter_register_timeout(server->waitset,
+			CLIENT_SYNC_DELAY_MS, client_sync_timeout, client);
 
 	return 0;
 }
@@ -662,92 +1836,130 @@ static int discover_server_process_connection(void *arg)
 void discover_server_notify_device_add(struct discover_server *server,
 		struct device *device)
 {
-	struct client *client;
+	state_export_changed(server);
 
-	list_for_each_entry(&server->clients, client, list)
-		write_device_add_message(server, client, device);
+	if (!server_subscribed(server, PB_PROTOCOL_SUB_DEVICES, device->type))
+		return;
 
+	broadcast_message(server, PB_PROTOCOL_SUB_DEVICES, device->type,
+			device_add_message(server->encoder, device), false);
 }
 
 void discover_server_notify_boot_option_add(struct discover_server *server,
-		struct boot_option *boot_option)
+		struct device *device, struct boot_option *boot_option)
 {
-	struct client *client;
+	state_export_changed(server);
 
-	list_for_each_entry(&server->clients, client, list)
-		write_boot_option_add_message(server, client, boot_option);
+	if (!server_subscribed(server, PB_PROTOCOL_SUB_DEVICES, device->type))
+		return;
+
+	broadcast_message(server, PB_PROTOCOL_SUB_DEVICES, device->type,
+			boot_option_add_message(server->encoder, boot_option),
+			false);
 }
 
 void discover_server_notify_device_remove(struct discover_server *server,
 		struct device *device)
 {
-	struct client *client;
+	state_export_changed(server);
 
-	list_for_each_entry(&server->clients, client, list)
-		write_device_remove_message(server, client, device->id);
+	if (!server_subscribed(server, PB_PROTOCOL_SUB_DEVICES, device->type))
+		return;
 
+	broadcast_message(server, PB_PROTOCOL_SUB_DEVICES, device->type,
+			device_remove_message(server->encoder, device->id),
+			false);
 }
 
 void discover_server_notify_boot_status(struct discover_server *server,
 		struct status *status)
 {
-	struct statuslog_entry *entry;
-	struct client *client;
+	status_backlog_add(server, status);
+	state_export_changed(server);
 
-	/* Duplicate the status struct to add to the backlog */
-	entry = talloc(server, struct statuslog_entry);
-	if (!entry) {
-		pb_log("Failed to allocated saved status!\n");
-	} else {
-		entry->status = talloc(entry, struct status);
-		if (entry->status) {
-			entry->status->type = status->type;
-			entry->status->message = talloc_strdup(entry->status,
-							       status->message);
-			entry->status->backlog = true;
-			list_add_tail(&server->status, &entry->list);
-		} else {
-			talloc_free(entry);
-		}
-	}
+	if (!server_subscribed(server, PB_PROTOCOL_SUB_STATUS, -1))
+		return;
 
-	list_for_each_entry(&server->clients, client, list)
-		write_boot_status_message(server, client, status);
+	/* only progress updates may be dropped for a lagging client; info
+	 * and error messages are always delivered */
+	broadcast_message(server, PB_PROTOCOL_SUB_STATUS, -1,
+			boot_status_message(server->encoder, status),
+			status->progress);
 }
 
-void discover_server_notify_system_info(struct discover_server *server,
-		const struct system_info *sysinfo)
+void discover_server_notify_system_info_update(struct discover_server *server,
+		const struct system_info_update *update)
 {
-	struct client *client;
+	struct system_info_update batch;
+	unsigned int n;
 
-	list_for_each_entry(&server->clients, client, list)
-		write_system_info_message(server, client, sysinfo);
+	state_export_changed(server);
+
+	if (!server_subscribed(server, PB_PROTOCOL_SUB_SYSINFO, -1))
+		return;
+
+	/* split large updates (eg, removing everything on reinit) into
+	 * batches that fit in a single message */
+	batch = *update;
+
+	while (batch.n_changes) {
+		pb_protocol_encoder_start(server->encoder,
+				PB_PROTOCOL_ACTION_SYSTEM_INFO_UPDATE);
+		n = pb_protocol_encode_system_info_update_batch(server->encoder,
+				&batch, PB_PROTOCOL_MAX_PAYLOAD_SIZE);
+
+		broadcast_message(server, PB_PROTOCOL_SUB_SYSINFO, -1,
+				pb_protocol_encoder_message(server->encoder),
+				false);
+
+		batch.changes += n;
+		batch.n_changes -= n;
+	}
 }
 
 void discover_server_notify_config(struct discover_server *server,
 		const struct config *config)
 {
-	struct client *client;
+	if (!server_subscribed(server, PB_PROTOCOL_SUB_CONFIG, -1))
+		return;
 
-	list_for_each_entry(&server->clients, client, list)
-		write_config_message(server, client, config);
+	broadcast_message(server, PB_PROTOCOL_SUB_CONFIG, -1,
+			config_message(server->encoder, config), false);
 }
 
 void discover_server_notify_plugin_option_add(struct discover_server *server,
 		struct plugin_option *opt)
 {
-	struct client *client;
+	if (!server_subscribed(server, PB_PROTOCOL_SUB_PLUGINS, -1))
+		return;
 
-	list_for_each_entry(&server->clients, client, list)
-		write_plugin_option_add_message(server, client, opt);
+	broadcast_message(server, PB_PROTOCOL_SUB_PLUGINS, -1,
+			plugin_option_add_message(server->encoder, opt), false);
 }
 
 void discover_server_notify_plugins_remove(struct discover_server *server)
 {
-	struct client *client;
+	if (!server_subscribed(server, PB_PROTOCOL_SUB_PLUGINS, -1))
+		return;
 
-	list_for_each_entry(&server->clients, client, list)
-		write_plugins_remove_message(server, client);
+	/* No payload so nothing to serialise */
+	pb_protocol_encoder_start(server->encoder,
+			PB_PROTOCOL_ACTION_PLUGINS_REMOVE);
+
+	broadcast_message(server, PB_PROTOCOL_SUB_PLUGINS, -1,
+			pb_protocol_encoder_message(server->encoder), false);
+}
+
+int discover_server_export_state(struct discover_server *server,
+		const char *path)
+{
+	server->state_export = state_export_init(server, path);
+	if (!server->state_export)
+		return -1;
+
+	state_export_changed(server);
+
+	return 0;
 }
 
 void discover_server_set_device_source(struct discover_server *server,
@@ -768,8 +1980,31 @@ struct discover_server *discover_server_init(struct waitset *waitset)
 
 	server->waiter = NULL;
 	server->waitset = waitset;
+	server->n_dropped_clients = 0;
 	list_init(&server->clients);
-	list_init(&server->status);
+	server->status_head = 0;
+	server->n_status = 0;
+	server->n_status_dropped = 0;
+	server->n_status_merged = 0;
+	server->seq = 0;
+	server->journal_head = 0;
+	server->n_journal = 0;
+	server->journal_bytes = 0;
+	server->resume_classes = 0;
+	server->resume_device_types = 0;
+	server->state_export = NULL;
+	server->state_export_waiter = NULL;
+
+	server->encoder = pb_protocol_encoder_create(server);
+	if (!server->encoder) {
+		talloc_free(server);
+		return NULL;
+	}
+
+	/* distinguishes our sequence numbers from a previous instance's */
+	server->session = time(NULL) ^ (getpid() << 16);
+	if (!server->session)
+		server->session = 1;
 
 	unlink(PB_SOCKET_PATH);
 
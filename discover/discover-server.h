@@ -9,7 +9,7 @@ struct boot_option;
 struct status;
 struct plugin_option;
 struct boot_status;
-struct system_info;
+struct system_info_update;
 struct device;
 struct config;
 
@@ -23,16 +23,21 @@ void discover_server_set_device_source(struct discover_server *server,
 void discover_server_set_auth_mode(struct discover_server *server,
 		bool restrict_clients);
 
+/* Publish a copy of our state in shared memory at path, for local
+ * observers */
+int discover_server_export_state(struct discover_server *server,
+		const char *path);
+
 void discover_server_notify_device_add(struct discover_server *server,
 		struct device *device);
 void discover_server_notify_boot_option_add(struct discover_server *server,
-		struct boot_option *option);
+		struct device *device, struct boot_option *option);
 void discover_server_notify_device_remove(struct discover_server *server,
 		struct device *device);
 void discover_server_notify_boot_status(struct discover_server *server,
 		struct status *status);
-void discover_server_notify_system_info(struct discover_server *server,
-		const struct system_info *sysinfo);
+void discover_server_notify_system_info_update(struct discover_server *server,
+		const struct system_info_update *update);
 void discover_server_notify_config(struct discover_server *server,
 		const struct config *config);
 void discover_server_notify_plugin_option_add(struct discover_server *server,
@@ -2,6 +2,7 @@
 #define _GNU_SOURCE
 
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -126,12 +127,17 @@ static const struct option search_options[] = {
 	{ 0 },
 };
 
+/* getopt keeps its state in globals, and scripts may be run from more than
+ * one discover worker at a time */
+static pthread_mutex_t getopt_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int builtin_search(struct grub2_script *script,
 		void *data __attribute__((unused)),
 		int argc, char *argv[])
 {
 	const char *env_var, *spec, *res;
 	struct discover_device *dev;
+	int argi;
 	enum {
 		LOOKUP_UUID = 'u',
 		LOOKUP_LABEL = 'l',
@@ -139,6 +145,8 @@ static int builtin_search(struct grub2_script *script,
 	} lookup_type;
 
 	env_var = "root";
+
+	pthread_mutex_lock(&getopt_lock);
 	optind = 0;
 
 	/* Default to UUID, for backwards compat with earlier petitboot
@@ -165,13 +173,16 @@ static int builtin_search(struct grub2_script *script,
 		}
 	}
 
+	argi = optind;
+	pthread_mutex_unlock(&getopt_lock);
+
 	if (!strlen(env_var))
 		return 0;
 
-	if (optind >= argc)
+	if (argi >= argc)
 		return -1;
 
-	spec = argv[optind];
+	spec = argv[argi];
 	res = NULL;
 
 	switch (lookup_type) {
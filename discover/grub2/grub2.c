@@ -115,6 +115,14 @@ bool resolve_grub2_resource(struct device_handler *handler,
 	return true;
 }
 
+/* grub2_lookup_device matches either a device id or a uuid */
+const char *grub2_resource_dependency(struct resource *res)
+{
+	struct grub2_file *file = res->info;
+
+	return file->dev;
+}
+
 struct grub2_file *grub2_parse_file(struct grub2_script *script,
 		const char *str)
 {
@@ -195,6 +203,7 @@ static struct parser grub2_parser = {
 	.name			= "grub2",
 	.parse			= grub2_parse,
 	.resolve_resource	= resolve_grub2_resource,
+	.resource_dependency	= grub2_resource_dependency,
 };
 
 register_parser(grub2_parser);
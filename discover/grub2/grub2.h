@@ -202,6 +202,8 @@ struct resource *create_grub2_resource(struct grub2_script *script,
 bool resolve_grub2_resource(struct device_handler *handler,
 		struct resource *res);
 
+const char *grub2_resource_dependency(struct resource *res);
+
 /* grub-style device+path parsing */
 struct grub2_file *grub2_parse_file(struct grub2_script *script,
 		const char *str);
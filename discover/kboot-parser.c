@@ -220,6 +220,7 @@ static struct parser kboot_parser = {
 	.name			= "kboot",
 	.parse			= kboot_parse,
 	.resolve_resource	= resolve_devpath_resource,
+	.resource_dependency	= devpath_resource_dependency,
 };
 
 register_parser(kboot_parser);
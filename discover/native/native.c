@@ -50,6 +50,7 @@ static struct parser native_parser = {
 	.name			= "native",
 	.parse			= native_parse,
 	.resolve_resource	= resolve_devpath_resource,
+	.resource_dependency	= devpath_resource_dependency,
 };
 
 register_parser(native_parser);
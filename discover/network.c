@@ -18,6 +18,7 @@
 #include <waiter/waiter.h>
 #include <process/process.h>
 #include <system/system.h>
+#include <util/util.h>
 
 #include "network.h"
 #include "sysinfo.h"
@@ -88,13 +89,11 @@ static char *mac_bytes_to_string(void *ctx, uint8_t *addr, int len)
 	return buf;
 }
 
-static const struct interface_config *find_config_by_hwaddr(
-		uint8_t *hwaddr)
+static const struct interface_config *find_config_in(
+		const struct config *config, uint8_t *hwaddr)
 {
-	const struct config *config;
 	unsigned int i;
 
-	config = config_get();
 	if (!config)
 		return NULL;
 
@@ -108,6 +107,12 @@ static const struct interface_config *find_config_by_hwaddr(
 	return NULL;
 }
 
+static const struct interface_config *find_config_by_hwaddr(
+		uint8_t *hwaddr)
+{
+	return find_config_in(config_get(), hwaddr);
+}
+
 static struct interface *find_interface_by_ifindex(struct network *network,
 		int ifindex)
 {
@@ -279,6 +284,7 @@ static int interface_change(struct interface *interface, bool up)
 		interface->udhcpc_process->data = NULL;
 		process_stop_async(interface->udhcpc_process);
 		process_release(interface->udhcpc_process);
+		interface->udhcpc_process = NULL;
 	}
 	if (!up && interface->udhcpc6_process) {
 		/* we don't care about the callback from here */
@@ -286,6 +292,7 @@ static int interface_change(struct interface *interface, bool up)
 		interface->udhcpc6_process->data = NULL;
 		process_stop_async(interface->udhcpc6_process);
 		process_release(interface->udhcpc6_process);
+		interface->udhcpc6_process = NULL;
 	}
 
 	if (!up) {
@@ -391,7 +398,7 @@ static void configure_interface_dhcp(struct network *network,
 	p_v4->data = interface;
 
 	pb_log("Running DHCPv4 client\n");
-	rc = process_run_async(p_v4);
+	rc = process_run_async_job(p_v4, PROCESS_JOB_DHCP);
 	if (rc)
 		process_release(p_v4);
 	else
@@ -404,7 +411,7 @@ static void configure_interface_dhcp(struct network *network,
 	p_v6->exit_cb = udhcpc_process_exit;
 	p_v6->data = interface;
 
-	rc = process_run_async(p_v6);
+	rc = process_run_async_job(p_v6, PROCESS_JOB_DHCP);
 	if (rc)
 		process_release(p_v6);
 	else
@@ -413,6 +420,29 @@ static void configure_interface_dhcp(struct network *network,
 	return;
 }
 
+/* Once a DHCP client has its lease, it no longer needs to be counted
+ * against the DHCP job limit */
+void network_dhcp_lease(struct network *network, const uint8_t *hwaddr,
+		bool ipv6)
+{
+	struct interface *interface;
+	struct process *process;
+
+	if (!network)
+		return;
+
+	list_for_each_entry(&network->interfaces, interface, list) {
+		if (memcmp(interface->hwaddr, hwaddr, HWADDR_SIZE))
+			continue;
+
+		process = ipv6 ? interface->udhcpc6_process :
+				interface->udhcpc_process;
+		if (process)
+			process_job_settled(process);
+		return;
+	}
+}
+
 static void configure_interface_static(struct network *network,
 		struct interface *interface,
 		const struct interface_config *config)
@@ -562,12 +592,14 @@ void network_requery_device(struct network *network,
 		interface->udhcpc_process->data = NULL;
 		process_stop_async(interface->udhcpc_process);
 		process_release(interface->udhcpc_process);
+		interface->udhcpc_process = NULL;
 	}
 	if (interface->udhcpc6_process) {
 		interface->udhcpc6_process->exit_cb = NULL;
 		interface->udhcpc6_process->data = NULL;
 		process_stop_async(interface->udhcpc6_process);
 		process_release(interface->udhcpc6_process);
+		interface->udhcpc6_process = NULL;
 	}
 
 	config = find_config_by_hwaddr(interface->hwaddr);
@@ -683,9 +715,12 @@ static int network_handle_nlmsg(struct network *network, struct nlmsghdr *nlmsg)
 	if (strncmp(interface->name, ifname, IFNAMSIZ)) {
 		pb_debug("ifname update: %s -> %s\n", interface->name, ifname);
 		strncpy(interface->name, ifname, sizeof(interface->name));
-		talloc_free(interface->dev->device->id);
+		/* a parser in a discover worker may still be using the old
+		 * id, so leave it to be freed with the device */
 		interface->dev->device->id =
 			talloc_strdup(interface->dev->device, ifname);
+		device_handler_reindex_device(network->handler,
+				interface->dev);
 	}
 
 	/* notify the sysinfo code about changes to this interface */
@@ -918,6 +953,84 @@ err:
 	return NULL;
 }
 
+/* Would configure_interface() treat this interface differently under
+ * old_config than under the current config? */
+static bool interface_config_changed(const struct config *old_config,
+		uint8_t *hwaddr)
+{
+	const struct interface_config *a, *b;
+	bool manual_a, manual_b;
+
+	a = find_config_in(old_config, hwaddr);
+	b = find_config_by_hwaddr(hwaddr);
+
+	/* without their own config, interfaces are ignored in manual config
+	 * mode, and use DHCP otherwise */
+	if (!a && !b) {
+		manual_a = old_config->network.n_interfaces != 0;
+		manual_b = config_get()->network.n_interfaces != 0;
+		return manual_a != manual_b;
+	}
+
+	if (!a || !b)
+		return true;
+
+	if (a->ignore || b->ignore)
+		return a->ignore != b->ignore;
+
+	if (a->method != b->method)
+		return true;
+
+	if (a->method != CONFIG_METHOD_STATIC)
+		return false;
+
+	return !streq_null(a->static_config.address,
+				b->static_config.address) ||
+		!streq_null(a->static_config.gateway,
+				b->static_config.gateway) ||
+		!streq_null(a->static_config.url,
+				b->static_config.url);
+}
+
+void network_reconfigure(struct network *network,
+		const struct config *old_config, bool all)
+{
+	struct interface *interface;
+
+	network->manual_config = config_get()->network.n_interfaces != 0;
+
+	network_init_dns(network);
+
+	list_for_each_entry(&network->interfaces, interface, list) {
+		if (!strcmp(interface->name, "lo"))
+			continue;
+
+		if (!interface_config_changed(old_config, interface->hwaddr) &&
+				!(all && interface->state != IFSTATE_IGNORED))
+			continue;
+
+		pb_log("network: reconfiguring interface %s\n",
+				interface->name);
+
+		/* drop anything we discovered through the old config */
+		if (interface->dev)
+			device_handler_remove(network->handler,
+					interface->dev);
+		interface->dev = NULL;
+
+		if (interface->state != IFSTATE_IGNORED)
+			interface_down(interface);
+
+		interface->state = IFSTATE_NEW;
+		create_interface_dev(network, interface);
+
+		/* bring the interface up, if the new config allows; link
+		 * notifications take care of the rest */
+		if (interface->ready)
+			configure_interface(network, interface, false, false);
+	}
+}
+
 int network_shutdown(struct network *network)
 {
 	struct interface *interface;
@@ -1,6 +1,7 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+struct config;
 struct network;
 struct device_handler;
 struct discover_device;
@@ -10,6 +11,12 @@ struct network *network_init(struct device_handler *handler,
 		struct waitset *waitset, bool dry_run);
 int network_shutdown(struct network *network);
 
+/* Apply the current network config, changed from old_config, re-running
+ * discovery on interfaces it affects. If all is set, re-run discovery on
+ * every configured interface. */
+void network_reconfigure(struct network *network,
+		const struct config *old_config, bool all);
+
 void network_register_device(struct network *network,
 		struct discover_device *dev);
 void network_unregister_device(struct network *network,
@@ -20,6 +27,9 @@ void network_requery_device(struct network *network,
 uint8_t *find_mac_by_name(void *ctx, struct network *network,
 		const char *name);
 
+void network_dhcp_lease(struct network *network, const uint8_t *hwaddr,
+		bool ipv6);
+
 void network_mark_interface_ready(struct device_handler *handler,
 		int ifindex, const char *ifname, uint8_t *mac, int hwsize);
 
@@ -0,0 +1,684 @@
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <asm/byteorder.h>
+
+#include <file/file.h>
+#include <list/list.h>
+#include <log/log.h>
+#include <pb-protocol/pb-protocol.h>
+#include <talloc/talloc.h>
+#include <types/types.h>
+#include <url/url.h>
+#include <util/util.h>
+#include <waiter/waiter.h>
+
+#include "device-handler.h"
+#include "option-cache.h"
+#include "parser.h"
+#include "resource.h"
+
+#define OPTION_CACHE_MAGIC	0x70626f63	/* "pboc" */
+#define OPTION_CACHE_VERSION	1
+
+/* The cached options are in the form that this build's parsers produce, so
+ * the file is only valid for the petitboot version that wrote it. This
+ * follows the magic and format version in the file header. */
+#define OPTION_CACHE_PACKAGE	PACKAGE_VERSION
+
+/* Entries are written most-recently-used first, and we drop any that
+ * would take the cache file past this size */
+#define OPTION_CACHE_MAX_SIZE	(128 * 1024)
+
+enum {
+	CACHE_FILE_EXISTS	= 0x1,
+	CACHE_FILE_HASH		= 0x2,
+};
+
+/* The parts of a file's stat result that change when it is written, and a
+ * hash of its contents if the parsers read it. If only the mtime differs,
+ * the file has been written with the same contents, and we can keep using
+ * the cached options. */
+struct option_cache_file {
+	char		*filename;
+	unsigned int	flags;
+	uint64_t	size;
+	uint64_t	mtime_sec;
+	uint32_t	mtime_nsec;
+	uint64_t	hash;
+};
+
+#define N_RESOURCES	5
+
+/* A boot option as the parsers left it: the boot_option in pb-protocol
+ * form, and the URLs of its (resolved) resources */
+struct option_cache_option {
+	char				*parser;
+	char				*urls[N_RESOURCES];
+	struct pb_protocol_message	*message;
+};
+
+struct option_cache_entry {
+	struct list_item		list;
+	char				*uuid;
+	char				*device_id;
+	char				*mount_path;
+	char				*root_path;
+	unsigned int			n_files;
+	struct option_cache_file	*files;
+	unsigned int			n_options;
+	struct option_cache_option	*options;
+};
+
+struct option_cache {
+	char		*path;
+	struct list	entries;
+	struct waitset	*waitset;
+	struct waiter	*write_waiter;
+};
+
+struct cache_buf {
+	char		*buf;
+	unsigned int	len;
+};
+
+static void option_resources(struct discover_boot_option *opt,
+		struct resource **res[N_RESOURCES])
+{
+	res[0] = &opt->boot_image;
+	res[1] = &opt->initrd;
+	res[2] = &opt->dtb;
+	res[3] = &opt->args_sig_file;
+	res[4] = &opt->icon;
+}
+
+static struct option_cache_entry *option_cache_lookup(
+		struct option_cache *cache, struct discover_device *dev)
+{
+	struct option_cache_entry *entry;
+
+	list_for_each_entry(&cache->entries, entry, list) {
+		if (!strcmp(entry->uuid, dev->uuid) &&
+				!strcmp(entry->device_id, dev->device->id))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void *put(struct cache_buf *b, unsigned int len)
+{
+	char *pos;
+
+	b->buf = talloc_realloc_size(NULL, b->buf, b->len + len);
+	pos = b->buf + b->len;
+	b->len += len;
+
+	return pos;
+}
+
+static void put_u32(struct cache_buf *b, uint32_t val)
+{
+	*(uint32_t *)put(b, sizeof(val)) = __cpu_to_be32(val);
+}
+
+static void put_u64(struct cache_buf *b, uint64_t val)
+{
+	put_u32(b, val >> 32);
+	put_u32(b, val & 0xffffffff);
+}
+
+static void put_data(struct cache_buf *b, const char *data, unsigned int len)
+{
+	put_u32(b, len);
+	memcpy(put(b, len), data, len);
+}
+
+static void put_string(struct cache_buf *b, const char *str)
+{
+	put_data(b, str, str ? strlen(str) : 0);
+}
+
+static int get_u32(const char **pos, unsigned int *len, uint32_t *val)
+{
+	if (*len < sizeof(*val))
+		return -1;
+
+	*val = __be32_to_cpu(*(uint32_t *)*pos);
+	*pos += sizeof(*val);
+	*len -= sizeof(*val);
+
+	return 0;
+}
+
+static int get_u64(const char **pos, unsigned int *len, uint64_t *val)
+{
+	uint32_t hi, lo;
+
+	if (get_u32(pos, len, &hi) || get_u32(pos, len, &lo))
+		return -1;
+
+	*val = (uint64_t)hi << 32 | lo;
+	return 0;
+}
+
+static int get_data(const char **pos, unsigned int *len,
+		const char **data, uint32_t *data_len)
+{
+	if (get_u32(pos, len, data_len) || *data_len > *len)
+		return -1;
+
+	*data = *pos;
+	*pos += *data_len;
+	*len -= *data_len;
+
+	return 0;
+}
+
+static int get_string(void *ctx, const char **pos, unsigned int *len,
+		char **str)
+{
+	const char *data;
+	uint32_t str_len;
+
+	if (get_data(pos, len, &data, &str_len))
+		return -1;
+
+	*str = str_len ? talloc_strndup(ctx, data, str_len) : NULL;
+	return 0;
+}
+
+static void option_cache_put_entry(struct cache_buf *b,
+		struct option_cache_entry *entry)
+{
+	unsigned int i, j;
+
+	put_string(b, entry->uuid);
+	put_string(b, entry->device_id);
+	put_string(b, entry->mount_path);
+	put_string(b, entry->root_path);
+
+	put_u32(b, entry->n_files);
+	for (i = 0; i < entry->n_files; i++) {
+		struct option_cache_file *file = &entry->files[i];
+
+		put_string(b, file->filename);
+		put_u32(b, file->flags);
+		put_u64(b, file->size);
+		put_u64(b, file->mtime_sec);
+		put_u32(b, file->mtime_nsec);
+		put_u64(b, file->hash);
+	}
+
+	put_u32(b, entry->n_options);
+	for (i = 0; i < entry->n_options; i++) {
+		struct option_cache_option *opt = &entry->options[i];
+
+		put_string(b, opt->parser);
+		for (j = 0; j < N_RESOURCES; j++)
+			put_string(b, opt->urls[j]);
+		put_data(b, opt->message->payload, opt->message->payload_len);
+	}
+}
+
+static struct option_cache_entry *option_cache_get_entry(void *ctx,
+		const char **pos, unsigned int *len)
+{
+	struct option_cache_entry *entry;
+	uint32_t n, data_len;
+	const char *data;
+	unsigned int i, j;
+
+	entry = talloc_zero(ctx, struct option_cache_entry);
+
+	if (get_string(entry, pos, len, &entry->uuid) || !entry->uuid ||
+		get_string(entry, pos, len, &entry->device_id) ||
+			!entry->device_id ||
+		get_string(entry, pos, len, &entry->mount_path) ||
+		get_string(entry, pos, len, &entry->root_path))
+		goto err;
+
+	if (get_u32(pos, len, &n) || n > *len)
+		goto err;
+
+	entry->n_files = n;
+	entry->files = talloc_zero_array(entry, struct option_cache_file, n);
+	for (i = 0; i < n; i++) {
+		struct option_cache_file *file = &entry->files[i];
+
+		if (get_string(entry, pos, len, &file->filename) ||
+				!file->filename ||
+				get_u32(pos, len, &file->flags) ||
+				get_u64(pos, len, &file->size) ||
+				get_u64(pos, len, &file->mtime_sec) ||
+				get_u32(pos, len, &file->mtime_nsec) ||
+				get_u64(pos, len, &file->hash))
+			goto err;
+	}
+
+	if (get_u32(pos, len, &n) || n > *len)
+		goto err;
+
+	entry->n_options = n;
+	entry->options = talloc_zero_array(entry,
+			struct option_cache_option, n);
+	for (i = 0; i < n; i++) {
+		struct option_cache_option *opt = &entry->options[i];
+
+		if (get_string(entry, pos, len, &opt->parser) || !opt->parser)
+			goto err;
+
+		for (j = 0; j < N_RESOURCES; j++)
+			if (get_string(entry, pos, len, &opt->urls[j]))
+				goto err;
+
+		if (get_data(pos, len, &data, &data_len))
+			goto err;
+
+		opt->message = pb_protocol_create_message(entry,
+				PB_PROTOCOL_ACTION_BOOT_OPTION_ADD, data_len);
+		memcpy(opt->message->payload, data, data_len);
+	}
+
+	return entry;
+
+err:
+	talloc_free(entry);
+	return NULL;
+}
+
+static void option_cache_load(struct option_cache *cache)
+{
+	struct option_cache_entry *entry;
+	uint32_t magic, version;
+	const char *pos, *package;
+	uint32_t package_len;
+	unsigned int len;
+	char *buf;
+	int rc, n;
+
+	rc = read_file(cache, cache->path, &buf, &n);
+	if (rc)
+		return;
+
+	pos = buf;
+	len = n;
+
+	if (get_u32(&pos, &len, &magic) || magic != OPTION_CACHE_MAGIC ||
+			get_u32(&pos, &len, &version) ||
+			version != OPTION_CACHE_VERSION ||
+			get_data(&pos, &len, &package, &package_len) ||
+			package_len != strlen(OPTION_CACHE_PACKAGE) ||
+			strncmp(package, OPTION_CACHE_PACKAGE, package_len)) {
+		pb_log("Ignoring option cache %s from another version\n",
+				cache->path);
+		goto out;
+	}
+
+	while (len) {
+		entry = option_cache_get_entry(cache, &pos, &len);
+		if (!entry) {
+			pb_log("Option cache %s is corrupt, ignoring the "
+					"rest\n", cache->path);
+			break;
+		}
+		list_add_tail(&cache->entries, &entry->list);
+	}
+
+out:
+	talloc_free(buf);
+}
+
+static void option_cache_write(struct option_cache *cache)
+{
+	struct option_cache_entry *entry, *tmp;
+	struct cache_buf b = { NULL, 0 };
+	unsigned int len;
+
+	put_u32(&b, OPTION_CACHE_MAGIC);
+	put_u32(&b, OPTION_CACHE_VERSION);
+	put_string(&b, OPTION_CACHE_PACKAGE);
+
+	list_for_each_entry_safe(&cache->entries, entry, tmp, list) {
+		len = b.len;
+		option_cache_put_entry(&b, entry);
+		if (b.len <= OPTION_CACHE_MAX_SIZE)
+			continue;
+
+		/* out of space: drop this and all older entries */
+		b.len = len;
+		list_remove(&entry->list);
+		talloc_free(entry);
+	}
+
+	if (replace_file(cache->path, b.buf, b.len))
+		pb_log("Failed to write option cache %s\n", cache->path);
+
+	talloc_free(b.buf);
+}
+
+static void option_cache_remove(struct option_cache_entry *entry)
+{
+	list_remove(&entry->list);
+	talloc_free(entry);
+}
+
+static int option_cache_write_pending(void *arg)
+{
+	struct option_cache *cache = arg;
+
+	cache->write_waiter = NULL;
+	option_cache_write(cache);
+
+	return 0;
+}
+
+/* Devices tend to be parsed in bursts, so write the cache out once the
+ * current burst has been handled, rather than once for each device */
+static void option_cache_changed(struct option_cache *cache)
+{
+	if (cache->write_waiter)
+		return;
+
+	cache->write_waiter = waiter_register_timeout(cache->waitset, 0,
+			option_cache_write_pending, cache);
+}
+
+/* Don't lose the last changes if we're shut down before they're written */
+static int option_cache_destroy(void *arg)
+{
+	struct option_cache *cache = arg;
+
+	if (cache->write_waiter) {
+		waiter_remove(cache->write_waiter);
+		option_cache_write(cache);
+	}
+
+	return 0;
+}
+
+struct option_cache *option_cache_init(void *ctx, struct waitset *waitset,
+		const char *path)
+{
+	struct option_cache *cache;
+
+	cache = talloc_zero(ctx, struct option_cache);
+	cache->path = talloc_strdup(cache, path);
+	cache->waitset = waitset;
+	list_init(&cache->entries);
+	talloc_set_destructor(cache, option_cache_destroy);
+
+	option_cache_load(cache);
+
+	return cache;
+}
+
+/* Check a cached file against the device. Returns 1 if it's unchanged,
+ * 0 if it has changed, and 2 if it is unchanged but has a new mtime. */
+static int option_cache_check_file(struct discover_context *ctx,
+		struct option_cache_file *file)
+{
+	struct stat statbuf;
+	char *buf;
+	int rc, len;
+
+	rc = parser_stat_path(ctx, ctx->device, file->filename, &statbuf);
+
+	if (!(file->flags & CACHE_FILE_EXISTS))
+		return rc != 0;
+
+	if (rc || (uint64_t)statbuf.st_size != file->size)
+		return 0;
+
+	if ((uint64_t)statbuf.st_mtim.tv_sec == file->mtime_sec &&
+			(uint32_t)statbuf.st_mtim.tv_nsec == file->mtime_nsec)
+		return 1;
+
+	if (!(file->flags & CACHE_FILE_HASH))
+		return 0;
+
+	rc = parser_request_file(ctx, ctx->device, file->filename, &buf, &len);
+	if (rc)
+		return 0;
+
+	rc = data_hash(buf, len) == file->hash;
+	talloc_free(buf);
+	if (!rc)
+		return 0;
+
+	file->mtime_sec = statbuf.st_mtim.tv_sec;
+	file->mtime_nsec = statbuf.st_mtim.tv_nsec;
+	return 2;
+}
+
+static void discard_options(struct discover_context *ctx)
+{
+	struct discover_boot_option *opt, *tmp;
+
+	list_for_each_entry_safe(&ctx->boot_options, opt, tmp, list) {
+		list_remove(&opt->list);
+		talloc_free(opt);
+	}
+}
+
+static int option_cache_add_option(struct discover_context *ctx,
+		struct option_cache_option *cached)
+{
+	struct resource **res[N_RESOURCES];
+	struct discover_boot_option *opt;
+	struct parser *parser;
+	unsigned int i;
+
+	parser = parser_lookup(cached->parser);
+	if (!parser)
+		return -1;
+
+	opt = discover_boot_option_create(ctx, ctx->device);
+	if (pb_protocol_deserialise_boot_option(opt->option,
+				cached->message)) {
+		talloc_free(opt);
+		return -1;
+	}
+
+	option_resources(opt, res);
+	for (i = 0; i < N_RESOURCES; i++) {
+		if (cached->urls[i])
+			*res[i] = create_url_resource(opt,
+					pb_url_parse(opt, cached->urls[i]));
+	}
+
+	discover_context_add_boot_option(ctx, opt);
+	opt->source = parser;
+
+	return 0;
+}
+
+bool option_cache_replay(struct option_cache *cache,
+		struct discover_context *ctx)
+{
+	struct discover_device *dev = ctx->device;
+	struct option_cache_entry *entry;
+	bool dirty = false;
+	unsigned int i;
+	int rc;
+
+	if (!dev->uuid)
+		return false;
+
+	entry = option_cache_lookup(cache, dev);
+	if (!entry)
+		return false;
+
+	/* options' URLs and IDs include the mount path and device id */
+	if (!streq_null(entry->mount_path, dev->mount_path) ||
+			!streq_null(entry->root_path, dev->root_path))
+		goto invalid;
+
+	for (i = 0; i < entry->n_files; i++) {
+		rc = option_cache_check_file(ctx, &entry->files[i]);
+		if (!rc) {
+			pb_debug("option cache: %s has changed on %s\n",
+					entry->files[i].filename,
+					dev->device->id);
+			goto invalid;
+		}
+		if (rc == 2)
+			dirty = true;
+	}
+
+	for (i = 0; i < entry->n_options; i++) {
+		if (option_cache_add_option(ctx, &entry->options[i])) {
+			discard_options(ctx);
+			goto invalid;
+		}
+	}
+
+	pb_log("option cache: replayed %u boot options for %s\n",
+			entry->n_options, dev->device->id);
+
+	list_remove(&entry->list);
+	list_add(&cache->entries, &entry->list);
+
+	if (dirty)
+		option_cache_changed(cache);
+
+	return true;
+
+invalid:
+	option_cache_remove(entry);
+	return false;
+}
+
+static void option_cache_add_file(
+		struct discover_context *ctx __attribute__((unused)),
+		const char *filename, int stat_rc, const struct stat *statbuf,
+		const char *data, int len, void *arg)
+{
+	struct option_cache_entry *entry = arg;
+	struct option_cache_file *file;
+
+	entry->files = talloc_realloc(entry, entry->files,
+			struct option_cache_file, entry->n_files + 1);
+	file = &entry->files[entry->n_files++];
+	memset(file, 0, sizeof(*file));
+
+	file->filename = talloc_strdup(entry, filename);
+
+	if (stat_rc)
+		return;
+
+	file->flags = CACHE_FILE_EXISTS;
+	file->size = statbuf->st_size;
+	file->mtime_sec = statbuf->st_mtim.tv_sec;
+	file->mtime_nsec = statbuf->st_mtim.tv_nsec;
+
+	if (data) {
+		file->flags |= CACHE_FILE_HASH;
+		file->hash = data_hash(data, len);
+	}
+}
+
+/* We can only replay resources that are resolved without reference to any
+ * other device: remote URLs, or files on this device */
+static bool resource_is_cacheable(struct discover_device *dev,
+		struct resource *res)
+{
+	size_t len;
+
+	if (!res)
+		return true;
+
+	if (!res->resolved || !res->url)
+		return false;
+
+	if (res->url->scheme != pb_url_file)
+		return true;
+
+	len = strlen(dev->mount_path);
+	return !strncmp(res->url->path, dev->mount_path, len) &&
+		res->url->path[len] == '/';
+}
+
+static int option_cache_add_options(struct option_cache_entry *entry,
+		struct discover_context *ctx)
+{
+	struct resource **res[N_RESOURCES];
+	struct option_cache_option *cached;
+	struct discover_boot_option *opt;
+	unsigned int i;
+	int len;
+
+	list_for_each_entry(&ctx->boot_options, opt, list) {
+		/* these are dropped by the handler; so drop them here too */
+		if (!opt->boot_image || !opt->boot_image->url)
+			continue;
+
+		if (!opt->source)
+			return -1;
+
+		option_resources(opt, res);
+		for (i = 0; i < N_RESOURCES; i++)
+			if (!resource_is_cacheable(ctx->device, *res[i]))
+				return -1;
+
+		entry->options = talloc_realloc(entry, entry->options,
+				struct option_cache_option,
+				entry->n_options + 1);
+		cached = &entry->options[entry->n_options++];
+		memset(cached, 0, sizeof(*cached));
+
+		cached->parser = talloc_strdup(entry, opt->source->name);
+		for (i = 0; i < N_RESOURCES; i++)
+			if (*res[i])
+				cached->urls[i] = talloc_strdup(entry,
+						(*res[i])->url->full);
+
+		len = pb_protocol_boot_option_len(opt->option);
+		cached->message = pb_protocol_create_message(entry,
+				PB_PROTOCOL_ACTION_BOOT_OPTION_ADD, len);
+		pb_protocol_serialise_boot_option(opt->option,
+				cached->message->payload, len);
+	}
+
+	return 0;
+}
+
+void option_cache_update(struct option_cache *cache,
+		struct discover_context *ctx)
+{
+	struct discover_device *dev = ctx->device;
+	struct option_cache_entry *entry;
+	bool stale;
+
+	if (!dev->uuid || !dev->mount_path)
+		return;
+
+	entry = option_cache_lookup(cache, dev);
+	stale = entry != NULL;
+	if (entry)
+		option_cache_remove(entry);
+
+	entry = talloc_zero(cache, struct option_cache_entry);
+	entry->uuid = talloc_strdup(entry, dev->uuid);
+	entry->device_id = talloc_strdup(entry, dev->device->id);
+	entry->mount_path = talloc_strdup(entry, dev->mount_path);
+	entry->root_path = talloc_strdup(entry, dev->root_path);
+
+	if (parser_walk_files(ctx, option_cache_add_file, entry) ||
+			option_cache_add_options(entry, ctx)) {
+		pb_debug("option cache: parse of %s can't be cached\n",
+				dev->device->id);
+		talloc_free(entry);
+		if (stale)
+			option_cache_changed(cache);
+		return;
+	}
+
+	list_add(&cache->entries, &entry->list);
+	option_cache_changed(cache);
+}
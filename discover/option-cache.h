@@ -0,0 +1,31 @@
+#ifndef OPTION_CACHE_H
+#define OPTION_CACHE_H
+
+#include <stdbool.h>
+
+struct discover_context;
+struct option_cache;
+struct waitset;
+
+/* A persistent record of the boot options that parsers found on each
+ * device, keyed by filesystem UUID, along with fingerprints of the files
+ * that the parsers looked at to find them. The cache is loaded from and
+ * written back to the file at path, which is best kept on tmpfs or a
+ * small persistent store. Changes are written from a waitset timeout, so
+ * that a burst of devices costs a single write, and on freeing the cache.
+ */
+struct option_cache *option_cache_init(void *ctx, struct waitset *waitset,
+		const char *path);
+
+/* If we have cached options for ctx's newly-mounted device, and none of
+ * the files that the parsers looked at have changed, add the cached options
+ * to ctx and return true. Otherwise the caller should run the parsers. */
+bool option_cache_replay(struct option_cache *cache,
+		struct discover_context *ctx);
+
+/* Record the results of running the parsers over ctx's device, before the
+ * context is committed */
+void option_cache_update(struct option_cache *cache,
+		struct discover_context *ctx);
+
+#endif /* OPTION_CACHE_H */
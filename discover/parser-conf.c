@@ -151,17 +151,27 @@ int conf_param_in_list(const char *const *list, const char *param)
 }
 
 /**
- * conf_init_global_options - Zero the global option table.
+ * conf_init_global_options - Give @conf its own, zeroed copy of the global
+ * option table.
+ *
+ * The parser's table is only a template, as parses of different devices may
+ * run at the same time.
  */
 
 void conf_init_global_options(struct conf_context *conf)
 {
-	int i;
+	int i, n;
 
 	if (!conf->global_options)
 		return;
 
-	for (i = 0; conf->global_options[i].name; i++)
+	for (n = 0; conf->global_options[n].name; n++)
+		;
+
+	conf->global_options = talloc_memdup(conf, conf->global_options,
+			(n + 1) * sizeof(*conf->global_options));
+
+	for (i = 0; i < n; i++)
 		conf->global_options[i].value = NULL;
 }
 
@@ -1,6 +1,7 @@
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "types/types.h"
 #include <file/file.h>
@@ -19,6 +20,37 @@ struct p_item {
 
 STATIC_LIST(parsers);
 
+/* Parsers often look at the same paths on a device (the grub2 source and
+ * test builtins, and each parser's search for its config files), so we
+ * cache the results of stat and reads for the life of a discover context,
+ * including failures. Files are only read for configuration, so are
+ * small; we don't cache any larger than this. */
+#define FILE_CACHE_MAX_SIZE	(1024 * 1024)
+
+struct file_cache_entry {
+	struct list_item	list;
+	struct discover_device	*dev;
+	char			*filename;
+
+	bool			have_stat;
+	int			stat_rc;
+	struct stat		statbuf;
+
+	bool			have_data;
+	int			data_rc;
+	char			*data;
+	int			len;
+};
+
+struct parser_file_cache {
+	struct list		entries;
+	unsigned int		hits;
+	unsigned int		misses;
+	/* set if the parse has depended on anything but the stat and data
+	 * results of entries on the context's own device */
+	bool			incomplete;
+};
+
 static char *local_path(struct discover_context *ctx,
 		struct discover_device *dev,
 		const char *filename)
@@ -26,24 +58,113 @@ static char *local_path(struct discover_context *ctx,
 	return join_paths(ctx, dev->root_path, filename);
 }
 
+static struct parser_file_cache *file_cache(struct discover_context *ctx)
+{
+	struct parser_file_cache *cache = ctx->file_cache;
+
+	if (!cache) {
+		cache = talloc_zero(ctx, struct parser_file_cache);
+		list_init(&cache->entries);
+		ctx->file_cache = cache;
+	}
+
+	return cache;
+}
+
+static struct file_cache_entry *file_cache_get(struct discover_context *ctx,
+		struct discover_device *dev, const char *filename)
+{
+	struct parser_file_cache *cache = file_cache(ctx);
+	struct file_cache_entry *entry;
+
+	list_for_each_entry(&cache->entries, entry, list) {
+		if (entry->dev == dev && !strcmp(entry->filename, filename))
+			return entry;
+	}
+
+	entry = talloc_zero(cache, struct file_cache_entry);
+	entry->dev = dev;
+	entry->filename = talloc_strdup(entry, filename);
+	list_add(&cache->entries, &entry->list);
+
+	return entry;
+}
+
+static void file_cache_count(struct discover_context *ctx, bool hit)
+{
+	if (hit)
+		ctx->file_cache->hits++;
+	else
+		ctx->file_cache->misses++;
+}
+
+static void file_cache_invalidate(struct discover_context *ctx,
+		struct discover_device *dev, const char *filename)
+{
+	struct file_cache_entry *entry;
+
+	if (!ctx->file_cache)
+		return;
+
+	list_for_each_entry(&ctx->file_cache->entries, entry, list) {
+		if (entry->dev == dev && !strcmp(entry->filename, filename)) {
+			list_remove(&entry->list);
+			talloc_free(entry);
+			return;
+		}
+	}
+}
+
 int parser_request_file(struct discover_context *ctx,
 		struct discover_device *dev, const char *filename,
 		char **buf, int *len)
 
 {
+	struct file_cache_entry *entry;
+	struct stat statbuf;
 	char *path;
 	int rc;
 
+	if (dev != ctx->device)
+		file_cache(ctx)->incomplete = true;
+
 	/* we only support local files at present */
 	if (!dev->mount_path)
 		return -1;
 
+	/* stat before reading, so that a change to the file after this
+	 * leaves it newer than the results we give to the parser */
+	parser_stat_path(ctx, dev, filename, &statbuf);
+
+	entry = file_cache_get(ctx, dev, filename);
+	file_cache_count(ctx, entry->have_data);
+
+	if (entry->have_data) {
+		if (entry->data_rc)
+			return entry->data_rc;
+
+		/* callers may modify the buffer, so give them a copy */
+		*buf = talloc_memdup(ctx, entry->data, entry->len + 1);
+		*len = entry->len;
+		return 0;
+	}
+
 	path = local_path(ctx, dev, filename);
 
 	rc = read_file(ctx, path, buf, len);
 
 	talloc_free(path);
 
+	if (rc) {
+		entry->have_data = true;
+		entry->data_rc = rc;
+	} else if (*len <= FILE_CACHE_MAX_SIZE) {
+		entry->have_data = true;
+		entry->data_rc = 0;
+		entry->data = talloc_memdup(entry, *buf, *len + 1);
+		entry->len = *len;
+	}
+
 	return rc;
 }
 
@@ -51,13 +172,26 @@ int parser_stat_path(struct discover_context *ctx,
 		struct discover_device *dev, const char *path,
 		struct stat *statbuf)
 {
+	struct file_cache_entry *entry;
 	int rc = -1;
 	char *full_path;
 
+	if (dev != ctx->device)
+		file_cache(ctx)->incomplete = true;
+
 	/* we only support local files at present */
 	if (!dev->mount_path)
 		return -1;
 
+	entry = file_cache_get(ctx, dev, path);
+	file_cache_count(ctx, entry->have_stat);
+
+	if (entry->have_stat) {
+		if (!entry->stat_rc)
+			*statbuf = entry->statbuf;
+		return entry->stat_rc;
+	}
+
 	full_path = local_path(ctx, dev, path);
 
 	rc = stat(full_path, statbuf);
@@ -67,7 +201,10 @@ int parser_stat_path(struct discover_context *ctx,
 	}
 
 	rc = 0;
+	entry->statbuf = *statbuf;
 out:
+	entry->have_stat = true;
+	entry->stat_rc = rc;
 	talloc_free(full_path);
 
 	return rc;
@@ -125,6 +262,9 @@ int parser_replace_file(struct discover_context *ctx,
 
 	rc = replace_file(path, buf, len);
 
+	file_cache_invalidate(ctx, dev, filename);
+	file_cache(ctx)->incomplete = true;
+
 	talloc_free(path);
 
 	device_release_write(dev, release);
@@ -138,6 +278,8 @@ int parser_request_url(struct discover_context *ctx, struct pb_url *url,
 	struct load_url_result *result;
 	int rc;
 
+	file_cache(ctx)->incomplete = true;
+
 	result = load_url(ctx, url);
 	if (!result)
 		goto out;
@@ -162,10 +304,21 @@ int parser_scandir(struct discover_context *ctx, const char *dirname,
 		   struct dirent ***files, int (*filter)(const struct dirent *),
 		   int (*comp)(const struct dirent **, const struct dirent **))
 {
+	struct discover_device *dev = ctx->device;
+	struct stat statbuf;
 	char *path;
 	int n;
 
-	path = talloc_asprintf(ctx, "%s%s", ctx->device->mount_path, dirname);
+	/* the directory's mtime changes with its entries, so its stat
+	 * result stands in for the listing; that's only in our cache if
+	 * the directory is under the device's root */
+	if (dev->root_path && dev->mount_path &&
+			!strcmp(dev->root_path, dev->mount_path))
+		parser_stat_path(ctx, dev, dirname, &statbuf);
+	else
+		file_cache(ctx)->incomplete = true;
+
+	path = talloc_asprintf(ctx, "%s%s", dev->mount_path, dirname);
 	if (!path)
 		return -1;
 
@@ -174,6 +327,30 @@ int parser_scandir(struct discover_context *ctx, const char *dirname,
 	return n;
 }
 
+int parser_walk_files(struct discover_context *ctx, parser_file_cb cb,
+		void *arg)
+{
+	struct file_cache_entry *entry;
+
+	if (!ctx->file_cache)
+		return 0;
+
+	if (ctx->file_cache->incomplete)
+		return -1;
+
+	list_for_each_entry(&ctx->file_cache->entries, entry, list) {
+		if (!entry->have_stat)
+			return -1;
+
+		cb(ctx, entry->filename, entry->stat_rc, &entry->statbuf,
+			entry->have_data && !entry->data_rc ?
+				entry->data : NULL,
+			entry->len, arg);
+	}
+
+	return 0;
+}
+
 void iterate_parsers(struct discover_context *ctx)
 {
 	struct p_item* i;
@@ -186,6 +363,24 @@ void iterate_parsers(struct discover_context *ctx)
 		i->parser->parse(ctx);
 	}
 	ctx->parser = NULL;
+
+	if (ctx->file_cache)
+		pb_debug("file cache for %s: %u hits, %u misses\n",
+				ctx->device->device->id,
+				ctx->file_cache->hits,
+				ctx->file_cache->misses);
+}
+
+struct parser *parser_lookup(const char *name)
+{
+	struct p_item *i;
+
+	list_for_each_entry(&parsers, i, list) {
+		if (!strcmp(i->parser->name, name))
+			return i->parser;
+	}
+
+	return NULL;
 }
 
 static void *parsers_ctx;
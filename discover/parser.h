@@ -28,6 +28,10 @@ struct resource;
  * resolve them whenever new devices are discovered, by calling the parser's
  * resolve_resource function. Once a boot option's resources are full resolved,
  * the option can be sent to clients.
+ *
+ * If the parser provides resource_dependency, it returns the id, uuid or
+ * label of the device that an unresolved resource is waiting for, so that
+ * resolution is only retried when a matching device appears.
  */
 struct parser {
 	char			*name;
@@ -35,6 +39,8 @@ struct parser {
 	bool			(*resolve_resource)(
 						struct device_handler *handler,
 						struct resource *res);
+	const char		*(*resource_dependency)(
+						struct resource *res);
 };
 
 enum generic_icon_type {
@@ -56,6 +62,7 @@ struct parser_found_file {
 void parser_init(void);
 
 void iterate_parsers(struct discover_context *ctx);
+struct parser *parser_lookup(const char *name);
 int parse_user_event(struct discover_context *ctx, struct event *event);
 
 /* File IO functions for parsers; these should be the only interface that
@@ -91,6 +98,19 @@ int parser_scandir(struct discover_context *ctx, const char *dirname,
 		   struct dirent ***files, int (*filter)(const struct dirent *),
 		   int (*comp)(const struct dirent **, const struct dirent **));
 
+/* Walk the files that parsers have looked at on the context's device,
+ * with the results they saw. stat_rc is non-zero if the file couldn't be
+ * stat-ed, and data is NULL if the file wasn't read, or was too large to
+ * keep. Returns non-zero (possibly after some callbacks) if the parse
+ * depended on anything other than these files, such as other devices or
+ * remote URLs.
+ */
+typedef void (*parser_file_cb)(struct discover_context *ctx,
+		const char *filename, int stat_rc, const struct stat *statbuf,
+		const char *data, int len, void *arg);
+int parser_walk_files(struct discover_context *ctx, parser_file_cb cb,
+		void *arg);
+
 /* parser_is_unique - Test a file against a list of known files.
  * If the file @filename exists and the file is not in @found_list add the
  * file to @found_list and return true.  Use when searching case-insensitive
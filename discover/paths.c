@@ -24,6 +24,8 @@
 
 #define DEVICE_MOUNT_BASE (LOCAL_STATE_DIR "/petitboot/mnt")
 
+#define LOAD_STDOUT_MAX (16 * 1024)
+
 
 struct list	pending_network_jobs;
 
@@ -39,6 +41,7 @@ struct load_task {
 	struct process		*process;
 	struct load_url_result	*result;
 	bool			async;
+	enum process_job_class	job_class;
 	load_url_complete	async_cb;
 	void			*async_data;
 };
@@ -151,10 +154,11 @@ static void load_url_process_exit(struct process *process)
 static int busybox_progress_cb(void *arg)
 {
 	const char *busybox_fmt = "%*s %u%*[%* |]%u%c %*u:%*u:%*u ETA\n";
+	unsigned int percentage = 0, size = 0, p_percentage, p_size;
 	struct process_info *procinfo = arg;
-	char *n, *s, suffix, *line = NULL;
+	char *line, *lines = NULL, *saveptr = NULL;
 	struct device_handler *handler;
-	unsigned int percentage, size;
+	char suffix = ' ', p_suffix;
 	struct process *p;
 	int rc;
 
@@ -164,37 +168,26 @@ static int busybox_progress_cb(void *arg)
 	p = procinfo_get_process(procinfo);
 	handler = p->stdout_data;
 
-	rc = process_process_stdout(procinfo, &line);
+	rc = process_process_stdout(procinfo, &lines);
 
 	if (rc) {
 		/* Unregister ourselves from progress tracking */
 		device_handler_status_download_remove(handler, procinfo);
 	}
 
-	if (rc || !line)
+	if (rc || !lines)
 		return rc;
 
-	rc = sscanf(line, busybox_fmt, &percentage, &size, &suffix);
-
-	/*
-	 * Many unrecognised lines are partial updates. If we see a partial
-	 * line with a newline character, see if we can match a valid line
-	 * at the end of stdout_buf
-	 */
-	if (rc != 3) {
-		n = strchr(line, '\n');
-		if (n)
-			for (s = n - 1; s >= p->stdout_buf; s--)
-				if (*s == '\n') {
-					rc = sscanf(s + 1, busybox_fmt,
-						&percentage, &size, &suffix);
-					break;
-				}
-	}
-
-	if (rc != 3) {
-		percentage = size = 0;
-		suffix = ' ';
+	/* We may have several progress updates since the last call; only
+	 * the latest one is of interest */
+	for (line = strtok_r(lines, "\r\n", &saveptr); line;
+			line = strtok_r(NULL, "\r\n", &saveptr)) {
+		if (sscanf(line, busybox_fmt, &p_percentage, &p_size,
+					&p_suffix) != 3)
+			continue;
+		percentage = p_percentage;
+		size = p_size;
+		suffix = p_suffix;
 	}
 
 	device_handler_status_download(handler, procinfo,
@@ -224,7 +217,7 @@ static void load_process_to_local_file(struct load_task *task,
 	task->process->path = argv[0];
 
 	if (task->async) {
-		rc = process_run_async(task->process);
+		rc = process_run_async_job(task->process, task->job_class);
 		if (rc) {
 			process_release(task->process);
 			task->process = NULL;
@@ -286,7 +279,7 @@ static void load_nfs(struct load_task *task)
 	task->process->argv = argv;
 
 	if (task->async) {
-		rc = process_run_async(task->process);
+		rc = process_run_async_job(task->process, task->job_class);
 		if (rc) {
 			process_release(task->process);
 			task->process = NULL;
@@ -554,7 +547,8 @@ static void pending_network_jobs_add(struct load_task *task, int flags)
  * or NULL on error.
  */
 
-struct load_url_result *load_url_async(void *ctx, struct pb_url *url,
+struct load_url_result *load_url_async_job(void *ctx, struct pb_url *url,
+		enum process_job_class job_class,
 		load_url_complete async_cb, void *async_data,
 		waiter_cb stdout_cb, void *stdout_data)
 {
@@ -569,6 +563,7 @@ struct load_url_result *load_url_async(void *ctx, struct pb_url *url,
 	task = talloc_zero(ctx, struct load_task);
 	task->url = url;
 	task->async = async_cb != NULL;
+	task->job_class = job_class;
 	task->result = talloc_zero(ctx, struct load_url_result);
 	task->result->task = task;
 	task->result->url = url;
@@ -585,10 +580,13 @@ struct load_url_result *load_url_async(void *ctx, struct pb_url *url,
 	if (!stdout_cb && stdout_data && have_busybox())
 		task->process->stdout_cb = busybox_progress_cb;
 
-	/* Make sure we save output for any task that has a custom handler */
+	/* Make sure we save output for any task that has a custom handler.
+	 * Progress output may run for the whole of a long transfer, so only
+	 * keep the latest of it, for error reporting */
 	if (task->process->stdout_cb) {
 		task->process->add_stderr = true;
 		task->process->keep_stdout = true;
+		task->process->stdout_max = LOAD_STDOUT_MAX;
 	}
 
 	/* If the url is remote but network is not yet available queue up this
@@ -640,6 +638,14 @@ struct load_url_result *load_url_async(void *ctx, struct pb_url *url,
 	return result;
 }
 
+struct load_url_result *load_url_async(void *ctx, struct pb_url *url,
+		load_url_complete async_cb, void *async_data,
+		waiter_cb stdout_cb, void *stdout_data)
+{
+	return load_url_async_job(ctx, url, PROCESS_JOB_LOAD, async_cb,
+			async_data, stdout_cb, stdout_data);
+}
+
 struct load_url_result *load_url(void *ctx, struct pb_url *url)
 {
 	return load_url_async(ctx, url, NULL, NULL, NULL, NULL);
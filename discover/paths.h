@@ -52,6 +52,13 @@ struct load_url_result *load_url_async(void *ctx, struct pb_url *url,
 		load_url_complete complete, void *data,
 		waiter_cb stdout_cb, void *stdout_data);
 
+/* As load_url_async, but with the helper process scheduled in a specific
+ * job class, rather than PROCESS_JOB_LOAD */
+struct load_url_result *load_url_async_job(void *ctx, struct pb_url *url,
+		enum process_job_class job_class,
+		load_url_complete complete, void *data,
+		waiter_cb stdout_cb, void *stdout_data);
+
 /* Cancel a pending load */
 void load_url_async_cancel(struct load_url_result *res);
 
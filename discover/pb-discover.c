@@ -15,6 +15,7 @@
 #include <process/process.h>
 #include <talloc/talloc.h>
 #include <i18n/i18n.h>
+#include <pb-protocol/pb-protocol.h>
 
 #include "discover-server.h"
 #include "device-handler.h"
@@ -30,8 +31,10 @@ static void print_usage(void)
 {
 	print_version();
 	printf(
-"Usage: pb-discover [-a, --no-autoboot] [-h, --help] [-l, --log log-file]\n"
-"                   [-n, --dry-run] [-v, --verbose] [-V, --version]\n");
+"Usage: pb-discover [-a, --no-autoboot] [-c, --option-cache file]\n"
+"                   [-e, --export-state] [-h, --help] [-l, --log log-file]\n"
+"                   [-n, --dry-run] [-s, --slow-callback ms]\n"
+"                   [-v, --verbose] [-V, --version] [-w, --workers n]\n");
 }
 
 /**
@@ -46,11 +49,15 @@ enum opt_value {opt_undef = 0, opt_yes, opt_no};
 
 struct opts {
 	enum opt_value no_autoboot;
+	const char *option_cache;
+	enum opt_value export_state;
 	enum opt_value show_help;
 	const char *log_file;
 	enum opt_value dry_run;
+	int slow_callback_ms;
 	enum opt_value show_version;
 	enum opt_value verbose;
+	int workers;
 };
 
 /**
@@ -61,19 +68,26 @@ static int opts_parse(struct opts *opts, int argc, char *argv[])
 {
 	static const struct option long_options[] = {
 		{"no-autoboot",    no_argument,       NULL, 'a'},
+		{"option-cache",   required_argument, NULL, 'c'},
+		{"export-state",   no_argument,       NULL, 'e'},
 		{"help",           no_argument,       NULL, 'h'},
 		{"log",            required_argument, NULL, 'l'},
 		{"dry-run",        no_argument,       NULL, 'n'},
+		{"slow-callback",  required_argument, NULL, 's'},
 		{"verbose",        no_argument,       NULL, 'v'},
 		{"version",        no_argument,       NULL, 'V'},
+		{"workers",        required_argument, NULL, 'w'},
 		{ NULL, 0, NULL, 0},
 	};
-	static const char short_options[] = "ahl:nvV";
+	static const char short_options[] = "ac:ehl:ns:vVw:";
 	static const struct opts default_values = {
 		.no_autoboot = opt_no,
+		.export_state = opt_no,
 		.log_file = "/var/log/petitboot/pb-discover.log",
 		.dry_run = opt_no,
+		.slow_callback_ms = -1,
 		.verbose = opt_no,
+		.workers = -1,
 	};
 
 	*opts = default_values;
@@ -89,6 +103,12 @@ static int opts_parse(struct opts *opts, int argc, char *argv[])
 		case 'a':
 			opts->no_autoboot = opt_yes;
 			break;
+		case 'c':
+			opts->option_cache = optarg;
+			break;
+		case 'e':
+			opts->export_state = opt_yes;
+			break;
 		case 'h':
 			opts->show_help = opt_yes;
 			break;
@@ -98,12 +118,18 @@ static int opts_parse(struct opts *opts, int argc, char *argv[])
 		case 'n':
 			opts->dry_run = opt_yes;
 			break;
+		case 's':
+			opts->slow_callback_ms = atoi(optarg);
+			break;
 		case 'v':
 			opts->verbose = opt_yes;
 			break;
 		case 'V':
 			opts->show_version = opt_yes;
 			break;
+		case 'w':
+			opts->workers = atoi(optarg);
+			break;
 		default:
 			opts->show_help = opt_yes;
 			return -1;
@@ -170,11 +196,17 @@ int main(int argc, char *argv[])
 	signal(SIGINT, sigint_handler);
 
 	waitset = waitset_create(NULL);
+	if (opts.slow_callback_ms >= 0)
+		waitset_set_slow_threshold(waitset, opts.slow_callback_ms);
 
 	server = discover_server_init(waitset);
 	if (!server)
 		return EXIT_FAILURE;
 
+	if (opts.export_state == opt_yes &&
+			discover_server_export_state(server, PB_STATE_PATH))
+		pb_log("Failed to export state to %s\n", PB_STATE_PATH);
+
 	procset = process_init(server, waitset, opts.dry_run == opt_yes);
 	if (!procset)
 		return EXIT_FAILURE;
@@ -192,7 +224,13 @@ int main(int argc, char *argv[])
 	if (platform_restrict_clients())
 		discover_server_set_auth_mode(server, true);
 
-	system_info_init(server);
+	system_info_init(server, waitset);
+
+	if (opts.workers >= 0)
+		device_handler_set_discover_workers(opts.workers);
+
+	if (opts.option_cache)
+		device_handler_set_option_cache(opts.option_cache);
 
 	handler = device_handler_init(server, waitset, opts.dry_run == opt_yes);
 	if (!handler)
@@ -0,0 +1,329 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <list/list.h>
+#include <talloc/talloc.h>
+#include <util/util.h>
+
+#include "device-handler.h"
+#include "resolve-queue.h"
+
+#define RESOLVE_QUEUE_INITIAL_BUCKETS	64
+
+enum resolve_entry_state {
+	RESOLVE_ENTRY_WAITING,	/* in a dependency bucket, or on ->any */
+	RESOLVE_ENTRY_WOKEN,	/* on ->woken */
+	RESOLVE_ENTRY_TAKEN,	/* with the caller, on no list */
+};
+
+struct resolve_queue_entry {
+	struct resolve_queue		*queue;
+	struct discover_boot_option	*opt;
+	enum resolve_entry_state	state;
+	struct list_item		all;
+	struct list_item		list;
+	char				*dep;
+	unsigned int			hash;
+	unsigned long			seq;
+	uint64_t			queued_ms;
+};
+
+struct resolve_queue {
+	struct device_handler	*handler;
+
+	/* every queued option, oldest first */
+	struct list	entries;
+	unsigned int	n_entries;
+	unsigned long	seq;
+
+	/* waiting options, hashed by dependency */
+	struct list	*buckets;
+	unsigned int	n_buckets;
+	unsigned int	n_deps;
+
+	/* waiting options with no known dependency */
+	struct list	any;
+
+	struct list	woken;
+
+	unsigned long	n_wakes;
+	unsigned long	n_woken;
+	unsigned long	n_resolved;
+	uint64_t	total_wait_ms;
+	uint64_t	max_wait_ms;
+};
+
+static uint64_t resolve_queue_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct list *dep_bucket(struct resolve_queue *queue,
+		unsigned int hash)
+{
+	return &queue->buckets[hash & (queue->n_buckets - 1)];
+}
+
+static void entry_unlink(struct resolve_queue_entry *entry)
+{
+	/* entries that are on no list are linked to themselves, so this is
+	 * safe to repeat */
+	list_remove(&entry->list);
+	entry->list.next = entry->list.prev = &entry->list;
+
+	if (entry->state == RESOLVE_ENTRY_WAITING && entry->dep)
+		entry->queue->n_deps--;
+
+	entry->state = RESOLVE_ENTRY_TAKEN;
+}
+
+static void resolve_queue_grow(struct resolve_queue *queue)
+{
+	struct resolve_queue_entry *entry;
+	unsigned int i;
+
+	talloc_free(queue->buckets);
+
+	queue->n_buckets = queue->n_buckets ?
+		queue->n_buckets * 2 : RESOLVE_QUEUE_INITIAL_BUCKETS;
+	queue->buckets = talloc_array(queue, struct list, queue->n_buckets);
+	for (i = 0; i < queue->n_buckets; i++)
+		list_init(&queue->buckets[i]);
+
+	/* re-link the waiting entries in queue order, so that each bucket
+	 * stays ordered */
+	list_for_each_entry(&queue->entries, entry, all) {
+		if (entry->state != RESOLVE_ENTRY_WAITING || !entry->dep)
+			continue;
+		list_add_tail(dep_bucket(queue, entry->hash), &entry->list);
+	}
+}
+
+static int resolve_queue_entry_destroy(void *arg)
+{
+	struct resolve_queue_entry *entry = arg;
+
+	entry_unlink(entry);
+	list_remove(&entry->all);
+	entry->queue->n_entries--;
+	entry->opt->queue_entry = NULL;
+
+	return 0;
+}
+
+/* Options may outlive the queue, so detach their entries */
+static int resolve_queue_destroy(void *arg)
+{
+	struct resolve_queue *queue = arg;
+	struct resolve_queue_entry *entry;
+
+	list_for_each_entry(&queue->entries, entry, all) {
+		talloc_set_destructor(entry, NULL);
+		entry->opt->queue_entry = NULL;
+	}
+
+	return 0;
+}
+
+struct resolve_queue *resolve_queue_create(void *ctx,
+		struct device_handler *handler)
+{
+	struct resolve_queue *queue;
+
+	queue = talloc_zero(ctx, struct resolve_queue);
+	queue->handler = handler;
+	list_init(&queue->entries);
+	list_init(&queue->any);
+	list_init(&queue->woken);
+	resolve_queue_grow(queue);
+	talloc_set_destructor(queue, resolve_queue_destroy);
+
+	return queue;
+}
+
+static void entry_wake(struct resolve_queue *queue,
+		struct resolve_queue_entry *entry)
+{
+	entry_unlink(entry);
+	list_add_tail(&queue->woken, &entry->list);
+	entry->state = RESOLVE_ENTRY_WOKEN;
+	queue->n_woken++;
+}
+
+/* Is a device matching dep already here? */
+static bool dep_present(struct resolve_queue *queue, const char *dep)
+{
+	return device_lookup_by_id(queue->handler, dep) ||
+		device_lookup_by_uuid(queue->handler, dep) ||
+		device_lookup_by_label(queue->handler, dep);
+}
+
+void resolve_queue_add(struct resolve_queue *queue,
+		struct discover_boot_option *opt, const char *dep)
+{
+	struct resolve_queue_entry *entry = opt->queue_entry;
+
+	if (!entry) {
+		entry = talloc_zero(opt, struct resolve_queue_entry);
+		entry->queue = queue;
+		entry->opt = opt;
+		entry->state = RESOLVE_ENTRY_TAKEN;
+		entry->seq = queue->seq++;
+		entry->queued_ms = resolve_queue_now();
+		entry->list.next = entry->list.prev = &entry->list;
+		list_add_tail(&queue->entries, &entry->all);
+		queue->n_entries++;
+		talloc_set_destructor(entry, resolve_queue_entry_destroy);
+		opt->queue_entry = entry;
+	} else {
+		entry_unlink(entry);
+	}
+
+	talloc_free(entry->dep);
+	entry->dep = NULL;
+
+	if (dep) {
+		if (queue->n_deps >= queue->n_buckets)
+			resolve_queue_grow(queue);
+		entry->dep = talloc_strdup(entry, dep);
+		entry->hash = str_hash(dep);
+		list_add_tail(dep_bucket(queue, entry->hash), &entry->list);
+		queue->n_deps++;
+	} else {
+		list_add_tail(&queue->any, &entry->list);
+	}
+
+	entry->state = RESOLVE_ENTRY_WAITING;
+
+	/* The device's wake-up has already been, for example when an option
+	 * depends on its own device, which is added just before the
+	 * option is queued. Retry it on the next pass instead. */
+	if (dep && dep_present(queue, dep))
+		entry_wake(queue, entry);
+}
+
+void resolve_queue_remove(struct resolve_queue *queue,
+		struct discover_boot_option *opt)
+{
+	struct resolve_queue_entry *entry = opt->queue_entry;
+	uint64_t wait;
+
+	if (!entry)
+		return;
+
+	wait = resolve_queue_now() - entry->queued_ms;
+	queue->n_resolved++;
+	queue->total_wait_ms += wait;
+	if (wait > queue->max_wait_ms)
+		queue->max_wait_ms = wait;
+
+	talloc_free(entry);
+}
+
+static void resolve_queue_wake_dep(struct resolve_queue *queue,
+		const char *key)
+{
+	struct resolve_queue_entry *entry, *tmp;
+	unsigned int hash;
+	struct list *bucket;
+
+	if (!key)
+		return;
+
+	hash = str_hash(key);
+	bucket = dep_bucket(queue, hash);
+
+	list_for_each_entry_safe(bucket, entry, tmp, list) {
+		if (entry->hash == hash && !strcmp(entry->dep, key))
+			entry_wake(queue, entry);
+	}
+}
+
+void resolve_queue_wake(struct resolve_queue *queue,
+		struct discover_device *dev)
+{
+	struct resolve_queue_entry *entry, *tmp;
+
+	queue->n_wakes++;
+
+	resolve_queue_wake_dep(queue, dev->device->id);
+	resolve_queue_wake_dep(queue, dev->uuid);
+	resolve_queue_wake_dep(queue, dev->label);
+
+	list_for_each_entry_safe(&queue->any, entry, tmp, list)
+		entry_wake(queue, entry);
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct discover_boot_option *opt_a =
+		*(struct discover_boot_option * const *)a;
+	const struct discover_boot_option *opt_b =
+		*(struct discover_boot_option * const *)b;
+	unsigned long seq_a = opt_a->queue_entry->seq;
+	unsigned long seq_b = opt_b->queue_entry->seq;
+
+	return seq_a < seq_b ? 1 : seq_a > seq_b ? -1 : 0;
+}
+
+int resolve_queue_take_woken(struct resolve_queue *queue, void *ctx,
+		struct discover_boot_option ***opts)
+{
+	struct resolve_queue_entry *entry, *tmp;
+	int n = 0;
+
+	list_for_each_entry(&queue->woken, entry, list)
+		n++;
+
+	*opts = NULL;
+	if (!n)
+		return 0;
+
+	*opts = talloc_array(ctx, struct discover_boot_option *, n);
+
+	n = 0;
+	list_for_each_entry_safe(&queue->woken, entry, tmp, list) {
+		entry_unlink(entry);
+		(*opts)[n++] = entry->opt;
+	}
+
+	qsort(*opts, n, sizeof((*opts)[0]), entry_cmp);
+
+	return n;
+}
+
+unsigned int resolve_queue_length(struct resolve_queue *queue)
+{
+	return queue->n_entries;
+}
+
+char *resolve_queue_stats_dump(void *ctx, struct resolve_queue *queue)
+{
+	struct resolve_queue_entry *oldest;
+	uint64_t oldest_ms = 0;
+
+	oldest = list_entry(queue->entries.head.next,
+			struct resolve_queue_entry, all, &queue->entries);
+	if (oldest)
+		oldest_ms = resolve_queue_now() - oldest->queued_ms;
+
+	return talloc_asprintf(ctx, "unresolved options: %u queued, "
+			"%u waiting on a device, oldest %llums\n"
+			"unresolved options: %lu resolved, avg wait %llums, "
+			"max wait %llums\n"
+			"unresolved options: %lu woken by %lu devices\n",
+			queue->n_entries, queue->n_deps,
+			(unsigned long long)oldest_ms,
+			queue->n_resolved,
+			queue->n_resolved ? (unsigned long long)
+				(queue->total_wait_ms / queue->n_resolved) : 0,
+			(unsigned long long)queue->max_wait_ms,
+			queue->n_woken, queue->n_wakes);
+}
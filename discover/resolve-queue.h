@@ -0,0 +1,43 @@
+#ifndef RESOLVE_QUEUE_H
+#define RESOLVE_QUEUE_H
+
+struct discover_boot_option;
+struct discover_device;
+struct device_handler;
+struct resolve_queue;
+
+/* Boot options with unresolved resources, indexed by the device that each
+ * option is waiting for - a device id, uuid or label, as given by the
+ * parser's resource_dependency callback. Adding a device only wakes the
+ * options that depend on it; options with no known dependency are woken by
+ * every device.
+ */
+struct resolve_queue *resolve_queue_create(void *ctx,
+		struct device_handler *handler);
+
+/* Queue opt until a device matching dep is added, or move an
+ * already-queued option to a new dependency. dep may be NULL. If a device
+ * matching dep is already in the handler, opt is woken straight away. */
+void resolve_queue_add(struct resolve_queue *queue,
+		struct discover_boot_option *opt, const char *dep);
+
+/* Remove a resolved option from the queue. Options that are freed while
+ * queued are removed automatically. */
+void resolve_queue_remove(struct resolve_queue *queue,
+		struct discover_boot_option *opt);
+
+/* Wake the options waiting for dev's id, uuid or label */
+void resolve_queue_wake(struct resolve_queue *queue,
+		struct discover_device *dev);
+
+/* Take the woken options, most recently queued first, as a talloc-ed array.
+ * Each stays in the queue until it is re-added or removed. */
+int resolve_queue_take_woken(struct resolve_queue *queue, void *ctx,
+		struct discover_boot_option ***opts);
+
+unsigned int resolve_queue_length(struct resolve_queue *queue);
+
+/* Returns a talloc-ed summary of the queue length and wait times */
+char *resolve_queue_stats_dump(void *ctx, struct resolve_queue *queue);
+
+#endif /* RESOLVE_QUEUE_H */
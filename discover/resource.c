@@ -28,7 +28,7 @@ static struct discover_device *parse_device_string(
 		struct device_handler *handler, const char *devstr)
 {
 	if (is_prefix_ignorecase(devstr, "uuid="))
-		return device_lookup_by_uuid(handler, devstr + strlen("uuid"));
+		return device_lookup_by_uuid(handler, devstr + strlen("uuid="));
 
 	if (is_prefix_ignorecase(devstr, "label="))
 		return device_lookup_by_label(handler,
@@ -118,6 +118,23 @@ bool resolve_devpath_resource(struct device_handler *handler,
 	return true;
 }
 
+const char *devpath_resource_dependency(struct resource *res)
+{
+	struct devpath_resource_info *info = res->info;
+	const char *devstr = info->dev;
+
+	if (is_prefix_ignorecase(devstr, "uuid="))
+		return devstr + strlen("uuid=");
+
+	if (is_prefix_ignorecase(devstr, "label="))
+		return devstr + strlen("label=");
+
+	if (!strncmp(devstr, "/dev/", strlen("/dev/")))
+		return devstr + strlen("/dev/");
+
+	return devstr;
+}
+
 struct resource *create_url_resource(struct discover_boot_option *opt,
 		struct pb_url *url)
 {
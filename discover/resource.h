@@ -50,5 +50,7 @@ struct resource *create_url_resource(struct discover_boot_option *opt,
 bool resolve_devpath_resource(struct device_handler *dev,
 		struct resource *res);
 
+const char *devpath_resource_dependency(struct resource *res);
+
 #endif /* RESOURCE_H */
 
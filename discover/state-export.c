@@ -0,0 +1,168 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <talloc/talloc.h>
+#include <log/log.h>
+#include <pb-protocol/pb-protocol.h>
+
+#include "state-export.h"
+
+/* Segments are sized to the next multiple of this, so that the state can
+ * grow a little before we need a new segment */
+#define STATE_EXPORT_GRANULE	(64 * 1024)
+
+struct state_export {
+	char				*path;
+	int				fd;
+	struct pb_protocol_state_header	*hdr;
+	unsigned int			size;
+};
+
+static void state_export_begin(struct pb_protocol_state_header *hdr)
+{
+	__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void state_export_end(struct pb_protocol_state_header *hdr)
+{
+	__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void state_export_unmap(struct state_export *export)
+{
+	if (export->hdr)
+		munmap(export->hdr, export->size);
+	if (export->fd >= 0)
+		close(export->fd);
+
+	export->hdr = NULL;
+	export->fd = -1;
+	export->size = 0;
+}
+
+static int state_export_destructor(void *arg)
+{
+	struct state_export *export = arg;
+
+	if (export->hdr) {
+		unlink(export->path);
+		state_export_unmap(export);
+	}
+
+	return 0;
+}
+
+/* Create a new segment of at least size bytes in place of the current one.
+ * Observers that have the old segment mapped see it marked stale. */
+static int state_export_create(struct state_export *export,
+		unsigned int size)
+{
+	struct pb_protocol_state_header *hdr;
+	char *tmp_path;
+	int fd;
+
+	size = (size + STATE_EXPORT_GRANULE - 1) & ~(STATE_EXPORT_GRANULE - 1);
+
+	tmp_path = talloc_asprintf(export, "%s.XXXXXX", export->path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		pb_log_fn("can't create %s: %s\n", tmp_path, strerror(errno));
+		talloc_free(tmp_path);
+		return -1;
+	}
+
+	/* observers only read */
+	if (fchmod(fd, 0644) || ftruncate(fd, size)) {
+		pb_log_fn("can't size %s: %s\n", tmp_path, strerror(errno));
+		goto err;
+	}
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		pb_log_fn("can't map %s: %s\n", tmp_path, strerror(errno));
+		goto err;
+	}
+
+	hdr->magic = PB_PROTOCOL_STATE_MAGIC;
+	hdr->version = PB_PROTOCOL_STATE_VERSION;
+	hdr->seq = 0;
+	hdr->stale = 0;
+	hdr->size = size;
+	hdr->payload_len = 0;
+
+	if (rename(tmp_path, export->path)) {
+		pb_log_fn("can't rename %s: %s\n", tmp_path, strerror(errno));
+		munmap(hdr, size);
+		goto err;
+	}
+
+	talloc_free(tmp_path);
+
+	if (export->hdr) {
+		state_export_begin(export->hdr);
+		export->hdr->stale = 1;
+		state_export_end(export->hdr);
+		state_export_unmap(export);
+	}
+
+	export->fd = fd;
+	export->hdr = hdr;
+	export->size = size;
+
+	return 0;
+
+err:
+	unlink(tmp_path);
+	talloc_free(tmp_path);
+	close(fd);
+	return -1;
+}
+
+int state_export_write(struct state_export *export, const char *payload,
+		unsigned int len)
+{
+	struct pb_protocol_state_header *hdr;
+
+	if (sizeof(*hdr) + len > export->size &&
+			state_export_create(export, sizeof(*hdr) + len))
+		return -1;
+
+	hdr = export->hdr;
+
+	state_export_begin(hdr);
+	memcpy(hdr + 1, payload, len);
+	hdr->payload_len = len;
+	state_export_end(hdr);
+
+	return 0;
+}
+
+struct state_export *state_export_init(void *ctx, const char *path)
+{
+	struct state_export *export;
+
+	export = talloc(ctx, struct state_export);
+	if (!export)
+		return NULL;
+
+	export->path = talloc_strdup(export, path);
+	export->fd = -1;
+	export->hdr = NULL;
+	export->size = 0;
+
+	if (state_export_create(export, sizeof(*export->hdr))) {
+		talloc_free(export);
+		return NULL;
+	}
+
+	talloc_set_destructor(export, state_export_destructor);
+
+	return export;
+}
@@ -0,0 +1,14 @@
+#ifndef STATE_EXPORT_H
+#define STATE_EXPORT_H
+
+struct state_export;
+
+/* A read-only view of our state for local observers, published in a
+ * shared memory file at path; see struct pb_protocol_state_header */
+struct state_export *state_export_init(void *ctx, const char *path);
+
+/* Replace the exported state with the given snapshot payload */
+int state_export_write(struct state_export *export, const char *payload,
+		unsigned int len);
+
+#endif /* STATE_EXPORT_H */
@@ -5,6 +5,7 @@
 #include <process/process.h>
 #include <log/log.h>
 #include <url/url.h>
+#include <waiter/waiter.h>
 
 #include "discover-server.h"
 #include "platform.h"
@@ -12,12 +13,68 @@
 
 static struct system_info *sysinfo;
 static struct discover_server *server;
+static struct waitset *waitset;
+
+/* Changes to the interfaces and blockdevs are batched up, and sent to
+ * clients once per waitset iteration */
+static struct system_info_update *pending;
+static struct waiter *pending_waiter;
 
 const struct system_info *system_info_get(void)
 {
 	return sysinfo;
 }
 
+static int system_info_flush(void *arg __attribute__((unused)))
+{
+	pending_waiter = NULL;
+
+	if (!pending)
+		return 0;
+
+	discover_server_notify_system_info_update(server, pending);
+
+	talloc_free(pending);
+	pending = NULL;
+
+	return 0;
+}
+
+static void system_info_queue_change(enum system_info_change_type type,
+		struct interface_info *if_info, struct blockdev_info *bd_info)
+{
+	struct system_info_change *change;
+	unsigned int i;
+
+	if (!pending)
+		pending = talloc_zero(sysinfo, struct system_info_update);
+
+	/* changes are serialised at flush time, so an entry that's already
+	 * queued will be sent in its current state */
+	if (type != SYSTEM_INFO_CHANGE_REMOVE) {
+		for (i = 0; i < pending->n_changes; i++) {
+			change = &pending->changes[i];
+			if (change->type == SYSTEM_INFO_CHANGE_REMOVE)
+				continue;
+			if (change->interface == if_info &&
+					change->blockdev == bd_info)
+				return;
+		}
+	}
+
+	pending->n_changes++;
+	pending->changes = talloc_realloc(pending, pending->changes,
+			struct system_info_change, pending->n_changes);
+	change = &pending->changes[pending->n_changes - 1];
+	change->type = type;
+	change->interface = if_info;
+	change->blockdev = bd_info;
+
+	if (!pending_waiter)
+		pending_waiter = waiter_register_timeout(waitset, 0,
+				system_info_flush, NULL);
+}
+
 void system_info_set_interface_address(unsigned int hwaddr_size,
 		uint8_t *hwaddr, const char *address)
 {
@@ -52,7 +109,8 @@ void system_info_set_interface_address(unsigned int hwaddr_size,
 		if (!*if_addr || strcmp(*if_addr, address)) {
 			talloc_free(*if_addr);
 			*if_addr = new_addr;
-			discover_server_notify_system_info(server, sysinfo);
+			system_info_queue_change(SYSTEM_INFO_CHANGE_UPDATE,
+					if_info, NULL);
 			return;
 		}
 	}
@@ -92,7 +150,8 @@ void system_info_register_interface(unsigned int hwaddr_size, uint8_t *hwaddr,
 		}
 
 		if (changed)
-			discover_server_notify_system_info(server, sysinfo);
+			system_info_queue_change(SYSTEM_INFO_CHANGE_UPDATE,
+					if_info, NULL);
 
 		return;
 	}
@@ -109,7 +168,7 @@ void system_info_register_interface(unsigned int hwaddr_size, uint8_t *hwaddr,
 						sysinfo->n_interfaces);
 	sysinfo->interfaces[sysinfo->n_interfaces - 1] = if_info;
 
-	discover_server_notify_system_info(server, sysinfo);
+	system_info_queue_change(SYSTEM_INFO_CHANGE_ADD, if_info, NULL);
 }
 
 void system_info_register_blockdev(const char *name, const char *uuid,
@@ -128,7 +187,8 @@ void system_info_register_blockdev(const char *name, const char *uuid,
 		talloc_free(bd_info->mountpoint);
 		bd_info->uuid = talloc_strdup(bd_info, uuid);
 		bd_info->mountpoint = talloc_strdup(bd_info, mountpoint);
-		discover_server_notify_system_info(server, sysinfo);
+		system_info_queue_change(SYSTEM_INFO_CHANGE_UPDATE,
+				NULL, bd_info);
 		return;
 	}
 
@@ -143,12 +203,13 @@ void system_info_register_blockdev(const char *name, const char *uuid,
 						sysinfo->n_blockdevs);
 	sysinfo->blockdevs[sysinfo->n_blockdevs - 1] = bd_info;
 
-	discover_server_notify_system_info(server, sysinfo);
+	system_info_queue_change(SYSTEM_INFO_CHANGE_ADD, NULL, bd_info);
 }
 
-void system_info_init(struct discover_server *s)
+void system_info_init(struct discover_server *s, struct waitset *set)
 {
 	server = s;
+	waitset = set;
 	sysinfo = talloc_zero(server, struct system_info);
 	platform_get_sysinfo(sysinfo);
 }
@@ -158,14 +219,28 @@ void system_info_reinit(void)
 {
 	unsigned int i;
 
-	for (i = 0; i < sysinfo->n_blockdevs; i++)
-		talloc_free(sysinfo->blockdevs[i]);
+	/* send anything still queued, so that the pending changes don't
+	 * refer to the entries we're about to remove */
+	if (pending_waiter) {
+		waiter_remove(pending_waiter);
+		system_info_flush(NULL);
+	}
+
+	/* the removed entries are freed along with the pending update */
+	for (i = 0; i < sysinfo->n_blockdevs; i++) {
+		system_info_queue_change(SYSTEM_INFO_CHANGE_REMOVE,
+				NULL, sysinfo->blockdevs[i]);
+		talloc_steal(pending, sysinfo->blockdevs[i]);
+	}
 	talloc_free(sysinfo->blockdevs);
 	sysinfo->blockdevs = NULL;
 	sysinfo->n_blockdevs = 0;
 
-	for (i = 0; i < sysinfo->n_interfaces; i++)
-		talloc_free(sysinfo->interfaces[i]);
+	for (i = 0; i < sysinfo->n_interfaces; i++) {
+		system_info_queue_change(SYSTEM_INFO_CHANGE_REMOVE,
+				sysinfo->interfaces[i], NULL);
+		talloc_steal(pending, sysinfo->interfaces[i]);
+	}
 	talloc_free(sysinfo->interfaces);
 	sysinfo->interfaces = NULL;
 	sysinfo->n_interfaces = 0;
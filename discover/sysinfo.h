@@ -4,6 +4,7 @@
 #include <types/types.h>
 
 struct discover_server;
+struct waitset;
 
 const struct system_info *system_info_get(void);
 
@@ -14,7 +15,8 @@ void system_info_register_interface(unsigned int hwaddr_size, uint8_t *hwaddr,
 void system_info_register_blockdev(const char *name, const char *uuid,
 		const char *mountpoint);
 
-void system_info_init(struct discover_server *server);
+void system_info_init(struct discover_server *server,
+		struct waitset *waitset);
 void system_info_reinit(void);
 
 #endif /* SYSINFO_H */
@@ -496,6 +496,7 @@ static struct parser syslinux_parser = {
 	.name			= "syslinux",
 	.parse			= syslinux_parse,
 	.resolve_resource	= resolve_devpath_resource,
+	.resource_dependency	= devpath_resource_dependency,
 };
 
 register_parser(syslinux_parser);
@@ -38,12 +38,26 @@ struct pb_udev {
 	struct udev *udev;
 	struct udev_monitor *monitor;
 	struct device_handler *handler;
+	struct process *lvm_process;
+	enum {
+		LVM_IDLE,
+		LVM_VGSCAN,
+		LVM_VGCHANGE,
+	} lvm_state;
+	bool lvm_rescan;
 };
 
 static int udev_destructor(void *p)
 {
 	struct pb_udev *udev = p;
 
+	if (udev->lvm_process) {
+		udev->lvm_process->exit_cb = NULL;
+		process_stop_async(udev->lvm_process);
+		process_release(udev->lvm_process);
+		udev->lvm_process = NULL;
+	}
+
 	if (udev->monitor) {
 		udev_monitor_unref(udev->monitor);
 		udev->monitor = NULL;
@@ -72,20 +86,84 @@ static void udev_setup_device_params(struct udev_device *udev,
 				udev_list_entry_get_value(entry));
 }
 
+static void lvm_process_exit(struct process *process);
+
+static int lvm_run(struct pb_udev *udev, const char **argv, int state)
+{
+	struct process *process;
+
+	process = process_create(udev);
+	process->path = argv[0];
+	process->argv = argv;
+	process->exit_cb = lvm_process_exit;
+	process->data = udev;
+
+	if (process_run_async(process)) {
+		pb_log_fn("Failed to execute %s\n", argv[0]);
+		process_release(process);
+		return -1;
+	}
+
+	udev->lvm_process = process;
+	udev->lvm_state = state;
+	return 0;
+}
+
+static void lvm_vgchange(struct pb_udev *udev)
+{
+	const char *argv[] = { pb_system_apps.vgchange, "-ay", "-qq", NULL };
+
+	if (lvm_run(udev, argv, LVM_VGCHANGE))
+		udev->lvm_state = LVM_IDLE;
+}
+
+static void lvm_vgscan(struct pb_udev *udev)
+{
+	const char *argv[] = { pb_system_apps.vgscan, "-qq", NULL };
+
+	udev->lvm_rescan = false;
+	if (lvm_run(udev, argv, LVM_VGSCAN))
+		lvm_vgchange(udev);
+}
+
+/* vgscan is followed by vgchange; once that completes, start again if any
+ * more LVM members have appeared in the meantime. */
+static void lvm_process_exit(struct process *process)
+{
+	struct pb_udev *udev = process->data;
+
+	if (!process_exit_ok(process))
+		pb_log_fn("%s failed\n", process->path);
+
+	udev->lvm_process = NULL;
+	process_release(process);
+
+	if (udev->lvm_state == LVM_VGSCAN) {
+		lvm_vgchange(udev);
+		return;
+	}
+
+	udev->lvm_state = LVM_IDLE;
+	if (udev->lvm_rescan)
+		lvm_vgscan(udev);
+}
+
 /*
  * Search for LVM logical volumes. If any exist they should be recognised
- * by udev as normal.
+ * by udev as normal, once vgchange has activated them.
  * Normally this is handled in an init script, but on some platforms
  * disks are slow enough to come up that we need to check again.
  */
-static void lvm_vg_search(struct device_handler *handler)
+static void lvm_vg_search(struct pb_udev *udev)
 {
-	if (process_run_simple(handler, pb_system_apps.vgscan, "-qq", NULL))
-		pb_log_fn("Failed to execute vgscan\n");
+	/* if a search is already running, it may have missed this
+	 * device, so queue up another */
+	if (udev->lvm_state != LVM_IDLE) {
+		udev->lvm_rescan = true;
+		return;
+	}
 
-	if (process_run_simple(handler, pb_system_apps.vgchange, "-ay", "-qq",
-				NULL))
-		pb_log_fn("Failed to execute vgchange\n");
+	lvm_vgscan(udev);
 }
 
 static int udev_handle_block_add(struct pb_udev *udev, struct udev_device *dev,
@@ -172,7 +250,7 @@ static int udev_handle_block_add(struct pb_udev *udev, struct udev_device *dev,
 
 	/* Search for LVM logical volumes if we see an LVM member */
 	if (strncmp(type, "LVM2_member", strlen("LVM2_member")) == 0) {
-		lvm_vg_search(udev->handler);
+		lvm_vg_search(udev);
 		return 0;
 	}
 
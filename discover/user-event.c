@@ -37,6 +37,7 @@
 #include "device-handler.h"
 #include "resource.h"
 #include "event.h"
+#include "network.h"
 #include "user-event.h"
 #include "sysinfo.h"
 
@@ -415,6 +416,9 @@ static int user_event_dhcp(struct user_event *uev, struct event *event)
 		system_info_set_interface_address(sizeof(hwaddr), hwaddr,
 						  event_get_param(event, "ip"));
 
+	network_dhcp_lease(device_handler_get_network(handler), hwaddr,
+			event_get_param(event, "ipv6") != NULL);
+
 	dev = discover_device_create(handler, event_get_param(event, "mac"),
 					event->device);
 
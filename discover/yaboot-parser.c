@@ -400,6 +400,7 @@ static struct parser yaboot_parser = {
 	.name			= "yaboot",
 	.parse			= yaboot_parse,
 	.resolve_resource	= resolve_devpath_resource,
+	.resource_dependency	= devpath_resource_dependency,
 };
 
 register_parser(yaboot_parser);
@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -119,13 +120,14 @@ out:
 	return result;
 }
 
-int read_file(void *ctx, const char *filename, char **bufp, int *lenp)
+static int __read_file(void *ctx, const char *filename, char **bufp,
+		int *lenp, bool owned)
 {
 	struct stat statbuf;
 	int rc, fd, i, len;
 	char *buf;
 
-	fd = open(filename, O_RDONLY);
+	fd = open(filename, O_RDONLY | (owned ? O_NOFOLLOW : 0));
 	if (fd < 0)
 		return -1;
 
@@ -133,6 +135,14 @@ int read_file(void *ctx, const char *filename, char **bufp, int *lenp)
 	if (rc < 0)
 		goto err_close;
 
+	if (owned && (!S_ISREG(statbuf.st_mode) ||
+			statbuf.st_uid != geteuid() ||
+			statbuf.st_mode & (S_IWGRP | S_IWOTH))) {
+		pb_log("%s: not reading %s, as it isn't ours\n",
+				__func__, filename);
+		goto err_close;
+	}
+
 	len = statbuf.st_size;
 	if (len > max_file_size)
 		goto err_close;
@@ -169,6 +179,16 @@ err_close:
 	return -1;
 }
 
+int read_file(void *ctx, const char *filename, char **bufp, int *lenp)
+{
+	return __read_file(ctx, filename, bufp, lenp, false);
+}
+
+int read_file_owned(void *ctx, const char *filename, char **bufp, int *lenp)
+{
+	return __read_file(ctx, filename, bufp, lenp, true);
+}
+
 static int write_fd(int fd, char *buf, int len)
 {
 	int i, rc;
@@ -21,6 +21,9 @@
 int copy_file_secure_dest(void *ctx,
 	const char * source_file, char ** destination_file);
 int read_file(void *ctx, const char *filename, char **bufp, int *lenp);
+/* As read_file(), but only reads a regular file that is owned by our
+ * effective uid, and can't be written by anyone else */
+int read_file_owned(void *ctx, const char *filename, char **bufp, int *lenp);
 int replace_file(const char *filename, char *buf, int len);
 
 #endif /* FILE_H */
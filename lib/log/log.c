@@ -12,16 +12,31 @@ static bool debug;
 static void __log_timestamp(void)
 {
 	char hms[20] = {'\0'};
+	struct tm tm;
 	time_t t;
 
 	if (!logf)
 		return;
 
 	t = time(NULL);
-	strftime(hms, sizeof(hms), "%T", localtime(&t));
+	strftime(hms, sizeof(hms), "%T", localtime_r(&t, &tm));
 	fprintf(logf, "[%s] ", hms);
 }
 
+/* Messages may come from worker threads too, so hold the stream lock over
+ * the timestamp and message to keep each line whole */
+static void __log_lock(void)
+{
+	if (logf)
+		flockfile(logf);
+}
+
+static void __log_unlock(void)
+{
+	if (logf)
+		funlockfile(logf);
+}
+
 static void __log(const char *fmt, va_list ap)
 {
 	if (!logf)
@@ -35,18 +50,22 @@ void pb_log(const char *fmt, ...)
 {
 	va_list ap;
 	va_start(ap, fmt);
+	__log_lock();
 	__log_timestamp();
 	__log(fmt, ap);
+	__log_unlock();
 	va_end(ap);
 }
 
 void _pb_log_fn(const char *func, const char *fmt, ...)
 {
 	va_list ap;
+	__log_lock();
 	pb_log("%s: ", func);
 	va_start(ap, fmt);
 	__log(fmt, ap);
 	va_end(ap);
+	__log_unlock();
 }
 
 void pb_debug(const char *fmt, ...)
@@ -55,8 +74,10 @@ void pb_debug(const char *fmt, ...)
 	if (!debug)
 		return;
 	va_start(ap, fmt);
+	__log_lock();
 	__log_timestamp();
 	__log(fmt, ap);
+	__log_unlock();
 	va_end(ap);
 }
 
@@ -65,10 +86,12 @@ void _pb_debug_fn(const char *func, const char *fmt, ...)
 	va_list ap;
 	if (!debug)
 		return;
+	__log_lock();
 	pb_log("%s: ", func);
 	va_start(ap, fmt);
 	__log(fmt, ap);
 	va_end(ap);
+	__log_unlock();
 }
 
 void _pb_debug_fl(const char *func, int line, const char *fmt, ...)
@@ -76,10 +99,12 @@ void _pb_debug_fl(const char *func, int line, const char *fmt, ...)
 	va_list ap;
 	if (!debug)
 		return;
+	__log_lock();
 	pb_log("%s:%d: ", func, line);
 	va_start(ap, fmt);
 	__log(fmt, ap);
 	va_end(ap);
+	__log_unlock();
 }
 
 void __pb_log_init(FILE *fp, bool _debug)
@@ -231,6 +231,22 @@ int pb_protocol_boot_status_len(const struct status *status)
 		4;	/* boot_active */
 }
 
+static int pb_protocol_interface_info_len(const struct interface_info *if_info)
+{
+	return	4 + if_info->hwaddr_size +
+		4 + optional_strlen(if_info->name) +
+		sizeof(if_info->link) +
+		4 + optional_strlen(if_info->address) +
+		4 + optional_strlen(if_info->address_v6);
+}
+
+static int pb_protocol_blockdev_info_len(const struct blockdev_info *bd_info)
+{
+	return	4 + optional_strlen(bd_info->name) +
+		4 + optional_strlen(bd_info->uuid) +
+		4 + optional_strlen(bd_info->mountpoint);
+}
+
 int pb_protocol_system_info_len(const struct system_info *sysinfo)
 {
 	unsigned int len, i;
@@ -256,21 +272,11 @@ int pb_protocol_system_info_len(const struct system_info *sysinfo)
 	/* BMC MAC */
 	len += HWADDR_SIZE;
 
-	for (i = 0; i < sysinfo->n_interfaces; i++) {
-		struct interface_info *if_info = sysinfo->interfaces[i];
-		len +=	4 + if_info->hwaddr_size +
-			4 + optional_strlen(if_info->name) +
-			sizeof(if_info->link) +
-			4 + optional_strlen(if_info->address) +
-			4 + optional_strlen(if_info->address_v6);
-	}
+	for (i = 0; i < sysinfo->n_interfaces; i++)
+		len += pb_protocol_interface_info_len(sysinfo->interfaces[i]);
 
-	for (i = 0; i < sysinfo->n_blockdevs; i++) {
-		struct blockdev_info *bd_info = sysinfo->blockdevs[i];
-		len +=	4 + optional_strlen(bd_info->name) +
-			4 + optional_strlen(bd_info->uuid) +
-			4 + optional_strlen(bd_info->mountpoint);
-	}
+	for (i = 0; i < sysinfo->n_blockdevs; i++)
+		len += pb_protocol_blockdev_info_len(sysinfo->blockdevs[i]);
 
 	/* stb info */
 	len += 3 * sizeof(bool);
@@ -278,6 +284,27 @@ int pb_protocol_system_info_len(const struct system_info *sysinfo)
 	return len;
 }
 
+int pb_protocol_system_info_update_len(const struct system_info_update *update)
+{
+	unsigned int len, i;
+
+	len = 4;
+
+	for (i = 0; i < update->n_changes; i++) {
+		const struct system_info_change *change = &update->changes[i];
+
+		len += 4 /* type */ + 4 /* interface or blockdev */;
+
+		if (change->interface)
+			len += pb_protocol_interface_info_len(
+					change->interface);
+		else
+			len += pb_protocol_blockdev_info_len(change->blockdev);
+	}
+
+	return len;
+}
+
 static int pb_protocol_interface_config_len(struct interface_config *conf)
 {
 	unsigned int len;
@@ -385,7 +412,7 @@ int pb_protocol_temp_autoboot_len(const struct autoboot_option *opt)
 	if (opt->boot_type == BOOT_DEVICE_TYPE)
 		len += 4;
 	else
-		len += optional_strlen(opt->uuid);
+		len += 4 + optional_strlen(opt->uuid);
 
 	return len;
 }
@@ -413,397 +440,724 @@ int pb_protocol_authenticate_len(struct auth_message *msg)
 	}
 }
 
+/* Encoders build a message's payload in a single pass, rather than sizing
+ * it with the _len() functions and then serialising it. An encoder from
+ * pb_protocol_encoder_create() grows its buffer as needed, and keeps it
+ * between messages. The pb_protocol_serialise_*() functions use a
+ * fixed-size encoder on the caller's buffer, so that each message layout
+ * is only written once. */
+struct pb_protocol_encoder {
+	struct pb_protocol_message	*message;
+	enum pb_protocol_action		action;
+	char				*buf;
+	unsigned int			len;
+	unsigned int			size;
+	bool				failed;
+};
+
+#define ENCODER_INITIAL_SIZE	256
+
+static int encoder_grow(struct pb_protocol_encoder *enc, unsigned int len)
+{
+	struct pb_protocol_message *message;
+	size_t need, size;
+
+	need = (size_t)enc->len + len;
+	if (need > PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE) {
+		pb_log_fn("payload too big %zu/%u\n", need,
+			PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE);
+		return -1;
+	}
+
+	size = enc->size ?: ENCODER_INITIAL_SIZE;
+	while (size < need)
+		size *= 2;
+	if (size > PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE)
+		size = PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE;
+
+	message = talloc_realloc_size(enc, enc->message,
+			sizeof(*message) + size);
+	if (!message)
+		return -1;
+
+	enc->message = message;
+	enc->buf = message->payload;
+	enc->size = size;
+
+	return 0;
+}
+
+static int __attribute__((noinline)) encoder_extend(
+		struct pb_protocol_encoder *enc, unsigned int len)
+{
+	if (enc->message && !encoder_grow(enc, len))
+		return 0;
+
+	enc->failed = true;
+	return -1;
+}
+
+/* Returns where to write the next len bytes of the payload, or NULL if
+ * they don't fit; the encoder's message is then invalid. Later fields may
+ * still be written, but never past the end of the buffer. */
+static inline char *encode_reserve(struct pb_protocol_encoder *enc,
+		unsigned int len)
+{
+	char *pos;
+
+	if (len > enc->size - enc->len && encoder_extend(enc, len))
+		return NULL;
+
+	pos = enc->buf + enc->len;
+	enc->len += len;
+
+	return pos;
+}
+
+static inline void encode_u32(struct pb_protocol_encoder *enc, uint32_t val)
+{
+	char *pos = encode_reserve(enc, sizeof(val));
+
+	if (pos)
+		*(uint32_t *)pos = __cpu_to_be32(val);
+}
+
+/* Some fields have always been sent in the sender's byte order */
+static inline void encode_u32_native(struct pb_protocol_encoder *enc,
+		uint32_t val)
+{
+	char *pos = encode_reserve(enc, sizeof(val));
+
+	if (pos)
+		*(uint32_t *)pos = val;
+}
+
+static inline void encode_u64(struct pb_protocol_encoder *enc, uint64_t val)
+{
+	encode_u32(enc, val >> 32);
+	encode_u32(enc, val & 0xffffffff);
+}
+
+static inline void encode_bool(struct pb_protocol_encoder *enc, bool val)
+{
+	char *pos = encode_reserve(enc, sizeof(val));
+
+	if (pos)
+		*(bool *)pos = val;
+}
+
+static inline void encode_data(struct pb_protocol_encoder *enc,
+		const void *data, unsigned int len)
+{
+	char *pos = encode_reserve(enc, len);
+
+	if (pos && len)
+		memcpy(pos, data, len);
+}
+
+struct pb_protocol_encoder *pb_protocol_encoder_create(void *ctx)
+{
+	struct pb_protocol_encoder *enc;
+
+	enc = talloc_zero(ctx, struct pb_protocol_encoder);
+	if (!enc)
+		return NULL;
+
+	if (encoder_grow(enc, 0)) {
+		talloc_free(enc);
+		return NULL;
+	}
+
+	return enc;
+}
+
+void pb_protocol_encoder_start(struct pb_protocol_encoder *enc,
+		enum pb_protocol_action action)
+{
+	enc->action = action;
+	enc->len = 0;
+	enc->failed = false;
+}
+
+struct pb_protocol_message *pb_protocol_encoder_message(
+		struct pb_protocol_encoder *enc)
+{
+	if (enc->failed)
+		return NULL;
+
+	enc->message->action = enc->action;
+	enc->message->payload_len = enc->len;
+
+	return enc->message;
+}
+
+static void encoder_init_fixed(struct pb_protocol_encoder *enc, char *buf,
+		int buf_len)
+{
+	memset(enc, 0, sizeof(*enc));
+	enc->buf = buf;
+	enc->size = buf_len;
+}
+
+static int encoder_fixed_result(struct pb_protocol_encoder *enc)
+{
+	assert(!enc->failed);
+
+	return enc->failed ? -1 : 0;
+}
+
+static inline void encode_string(struct pb_protocol_encoder *enc,
+		const char *str)
+{
+	unsigned int len = optional_strlen(str);
+	char *pos;
+
+	pos = encode_reserve(enc, sizeof(uint32_t) + len);
+	if (!pos)
+		return;
+
+	*(uint32_t *)pos = __cpu_to_be32(len);
+	if (len)
+		memcpy(pos + sizeof(uint32_t), str, len);
+}
+
+void pb_protocol_encode_string(struct pb_protocol_encoder *enc,
+		const char *str)
+{
+	encode_string(enc, str);
+}
+
+void pb_protocol_encode_device(struct pb_protocol_encoder *enc,
+		const struct device *dev)
+{
+	encode_string(enc, dev->id);
+	encode_data(enc, &dev->type, sizeof(dev->type));
+	encode_string(enc, dev->name);
+	encode_string(enc, dev->description);
+	encode_string(enc, dev->icon_file);
+}
+
 int pb_protocol_serialise_device(const struct device *dev,
 		char *buf, int buf_len)
 {
-	char *pos = buf;
+	struct pb_protocol_encoder enc;
 
-	pos += pb_protocol_serialise_string(pos, dev->id);
-	*(enum device_type *)pos = dev->type;
-	pos += sizeof(enum device_type);
-	pos += pb_protocol_serialise_string(pos, dev->name);
-	pos += pb_protocol_serialise_string(pos, dev->description);
-	pos += pb_protocol_serialise_string(pos, dev->icon_file);
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_device(&enc, dev);
 
-	assert(pos <= buf + buf_len);
+	return encoder_fixed_result(&enc);
+}
 
-	return (pos <= buf + buf_len) ? 0 : -1;
+void pb_protocol_encode_boot_option(struct pb_protocol_encoder *enc,
+		const struct boot_option *opt)
+{
+	encode_string(enc, opt->device_id);
+	encode_string(enc, opt->id);
+	encode_string(enc, opt->name);
+	encode_string(enc, opt->description);
+	encode_string(enc, opt->icon_file);
+	encode_string(enc, opt->boot_image_file);
+	encode_string(enc, opt->initrd_file);
+	encode_string(enc, opt->dtb_file);
+	encode_string(enc, opt->boot_args);
+	encode_string(enc, opt->args_sig_file);
+
+	encode_bool(enc, opt->is_default);
+	encode_bool(enc, opt->is_autoboot_default);
+
+	encode_u32(enc, opt->type);
 }
 
 int pb_protocol_serialise_boot_option(const struct boot_option *opt,
 		char *buf, int buf_len)
 {
-	char *pos = buf;
-
-	pos += pb_protocol_serialise_string(pos, opt->device_id);
-	pos += pb_protocol_serialise_string(pos, opt->id);
-	pos += pb_protocol_serialise_string(pos, opt->name);
-	pos += pb_protocol_serialise_string(pos, opt->description);
-	pos += pb_protocol_serialise_string(pos, opt->icon_file);
-	pos += pb_protocol_serialise_string(pos, opt->boot_image_file);
-	pos += pb_protocol_serialise_string(pos, opt->initrd_file);
-	pos += pb_protocol_serialise_string(pos, opt->dtb_file);
-	pos += pb_protocol_serialise_string(pos, opt->boot_args);
-	pos += pb_protocol_serialise_string(pos, opt->args_sig_file);
+	struct pb_protocol_encoder enc;
 
-	*(bool *)pos = opt->is_default;
-	pos += sizeof(bool);
-	*(bool *)pos = opt->is_autoboot_default;
-	pos += sizeof(bool);
-
-	*(uint32_t *)pos = __cpu_to_be32(opt->type);
-	pos += 4;
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_boot_option(&enc, opt);
 
-	assert(pos <= buf + buf_len);
+	return encoder_fixed_result(&enc);
+}
 
-	return (pos <= buf + buf_len) ? 0 : -1;
+void pb_protocol_encode_boot_command(struct pb_protocol_encoder *enc,
+		const struct boot_command *boot)
+{
+	encode_string(enc, boot->option_id);
+	encode_string(enc, boot->boot_image_file);
+	encode_string(enc, boot->initrd_file);
+	encode_string(enc, boot->dtb_file);
+	encode_string(enc, boot->boot_args);
+	encode_string(enc, boot->args_sig_file);
+	encode_string(enc, boot->console);
 }
 
 int pb_protocol_serialise_boot_command(const struct boot_command *boot,
 		char *buf, int buf_len)
 {
-	char *pos = buf;
+	struct pb_protocol_encoder enc;
 
-	pos += pb_protocol_serialise_string(pos, boot->option_id);
-	pos += pb_protocol_serialise_string(pos, boot->boot_image_file);
-	pos += pb_protocol_serialise_string(pos, boot->initrd_file);
-	pos += pb_protocol_serialise_string(pos, boot->dtb_file);
-	pos += pb_protocol_serialise_string(pos, boot->boot_args);
-	pos += pb_protocol_serialise_string(pos, boot->args_sig_file);
-	pos += pb_protocol_serialise_string(pos, boot->console);
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_boot_command(&enc, boot);
 
-	assert(pos <= buf + buf_len);
+	return encoder_fixed_result(&enc);
+}
 
-	return (pos <= buf + buf_len) ? 0 : -1;
+void pb_protocol_encode_boot_status(struct pb_protocol_encoder *enc,
+		const struct status *status)
+{
+	encode_u32(enc, status->type);
+	encode_string(enc, status->message);
+	encode_bool(enc, status->backlog);
+	encode_bool(enc, status->boot_active);
 }
 
 int pb_protocol_serialise_boot_status(const struct status *status,
 		char *buf, int buf_len)
 {
-	char *pos = buf;
+	struct pb_protocol_encoder enc;
 
-	*(uint32_t *)pos = __cpu_to_be32(status->type);
-	pos += sizeof(uint32_t);
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_boot_status(&enc, status);
 
-	pos += pb_protocol_serialise_string(pos, status->message);
+	return encoder_fixed_result(&enc);
+}
 
-	*(bool *)pos = __cpu_to_be32(status->backlog);
-	pos += sizeof(bool);
+static void encode_interface_info(struct pb_protocol_encoder *enc,
+		const struct interface_info *if_info)
+{
+	encode_u32(enc, if_info->hwaddr_size);
+	encode_data(enc, if_info->hwaddr, if_info->hwaddr_size);
 
-	*(bool *)pos = __cpu_to_be32(status->boot_active);
-	pos += sizeof(bool);
+	encode_string(enc, if_info->name);
+	encode_bool(enc, if_info->link);
+	encode_string(enc, if_info->address);
+	encode_string(enc, if_info->address_v6);
+}
+
+static void encode_blockdev_info(struct pb_protocol_encoder *enc,
+		const struct blockdev_info *bd_info)
+{
+	encode_string(enc, bd_info->name);
+	encode_string(enc, bd_info->uuid);
+	encode_string(enc, bd_info->mountpoint);
+}
 
-	assert(pos <= buf + buf_len);
+static void encode_string_array(struct pb_protocol_encoder *enc,
+		char **strs, unsigned int n)
+{
+	unsigned int i;
 
-	return (pos <= buf + buf_len) ? 0 : -1;
+	encode_u32(enc, n);
+	for (i = 0; i < n; i++)
+		encode_string(enc, strs[i]);
 }
 
-int pb_protocol_serialise_system_info(const struct system_info *sysinfo,
-		char *buf, int buf_len)
+void pb_protocol_encode_system_info(struct pb_protocol_encoder *enc,
+		const struct system_info *sysinfo)
 {
-	char *pos = buf;
 	unsigned int i;
+	char *pos;
 
-	pos += pb_protocol_serialise_string(pos, sysinfo->type);
-	pos += pb_protocol_serialise_string(pos, sysinfo->identifier);
+	encode_string(enc, sysinfo->type);
+	encode_string(enc, sysinfo->identifier);
 
-	*(uint32_t *)pos = __cpu_to_be32(sysinfo->n_primary);
-	pos += sizeof(uint32_t);
-	for (i = 0; i < sysinfo->n_primary; i++)
-		pos += pb_protocol_serialise_string(pos, sysinfo->platform_primary[i]);
+	encode_string_array(enc, sysinfo->platform_primary,
+			sysinfo->n_primary);
+	encode_string_array(enc, sysinfo->platform_other,
+			sysinfo->n_other);
+	encode_string_array(enc, sysinfo->bmc_current,
+			sysinfo->n_bmc_current);
+	encode_string_array(enc, sysinfo->bmc_golden,
+			sysinfo->n_bmc_golden);
 
-	*(uint32_t *)pos = __cpu_to_be32(sysinfo->n_other);
-	pos += sizeof(uint32_t);
-	for (i = 0; i < sysinfo->n_other; i++)
-		pos += pb_protocol_serialise_string(pos, sysinfo->platform_other[i]);
+	encode_u32(enc, sysinfo->n_interfaces);
+	for (i = 0; i < sysinfo->n_interfaces; i++)
+		encode_interface_info(enc, sysinfo->interfaces[i]);
 
-	*(uint32_t *)pos = __cpu_to_be32(sysinfo->n_bmc_current);
-	pos += sizeof(uint32_t);
-	for (i = 0; i < sysinfo->n_bmc_current; i++)
-		pos += pb_protocol_serialise_string(pos, sysinfo->bmc_current[i]);
+	encode_u32(enc, sysinfo->n_blockdevs);
+	for (i = 0; i < sysinfo->n_blockdevs; i++)
+		encode_blockdev_info(enc, sysinfo->blockdevs[i]);
 
-	*(uint32_t *)pos = __cpu_to_be32(sysinfo->n_bmc_golden);
-	pos += sizeof(uint32_t);
-	for (i = 0; i < sysinfo->n_bmc_golden; i++)
-		pos += pb_protocol_serialise_string(pos, sysinfo->bmc_golden[i]);
+	pos = encode_reserve(enc, HWADDR_SIZE);
+	if (pos && sysinfo->bmc_mac)
+		memcpy(pos, sysinfo->bmc_mac, HWADDR_SIZE);
+	else if (pos)
+		memset(pos, 0, HWADDR_SIZE);
 
-	*(uint32_t *)pos = __cpu_to_be32(sysinfo->n_interfaces);
-	pos += sizeof(uint32_t);
+	encode_bool(enc, sysinfo->stb_fw_measurement);
+	encode_bool(enc, sysinfo->stb_fw_enforcing);
+	encode_bool(enc, sysinfo->stb_os_enforcing);
+}
 
-	for (i = 0; i < sysinfo->n_interfaces; i++) {
-		struct interface_info *if_info = sysinfo->interfaces[i];
+int pb_protocol_serialise_system_info(const struct system_info *sysinfo,
+		char *buf, int buf_len)
+{
+	struct pb_protocol_encoder enc;
 
-		*(uint32_t *)pos = __cpu_to_be32(if_info->hwaddr_size);
-		pos += sizeof(uint32_t);
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_system_info(&enc, sysinfo);
 
-		memcpy(pos, if_info->hwaddr, if_info->hwaddr_size);
-		pos += if_info->hwaddr_size;
+	return encoder_fixed_result(&enc);
+}
 
-		pos += pb_protocol_serialise_string(pos, if_info->name);
+static void encode_system_info_change(struct pb_protocol_encoder *enc,
+		const struct system_info_change *change)
+{
+	encode_u32(enc, change->type);
+	encode_u32(enc, change->interface ? 0 : 1);
 
-		*(bool *)pos = if_info->link;
-		pos += sizeof(bool);
+	if (change->interface)
+		encode_interface_info(enc, change->interface);
+	else
+		encode_blockdev_info(enc, change->blockdev);
+}
 
-		pos += pb_protocol_serialise_string(pos, if_info->address);
-		pos += pb_protocol_serialise_string(pos, if_info->address_v6);
-	}
+void pb_protocol_encode_system_info_update(struct pb_protocol_encoder *enc,
+		const struct system_info_update *update)
+{
+	unsigned int i;
 
-	*(uint32_t *)pos = __cpu_to_be32(sysinfo->n_blockdevs);
-	pos += sizeof(uint32_t);
+	encode_u32(enc, update->n_changes);
 
-	for (i = 0; i < sysinfo->n_blockdevs; i++) {
-		struct blockdev_info *bd_info = sysinfo->blockdevs[i];
+	for (i = 0; i < update->n_changes; i++)
+		encode_system_info_change(enc, &update->changes[i]);
+}
 
-		pos += pb_protocol_serialise_string(pos, bd_info->name);
-		pos += pb_protocol_serialise_string(pos, bd_info->uuid);
-		pos += pb_protocol_serialise_string(pos, bd_info->mountpoint);
-	}
+unsigned int pb_protocol_encode_system_info_update_batch(
+		struct pb_protocol_encoder *enc,
+		const struct system_info_update *update, unsigned int max_len)
+{
+	unsigned int i, start, len;
 
-	if (sysinfo->bmc_mac)
-		memcpy(pos, sysinfo->bmc_mac, HWADDR_SIZE);
-	else
-		memset(pos, 0, HWADDR_SIZE);
-	pos += HWADDR_SIZE;
+	/* the change count is filled in once we know how many fit */
+	start = enc->len;
+	encode_u32(enc, 0);
 
-	*(bool *)pos = sysinfo->stb_fw_measurement;
-	pos += sizeof(bool);
-	*(bool *)pos = sysinfo->stb_fw_enforcing;
-	pos += sizeof(bool);
-	*(bool *)pos = sysinfo->stb_os_enforcing;
-	pos += sizeof(bool);
+	for (i = 0; i < update->n_changes; i++) {
+		len = enc->len;
+		encode_system_info_change(enc, &update->changes[i]);
+
+		if (i && enc->len - start > max_len) {
+			enc->len = len;
+			break;
+		}
+	}
 
-	assert(pos <= buf + buf_len);
+	if (!enc->failed)
+		*(uint32_t *)(enc->buf + start) = __cpu_to_be32(i);
 
-	return (pos <= buf + buf_len) ? 0 : -1;
+	return i;
 }
 
-static int pb_protocol_serialise_config_interface(char *buf,
-		struct interface_config *conf)
+int pb_protocol_serialise_system_info_update(
+		const struct system_info_update *update, char *buf, int buf_len)
 {
-	char *pos = buf;
+	struct pb_protocol_encoder enc;
 
-	memcpy(pos, conf->hwaddr, sizeof(conf->hwaddr));
-	pos += sizeof(conf->hwaddr);
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_system_info_update(&enc, update);
 
-	*(uint32_t *)pos = conf->ignore;
-	pos += 4;
+	return encoder_fixed_result(&enc);
+}
+
+static void encode_config_interface(struct pb_protocol_encoder *enc,
+		struct interface_config *conf)
+{
+	encode_data(enc, conf->hwaddr, sizeof(conf->hwaddr));
+	encode_u32_native(enc, conf->ignore);
 
 	if (conf->ignore)
-		return pos - buf;
+		return;
 
-	*(uint32_t *)pos = __cpu_to_be32(conf->method);
-	pos += 4;
+	encode_u32(enc, conf->method);
 
 	if (conf->method == CONFIG_METHOD_STATIC) {
-		pos += pb_protocol_serialise_string(pos,
-				conf->static_config.address);
-		pos += pb_protocol_serialise_string(pos,
-				conf->static_config.gateway);
-		pos += pb_protocol_serialise_string(pos,
-				conf->static_config.url);
+		encode_string(enc, conf->static_config.address);
+		encode_string(enc, conf->static_config.gateway);
+		encode_string(enc, conf->static_config.url);
 	}
 
-	*(uint32_t *)pos = conf->override;
-	pos += 4;
+	encode_u32_native(enc, conf->override);
+}
+
+static void encode_autoboot_option(struct pb_protocol_encoder *enc,
+		const struct autoboot_option *opt)
+{
+	encode_u32(enc, opt->boot_type);
 
-	return pos - buf;
+	if (opt->boot_type == BOOT_DEVICE_TYPE)
+		encode_u32(enc, opt->type);
+	else
+		encode_string(enc, opt->uuid);
 }
 
-int pb_protocol_serialise_config(const struct config *config,
-		char *buf, int buf_len)
+void pb_protocol_encode_config(struct pb_protocol_encoder *enc,
+		const struct config *config)
 {
-	char *pos = buf;
 	unsigned int i;
 
-	*(uint32_t *)pos = config->autoboot_enabled;
-	pos += 4;
+	encode_u32_native(enc, config->autoboot_enabled);
+	encode_u32(enc, config->autoboot_timeout_sec);
+	encode_u32_native(enc, config->safe_mode);
 
-	*(uint32_t *)pos = __cpu_to_be32(config->autoboot_timeout_sec);
-	pos += 4;
-
-	*(uint32_t *)pos = config->safe_mode;
-	pos += 4;
+	encode_u32(enc, config->network.n_interfaces);
+	for (i = 0; i < config->network.n_interfaces; i++)
+		encode_config_interface(enc, config->network.interfaces[i]);
 
-	*(uint32_t *)pos = __cpu_to_be32(config->network.n_interfaces);
-	pos += 4;
-	for (i = 0; i < config->network.n_interfaces; i++) {
-		struct interface_config *iface =
-			config->network.interfaces[i];
-		pos += pb_protocol_serialise_config_interface(pos, iface);
-	}
+	encode_u32(enc, config->network.n_dns_servers);
+	for (i = 0; i < config->network.n_dns_servers; i++)
+		encode_string(enc, config->network.dns_servers[i]);
 
-	*(uint32_t *)pos = __cpu_to_be32(config->network.n_dns_servers);
-	pos += 4;
-	for (i = 0; i < config->network.n_dns_servers; i++) {
-		pos += pb_protocol_serialise_string(pos,
-				config->network.dns_servers[i]);
-	}
+	encode_string(enc, config->http_proxy);
+	encode_string(enc, config->https_proxy);
 
-	pos += pb_protocol_serialise_string(pos, config->http_proxy);
-	pos += pb_protocol_serialise_string(pos, config->https_proxy);
+	encode_u32(enc, config->n_autoboot_opts);
+	for (i = 0; i < config->n_autoboot_opts; i++)
+		encode_autoboot_option(enc, &config->autoboot_opts[i]);
 
-	*(uint32_t *)pos = __cpu_to_be32(config->n_autoboot_opts);
-	pos += 4;
-	for (i = 0; i < config->n_autoboot_opts; i++) {
-		*(uint32_t *)pos =
-			__cpu_to_be32(config->autoboot_opts[i].boot_type);
-		pos += 4;
-		if (config->autoboot_opts[i].boot_type == BOOT_DEVICE_TYPE) {
-			*(uint32_t *)pos =
-				__cpu_to_be32(config->autoboot_opts[i].type);
-			pos += 4;
-		} else {
-			pos += pb_protocol_serialise_string(pos,
-						config->autoboot_opts[i].uuid);
-		}
-	}
+	encode_u32(enc, config->ipmi_bootdev);
+	encode_u32_native(enc, config->ipmi_bootdev_persistent);
+	encode_u32_native(enc, config->ipmi_bootdev_mailbox);
 
-	*(uint32_t *)pos = __cpu_to_be32(config->ipmi_bootdev);
-	pos += 4;
-	*(uint32_t *)pos = config->ipmi_bootdev_persistent;
-	pos += 4;
-	*(uint32_t *)pos = config->ipmi_bootdev_mailbox;
-	pos += 4;
+	encode_u32_native(enc, config->allow_writes);
 
-	*(uint32_t *)pos = config->allow_writes;
-	pos += 4;
+	encode_string_array(enc, config->consoles, config->n_consoles);
 
-	*(uint32_t *)pos = __cpu_to_be32(config->n_consoles);
-	pos += 4;
-	for (i = 0; i < config->n_consoles; i++)
-		pos += pb_protocol_serialise_string(pos, config->consoles[i]);
+	encode_string(enc, config->boot_console);
+	encode_u32_native(enc, config->manual_console);
 
-	pos += pb_protocol_serialise_string(pos, config->boot_console);
-	*(uint32_t *)pos = config->manual_console;
-	pos += 4;
+	encode_string(enc, config->lang);
 
-	pos += pb_protocol_serialise_string(pos, config->lang);
+	encode_u32_native(enc, config->preboot_check_enabled);
+}
 
-	*(uint32_t *)pos = config->preboot_check_enabled;
-	pos += 4;
+int pb_protocol_serialise_config(const struct config *config,
+		char *buf, int buf_len)
+{
+	struct pb_protocol_encoder enc;
 
-	assert(pos <= buf + buf_len);
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_config(&enc, config);
 
-	return (pos <= buf + buf_len) ? 0 : -1;
+	return encoder_fixed_result(&enc);
 }
 
 int pb_protocol_serialise_url(const char *url, char *buf, int buf_len)
 {
-	char *pos = buf;
+	struct pb_protocol_encoder enc;
 
-	pos += pb_protocol_serialise_string(pos, url);
+	encoder_init_fixed(&enc, buf, buf_len);
+	encode_string(&enc, url);
 
-	assert(pos <=buf+buf_len);
+	return encoder_fixed_result(&enc);
+}
 
-	return (pos <= buf + buf_len) ? 0 : -1;
+void pb_protocol_encode_plugin_option(struct pb_protocol_encoder *enc,
+		const struct plugin_option *opt)
+{
+	encode_string(enc, opt->id);
+	encode_string(enc, opt->name);
+	encode_string(enc, opt->vendor);
+	encode_string(enc, opt->vendor_id);
+	encode_string(enc, opt->version);
+	encode_string(enc, opt->date);
+	encode_string(enc, opt->plugin_file);
+
+	encode_string_array(enc, opt->executables, opt->n_executables);
 }
 
 int pb_protocol_serialise_plugin_option(const struct plugin_option *opt,
 		char *buf, int buf_len)
 {
-	char *pos = buf;
-	unsigned int i;
+	struct pb_protocol_encoder enc;
 
-	pos += pb_protocol_serialise_string(pos, opt->id);
-	pos += pb_protocol_serialise_string(pos, opt->name);
-	pos += pb_protocol_serialise_string(pos, opt->vendor);
-	pos += pb_protocol_serialise_string(pos, opt->vendor_id);
-	pos += pb_protocol_serialise_string(pos, opt->version);
-	pos += pb_protocol_serialise_string(pos, opt->date);
-	pos += pb_protocol_serialise_string(pos, opt->plugin_file);
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_plugin_option(&enc, opt);
 
-	*(uint32_t *)pos = __cpu_to_be32(opt->n_executables);
-	pos += 4;
-
-	for (i = 0; i < opt->n_executables; i++)
-		pos += pb_protocol_serialise_string(pos, opt->executables[i]);
-
-	assert(pos <= buf + buf_len);
+	return encoder_fixed_result(&enc);
+}
 
-	return (pos <= buf + buf_len) ? 0 : -1;
+void pb_protocol_encode_temp_autoboot(struct pb_protocol_encoder *enc,
+		const struct autoboot_option *opt)
+{
+	encode_autoboot_option(enc, opt);
 }
 
 int pb_protocol_serialise_temp_autoboot(const struct autoboot_option *opt,
 		char *buf, int buf_len)
 {
-	char *pos = buf;
+	struct pb_protocol_encoder enc;
 
-	*(uint32_t *)pos = __cpu_to_be32(opt->boot_type);
-	pos += 4;
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_temp_autoboot(&enc, opt);
 
-	if (opt->boot_type == BOOT_DEVICE_TYPE) {
-		*(uint32_t *)pos = __cpu_to_be32(opt->type);
-		pos += 4;
-	} else {
-		pos += pb_protocol_serialise_string(pos, opt->uuid);
-	}
-
-	assert(pos <= buf + buf_len);
-
-	return (pos <= buf + buf_len) ? 0 : -1;
+	return encoder_fixed_result(&enc);
 }
 
-int pb_protocol_serialise_authenticate(struct auth_message *msg,
-		char *buf, int buf_len)
+/* Unknown operations leave the encoder failed */
+void pb_protocol_encode_authenticate(struct pb_protocol_encoder *enc,
+		const struct auth_message *msg)
 {
-	char *pos = buf;
-
-	*(enum auth_msg_type *)pos = msg->op;
-	pos += sizeof(enum auth_msg_type);
+	encode_data(enc, &msg->op, sizeof(msg->op));
 
 	switch(msg->op) {
 	case AUTH_MSG_REQUEST:
-		pos += pb_protocol_serialise_string(pos, msg->password);
+		encode_string(enc, msg->password);
 		break;
 	case AUTH_MSG_RESPONSE:
-		*(bool *)pos = msg->authenticated;
-		pos += sizeof(bool);
+		encode_bool(enc, msg->authenticated);
 		break;
 	case AUTH_MSG_SET:
-		pos += pb_protocol_serialise_string(pos,
-				msg->set_password.password);
-		pos += pb_protocol_serialise_string(pos,
-				msg->set_password.new_password);
+		encode_string(enc, msg->set_password.password);
+		encode_string(enc, msg->set_password.new_password);
 		break;
 	case AUTH_MSG_DECRYPT:
-		pos += pb_protocol_serialise_string(pos,
-				msg->decrypt_dev.password);
-		pos += pb_protocol_serialise_string(pos,
-				msg->decrypt_dev.device_id);
+		encode_string(enc, msg->decrypt_dev.password);
+		encode_string(enc, msg->decrypt_dev.device_id);
 		break;
 	default:
 		pb_log("%s: invalid msg\n", __func__);
-		return -1;
+		enc->failed = true;
 	};
+}
 
-	assert(pos <= buf + buf_len);
+int pb_protocol_serialise_authenticate(struct auth_message *msg,
+		char *buf, int buf_len)
+{
+	struct pb_protocol_encoder enc;
+
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_authenticate(&enc, msg);
 
-	return (pos <= buf + buf_len) ? 0 : -1;
+	return enc.failed ? -1 : 0;
 }
 
-int pb_protocol_write_message(int fd, struct pb_protocol_message *message)
+int pb_protocol_finalise_message(struct pb_protocol_message *message)
 {
-	int total_len, rc;
-	char *pos;
+	int total_len;
 
 	total_len = sizeof(*message) + message->payload_len;
 
 	message->payload_len = __cpu_to_be32(message->payload_len);
 	message->action = __cpu_to_be32(message->action);
 
-	for (pos = (void *)message; total_len;) {
-		rc = write(fd, pos, total_len);
+	return total_len;
+}
+
+/* CHUNK frames have a normal header, then the action and total payload
+ * length of the original message, then the next part of its payload */
+#define CHUNK_HEADER_SIZE	(2 * sizeof(uint32_t))
+#define CHUNK_DATA_SIZE		(PB_PROTOCOL_MAX_PAYLOAD_SIZE - \
+					CHUNK_HEADER_SIZE)
+
+static char *serialise_chunk_header(char *pos,
+		const struct pb_protocol_message *message, unsigned int len)
+{
+	*(uint32_t *)pos = __cpu_to_be32(PB_PROTOCOL_ACTION_CHUNK);
+	pos += sizeof(uint32_t);
+	*(uint32_t *)pos = __cpu_to_be32(CHUNK_HEADER_SIZE + len);
+	pos += sizeof(uint32_t);
+	*(uint32_t *)pos = __cpu_to_be32(message->action);
+	pos += sizeof(uint32_t);
+	*(uint32_t *)pos = __cpu_to_be32(message->payload_len);
+	pos += sizeof(uint32_t);
+
+	return pos;
+}
+
+void *pb_protocol_encode_message(void *ctx,
+		struct pb_protocol_message *message, unsigned int *len)
+{
+	unsigned int n_chunks, pos, n;
+	char *buf, *p;
+
+	if (message->payload_len <= PB_PROTOCOL_MAX_PAYLOAD_SIZE) {
+		*len = pb_protocol_finalise_message(message);
+		return message;
+	}
+
+	n_chunks = (message->payload_len + CHUNK_DATA_SIZE - 1) /
+			CHUNK_DATA_SIZE;
+	*len = n_chunks * (sizeof(*message) + CHUNK_HEADER_SIZE) +
+			message->payload_len;
+
+	buf = talloc_size(ctx, *len);
+	if (!buf) {
+		talloc_free(message);
+		return NULL;
+	}
+
+	for (p = buf, pos = 0; pos < message->payload_len; pos += n) {
+		n = message->payload_len - pos;
+		if (n > CHUNK_DATA_SIZE)
+			n = CHUNK_DATA_SIZE;
+
+		p = serialise_chunk_header(p, message, n);
+		memcpy(p, message->payload + pos, n);
+		p += n;
+	}
+
+	talloc_free(message);
+
+	return buf;
+}
+
+static int write_all(int fd, const char *pos, unsigned int len)
+{
+	int rc;
+
+	while (len) {
+		rc = write(fd, pos, len);
 
 		if (rc <= 0)
-			break;
+			return -1;
 
-		total_len -= rc;
+		len -= rc;
 		pos += rc;
 	}
 
+	return 0;
+}
+
+/* Write a large message as CHUNK frames, directly from its payload */
+static int write_chunked_message(int fd,
+		const struct pb_protocol_message *message)
+{
+	char hdr[sizeof(*message) + CHUNK_HEADER_SIZE];
+	unsigned int pos, n;
+	int rc;
+
+	for (pos = 0; pos < message->payload_len; pos += n) {
+		n = message->payload_len - pos;
+		if (n > CHUNK_DATA_SIZE)
+			n = CHUNK_DATA_SIZE;
+
+		serialise_chunk_header(hdr, message, n);
+
+		rc = write_all(fd, hdr, sizeof(hdr));
+		if (!rc)
+			rc = write_all(fd, message->payload + pos, n);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+int pb_protocol_write_message(int fd, struct pb_protocol_message *message)
+{
+	int total_len, rc;
+
+	if (message->payload_len > PB_PROTOCOL_MAX_PAYLOAD_SIZE) {
+		rc = write_chunked_message(fd, message);
+	} else {
+		total_len = pb_protocol_finalise_message(message);
+		rc = write_all(fd, (char *)message, total_len);
+	}
+
 	talloc_free(message);
 
-	if (!total_len)
+	if (!rc)
 		return 0;
 
 	pb_log_fn("failed: %s\n", strerror(errno));
@@ -815,9 +1169,9 @@ struct pb_protocol_message *pb_protocol_create_message(void *ctx,
 {
 	struct pb_protocol_message *message;
 
-	if (payload_len > PB_PROTOCOL_MAX_PAYLOAD_SIZE) {
+	if (payload_len > PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE) {
 		pb_log_fn("payload too big %u/%u\n", payload_len,
-			PB_PROTOCOL_MAX_PAYLOAD_SIZE);
+			PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE);
 		return NULL;
 	}
 
@@ -839,36 +1193,257 @@ struct pb_protocol_message *pb_protocol_read_message(void *ctx, int fd)
 
 	/* use the stack for the initial 8-byte read */
 
-	rc = read(fd, &m, sizeof(m));
-	if (rc != sizeof(m))
-		return NULL;
+	rc = read(fd, &m, sizeof(m));
+	if (rc != sizeof(m))
+		return NULL;
+
+	m.payload_len = __be32_to_cpu(m.payload_len);
+	m.action = __be32_to_cpu(m.action);
+
+	if (m.payload_len > PB_PROTOCOL_MAX_PAYLOAD_SIZE) {
+		pb_log_fn("payload too big %u/%u\n", m.payload_len,
+			PB_PROTOCOL_MAX_PAYLOAD_SIZE);
+		return NULL;
+	}
+
+	message = talloc_size(ctx, sizeof(m) + m.payload_len);
+	memcpy(message, &m, sizeof(m));
+
+	for (len = 0; len < m.payload_len;) {
+		rc = read(fd, message->payload + len, m.payload_len - len);
+
+		if (rc <= 0) {
+			talloc_free(message);
+			pb_log_fn("failed (%u): %s\n", len,
+				strerror(errno));
+			return NULL;
+		}
+
+		len += rc;
+	}
+
+	return message;
+}
+
+struct pb_protocol_reader {
+	int				fd;
+	char				*buf;
+	unsigned int			size;
+	unsigned int			start;
+	unsigned int			end;
+	/* for messages that aren't aligned in buf */
+	struct pb_protocol_message	*message;
+	/* a message being reassembled from CHUNK frames */
+	struct pb_protocol_message	*chunked;
+	unsigned int			chunked_pos;
+	bool				chunked_done;
+	/* the largest message we'll reassemble; zero if the other end
+	 * hasn't negotiated chunking */
+	unsigned int			chunked_max;
+};
+
+struct pb_protocol_reader *pb_protocol_reader_create(void *ctx, int fd)
+{
+	struct pb_protocol_reader *reader;
+
+	reader = talloc_zero(ctx, struct pb_protocol_reader);
+	if (!reader)
+		return NULL;
+
+	/* large enough for any single message */
+	reader->size = sizeof(struct pb_protocol_message) +
+			PB_PROTOCOL_MAX_PAYLOAD_SIZE;
+	reader->buf = talloc_size(reader, reader->size);
+	if (!reader->buf) {
+		talloc_free(reader);
+		return NULL;
+	}
+
+	reader->fd = fd;
+
+	return reader;
+}
+
+void pb_protocol_reader_set_chunked_max(struct pb_protocol_reader *reader,
+		unsigned int max_payload)
+{
+	if (max_payload > PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE)
+		max_payload = PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE;
+
+	reader->chunked_max = max_payload;
+}
+
+int pb_protocol_reader_fill(struct pb_protocol_reader *reader)
+{
+	int rc;
+
+	/* move any partial message to the start of the buffer. Since it's
+	 * smaller than a complete message, there's always some space left
+	 * to read into. */
+	if (reader->start) {
+		memmove(reader->buf, reader->buf + reader->start,
+				reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+
+	rc = read(reader->fd, reader->buf + reader->end,
+			reader->size - reader->end);
+	if (rc < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		pb_log_fn("read failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (rc == 0) {
+		if (reader->end)
+			pb_log_fn("EOF with partial message (%u bytes)\n",
+					reader->end);
+		return -1;
+	}
+
+	reader->end += rc;
+
+	return 0;
+}
+
+/* Add a CHUNK frame to the message being reassembled. Returns 0 when the
+ * message is complete, 1 if more frames are needed, -1 on error */
+static int reader_add_chunk(struct pb_protocol_reader *reader,
+		const struct pb_protocol_message *frame)
+{
+	unsigned int action, total_len, len = frame->payload_len;
+	const char *pos = frame->payload;
+
+	if (read_u32(&pos, &len, &action))
+		return -1;
+	if (read_u32(&pos, &len, &total_len))
+		return -1;
+
+	if (!reader->chunked) {
+		if (!reader->chunked_max) {
+			pb_log_fn("unexpected chunked message\n");
+			return -1;
+		}
+
+		if (total_len > reader->chunked_max) {
+			pb_log_fn("chunked payload too big %u/%u\n",
+					total_len, reader->chunked_max);
+			return -1;
+		}
+
+		reader->chunked = talloc_size(reader,
+				sizeof(*reader->chunked) + total_len);
+		if (!reader->chunked)
+			return -1;
+
+		reader->chunked->action = action;
+		reader->chunked->payload_len = total_len;
+		reader->chunked_pos = 0;
+
+	} else if (reader->chunked->action != action ||
+			reader->chunked->payload_len != total_len) {
+		pb_log_fn("chunk doesn't match message\n");
+		return -1;
+	}
+
+	if (len > total_len - reader->chunked_pos) {
+		pb_log_fn("chunk overflows message\n");
+		return -1;
+	}
+
+	memcpy(reader->chunked->payload + reader->chunked_pos, pos, len);
+	reader->chunked_pos += len;
+
+	return reader->chunked_pos == total_len ? 0 : 1;
+}
+
+static int reader_next_frame(struct pb_protocol_reader *reader,
+		struct pb_protocol_message **messagep)
+{
+	struct pb_protocol_message *message, m;
+	unsigned int len;
+	char *pos;
+
+	pos = reader->buf + reader->start;
+	len = reader->end - reader->start;
+
+	if (len < sizeof(m))
+		return 1;
 
+	memcpy(&m, pos, sizeof(m));
 	m.payload_len = __be32_to_cpu(m.payload_len);
 	m.action = __be32_to_cpu(m.action);
 
 	if (m.payload_len > PB_PROTOCOL_MAX_PAYLOAD_SIZE) {
 		pb_log_fn("payload too big %u/%u\n", m.payload_len,
 			PB_PROTOCOL_MAX_PAYLOAD_SIZE);
-		return NULL;
+		return -1;
 	}
 
-	message = talloc_size(ctx, sizeof(m) + m.payload_len);
-	memcpy(message, &m, sizeof(m));
+	if (len < sizeof(m) + m.payload_len)
+		return 1;
 
-	for (len = 0; len < m.payload_len;) {
-		rc = read(fd, message->payload + len, m.payload_len - len);
+	if ((uintptr_t)pos % __alignof__(m) == 0) {
+		message = (struct pb_protocol_message *)pos;
+	} else {
+		message = talloc_realloc_size(reader, reader->message,
+				sizeof(m) + m.payload_len);
+		if (!message)
+			return -1;
+		reader->message = message;
+		memcpy(message->payload, pos + sizeof(m), m.payload_len);
+	}
 
-		if (rc <= 0) {
-			talloc_free(message);
-			pb_log_fn("failed (%u): %s\n", len,
-				strerror(errno));
-			return NULL;
-		}
+	message->action = m.action;
+	message->payload_len = m.payload_len;
 
-		len += rc;
+	reader->start += sizeof(m) + m.payload_len;
+	*messagep = message;
+
+	return 0;
+}
+
+int pb_protocol_reader_next(struct pb_protocol_reader *reader,
+		struct pb_protocol_message **messagep)
+{
+	struct pb_protocol_message *message;
+	int rc;
+
+	/* we've already returned the reassembled message */
+	if (reader->chunked_done) {
+		talloc_free(reader->chunked);
+		reader->chunked = NULL;
+		reader->chunked_done = false;
 	}
 
-	return message;
+	for (;;) {
+		rc = reader_next_frame(reader, &message);
+		if (rc)
+			return rc;
+
+		if (message->action != PB_PROTOCOL_ACTION_CHUNK) {
+			/* frames from a chunked message aren't interleaved
+			 * with others */
+			if (reader->chunked) {
+				pb_log_fn("incomplete chunked message\n");
+				return -1;
+			}
+			*messagep = message;
+			return 0;
+		}
+
+		rc = reader_add_chunk(reader, message);
+		if (rc < 0)
+			return rc;
+
+		if (rc == 0) {
+			reader->chunked_done = true;
+			*messagep = reader->chunked;
+			return 0;
+		}
+	}
 }
 
 
@@ -1046,6 +1621,62 @@ out:
 	return rc;
 }
 
+static struct interface_info *pb_protocol_deserialise_interface_info(
+		void *ctx, const char **pos, unsigned int *len)
+{
+	struct interface_info *if_info;
+
+	if_info = talloc_zero(ctx, struct interface_info);
+
+	if (read_u32(pos, len, &if_info->hwaddr_size))
+		goto err;
+
+	if (*len < if_info->hwaddr_size)
+		goto err;
+
+	if_info->hwaddr = talloc_memdup(if_info, *pos, if_info->hwaddr_size);
+	*pos += if_info->hwaddr_size;
+	*len -= if_info->hwaddr_size;
+
+	if (read_string(if_info, pos, len, &if_info->name))
+		goto err;
+
+	if (*len < sizeof(if_info->link))
+		goto err;
+
+	if_info->link = *(bool *)*pos;
+	*pos += sizeof(if_info->link);
+	*len -= sizeof(if_info->link);
+
+	if (read_string(if_info, pos, len, &if_info->address))
+		goto err;
+	if (read_string(if_info, pos, len, &if_info->address_v6))
+		goto err;
+
+	return if_info;
+
+err:
+	talloc_free(if_info);
+	return NULL;
+}
+
+static struct blockdev_info *pb_protocol_deserialise_blockdev_info(
+		void *ctx, const char **pos, unsigned int *len)
+{
+	struct blockdev_info *bd_info;
+
+	bd_info = talloc_zero(ctx, struct blockdev_info);
+
+	if (read_string(bd_info, pos, len, &bd_info->name) ||
+			read_string(bd_info, pos, len, &bd_info->uuid) ||
+			read_string(bd_info, pos, len, &bd_info->mountpoint)) {
+		talloc_free(bd_info);
+		return NULL;
+	}
+
+	return bd_info;
+}
+
 int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
 		const struct pb_protocol_message *message)
 {
@@ -1114,32 +1745,10 @@ int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
 			sysinfo->n_interfaces);
 
 	for (i = 0; i < sysinfo->n_interfaces; i++) {
-		struct interface_info *if_info = talloc(sysinfo,
-							struct interface_info);
-
-		if (read_u32(&pos, &len, &if_info->hwaddr_size))
-			goto out;
-
-		if (len < if_info->hwaddr_size)
-			goto out;
-
-		if_info->hwaddr = talloc_memdup(if_info, pos,
-						if_info->hwaddr_size);
-		pos += if_info->hwaddr_size;
-		len -= if_info->hwaddr_size;
-
-		if (read_string(if_info, &pos, &len, &if_info->name))
-			goto out;
-
-		if_info->link = *(bool *)pos;
-		pos += sizeof(if_info->link);
-
-		if (read_string(if_info, &pos, &len, &if_info->address))
-			goto out;
-		if (read_string(if_info, &pos, &len, &if_info->address_v6))
+		sysinfo->interfaces[i] = pb_protocol_deserialise_interface_info(
+				sysinfo, &pos, &len);
+		if (!sysinfo->interfaces[i])
 			goto out;
-
-		sysinfo->interfaces[i] = if_info;
 	}
 
 	/* number of interfaces */
@@ -1150,19 +1759,10 @@ int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
 			sysinfo->n_blockdevs);
 
 	for (i = 0; i < sysinfo->n_blockdevs; i++) {
-		struct blockdev_info *bd_info = talloc(sysinfo,
-							struct blockdev_info);
-
-		if (read_string(bd_info, &pos, &len, &bd_info->name))
-			goto out;
-
-		if (read_string(bd_info, &pos, &len, &bd_info->uuid))
+		sysinfo->blockdevs[i] = pb_protocol_deserialise_blockdev_info(
+				sysinfo, &pos, &len);
+		if (!sysinfo->blockdevs[i])
 			goto out;
-
-		if (read_string(bd_info, &pos, &len, &bd_info->mountpoint))
-			goto out;
-
-		sysinfo->blockdevs[i] = bd_info;
 	}
 
 	for (i = 0; i < HWADDR_SIZE; i++) {
@@ -1188,6 +1788,65 @@ out:
 	return rc;
 }
 
+int pb_protocol_deserialise_system_info_update(
+		struct system_info_update *update,
+		const struct pb_protocol_message *message)
+{
+	unsigned int len, i, type, kind;
+	const char *pos;
+
+	len = message->payload_len;
+	pos = message->payload;
+
+	if (read_u32(&pos, &len, &update->n_changes))
+		return -1;
+
+	/* each change needs at least its type and kind */
+	if (update->n_changes > len / (2 * sizeof(uint32_t)))
+		return -1;
+
+	update->changes = talloc_zero_array(update, struct system_info_change,
+			update->n_changes);
+
+	for (i = 0; i < update->n_changes; i++) {
+		struct system_info_change *change = &update->changes[i];
+
+		if (read_u32(&pos, &len, &type))
+			return -1;
+
+		switch (type) {
+		case SYSTEM_INFO_CHANGE_ADD:
+		case SYSTEM_INFO_CHANGE_UPDATE:
+		case SYSTEM_INFO_CHANGE_REMOVE:
+			change->type = type;
+			break;
+		default:
+			return -1;
+		}
+
+		if (read_u32(&pos, &len, &kind))
+			return -1;
+
+		if (kind == 0) {
+			change->interface =
+				pb_protocol_deserialise_interface_info(
+						update->changes, &pos, &len);
+			if (!change->interface)
+				return -1;
+		} else if (kind == 1) {
+			change->blockdev =
+				pb_protocol_deserialise_blockdev_info(
+						update->changes, &pos, &len);
+			if (!change->blockdev)
+				return -1;
+		} else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int pb_protocol_deserialise_config_interface(const char **buf,
 		unsigned int *len, struct interface_config *iface)
 {
@@ -1485,3 +2144,315 @@ int pb_protocol_deserialise_authenticate(struct auth_message *msg,
 
 	return 0;
 }
+
+int pb_protocol_hello_len(void)
+{
+	return 4 + 4 + 4 + 8;
+}
+
+static int read_u64(const char **pos, unsigned int *len, uint64_t *val)
+{
+	unsigned int hi, lo;
+
+	if (read_u32(pos, len, &hi))
+		return -1;
+	if (read_u32(pos, len, &lo))
+		return -1;
+
+	*val = (uint64_t)hi << 32 | lo;
+
+	return 0;
+}
+
+void pb_protocol_encode_hello(struct pb_protocol_encoder *enc,
+		const struct pb_protocol_hello *hello)
+{
+	encode_u32(enc, hello->capabilities);
+	encode_u32(enc, hello->max_payload);
+	encode_u32(enc, hello->session);
+	encode_u64(enc, hello->seq);
+}
+
+int pb_protocol_serialise_hello(const struct pb_protocol_hello *hello,
+		char *buf, int buf_len)
+{
+	struct pb_protocol_encoder enc;
+
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_hello(&enc, hello);
+
+	return encoder_fixed_result(&enc);
+}
+
+int pb_protocol_deserialise_hello(struct pb_protocol_hello *hello,
+		const struct pb_protocol_message *message)
+{
+	unsigned int len = message->payload_len;
+	const char *pos = message->payload;
+
+	hello->max_payload = PB_PROTOCOL_MAX_PAYLOAD_SIZE;
+	hello->session = 0;
+	hello->seq = 0;
+
+	if (read_u32(&pos, &len, &hello->capabilities))
+		return -1;
+
+	/* the remaining fields aren't sent by older peers */
+	if (len && read_u32(&pos, &len, &hello->max_payload))
+		return -1;
+
+	if (len && read_u32(&pos, &len, &hello->session))
+		return -1;
+
+	if (len && read_u64(&pos, &len, &hello->seq))
+		return -1;
+
+	return 0;
+}
+
+int pb_protocol_sequence_len(void)
+{
+	return 8;
+}
+
+void pb_protocol_encode_sequence(struct pb_protocol_encoder *enc,
+		uint64_t seq)
+{
+	encode_u64(enc, seq);
+}
+
+int pb_protocol_serialise_sequence(uint64_t seq, char *buf, int buf_len)
+{
+	struct pb_protocol_encoder enc;
+
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_sequence(&enc, seq);
+
+	return encoder_fixed_result(&enc);
+}
+
+int pb_protocol_deserialise_sequence(uint64_t *seq,
+		const struct pb_protocol_message *message)
+{
+	unsigned int len = message->payload_len;
+	const char *pos = message->payload;
+
+	return read_u64(&pos, &len, seq);
+}
+
+/* How many times to try reading a state export that is being updated */
+#define STATE_READ_RETRIES	1000
+
+int pb_protocol_read_state(void *ctx, const void *map, unsigned int map_len,
+		struct pb_protocol_message **snapshot)
+{
+	const struct pb_protocol_state_header *hdr = map;
+	struct pb_protocol_message *tmp;
+	uint32_t seq, payload_len;
+	int i;
+
+	if (map_len < sizeof(*hdr) || hdr->magic != PB_PROTOCOL_STATE_MAGIC ||
+			hdr->version != PB_PROTOCOL_STATE_VERSION)
+		return -1;
+
+	for (i = 0; i < STATE_READ_RETRIES; i++) {
+		seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		if (hdr->stale)
+			return 1;
+
+		payload_len = hdr->payload_len;
+		if (payload_len < sizeof(uint32_t) ||
+				payload_len > map_len - sizeof(*hdr))
+			continue;
+
+		tmp = pb_protocol_create_message(ctx,
+				PB_PROTOCOL_ACTION_SNAPSHOT, payload_len);
+		if (!tmp)
+			return -1;
+
+		memcpy(tmp->payload, hdr + 1, payload_len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq) {
+			*snapshot = tmp;
+			return 0;
+		}
+
+		talloc_free(tmp);
+	}
+
+	return -1;
+}
+
+int pb_protocol_subscription_len(void)
+{
+	return 4 + 4;
+}
+
+void pb_protocol_encode_subscription(struct pb_protocol_encoder *enc,
+		const struct pb_protocol_subscription *sub)
+{
+	encode_u32(enc, sub->classes);
+	encode_u32(enc, sub->device_types);
+}
+
+int pb_protocol_serialise_subscription(
+		const struct pb_protocol_subscription *sub,
+		char *buf, int buf_len)
+{
+	struct pb_protocol_encoder enc;
+
+	encoder_init_fixed(&enc, buf, buf_len);
+	pb_protocol_encode_subscription(&enc, sub);
+
+	return encoder_fixed_result(&enc);
+}
+
+int pb_protocol_deserialise_subscription(
+		struct pb_protocol_subscription *sub,
+		const struct pb_protocol_message *message)
+{
+	unsigned int len = message->payload_len;
+	const char *pos = message->payload;
+
+	if (read_u32(&pos, &len, &sub->classes))
+		return -1;
+
+	if (read_u32(&pos, &len, &sub->device_types))
+		return -1;
+
+	return 0;
+}
+
+/* Snapshot payload:
+ *   4-byte record count
+ *   for each record:
+ *    4-byte action
+ *    4-byte len, payload
+ */
+struct pb_protocol_message *pb_protocol_create_snapshot(void *ctx)
+{
+	struct pb_protocol_message *snapshot;
+
+	snapshot = pb_protocol_create_message(ctx, PB_PROTOCOL_ACTION_SNAPSHOT,
+			PB_PROTOCOL_MAX_PAYLOAD_SIZE);
+	if (!snapshot)
+		return NULL;
+
+	*(uint32_t *)snapshot->payload = 0;
+	snapshot->payload_len = sizeof(uint32_t);
+
+	return snapshot;
+}
+
+unsigned int pb_protocol_snapshot_n_records(
+		const struct pb_protocol_message *snapshot)
+{
+	return __be32_to_cpu(*(uint32_t *)snapshot->payload);
+}
+
+static char *snapshot_add_record(struct pb_protocol_message *snapshot,
+		enum pb_protocol_action action, int payload_len)
+{
+	unsigned int n_records;
+	char *pos;
+
+	pos = snapshot->payload + snapshot->payload_len;
+
+	*(uint32_t *)pos = __cpu_to_be32(action);
+	pos += sizeof(uint32_t);
+	*(uint32_t *)pos = __cpu_to_be32(payload_len);
+	pos += sizeof(uint32_t);
+
+	snapshot->payload_len += 2 * sizeof(uint32_t) + payload_len;
+
+	n_records = pb_protocol_snapshot_n_records(snapshot);
+	*(uint32_t *)snapshot->payload = __cpu_to_be32(n_records + 1);
+
+	return pos;
+}
+
+char *pb_protocol_snapshot_reserve(struct pb_protocol_message *snapshot,
+		enum pb_protocol_action action, int payload_len)
+{
+	if (snapshot->payload_len + 2 * sizeof(uint32_t) + payload_len >
+			PB_PROTOCOL_MAX_PAYLOAD_SIZE)
+		return NULL;
+
+	return snapshot_add_record(snapshot, action, payload_len);
+}
+
+char *pb_protocol_snapshot_append(struct pb_protocol_message **snapshot,
+		enum pb_protocol_action action, int payload_len)
+{
+	struct pb_protocol_message *tmp = *snapshot;
+	size_t size, need;
+
+	need = sizeof(*tmp) + tmp->payload_len +
+		2 * sizeof(uint32_t) + payload_len;
+	size = talloc_get_size(tmp);
+
+	if (need > size) {
+		while (size < need)
+			size *= 2;
+
+		tmp = talloc_realloc_size(NULL, tmp, size);
+		if (!tmp)
+			return NULL;
+
+		*snapshot = tmp;
+	}
+
+	return snapshot_add_record(tmp, action, payload_len);
+}
+
+int pb_protocol_snapshot_append_message(struct pb_protocol_message **snapshot,
+		const struct pb_protocol_message *message)
+{
+	char *buf;
+
+	buf = pb_protocol_snapshot_append(snapshot, message->action,
+			message->payload_len);
+	if (!buf)
+		return -1;
+
+	memcpy(buf, message->payload, message->payload_len);
+	return 0;
+}
+
+int pb_protocol_snapshot_next_record(void *ctx,
+		const struct pb_protocol_message *snapshot,
+		unsigned int *offset, struct pb_protocol_message **record)
+{
+	unsigned int len, action, payload_len;
+	const char *pos;
+
+	if (*offset == 0)
+		*offset = sizeof(uint32_t);
+
+	if (*offset >= snapshot->payload_len)
+		return 1;
+
+	pos = snapshot->payload + *offset;
+	len = snapshot->payload_len - *offset;
+
+	if (read_u32(&pos, &len, &action))
+		return -1;
+	if (read_u32(&pos, &len, &payload_len))
+		return -1;
+	if (payload_len > len)
+		return -1;
+
+	*record = talloc_realloc_size(ctx, *record,
+			sizeof(**record) + payload_len);
+	(*record)->action = action;
+	(*record)->payload_len = payload_len;
+	memcpy((*record)->payload, pos, payload_len);
+
+	*offset += 2 * sizeof(uint32_t) + payload_len;
+
+	return 0;
+}
@@ -7,10 +7,21 @@
 #include <list/list.h>
 #include <types/types.h>
 
+/* Test builds may run a server on a socket of their own */
+#ifndef PB_SOCKET_PATH
 #define PB_SOCKET_PATH "/tmp/petitboot.ui"
+#endif
 
+/* Where pb-discover publishes its state for local observers, if enabled */
+#define PB_STATE_PATH "/tmp/petitboot.state"
+
+/* The largest payload that fits in a single frame on the wire. */
 #define PB_PROTOCOL_MAX_PAYLOAD_SIZE (64 * 1024)
 
+/* Larger payloads are sent as a sequence of CHUNK frames, to peers that
+ * have advertised PB_PROTOCOL_CAP_CHUNKED; this is the largest we support */
+#define PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE (16 * 1024 * 1024)
+
 enum pb_protocol_action {
 	PB_PROTOCOL_ACTION_DEVICE_ADD		= 0x1,
 	PB_PROTOCOL_ACTION_BOOT_OPTION_ADD	= 0x2,
@@ -28,8 +39,37 @@ enum pb_protocol_action {
 	PB_PROTOCOL_ACTION_PLUGIN_INSTALL	= 0xe,
 	PB_PROTOCOL_ACTION_TEMP_AUTOBOOT	= 0xf,
 	PB_PROTOCOL_ACTION_AUTHENTICATE		= 0x10,
+	PB_PROTOCOL_ACTION_LOOP_STATS		= 0x11,
+	PB_PROTOCOL_ACTION_SYSTEM_INFO_UPDATE	= 0x12,
+	PB_PROTOCOL_ACTION_HELLO		= 0x13,
+	PB_PROTOCOL_ACTION_SNAPSHOT		= 0x14,
+	PB_PROTOCOL_ACTION_CHUNK		= 0x15,
+	PB_PROTOCOL_ACTION_SEQUENCE		= 0x16,
+	PB_PROTOCOL_ACTION_SUBSCRIBE		= 0x17,
+};
+
+/* Features that a client supports, sent to the server in a HELLO message */
+enum pb_protocol_capability {
+	PB_PROTOCOL_CAP_SNAPSHOT		= 0x1,
+	PB_PROTOCOL_CAP_CHUNKED			= 0x2,
+	PB_PROTOCOL_CAP_SEQUENCE		= 0x4,
+};
+
+/* Classes of notification that a client can subscribe to. Boot options are
+ * sent along with their devices. */
+enum pb_protocol_subscription_class {
+	PB_PROTOCOL_SUB_DEVICES			= 0x1,
+	PB_PROTOCOL_SUB_STATUS			= 0x2,
+	PB_PROTOCOL_SUB_SYSINFO			= 0x4,
+	PB_PROTOCOL_SUB_CONFIG			= 0x8,
+	PB_PROTOCOL_SUB_PLUGINS			= 0x10,
+	PB_PROTOCOL_SUB_ALL			= 0x1f,
 };
 
+/* Bit for an enum device_type in pb_protocol_subscription.device_types */
+#define PB_PROTOCOL_DEVICE_TYPE(type)		(1u << (type))
+#define PB_PROTOCOL_DEVICE_TYPES_ALL		0xffffffffu
+
 struct pb_protocol_message {
 	uint32_t action;
 	uint32_t payload_len;
@@ -66,6 +106,8 @@ int pb_protocol_boot_option_len(const struct boot_option *opt);
 int pb_protocol_boot_len(const struct boot_command *boot);
 int pb_protocol_boot_status_len(const struct status *status);
 int pb_protocol_system_info_len(const struct system_info *sysinfo);
+int pb_protocol_system_info_update_len(
+		const struct system_info_update *update);
 int pb_protocol_config_len(const struct config *config);
 int pb_protocol_url_len(const char *url);
 int pb_protocol_plugin_option_len(const struct plugin_option *opt);
@@ -90,6 +132,8 @@ int pb_protocol_serialise_boot_status(const struct status *status,
 		char *buf, int buf_len);
 int pb_protocol_serialise_system_info(const struct system_info *sysinfo,
 		char *buf, int buf_len);
+int pb_protocol_serialise_system_info_update(
+		const struct system_info_update *update, char *buf, int buf_len);
 int pb_protocol_serialise_config(const struct config *config,
 		char *buf, int buf_len);
 int pb_protocol_serialise_url(const char *url, char *buf, int buf_len);
@@ -100,13 +144,198 @@ int pb_protocol_serialise_temp_autoboot(const struct autoboot_option *opt,
 int pb_protocol_serialise_authenticate(struct auth_message *msg,
 		char *buf, int buf_len);
 
+/* An encoder builds messages in a single pass, growing its buffer as
+ * needed, so the payload length doesn't have to be known beforehand. The
+ * buffer is kept between messages: pb_protocol_encoder_start() begins a
+ * new one, and pb_protocol_encoder_message() returns it, or NULL if it
+ * couldn't be encoded. That message is owned by the encoder, and is only
+ * valid until the next start. */
+struct pb_protocol_encoder;
+
+struct pb_protocol_encoder *pb_protocol_encoder_create(void *ctx);
+void pb_protocol_encoder_start(struct pb_protocol_encoder *enc,
+		enum pb_protocol_action action);
+struct pb_protocol_message *pb_protocol_encoder_message(
+		struct pb_protocol_encoder *enc);
+
+void pb_protocol_encode_string(struct pb_protocol_encoder *enc,
+		const char *str);
+void pb_protocol_encode_device(struct pb_protocol_encoder *enc,
+		const struct device *dev);
+void pb_protocol_encode_boot_option(struct pb_protocol_encoder *enc,
+		const struct boot_option *opt);
+void pb_protocol_encode_boot_command(struct pb_protocol_encoder *enc,
+		const struct boot_command *boot);
+void pb_protocol_encode_boot_status(struct pb_protocol_encoder *enc,
+		const struct status *status);
+void pb_protocol_encode_system_info(struct pb_protocol_encoder *enc,
+		const struct system_info *sysinfo);
+void pb_protocol_encode_system_info_update(struct pb_protocol_encoder *enc,
+		const struct system_info_update *update);
+/* Encode as many of update's changes as fit in a payload of max_len bytes,
+ * but always at least one; returns the number of changes encoded. */
+unsigned int pb_protocol_encode_system_info_update_batch(
+		struct pb_protocol_encoder *enc,
+		const struct system_info_update *update, unsigned int max_len);
+void pb_protocol_encode_config(struct pb_protocol_encoder *enc,
+		const struct config *config);
+void pb_protocol_encode_plugin_option(struct pb_protocol_encoder *enc,
+		const struct plugin_option *opt);
+void pb_protocol_encode_temp_autoboot(struct pb_protocol_encoder *enc,
+		const struct autoboot_option *opt);
+void pb_protocol_encode_authenticate(struct pb_protocol_encoder *enc,
+		const struct auth_message *msg);
+
 int pb_protocol_write_message(int fd, struct pb_protocol_message *message);
 
+/* Convert a message's header to wire format, for callers that do their
+ * own writes. Returns the total length of the message, including the
+ * header; the message can't be used with other pb_protocol functions
+ * afterwards. */
+int pb_protocol_finalise_message(struct pb_protocol_message *message);
+
+/* As above, but also handles payloads larger than
+ * PB_PROTOCOL_MAX_PAYLOAD_SIZE, which are encoded as CHUNK frames in a new
+ * buffer. The message must have been allocated in ctx, and is consumed;
+ * the returned buffer (of *len bytes) is allocated in ctx. */
+void *pb_protocol_encode_message(void *ctx,
+		struct pb_protocol_message *message, unsigned int *len);
+
 struct pb_protocol_message *pb_protocol_create_message(void *ctx,
 		enum pb_protocol_action action, int payload_len);
 
 struct pb_protocol_message *pb_protocol_read_message(void *ctx, int fd);
 
+/* A buffered reader for a stream of messages. Each call to
+ * pb_protocol_reader_fill() does a single read() of as much as is
+ * available on the fd, for use from a waiter callback. Any complete
+ * messages can then be retrieved with pb_protocol_reader_next().
+ *
+ * fill returns 0 on success, or -1 on error or EOF. next returns 0 with
+ * *message set, 1 if there are no more complete messages buffered, and -1
+ * if the stream is malformed. The message may point into the reader's
+ * buffer, so is only valid until the next call to either function.
+ *
+ * CHUNK frames are reassembled, and returned as a single message, once
+ * pb_protocol_reader_set_chunked_max() has set the largest message to
+ * accept; until then, they are treated as malformed.
+ */
+struct pb_protocol_reader;
+
+struct pb_protocol_reader *pb_protocol_reader_create(void *ctx, int fd);
+void pb_protocol_reader_set_chunked_max(struct pb_protocol_reader *reader,
+		unsigned int max_payload);
+int pb_protocol_reader_fill(struct pb_protocol_reader *reader);
+int pb_protocol_reader_next(struct pb_protocol_reader *reader,
+		struct pb_protocol_message **message);
+
+/* Snapshot messages carry a sequence of records, each encoded as a complete
+ * message (action, payload length and payload). Records are added to a
+ * snapshot by reserving space for their payload; reserve returns NULL if
+ * the record won't fit in this snapshot message. */
+struct pb_protocol_message *pb_protocol_create_snapshot(void *ctx);
+char *pb_protocol_snapshot_reserve(struct pb_protocol_message *snapshot,
+		enum pb_protocol_action action, int payload_len);
+unsigned int pb_protocol_snapshot_n_records(
+		const struct pb_protocol_message *snapshot);
+
+/* As pb_protocol_snapshot_reserve(), but for snapshots that aren't sent as
+ * a single message: the snapshot is reallocated as needed, so *snapshot may
+ * change. Returns NULL if the snapshot can't be extended. */
+char *pb_protocol_snapshot_append(struct pb_protocol_message **snapshot,
+		enum pb_protocol_action action, int payload_len);
+
+/* Append a copy of an encoded message to a snapshot, as a record */
+int pb_protocol_snapshot_append_message(struct pb_protocol_message **snapshot,
+		const struct pb_protocol_message *message);
+
+/* Read the record at *offset in a received snapshot, into *record, which
+ * is (re)allocated as needed. Returns 0 on success, 1 when there are no
+ * more records, and -1 if the snapshot is malformed. */
+int pb_protocol_snapshot_next_record(void *ctx,
+		const struct pb_protocol_message *snapshot,
+		unsigned int *offset, struct pb_protocol_message **record);
+
+/* The state export is a shared memory segment, holding this header then
+ * the payload of a snapshot message. Integers in the header are in host
+ * byte order.
+ *
+ * seq is incremented before and after each update, so is odd while the
+ * payload is being written; readers retry if it is odd, or changes while
+ * they copy the payload. When the payload outgrows the segment, a new
+ * segment is created in its place, and the old one is marked stale;
+ * observers should then open PB_STATE_PATH again.
+ */
+#define PB_PROTOCOL_STATE_MAGIC		0x50425354	/* "PBST" */
+#define PB_PROTOCOL_STATE_VERSION	1
+
+struct pb_protocol_state_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	seq;
+	uint32_t	stale;
+	uint32_t	size;
+	uint32_t	payload_len;
+};
+
+/* Copy the current state out of a mapped export segment of map_len bytes,
+ * as a snapshot message. Returns 0 on success, 1 if the segment is stale,
+ * and -1 if it is invalid, or is being updated too often to read. */
+int pb_protocol_read_state(void *ctx, const void *map, unsigned int map_len,
+		struct pb_protocol_message **snapshot);
+
+/* HELLO messages carry the sender's capabilities, and the largest payload
+ * it will accept. Older peers send only some of these fields; the rest are
+ * defaulted when deserialising.
+ *
+ * With PB_PROTOCOL_CAP_SEQUENCE, the server follows each event it
+ * broadcasts with a SEQUENCE message. A reconnecting client sends the
+ * server's session and the last sequence number it saw, to resume from
+ * there; the server replies with its session, and the sequence number that
+ * the client's state is at once the server's initial messages have been
+ * processed. If that isn't the client's own, it's being sent the full
+ * state instead.
+ */
+struct pb_protocol_hello {
+	unsigned int	capabilities;
+	unsigned int	max_payload;
+	uint32_t	session;
+	uint64_t	seq;
+};
+
+int pb_protocol_hello_len(void);
+int pb_protocol_serialise_hello(const struct pb_protocol_hello *hello,
+		char *buf, int buf_len);
+void pb_protocol_encode_hello(struct pb_protocol_encoder *enc,
+		const struct pb_protocol_hello *hello);
+int pb_protocol_deserialise_hello(struct pb_protocol_hello *hello,
+		const struct pb_protocol_message *message);
+
+int pb_protocol_sequence_len(void);
+int pb_protocol_serialise_sequence(uint64_t seq, char *buf, int buf_len);
+void pb_protocol_encode_sequence(struct pb_protocol_encoder *enc,
+		uint64_t seq);
+int pb_protocol_deserialise_sequence(uint64_t *seq,
+		const struct pb_protocol_message *message);
+
+/* SUBSCRIBE messages select the notifications that a client is sent, from
+ * its next message onwards; clients that don't send one get everything.
+ * To also apply to the initial state, it must be sent before HELLO. */
+struct pb_protocol_subscription {
+	unsigned int	classes;
+	unsigned int	device_types;
+};
+
+int pb_protocol_subscription_len(void);
+int pb_protocol_serialise_subscription(
+		const struct pb_protocol_subscription *sub,
+		char *buf, int buf_len);
+void pb_protocol_encode_subscription(struct pb_protocol_encoder *enc,
+		const struct pb_protocol_subscription *sub);
+int pb_protocol_deserialise_subscription(
+		struct pb_protocol_subscription *sub,
+		const struct pb_protocol_message *message);
+
 int pb_protocol_deserialise_device(struct device *dev,
 		const struct pb_protocol_message *message);
 
@@ -122,6 +351,10 @@ int pb_protocol_deserialise_boot_status(struct status *status,
 int pb_protocol_deserialise_system_info(struct system_info *sysinfo,
 		const struct pb_protocol_message *message);
 
+int pb_protocol_deserialise_system_info_update(
+		struct system_info_update *update,
+		const struct pb_protocol_message *message);
+
 int pb_protocol_deserialise_config(struct config *config,
 		const struct pb_protocol_message *message);
 
@@ -13,10 +13,20 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 #include <process/process.h>
@@ -24,12 +34,52 @@
 #include <waiter/waiter.h>
 #include <log/log.h>
 
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+#define PROCESS_MAX_JOBS	8
+
+struct process_job_queue {
+	const char		*name;
+	unsigned int		max_running;
+	unsigned int		hold_ms;
+	unsigned int		n_running;
+	struct list		queue;
+	unsigned int		queue_len;
+
+	/* statistics */
+	unsigned long		n_submitted;
+	unsigned long		n_queued;
+	unsigned long		n_cancelled;
+	unsigned int		max_queue_len;
+	uint64_t		total_wait_ms;
+	uint64_t		max_wait_ms;
+};
+
+/* Leave at least one slot free for boot resources, whatever else is
+ * running */
+static const struct process_job_queue process_job_defaults[] = {
+	[PROCESS_JOB_BOOT]	= { .name = "boot",	.max_running = 0, },
+	[PROCESS_JOB_LOAD]	= { .name = "load",	.max_running = 3, },
+	[PROCESS_JOB_DHCP]	= { .name = "dhcp",	.max_running = 3,
+					.hold_ms = 10000, },
+	[PROCESS_JOB_PLUGIN]	= { .name = "plugin",	.max_running = 1, },
+};
+
 struct procset {
 	struct waitset		*waitset;
 	struct list		async_list;
-	int			sigchld_pipe[2];
+	bool			use_pidfd;
+	/* signalfd fallback, for kernels without pidfd support */
+	int			sigchld_fd;
 	struct waiter		*sigchld_waiter;
+	sigset_t		orig_sigmask;
+	bool			use_spawn;
 	bool			dry_run;
+	struct process_job_queue job_queues[PROCESS_JOB_NR_CLASSES];
+	unsigned int		max_jobs;
+	unsigned int		n_running_jobs;
 };
 
 /* Internal data type for process handling
@@ -48,10 +98,22 @@ struct process_info {
 	struct process		process;
 	struct list_item	async_list;
 	int			stdout_buf_len;
+	int			stdout_line_pos;
+	char			*stdout_lines;
 	struct waiter		*stdout_waiter;
 	int			stdout_pipe[2];
 	int			stdin_pipe[2];
+	int			pidfd;
+	struct waiter		*pidfd_waiter;
 	void			*orig_ctx;
+
+	/* scheduled jobs */
+	enum process_job_class	job_class;
+	bool			job_queued;
+	bool			job_slot;
+	struct list_item	job_list;
+	uint64_t		job_submit_ms;
+	struct waiter		*job_waiter;
 };
 
 static struct procset *procset;
@@ -66,17 +128,61 @@ struct process *procinfo_get_process(struct process_info *procinfo)
 	return &procinfo->process;
 }
 
-/* Read as much as possible into the currently-allocated stdout buffer, and
- * possibly realloc it for the next read
- * If the line pointer is not NULL, it is set to the start of the latest
- * output.
+/* Drop the oldest output, so that (at most) the last stdout_max bytes
+ * remain, starting at a line boundary where there is one. The buffer is allowed to fill to
+ * at least twice stdout_max before we do this, so the cost of the move is
+ * spread over the reads that filled it.
+ */
+static void process_trim_stdout(struct process_info *procinfo)
+{
+	struct process *process = &procinfo->process;
+	char *buf = process->stdout_buf, *nl;
+	int start;
+
+	/* don't look too far for the line boundary, or we may lose most
+	 * of the output we meant to keep */
+	start = process->stdout_len - process->stdout_max;
+	nl = memchr(buf + start, '\n', process->stdout_max / 2);
+	if (nl)
+		start = nl - buf + 1;
+
+	process->stdout_len -= start;
+	memmove(buf, buf + start, process->stdout_len);
+
+	procinfo->stdout_line_pos -= start;
+	if (procinfo->stdout_line_pos < 0)
+		procinfo->stdout_line_pos = 0;
+}
+
+/* Make room in a full stdout buffer, by either growing it, or dropping the
+ * oldest output. We do this before a read rather than after, so that the
+ * caller has seen the latest output before any of it is dropped.
+ */
+static void process_expand_stdout(struct process_info *procinfo)
+{
+	struct process *process = &procinfo->process;
+
+	if (process->stdout_max &&
+			procinfo->stdout_buf_len >= 2 * process->stdout_max) {
+		process_trim_stdout(procinfo);
+		return;
+	}
+
+	procinfo->stdout_buf_len *= 2;
+	process->stdout_buf = talloc_realloc(procinfo,
+			process->stdout_buf, char,
+			procinfo->stdout_buf_len);
+}
+
+/* Read as much as possible into the currently-allocated stdout buffer,
+ * making room in it first if necessary
  *
  * Returns:
  *  > 0 on success (even though no bytes may have been read)
  *    0 on EOF (no error, but no more reads can be performed)
  *  < 0 on error
  **/
-static int process_read_stdout_once(struct process_info *procinfo, char **line)
+static int process_read_stdout_once(struct process_info *procinfo)
 {
 	struct process *process = &procinfo->process;
 	int rc, fd, max_len;
@@ -85,6 +191,9 @@ static int process_read_stdout_once(struct process_info *procinfo, char **line)
 
 	fd = procinfo->stdout_pipe[0];
 
+	if (process->stdout_len == procinfo->stdout_buf_len - 1)
+		process_expand_stdout(procinfo);
+
 	max_len =  procinfo->stdout_buf_len - process->stdout_len - 1;
 
 	rc = read(fd, process->stdout_buf + process->stdout_len, max_len);
@@ -97,20 +206,38 @@ static int process_read_stdout_once(struct process_info *procinfo, char **line)
 		return rc;
 	}
 
-	if (line)
-		*line = process->stdout_buf + process->stdout_len;
-
 	process->stdout_len += rc;
-	if (process->stdout_len == procinfo->stdout_buf_len - 1) {
-		procinfo->stdout_buf_len *= 2;
-		process->stdout_buf = talloc_realloc(procinfo,
-				process->stdout_buf, char,
-				procinfo->stdout_buf_len);
-	}
 
 	return 1;
 }
 
+/* Returns a copy of the complete lines of output that have arrived since the
+ * last call, or NULL if there are none. Lines may be terminated with '\r' as
+ * well as '\n', as progress meters redraw that way.
+ */
+static char *process_stdout_lines(struct process_info *procinfo)
+{
+	struct process *process = &procinfo->process;
+	char *buf = process->stdout_buf;
+	int start, end;
+
+	start = procinfo->stdout_line_pos;
+
+	for (end = process->stdout_len; end > start; end--)
+		if (buf[end - 1] == '\n' || buf[end - 1] == '\r')
+			break;
+
+	if (end == start)
+		return NULL;
+
+	talloc_free(procinfo->stdout_lines);
+	procinfo->stdout_lines = talloc_strndup(procinfo, buf + start,
+			end - start);
+	procinfo->stdout_line_pos = end;
+
+	return procinfo->stdout_lines;
+}
+
 static int process_setup_stdout_pipe(struct process_info *procinfo)
 {
 	int rc;
@@ -119,11 +246,14 @@ static int process_setup_stdout_pipe(struct process_info *procinfo)
 		return 0;
 
 	procinfo->stdout_buf_len = 4096;
+	procinfo->stdout_line_pos = 0;
 	procinfo->process.stdout_len = 0;
 	procinfo->process.stdout_buf = talloc_array(procinfo, char,
 			procinfo->stdout_buf_len);
 
-	rc = pipe(procinfo->stdout_pipe);
+	/* the child gets its end of the pipe through dup2(), so don't leak
+	 * either end into other children */
+	rc = pipe2(procinfo->stdout_pipe, O_CLOEXEC);
 	if (rc) {
 		pb_log("pipe failed");
 		return rc;
@@ -188,6 +318,32 @@ static void process_finish_stdout(struct process_info *procinfo)
 	procinfo->process.stdout_buf[procinfo->process.stdout_len] = '\0';
 }
 
+static int process_stdout_cb(struct process_info *procinfo);
+
+/* Drop a stdout waiter that hasn't yet seen EOF. The stdout callback is run
+ * until it reports the end of output, so that it sees all of the remaining
+ * lines, and can clean up any of its own state */
+static void process_release_stdout_waiter(struct process_info *procinfo)
+{
+	struct waiter *waiter = procinfo->stdout_waiter;
+	waiter_cb stdout_cb;
+
+	if (!waiter)
+		return;
+
+	stdout_cb = procinfo->process.stdout_cb ?:
+		(waiter_cb)process_stdout_cb;
+	while (!stdout_cb(procinfo))
+		;
+
+	if (procinfo->stdout_waiter) {
+		talloc_unlink(procset, procinfo);
+		procinfo->stdout_waiter = NULL;
+	}
+
+	waiter_remove(waiter);
+}
+
 static int process_read_stdout(struct process_info *procinfo)
 {
 	int rc;
@@ -195,8 +351,10 @@ static int process_read_stdout(struct process_info *procinfo)
 	if (!procinfo->process.keep_stdout)
 		return 0;
 
+	process_release_stdout_waiter(procinfo);
+
 	do {
-		rc = process_read_stdout_once(procinfo, NULL);
+		rc = process_read_stdout_once(procinfo);
 	} while (rc > 0);
 
 	process_finish_stdout(procinfo);
@@ -208,12 +366,15 @@ int process_process_stdout(struct process_info *procinfo, char **line)
 {
 	int rc;
 
-	rc = process_read_stdout_once(procinfo, line);
+	rc = process_read_stdout_once(procinfo);
+
+	if (line)
+		*line = rc > 0 ? process_stdout_lines(procinfo) : NULL;
 
 	/* if we're going to signal to the waitset that we're done (ie, non-zero
-	 * return value), then the waiters will remove us, so we drop the
-	 * reference */
-	if (rc < 0) {
+	 * return value, on EOF or error), then the waiters will remove us, so
+	 * we drop the reference */
+	if (rc <= 0) {
 		talloc_unlink(procset, procinfo);
 		procinfo->stdout_waiter = NULL;
 		rc = -1;
@@ -224,132 +385,189 @@ int process_process_stdout(struct process_info *procinfo, char **line)
 	return rc;
 }
 
-static void sigchld_sigaction(int signo, siginfo_t *info,
-		void *arg __attribute__((unused)))
+static int process_pidfd_open(pid_t pid)
 {
-	pid_t pid;
+	return syscall(__NR_pidfd_open, pid, 0);
+}
+
+static void process_job_release_slot(struct process_info *procinfo);
+static void process_job_dispatch(void);
+
+static void process_handle_exit(struct process_info *procinfo)
+{
+	struct process *process = &procinfo->process;
+
+	if (procinfo->pidfd_waiter) {
+		waiter_remove(procinfo->pidfd_waiter);
+		procinfo->pidfd_waiter = NULL;
+	}
+
+	if (procinfo->pidfd >= 0) {
+		close(procinfo->pidfd);
+		procinfo->pidfd = -1;
+	}
+
+	/* ensure we have all of the child's stdout */
+	process_read_stdout(procinfo);
+
+	process_job_release_slot(procinfo);
+
+	if (process->exit_cb)
+		process->exit_cb(process);
+
+	list_remove(&procinfo->async_list);
+	talloc_unlink(procset, procinfo);
+
+	process_job_dispatch();
+}
+
+static int process_pidfd_event(void *arg)
+{
+	struct process_info *procinfo = arg;
+	struct process *process = &procinfo->process;
 	int rc;
 
-	if (signo != SIGCHLD)
-		return;
+	rc = waitpid(process->pid, &process->exit_status, WNOHANG);
 
-	pid = info->si_pid;
+	/* the pidfd only becomes readable once the child has exited, but
+	 * handle spurious wakeups anyway */
+	if (rc == 0 || (rc < 0 && errno == EINTR))
+		return 0;
 
-	rc = write(procset->sigchld_pipe[1], &pid, sizeof(pid));
-	if (rc != sizeof(pid))
-		pb_log_fn("write failed: %s\n", strerror(errno));
+	process_handle_exit(procinfo);
+
+	return 0;
 }
 
-static int sigchld_pipe_event(void *arg)
+static int sigchld_fd_event(void *arg)
 {
-	struct process_info *procinfo;
+	struct process_info *procinfo, *tmp;
+	struct signalfd_siginfo info;
 	struct procset *procset = arg;
 	struct process *process;
-	int pid, rc;
+	int rc;
 
-	rc = read(procset->sigchld_pipe[0], &pid, sizeof(pid));
-	if (rc != sizeof(pid))
-		return 0;
+	/* SIGCHLDs may be coalesced, so we drain the signalfd, and check each
+	 * of our async children. We'll receive SIGCHLD for synchronous
+	 * processes too, but those aren't on async_list. */
+	while (read(procset->sigchld_fd, &info, sizeof(info)) == sizeof(info))
+		;
 
-	process = NULL;
-	list_for_each_entry(&procset->async_list, procinfo, async_list) {
-		if (procinfo->process.pid == pid) {
-			process = &procinfo->process;
-			break;
-		}
+	list_for_each_entry_safe(&procset->async_list, procinfo, tmp,
+			async_list) {
+		process = &procinfo->process;
+
+		rc = waitpid(process->pid, &process->exit_status, WNOHANG);
+
+		/* if the process is still running, leave it in async_list */
+		if (rc == 0)
+			continue;
+
+		process_handle_exit(procinfo);
 	}
 
-	/* We'll receive SIGCHLD for synchronous processes too; just ignore */
-	if (!process)
-		return 0;
+	return 0;
+}
 
-	rc = waitpid(process->pid, &process->exit_status, WNOHANG);
+static int process_fini(void *p)
+{
+	struct procset *procset = p;
 
-	/* if the process is still running, ignore the event. We leave
-	 * the process in async_list so we can manage the final signal */
-	if (rc == 0)
+	if (procset->use_pidfd)
 		return 0;
 
-	/* ensure we have all of the child's stdout */
-	process_read_stdout(procinfo);
-
-	if (process->exit_cb)
-		process->exit_cb(process);
+	waiter_remove(procset->sigchld_waiter);
+	close(procset->sigchld_fd);
 
-	list_remove(&procinfo->async_list);
-	talloc_unlink(procset, procinfo);
+	sigprocmask(SIG_SETMASK, &procset->orig_sigmask, NULL);
 
 	return 0;
 }
 
-static int process_fini(void *p)
+static int process_init_sigchld_fd(struct procset *procset)
 {
-	struct procset *procset = p;
-	struct sigaction sa;
+	sigset_t mask;
 
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = SIG_DFL;
+	/* SIGCHLD needs to be blocked for signalfd to see it */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
 
-	sigaction(SIGCHLD, &sa, NULL);
+	if (sigprocmask(SIG_BLOCK, &mask, &procset->orig_sigmask)) {
+		pb_log_fn("sigprocmask() failed: %s\n", strerror(errno));
+		return -1;
+	}
 
-	waiter_remove(procset->sigchld_waiter);
+	procset->sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (procset->sigchld_fd < 0) {
+		pb_log_fn("signalfd() failed: %s\n", strerror(errno));
+		goto err_restore;
+	}
+
+	procset->sigchld_waiter = waiter_register_io(procset->waitset,
+					procset->sigchld_fd, WAIT_IN,
+					sigchld_fd_event, procset);
+	if (!procset->sigchld_waiter)
+		goto err_close;
 
-	close(procset->sigchld_pipe[0]);
-	close(procset->sigchld_pipe[1]);
 	return 0;
+
+err_close:
+	close(procset->sigchld_fd);
+err_restore:
+	sigprocmask(SIG_SETMASK, &procset->orig_sigmask, NULL);
+	return -1;
 }
 
 struct procset *process_init(void *ctx, struct waitset *set, bool dry_run)
 {
-	struct sigaction sa;
-	int rc;
+	unsigned int i;
+	int fd;
 
 	procset = talloc(ctx, struct procset);
 	procset->waitset = set;
+	procset->use_spawn = true;
 	procset->dry_run = dry_run;
 	list_init(&procset->async_list);
 
-	rc = pipe(procset->sigchld_pipe);
-	if (rc) {
-		pb_log_fn("pipe() failed: %s\n", strerror(errno));
-		goto err_free;
+	procset->max_jobs = PROCESS_MAX_JOBS;
+	procset->n_running_jobs = 0;
+	for (i = 0; i < PROCESS_JOB_NR_CLASSES; i++) {
+		procset->job_queues[i] = process_job_defaults[i];
+		list_init(&procset->job_queues[i].queue);
 	}
 
-	procset->sigchld_waiter = waiter_register_io(set,
-					procset->sigchld_pipe[0], WAIT_IN,
-					sigchld_pipe_event, procset);
-	if (!procset->sigchld_waiter)
-		goto err_close;
-
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_sigaction = sigchld_sigaction;
-	sa.sa_flags = SA_SIGINFO | SA_NOCLDSTOP;
+	/* Each async child gets its own pidfd in the waitset where the
+	 * kernel supports them; otherwise we fall back to a signalfd for
+	 * SIGCHLD */
+	fd = process_pidfd_open(getpid());
+	procset->use_pidfd = fd >= 0;
 
-	rc = sigaction(SIGCHLD, &sa, NULL);
-	if (rc) {
-		pb_log_fn("sigaction() failed: %s\n",
+	if (procset->use_pidfd) {
+		close(fd);
+	} else {
+		pb_debug("process: no pidfd support (%s), using signalfd\n",
 				strerror(errno));
-		goto err_remove;
+		if (process_init_sigchld_fd(procset)) {
+			talloc_free(procset);
+			return NULL;
+		}
 	}
 
 	talloc_set_destructor(procset, process_fini);
 
 	return procset;
+}
 
-err_remove:
-	waiter_remove(procset->sigchld_waiter);
-err_close:
-	close(procset->sigchld_pipe[0]);
-	close(procset->sigchld_pipe[1]);
-err_free:
-	talloc_free(procset);
-	return NULL;
+void process_set_spawn(bool use_spawn)
+{
+	procset->use_spawn = use_spawn;
 }
 
 struct process *process_create(void *ctx)
 {
 	struct process_info *info = talloc_zero(ctx, struct process_info);
 	info->orig_ctx = ctx;
+	info->pidfd = -1;
 	return &info->process;
 }
 
@@ -359,12 +577,97 @@ void process_release(struct process *process)
 	talloc_unlink(info->orig_ctx, info);
 }
 
+static int process_fork(struct process_info *procinfo)
+{
+	struct process *process = &procinfo->process;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		pb_log_fn("fork failed: %s\n", strerror(errno));
+		return pid;
+	}
+
+	if (pid == 0) {
+		if (!procset->use_pidfd)
+			sigprocmask(SIG_SETMASK, &procset->orig_sigmask, NULL);
+		process_setup_stdout_child(procinfo);
+		process_setup_stdin_child(procinfo);
+		if (procset->dry_run)
+			exit(EXIT_SUCCESS);
+		execvp(process->path, (char * const *)process->argv);
+		exit(EXIT_FAILURE);
+	}
+
+	process->pid = pid;
+	return 0;
+}
+
+/* The posix_spawn() equivalent of process_setup_std{out,in}_child */
+static void process_spawn_file_actions(struct process_info *procinfo,
+		posix_spawn_file_actions_t *actions)
+{
+	struct process *process = &procinfo->process;
+	int log = fileno(pb_log_get_stream());
+
+	if (!process->raw_stdout) {
+		posix_spawn_file_actions_adddup2(actions,
+				process->keep_stdout ?
+					procinfo->stdout_pipe[1] : log,
+				STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(actions,
+				process->keep_stdout && process->add_stderr ?
+					procinfo->stdout_pipe[1] : log,
+				STDERR_FILENO);
+	}
+
+	if (process->pipe_stdin)
+		posix_spawn_file_actions_adddup2(actions,
+				procinfo->stdin_pipe[0], STDIN_FILENO);
+}
+
+/* Start the child with posix_spawn(), which shares our address space until
+ * the exec rather than copying our page tables, as fork() would. */
+static int process_spawn(struct process_info *procinfo)
+{
+	struct process *process = &procinfo->process;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	pid_t pid;
+	int rc;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attr);
+
+	process_spawn_file_actions(procinfo, &actions);
+
+	if (!procset->use_pidfd) {
+		posix_spawnattr_setsigmask(&attr, &procset->orig_sigmask);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	}
+
+	rc = posix_spawnp(&pid, process->path, &actions, &attr,
+			(char * const *)process->argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (rc) {
+		/* fork() and exec() instead, so that callers see the same
+		 * failed exit status for a missing helper as before */
+		pb_debug_fn("posix_spawn failed: %s\n", strerror(rc));
+		return process_fork(procinfo);
+	}
+
+	process->pid = pid;
+	return 0;
+}
+
 static int process_run_common(struct process_info *procinfo)
 {
 	struct process *process = &procinfo->process;
 	const char *arg;
 	char *logmsg;
-	pid_t pid;
 	int rc, i;
 
 	logmsg = talloc_asprintf(procinfo, " exe:  %s\n argv:", process->path);
@@ -377,29 +680,22 @@ static int process_run_common(struct process_info *procinfo)
 	if (rc)
 		return rc;
 	if (procinfo->process.pipe_stdin) {
-		rc = pipe(procinfo->stdin_pipe);
+		rc = pipe2(procinfo->stdin_pipe, O_CLOEXEC);
 		if (rc)
 			return rc;
 	}
 
-	pid = fork();
-	if (pid < 0) {
-		pb_log_fn("fork failed: %s\n", strerror(errno));
-		return pid;
-	}
+	/* dry-run children exit without exec()ing, so need a fork() */
+	if (procset->use_spawn && !procset->dry_run)
+		rc = process_spawn(procinfo);
+	else
+		rc = process_fork(procinfo);
 
-	if (pid == 0) {
-		process_setup_stdout_child(procinfo);
-		process_setup_stdin_child(procinfo);
-		if (procset->dry_run)
-			exit(EXIT_SUCCESS);
-		execvp(process->path, (char * const *)process->argv);
-		exit(EXIT_FAILURE);
-	}
+	if (rc)
+		return rc;
 
 	process_setup_stdout_parent(procinfo);
 	process_setup_stdin_parent(procinfo);
-	process->pid = pid;
 
 	return 0;
 }
@@ -434,6 +730,34 @@ static int process_stdout_cb(struct process_info *procinfo)
 	return process_process_stdout(procinfo, NULL);
 }
 
+static int process_setup_pidfd(struct process_info *procinfo)
+{
+	struct process *process = &procinfo->process;
+
+	procinfo->pidfd = process_pidfd_open(process->pid);
+	if (procinfo->pidfd < 0) {
+		pb_log_fn("pidfd_open(%d) failed: %s\n", process->pid,
+				strerror(errno));
+		goto err_kill;
+	}
+
+	procinfo->pidfd_waiter = waiter_register_io(procset->waitset,
+					procinfo->pidfd, WAIT_IN,
+					process_pidfd_event, procinfo);
+	if (procinfo->pidfd_waiter)
+		return 0;
+
+	close(procinfo->pidfd);
+	procinfo->pidfd = -1;
+
+err_kill:
+	/* we'd have no way to reap the child, so don't leave it running */
+	kill(process->pid, SIGKILL);
+	waitpid(process->pid, &process->exit_status, 0);
+	process_read_stdout(procinfo);
+	return -1;
+}
+
 int process_run_async(struct process *process)
 {
 	struct process_info *procinfo = get_info(process);
@@ -443,6 +767,12 @@ int process_run_async(struct process *process)
 	if (rc)
 		return rc;
 
+	if (procset->use_pidfd) {
+		rc = process_setup_pidfd(procinfo);
+		if (rc)
+			return rc;
+	}
+
 	if (process->keep_stdout) {
 		waiter_cb stdout_cb = process->stdout_cb ?:
 			(waiter_cb)process_stdout_cb;
@@ -458,12 +788,32 @@ int process_run_async(struct process *process)
 	return 0;
 }
 
+static void process_job_dequeue(struct process_info *procinfo);
+static void process_job_fail(struct process_info *procinfo);
+
 void process_stop_async(struct process *process)
 {
+	struct process_info *procinfo = get_info(process);
+
 	/* Avoid signalling an old pid */
 	if (process->cancelled)
 		return;
 
+	if (procinfo->job_queued) {
+		pb_debug("process: cancelling queued job %s\n", process->path);
+		procset->job_queues[procinfo->job_class].n_cancelled++;
+		process_job_dequeue(procinfo);
+		process->cancelled = true;
+		process_job_fail(procinfo);
+		return;
+	}
+
+	/* a job that failed to start, waiting for its exit_cb */
+	if (!process->pid) {
+		process->cancelled = true;
+		return;
+	}
+
 	pb_debug("process: sending SIGTERM to pid %d\n", process->pid);
 	kill(process->pid, SIGTERM);
 	process->cancelled = true;
@@ -471,11 +821,22 @@ void process_stop_async(struct process *process)
 
 void process_stop_async_all(void)
 {
-	struct process_info *procinfo;
+	struct process_info *procinfo, *tmp;
 	struct process *process = NULL;
+	unsigned int i;
 
 	pb_debug("process: cancelling all async jobs\n");
 
+	for (i = 0; i < PROCESS_JOB_NR_CLASSES; i++) {
+		list_for_each_entry_safe(&procset->job_queues[i].queue,
+				procinfo, tmp, job_list) {
+			process = &procinfo->process;
+			process->exit_cb = NULL;
+			process->stdout_cb = NULL;
+			process_stop_async(process);
+		}
+	}
+
 	list_for_each_entry(&procset->async_list, procinfo, async_list) {
 		process = &procinfo->process;
 		/* Ignore the process completion - callbacks may use stale data */
@@ -485,6 +846,268 @@ void process_stop_async_all(void)
 	}
 }
 
+static uint64_t process_job_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool process_jobs_full(void)
+{
+	return procset->max_jobs &&
+		procset->n_running_jobs >= procset->max_jobs;
+}
+
+static bool process_job_queue_full(struct process_job_queue *queue)
+{
+	return queue->max_running && queue->n_running >= queue->max_running;
+}
+
+static void process_job_release_slot(struct process_info *procinfo)
+{
+	struct process_job_queue *queue;
+
+	if (!procinfo->job_slot)
+		return;
+
+	queue = &procset->job_queues[procinfo->job_class];
+	queue->n_running--;
+	procset->n_running_jobs--;
+	procinfo->job_slot = false;
+
+	if (procinfo->job_waiter) {
+		waiter_remove(procinfo->job_waiter);
+		procinfo->job_waiter = NULL;
+	}
+}
+
+static int process_job_hold_expired(void *arg)
+{
+	struct process_info *procinfo = arg;
+
+	procinfo->job_waiter = NULL;
+
+	pb_debug("process: %s [pid %d] still running, releasing its job slot\n",
+			procinfo->process.path, procinfo->process.pid);
+
+	process_job_release_slot(procinfo);
+	process_job_dispatch();
+
+	return 0;
+}
+
+/* Completion for jobs that never ran: called from the waitset, so that
+ * callers see the same sequence of events as for a real exit */
+static int process_job_complete(void *arg)
+{
+	struct process_info *procinfo = arg;
+	struct process *process = &procinfo->process;
+
+	procinfo->job_waiter = NULL;
+
+	if (process->exit_cb)
+		process->exit_cb(process);
+
+	talloc_unlink(procset, procinfo);
+
+	return 0;
+}
+
+static void process_job_fail(struct process_info *procinfo)
+{
+	procinfo->process.exit_status = -1;
+	procinfo->job_waiter = waiter_register_timeout(procset->waitset, 0,
+					process_job_complete, procinfo);
+}
+
+static int process_job_start(struct process_info *procinfo)
+{
+	struct process_job_queue *queue;
+	int rc;
+
+	queue = &procset->job_queues[procinfo->job_class];
+	queue->n_running++;
+	procset->n_running_jobs++;
+	procinfo->job_slot = true;
+
+	rc = process_run_async(&procinfo->process);
+	if (rc) {
+		process_job_release_slot(procinfo);
+		return rc;
+	}
+
+	if (queue->hold_ms)
+		procinfo->job_waiter = waiter_register_timeout(procset->waitset,
+					queue->hold_ms, process_job_hold_expired,
+					procinfo);
+
+	return 0;
+}
+
+/* Queued jobs may outlive the caller's argv array, so take our own copy */
+static void process_job_copy_args(struct process_info *procinfo)
+{
+	struct process *process = &procinfo->process;
+	char **argv;
+	int i, n;
+
+	for (n = 0; process->argv[n]; n++)
+		;
+
+	argv = talloc_array(procinfo, char *, n + 1);
+	for (i = 0; i < n; i++)
+		argv[i] = talloc_strdup(argv, process->argv[i]);
+	argv[n] = NULL;
+
+	process->argv = (const char **)argv;
+	process->path = talloc_strdup(procinfo, process->path);
+	if (process->pipe_stdin)
+		process->pipe_stdin = talloc_strdup(procinfo,
+				process->pipe_stdin);
+}
+
+static void process_job_dequeue(struct process_info *procinfo)
+{
+	struct process_job_queue *queue;
+	uint64_t wait;
+
+	queue = &procset->job_queues[procinfo->job_class];
+	list_remove(&procinfo->job_list);
+	queue->queue_len--;
+	procinfo->job_queued = false;
+
+	wait = process_job_now() - procinfo->job_submit_ms;
+	queue->total_wait_ms += wait;
+	if (wait > queue->max_wait_ms)
+		queue->max_wait_ms = wait;
+}
+
+static void process_job_dispatch(void)
+{
+	struct process_job_queue *queue;
+	struct process_info *procinfo;
+	unsigned int i;
+
+	/* classes are in priority order */
+	for (i = 0; i < PROCESS_JOB_NR_CLASSES; i++) {
+		queue = &procset->job_queues[i];
+
+		while (!process_jobs_full() && !process_job_queue_full(queue)) {
+			procinfo = list_entry(queue->queue.head.next,
+					struct process_info, job_list,
+					&queue->queue);
+			if (!procinfo)
+				break;
+
+			process_job_dequeue(procinfo);
+
+			if (process_job_start(procinfo)) {
+				process_job_fail(procinfo);
+				continue;
+			}
+
+			/* process_run_async has taken its own references */
+			talloc_unlink(procset, procinfo);
+		}
+	}
+}
+
+int process_run_async_job(struct process *process,
+		enum process_job_class job_class)
+{
+	struct process_info *procinfo = get_info(process);
+	struct process_job_queue *queue;
+
+	assert(job_class < PROCESS_JOB_NR_CLASSES);
+
+	queue = &procset->job_queues[job_class];
+	procinfo->job_class = job_class;
+	queue->n_submitted++;
+
+	/* slots are handed out as soon as they're freed, so if there's one
+	 * available now, nothing of a higher priority is waiting for it */
+	if (!process_jobs_full() && !process_job_queue_full(queue))
+		return process_job_start(procinfo);
+
+	process_job_copy_args(procinfo);
+	procinfo->job_submit_ms = process_job_now();
+	procinfo->job_queued = true;
+	list_add_tail(&queue->queue, &procinfo->job_list);
+	talloc_reference(procset, procinfo);
+
+	queue->n_queued++;
+	queue->queue_len++;
+	if (queue->queue_len > queue->max_queue_len)
+		queue->max_queue_len = queue->queue_len;
+
+	pb_debug("process: queued %s job %s, %d waiting\n",
+			queue->name, process->path, queue->queue_len);
+
+	return 0;
+}
+
+void process_job_settled(struct process *process)
+{
+	struct process_info *procinfo = get_info(process);
+
+	if (!procinfo->job_slot)
+		return;
+
+	process_job_release_slot(procinfo);
+	process_job_dispatch();
+}
+
+void process_job_set_limit(enum process_job_class job_class,
+		unsigned int max_running, unsigned int hold_ms)
+{
+	assert(job_class < PROCESS_JOB_NR_CLASSES);
+
+	procset->job_queues[job_class].max_running = max_running;
+	procset->job_queues[job_class].hold_ms = hold_ms;
+	process_job_dispatch();
+}
+
+void process_job_set_max(unsigned int max_running)
+{
+	procset->max_jobs = max_running;
+	process_job_dispatch();
+}
+
+char *process_job_stats_dump(void *ctx)
+{
+	struct process_job_queue *queue;
+	unsigned long n_waited;
+	unsigned int i;
+	char *str;
+
+	str = talloc_asprintf(ctx, "%-8s %7s %5s %7s %9s %7s %9s %9s %9s\n",
+			"jobs", "running", "limit", "waiting", "submitted",
+			"queued", "cancelled", "avg(ms)", "max(ms)");
+
+	for (i = 0; i < PROCESS_JOB_NR_CLASSES; i++) {
+		queue = &procset->job_queues[i];
+		n_waited = queue->n_queued - queue->queue_len;
+
+		str = talloc_asprintf_append(str,
+				"%-8s %7u %5u %7u %9lu %7lu %9lu %9llu %9llu\n",
+				queue->name, queue->n_running,
+				queue->max_running, queue->queue_len,
+				queue->n_submitted, queue->n_queued,
+				queue->n_cancelled,
+				n_waited ? (unsigned long long)
+					(queue->total_wait_ms / n_waited) : 0,
+				(unsigned long long)queue->max_wait_ms);
+	}
+
+	str = talloc_asprintf_append(str, "%-8s %7u %5u\n", "total",
+			procset->n_running_jobs, procset->max_jobs);
+
+	return str;
+}
+
 int process_get_stdout_argv(void *ctx, struct process_stdout **stdout,
 	const char *argv[])
 {
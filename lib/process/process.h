@@ -39,6 +39,7 @@ struct process {
 	bool			keep_stdout;
 	bool			add_stderr;
 	bool			raw_stdout;
+	int			stdout_max;
 	process_exit_cb		exit_cb;
 	void			*data;
 	waiter_cb		stdout_cb;
@@ -63,6 +64,12 @@ struct procset *process_init(void *ctx, struct waitset *set, bool dry_run);
 
 struct process *process_create(void *ctx);
 
+/* Children are started with posix_spawn() by default, which avoids copying
+ * our page tables. Passing false to process_set_spawn reverts to fork() and
+ * exec(), mainly for comparison.
+ */
+void process_set_spawn(bool use_spawn);
+
 /* process_release: release our reference to the process, but potentially
  * leave it running. When the process exits, associated resources will
  * be deallocated.
@@ -98,11 +105,54 @@ int process_run_async(struct process *process);
 void process_stop_async(struct process *process);
 void process_stop_async_all(void);
 
+/* Scheduled asynchronous jobs. Rather than starting straight away, a process
+ * submitted with process_run_async_job waits until both its class and the
+ * procset as a whole are under their limit of running jobs. Classes are in
+ * priority order: when a slot is freed, it goes to the oldest waiting job of
+ * the first class that can run one.
+ *
+ * A job holds its slot until it exits, or until process_job_settled is
+ * called, or until its class' hold time expires. The last two are for
+ * long-running helpers (like DHCP clients) that only need to be throttled
+ * while they start up.
+ *
+ * Queued jobs may be cancelled with process_stop_async; their exit_cb is
+ * still called, from the waitset, with a non-zero exit status. Failures to
+ * start a queued job are reported the same way.
+ */
+enum process_job_class {
+	PROCESS_JOB_BOOT,	/* resources for a pending boot */
+	PROCESS_JOB_LOAD,	/* other downloads */
+	PROCESS_JOB_DHCP,	/* DHCP clients, until they have a lease */
+	PROCESS_JOB_PLUGIN,	/* pb-plugin scans */
+	PROCESS_JOB_NR_CLASSES,
+};
+
+int process_run_async_job(struct process *process,
+		enum process_job_class job_class);
+void process_job_settled(struct process *process);
+
+/* Set the number of jobs that may run at once, for a class or overall. A
+ * limit of zero means unlimited. */
+void process_job_set_limit(enum process_job_class job_class,
+		unsigned int max_running, unsigned int hold_ms);
+void process_job_set_max(unsigned int max_running);
+
+/* Returns a talloc-ed table of per-class job queueing statistics */
+char *process_job_stats_dump(void *ctx);
+
 /* helper function to determine if a process exited cleanly, with a non-zero
  * exit status */
 bool process_exit_ok(struct process *process);
 
-/* Functions to assist callers using a custom stdout callback */
+/* Functions to assist callers using a custom stdout callback.
+ * process_process_stdout reads any available output; if line is not NULL,
+ * it is set to the complete lines received since the last call (or NULL if
+ * there are none). The lines are valid until the next call.
+ *
+ * For long-running processes, setting stdout_max limits stdout_buf to around
+ * the last stdout_max bytes of output, rather than all of it.
+ */
 struct process *procinfo_get_process(struct process_info *procinfo);
 int process_process_stdout(struct process_info *procinfo, char **line);
 
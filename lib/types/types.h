@@ -100,6 +100,9 @@ struct status {
 	char	*message;
 	bool	backlog;
 	bool	boot_active;
+	/* transient progress updates (eg. download progress), which are
+	 * superseded by the next one. Not sent to clients. */
+	bool	progress;
 };
 
 struct statuslog_entry {
@@ -143,6 +146,24 @@ struct system_info {
 	bool			stb_os_enforcing;
 };
 
+/* Incremental changes to the interfaces and blockdevs of a system_info.
+ * Each change carries exactly one of interface or blockdev; interfaces are
+ * matched by hwaddr, and blockdevs by name. */
+struct system_info_change {
+	enum system_info_change_type {
+		SYSTEM_INFO_CHANGE_ADD,
+		SYSTEM_INFO_CHANGE_UPDATE,
+		SYSTEM_INFO_CHANGE_REMOVE,
+	} type;
+	struct interface_info	*interface;
+	struct blockdev_info	*blockdev;
+};
+
+struct system_info_update {
+	struct system_info_change	*changes;
+	unsigned int			n_changes;
+};
+
 #define HWADDR_SIZE	6
 
 struct interface_config {
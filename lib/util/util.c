@@ -64,3 +64,29 @@ char *format_buffer(void *ctx, const uint8_t *buf, unsigned int len)
 
 	return str;
 }
+
+bool streq_null(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+uint64_t data_hash(const void *data, size_t len)
+{
+	const unsigned char *pos = data;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= pos[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+unsigned int str_hash(const char *str)
+{
+	return data_hash(str, strlen(str));
+}
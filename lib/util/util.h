@@ -18,6 +18,8 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef container_of
@@ -52,5 +54,13 @@
 void mac_str(uint8_t *mac, unsigned int maclen, char *buf, unsigned int buflen);
 char *format_buffer(void *ctx, const uint8_t *buf, unsigned int len);
 
+/* Compare two strings, either of which may be NULL */
+bool streq_null(const char *a, const char *b);
+
+/* 64-bit FNV-1a hash of a buffer; str_hash() is the same over a string,
+ * truncated for hash tables */
+uint64_t data_hash(const void *data, size_t len);
+unsigned int str_hash(const char *str);
+
 #endif /* UTIL_H */
 
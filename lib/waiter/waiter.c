@@ -1,13 +1,18 @@
 
-#include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <errno.h>
-#include <sys/time.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/epoll.h>
 
 #include <talloc/talloc.h>
 #include <list/list.h>
+#include <log/log.h>
 
 #include "waiter.h"
 
@@ -19,74 +24,359 @@ struct waiter {
 	} type;
 	union {
 		struct {
-			int	fd;
-			int	events;
+			int		fd;
+			int		events;
+			/* the fd registered with epoll; a dup of fd if
+			 * another waiter already owns fd */
+			int		reg_fd;
+			uint32_t	gen;
 		} io;
-		struct timeval	timeout;
+		struct {
+			/* CLOCK_MONOTONIC expiry, in nanoseconds */
+			uint64_t	expiry;
+			uint64_t	seq;
+			int		idx;
+		} time;
 	};
 	waiter_cb	callback;
 	void		*arg;
+	int		stats_idx;
 
 	bool			active;
 	struct list_item	list;
 };
 
 struct waitset {
-	struct waiter	**waiters;
-	int		n_waiters;
-	bool		waiters_changed;
-
-	struct timeval	next_timeout;
-
-	/* These are kept consistent over each call to waiter_poll, as
-	 * set->waiters may be updated (by waiters' callbacks calling
-	 * waiter_register or waiter_remove) during iteration. */
-	struct pollfd	*pollfds;
-	int		n_pollfds;
-	struct waiter	**io_waiters;
+	int		epoll_fd;
+
+	/* IO waiters, indexed by registered fd. Registrations live in the
+	 * kernel, so these are only touched when a waiter is added or
+	 * removed. */
+	struct waiter	**fd_waiters;
+	int		n_fd_waiters;
 	int		n_io_waiters;
-	struct waiter	**time_waiters;
-	int		n_time_waiters;
+	uint32_t	io_gen;
+
+	struct epoll_event	*events;
+	int			n_events;
+
+	/* Time waiters: a binary min-heap, ordered by expiry then by
+	 * registration sequence */
+	struct waiter	**timers;
+	int		n_timers;
+	int		timers_size;
+	uint64_t	timer_seq;
+
+	struct waiter_stats	*stats;
+	int			n_stats;
+	uint64_t		slow_threshold;
 
 	struct list	free_list;
 };
 
+#define WAITER_SLOW_THRESHOLD_MS	250
+
+/* run time histogram buckets: <10us, <100us, ... <1s, >=1s */
+#define WAITER_STATS_N_BUCKETS		7
+
+struct waiter_stats {
+	waiter_cb	callback;
+	const char	*name;
+	unsigned long	count;
+	unsigned long	n_slow;
+	uint64_t	total;
+	uint64_t	max;
+	unsigned long	buckets[WAITER_STATS_N_BUCKETS];
+};
+
+static int waitset_destructor(void *p)
+{
+	struct waitset *set = p;
+
+	if (set->epoll_fd >= 0)
+		close(set->epoll_fd);
+
+	return 0;
+}
+
 struct waitset *waitset_create(void *ctx)
 {
 	struct waitset *set = talloc_zero(ctx, struct waitset);
+
+	set->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (set->epoll_fd < 0) {
+		pb_log_fn("epoll_create1 failed: %s\n", strerror(errno));
+		talloc_free(set);
+		return NULL;
+	}
+
+	set->slow_threshold = WAITER_SLOW_THRESHOLD_MS * 1000000ull;
+
 	list_init(&set->free_list);
+	talloc_set_destructor(set, waitset_destructor);
 	return set;
 }
 
-static struct waiter *waiter_new(struct waitset *set)
+void waitset_set_slow_threshold(struct waitset *set, int threshold_ms)
 {
-	struct waiter **waiters, *waiter;
+	set->slow_threshold = threshold_ms > 0 ?
+		(uint64_t)threshold_ms * 1000000ull : 0;
+}
+
+/* Callback names come from the stringified argument to the register
+ * macros, so may include a cast */
+static const char *waiter_cb_name(const char *name)
+{
+	const char *p;
+
+	if (!name)
+		return "(unknown)";
+
+	p = strrchr(name, ')');
+	if (p && name[0] == '(') {
+		for (p++; *p == ' '; p++)
+			;
+		if (*p)
+			return p;
+	}
+
+	return name;
+}
+
+static int waiter_stats_lookup(struct waitset *set, waiter_cb callback,
+		const char *name)
+{
+	struct waiter_stats *stats;
+	int i;
+
+	for (i = 0; i < set->n_stats; i++)
+		if (set->stats[i].callback == callback)
+			return i;
+
+	stats = talloc_realloc(set, set->stats, struct waiter_stats,
+			set->n_stats + 1);
+	if (!stats)
+		return -1;
+
+	set->stats = stats;
+	stats = &set->stats[set->n_stats];
+	memset(stats, 0, sizeof(*stats));
+	stats->callback = callback;
+	stats->name = waiter_cb_name(name);
+
+	return set->n_stats++;
+}
+
+static struct waiter *waiter_new(struct waitset *set, waiter_cb callback,
+		const char *name)
+{
+	struct waiter *waiter;
 
 	waiter = talloc(set, struct waiter);
 	if (!waiter)
 		return NULL;
 
-	waiters = talloc_realloc(set, set->waiters,
-			struct waiter *, set->n_waiters + 1);
+	waiter->stats_idx = waiter_stats_lookup(set, callback, name);
+	waiter->active = true;
+	return waiter;
+}
 
-	if (!waiters) {
-		talloc_free(waiter);
-		return NULL;
+static uint64_t waiter_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool timer_before(struct waiter *a, struct waiter *b)
+{
+	if (a->time.expiry != b->time.expiry)
+		return a->time.expiry < b->time.expiry;
+	return a->time.seq < b->time.seq;
+}
+
+static void timer_set(struct waitset *set, int idx, struct waiter *waiter)
+{
+	set->timers[idx] = waiter;
+	waiter->time.idx = idx;
+}
+
+static void timer_sift_up(struct waitset *set, int idx)
+{
+	struct waiter *waiter = set->timers[idx];
+	int parent;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (!timer_before(waiter, set->timers[parent]))
+			break;
+		timer_set(set, idx, set->timers[parent]);
+		idx = parent;
 	}
 
-	set->waiters_changed = true;
-	set->waiters = waiters;
-	set->n_waiters++;
+	timer_set(set, idx, waiter);
+}
 
-	set->waiters[set->n_waiters - 1] = waiter;
-	waiter->active = true;
-	return waiter;
+static void timer_sift_down(struct waitset *set, int idx)
+{
+	struct waiter *waiter = set->timers[idx];
+	int child;
+
+	for (;;) {
+		child = 2 * idx + 1;
+		if (child >= set->n_timers)
+			break;
+		if (child + 1 < set->n_timers &&
+				timer_before(set->timers[child + 1],
+					set->timers[child]))
+			child++;
+		if (!timer_before(set->timers[child], waiter))
+			break;
+		timer_set(set, idx, set->timers[child]);
+		idx = child;
+	}
+
+	timer_set(set, idx, waiter);
+}
+
+static int waiter_time_add(struct waitset *set, struct waiter *waiter)
+{
+	struct waiter **timers;
+	int n;
+
+	if (set->n_timers == set->timers_size) {
+		n = set->timers_size ? set->timers_size * 2 : 16;
+		timers = talloc_realloc(set, set->timers, struct waiter *, n);
+		if (!timers)
+			return -1;
+		set->timers = timers;
+		set->timers_size = n;
+	}
+
+	waiter->time.seq = set->timer_seq++;
+	timer_set(set, set->n_timers++, waiter);
+	timer_sift_up(set, waiter->time.idx);
+
+	return 0;
+}
+
+static void waiter_time_del(struct waitset *set, struct waiter *waiter)
+{
+	int idx = waiter->time.idx;
+	struct waiter *last;
+
+	assert(idx < set->n_timers && set->timers[idx] == waiter);
+
+	last = set->timers[--set->n_timers];
+	if (last == waiter)
+		return;
+
+	timer_set(set, idx, last);
+	if (idx > 0 && timer_before(last, set->timers[(idx - 1) / 2]))
+		timer_sift_up(set, idx);
+	else
+		timer_sift_down(set, idx);
+}
+
+/* (Re-)arm an IO waiter's registration. We use one-shot registrations so
+ * that a stale kernel entry (eg, for an fd that was closed while a forked
+ * child still holds a reference) can never fire more than once. */
+static int waiter_io_arm(struct waiter *waiter, int op)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = waiter->io.events | EPOLLONESHOT;
+	event.data.u64 = (uint64_t)waiter->io.gen << 32 |
+				(uint32_t)waiter->io.reg_fd;
+
+	return epoll_ctl(waiter->set->epoll_fd, op, waiter->io.reg_fd, &event);
+}
+
+static int waiter_io_add(struct waitset *set, struct waiter *waiter)
+{
+	struct waiter **fd_waiters;
+	int fd, rc, n;
+
+	waiter->io.reg_fd = waiter->io.fd;
+	waiter->io.gen = ++set->io_gen;
+
+	rc = waiter_io_arm(waiter, EPOLL_CTL_ADD);
+	if (rc && errno == EEXIST) {
+		/* epoll only allows one registration per open file, so
+		 * another waiter on the same fd gets a duplicate */
+		fd = fcntl(waiter->io.fd, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		waiter->io.reg_fd = fd;
+		rc = waiter_io_arm(waiter, EPOLL_CTL_ADD);
+	}
+
+	if (rc) {
+		pb_log_fn("epoll_ctl(%d) failed: %s\n", waiter->io.fd,
+				strerror(errno));
+		goto err;
+	}
+
+	fd = waiter->io.reg_fd;
+	if (fd >= set->n_fd_waiters) {
+		n = set->n_fd_waiters ?: 16;
+		while (n <= fd)
+			n *= 2;
+		fd_waiters = talloc_realloc(set, set->fd_waiters,
+				struct waiter *, n);
+		if (!fd_waiters)
+			goto err_del;
+		memset(&fd_waiters[set->n_fd_waiters], 0,
+			(n - set->n_fd_waiters) * sizeof(fd_waiters[0]));
+		set->fd_waiters = fd_waiters;
+		set->n_fd_waiters = n;
+	}
+
+	/* If the fd slot is still occupied, the previous owner's fd has
+	 * been closed (dropping its kernel registration) and the number
+	 * reused; that waiter's eventual removal will leave us alone. */
+	if (!set->fd_waiters[fd])
+		set->n_io_waiters++;
+	set->fd_waiters[fd] = waiter;
+
+	return 0;
+
+err_del:
+	epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, waiter->io.reg_fd, NULL);
+err:
+	if (waiter->io.reg_fd != waiter->io.fd)
+		close(waiter->io.reg_fd);
+	return -1;
+}
+
+static void waiter_io_del(struct waitset *set, struct waiter *waiter)
+{
+	int fd = waiter->io.reg_fd;
+
+	if (fd >= set->n_fd_waiters || set->fd_waiters[fd] != waiter)
+		return;
+
+	set->fd_waiters[fd] = NULL;
+	set->n_io_waiters--;
+
+	/* the fd may have already been closed by its owner, which removes
+	 * it from the epoll set; ignore any errors here */
+	epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+	if (fd != waiter->io.fd)
+		close(fd);
 }
 
-struct waiter *waiter_register_io(struct waitset *set, int fd, int events,
-		waiter_cb callback, void *arg)
+struct waiter *_waiter_register_io(struct waitset *set, int fd, int events,
+		waiter_cb callback, void *arg, const char *name)
 {
-	struct waiter *waiter = waiter_new(set);
+	struct waiter *waiter = waiter_new(set, callback, name);
+
+	if (!waiter)
+		return NULL;
 
 	waiter->type = WAITER_IO;
 	waiter->set = set;
@@ -95,135 +385,207 @@ struct waiter *waiter_register_io(struct waitset *set, int fd, int events,
 	waiter->callback = callback;
 	waiter->arg = arg;
 
+	if (waiter_io_add(set, waiter)) {
+		talloc_free(waiter);
+		return NULL;
+	}
+
 	return waiter;
 }
 
-struct waiter *waiter_register_timeout(struct waitset *set, int delay_ms,
-		waiter_cb callback, void *arg)
+struct waiter *_waiter_register_timeout(struct waitset *set, int delay_ms,
+		waiter_cb callback, void *arg, const char *name)
 {
-	struct waiter *waiter = waiter_new(set);
-	struct timeval now, delay;
-
-	delay.tv_sec = delay_ms / 1000;
-	delay.tv_usec = 1000 * (delay_ms % 1000);
+	struct waiter *waiter = waiter_new(set, callback, name);
 
-	gettimeofday(&now, NULL);
+	if (!waiter)
+		return NULL;
 
-	timeradd(&now, &delay, &waiter->timeout);
+	if (delay_ms < 0)
+		delay_ms = 0;
 
 	waiter->type = WAITER_TIME;
 	waiter->set = set;
+	waiter->time.expiry = waiter_now() + (uint64_t)delay_ms * 1000000ull;
 	waiter->callback = callback;
 	waiter->arg = arg;
 
+	if (waiter_time_add(set, waiter)) {
+		talloc_free(waiter);
+		return NULL;
+	}
+
 	return waiter;
 }
 
 void waiter_remove(struct waiter *waiter)
 {
 	struct waitset *set = waiter->set;
-	int i;
 
-	for (i = 0; i < set->n_waiters; i++)
-		if (set->waiters[i] == waiter)
-			break;
+	if (waiter->type == WAITER_IO)
+		waiter_io_del(set, waiter);
+	else
+		waiter_time_del(set, waiter);
 
-	assert(i < set->n_waiters);
+	waiter->active = false;
+	list_add(&set->free_list, &waiter->list);
+}
 
-	set->n_waiters--;
-	memmove(&set->waiters[i], &set->waiters[i+1],
-		(set->n_waiters - i) * sizeof(set->waiters[0]));
+static struct waiter *waiter_lookup_event(struct waitset *set,
+		struct epoll_event *event)
+{
+	struct waiter *waiter;
+	uint32_t gen;
+	int fd;
 
-	set->waiters = talloc_realloc(set, set->waiters,
-			struct waiter *, set->n_waiters);
-	set->waiters_changed = true;
+	fd = (int)(event->data.u64 & 0xffffffff);
+	gen = event->data.u64 >> 32;
 
-	waiter->active = false;
-	list_add(&set->free_list, &waiter->list);
+	if (fd < 0 || fd >= set->n_fd_waiters)
+		return NULL;
+
+	waiter = set->fd_waiters[fd];
+	if (!waiter || !waiter->active || waiter->io.gen != gen)
+		return NULL;
+
+	return waiter;
 }
 
-static void update_waiters(struct waitset *set)
+static void waiter_stats_account(struct waitset *set, struct waiter *waiter,
+		uint64_t duration)
 {
-	int n_io, n_time, i_io, i_time, i;
+	struct waiter_stats *stats;
+	uint64_t limit;
+	int i;
 
-	if (!set->waiters_changed)
+	if (waiter->stats_idx < 0)
 		return;
 
-	n_io = n_time = 0;
+	stats = &set->stats[waiter->stats_idx];
+	stats->count++;
+	stats->total += duration;
+	if (duration > stats->max)
+		stats->max = duration;
 
-	for (i = 0; i < set->n_waiters; i++) {
-		if (set->waiters[i]->type == WAITER_IO)
-			n_io++;
-		else if (set->waiters[i]->type == WAITER_TIME)
-			n_time++;
-	}
+	for (i = 0, limit = 10000; i < WAITER_STATS_N_BUCKETS - 1;
+			i++, limit *= 10)
+		if (duration < limit)
+			break;
+	stats->buckets[i]++;
 
-	/* realloc if counts have changed */
-	if (set->n_io_waiters != n_io) {
-		set->io_waiters = talloc_realloc(set, set->io_waiters,
-				struct waiter *, n_io);
-		set->pollfds = talloc_realloc(set, set->pollfds,
-				struct pollfd, n_io);
-		set->n_io_waiters = n_io;
+	if (set->slow_threshold && duration >= set->slow_threshold) {
+		stats->n_slow++;
+		pb_log("waiter: slow callback %s (%p) took %llu ms\n",
+				stats->name, waiter->arg,
+				(unsigned long long)duration / 1000000);
 	}
-	if (set->n_time_waiters != n_time) {
-		set->time_waiters = talloc_realloc(set, set->time_waiters,
-				struct waiter *, n_time);
-		set->n_time_waiters = n_time;
+}
+
+static int waiter_run_callback(struct waitset *set, struct waiter *waiter)
+{
+	uint64_t start;
+	int rc;
+
+	start = waiter_now();
+	rc = waiter->callback(waiter->arg);
+	waiter_stats_account(set, waiter, waiter_now() - start);
+
+	return rc;
+}
+
+char *waitset_stats_dump(void *ctx, struct waitset *set)
+{
+	static const char *bucket_names[WAITER_STATS_N_BUCKETS] = {
+		"<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s",
+	};
+	struct waiter_stats *stats;
+	char *str;
+	int i, j;
+
+	str = talloc_asprintf(ctx, "%-32s %8s %10s %8s %6s",
+			"callback", "calls", "total(ms)", "max(ms)", "slow");
+	for (j = 0; j < WAITER_STATS_N_BUCKETS; j++)
+		str = talloc_asprintf_append(str, " %7s", bucket_names[j]);
+	str = talloc_asprintf_append(str, "\n");
+
+	for (i = 0; i < set->n_stats; i++) {
+		stats = &set->stats[i];
+
+		str = talloc_asprintf_append(str, "%-32s %8lu %10llu %8llu %6lu",
+				stats->name, stats->count,
+				(unsigned long long)stats->total / 1000000,
+				(unsigned long long)stats->max / 1000000,
+				stats->n_slow);
+		for (j = 0; j < WAITER_STATS_N_BUCKETS; j++)
+			str = talloc_asprintf_append(str, " %7lu",
+					stats->buckets[j]);
+		str = talloc_asprintf_append(str, "\n");
 	}
 
-	i_io = 0;
-	i_time = 0;
+	return str;
+}
 
-	timerclear(&set->next_timeout);
+static int waiter_poll_timeout(struct waitset *set)
+{
+	uint64_t now, expiry, delay;
 
-	for (i = 0; i < set->n_waiters; i++) {
-		struct waiter *waiter = set->waiters[i];
+	if (!set->n_timers)
+		return -1;
 
-		/* IO waiters: copy to io_waiters, populate pollfds */
-		if (waiter->type == WAITER_IO) {
-			set->pollfds[i_io].fd = waiter->io.fd;
-			set->pollfds[i_io].events = waiter->io.events;
-			set->io_waiters[i_io] = waiter;
-			i_io++;
-		}
+	now = waiter_now();
+	expiry = set->timers[0]->time.expiry;
+	if (expiry <= now)
+		return 0;
 
-		/* time waiters: copy to time_waiters, calculate next expiry */
-		if (waiter->type == WAITER_TIME) {
-			if (!timerisset(&set->next_timeout) ||
-					timercmp(&waiter->timeout,
-						&set->next_timeout, <))
-				set->next_timeout = waiter->timeout;
+	/* round up, so that we don't wake before the expiry time */
+	delay = (expiry - now + 999999) / 1000000;
 
-			set->time_waiters[i_time] = waiter;
-			i_time++;
-		}
+	return delay > INT_MAX ? INT_MAX : (int)delay;
+}
+
+static void waiter_run_timers(struct waitset *set)
+{
+	struct waiter *waiter;
+	uint64_t now, seq;
+
+	if (!set->n_timers)
+		return;
+
+	now = waiter_now();
+
+	/* timers registered by callbacks in this pass will not run until
+	 * the next one */
+	seq = set->timer_seq;
+
+	while (set->n_timers) {
+		waiter = set->timers[0];
+
+		if (waiter->time.expiry > now || waiter->time.seq >= seq)
+			break;
+
+		waiter_remove(waiter);
+		waiter_run_callback(set, waiter);
 	}
 }
 
 int waiter_poll(struct waitset *set)
 {
-	struct timeval now, timeout;
 	struct waiter *waiter, *tmp;
 	int timeout_ms;
-	int i, rc;
-
-	/* If the waiters have been updated, we need to update our
-	 * consistent copy */
-	update_waiters(set);
-
-	if (timerisset(&set->next_timeout)) {
-		gettimeofday(&now, NULL);
-		timersub(&set->next_timeout, &now, &timeout);
-		timeout_ms = timeout.tv_sec * 1000 +
-				timeout.tv_usec / 1000;
-		if (timeout_ms < 0)
-			timeout_ms = 0;
-	} else {
-		timeout_ms = -1;
+	int i, n, rc;
+
+	timeout_ms = waiter_poll_timeout(set);
+
+	/* size the event buffer to the number of registrations, so that
+	 * every ready fd is reported in a single pass */
+	n = set->n_io_waiters ?: 1;
+	if (n > set->n_events) {
+		set->events = talloc_realloc(set, set->events,
+				struct epoll_event, n);
+		set->n_events = n;
 	}
 
-	rc = poll(set->pollfds, set->n_io_waiters, timeout_ms);
+	rc = epoll_wait(set->epoll_fd, set->events, n, timeout_ms);
 
 	if (rc < 0) {
 		if (errno == EINTR)
@@ -231,36 +593,23 @@ int waiter_poll(struct waitset *set)
 		goto out;
 	}
 
-	for (i = 0; i < set->n_io_waiters; i++) {
-		struct waiter *waiter = set->io_waiters[i];
-
-		if (!waiter->active)
+	for (i = 0; i < rc; i++) {
+		waiter = waiter_lookup_event(set, &set->events[i]);
+		if (!waiter)
 			continue;
 
-		if (!set->pollfds[i].revents)
+		if (waiter_run_callback(set, waiter)) {
+			if (waiter->active)
+				waiter_remove(waiter);
 			continue;
-		rc = waiter->callback(waiter->arg);
+		}
 
-		if (rc)
-			waiter_remove(waiter);
+		/* the callback may have removed the waiter itself */
+		if (waiter->active)
+			waiter_io_arm(waiter, EPOLL_CTL_MOD);
 	}
 
-	if (set->n_time_waiters > 0)
-		gettimeofday(&now, NULL);
-
-	for (i = 0; i < set->n_time_waiters; i++) {
-		struct waiter *waiter = set->time_waiters[i];
-
-		if (!waiter->active)
-			continue;
-
-		if (timercmp(&waiter->timeout, &now, >))
-			continue;
-
-		waiter->callback(waiter->arg);
-
-		waiter_remove(waiter);
-	}
+	waiter_run_timers(set);
 
 	rc = 0;
 
@@ -1,29 +1,42 @@
 #ifndef _WAITER_H
 #define _WAITER_H
 
-#include <poll.h>
+#include <sys/epoll.h>
 
 struct waiter;
 struct waitset;
 
 enum events {
-	WAIT_IN  = POLLIN,
-	WAIT_OUT = POLLOUT,
+	WAIT_IN  = EPOLLIN,
+	WAIT_OUT = EPOLLOUT,
 };
 
 typedef int (*waiter_cb)(void *);
 
 struct waitset *waitset_create(void *ctx);
 
-struct waiter *waiter_register_io(struct waitset *waitset, int fd, int events,
-		waiter_cb callback, void *arg);
+/* The register functions record the callback's name, for reporting in the
+ * waitset stats */
+struct waiter *_waiter_register_io(struct waitset *waitset, int fd, int events,
+		waiter_cb callback, void *arg, const char *name);
+#define waiter_register_io(_set, _fd, _events, _cb, _arg) \
+	_waiter_register_io(_set, _fd, _events, _cb, _arg, #_cb)
 
-struct waiter *waiter_register_timeout(struct waitset *set, int delay_ms,
-		waiter_cb callback, void *arg);
+struct waiter *_waiter_register_timeout(struct waitset *set, int delay_ms,
+		waiter_cb callback, void *arg, const char *name);
+#define waiter_register_timeout(_set, _delay_ms, _cb, _arg) \
+	_waiter_register_timeout(_set, _delay_ms, _cb, _arg, #_cb)
 
 void waiter_remove(struct waiter *waiter);
 
 int waiter_poll(struct waitset *waitset);
-#endif /* _WAITER_H */
 
+/* Callbacks that run for longer than threshold_ms are logged. A threshold
+ * of zero disables logging; run times are always recorded. */
+void waitset_set_slow_threshold(struct waitset *set, int threshold_ms);
+
+/* Returns a talloc-ed text table of callback run times, with a histogram of
+ * run times for each callback */
+char *waitset_stats_dump(void *ctx, struct waitset *set);
 
+#endif /* _WAITER_H */
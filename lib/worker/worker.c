@@ -0,0 +1,218 @@
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <list/list.h>
+#include <log/log.h>
+#include <talloc/talloc.h>
+#include <waiter/waiter.h>
+
+#include "worker.h"
+
+struct work {
+	work_fn			fn;
+	work_complete_fn	complete;
+	void			*arg;
+	struct list_item	list;
+};
+
+/* Items move from pending, to running (off-list), to completed. The lists
+ * and the stop flag are protected by lock; the items themselves are only
+ * allocated and freed by the owning thread. */
+struct workqueue {
+	struct waitset		*waitset;
+	struct waiter		*waiter;
+	int			event_fd;
+	pthread_t		*threads;
+	unsigned int		n_threads;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct list		pending;
+	struct list		completed;
+	bool			stop;
+};
+
+static void *workqueue_thread(void *arg)
+{
+	struct workqueue *wq = arg;
+	uint64_t val = 1;
+	struct work *work;
+
+	pthread_mutex_lock(&wq->lock);
+
+	for (;;) {
+		while (!wq->stop && !(work = list_entry(wq->pending.head.next,
+						struct work, list, &wq->pending)))
+			pthread_cond_wait(&wq->cond, &wq->lock);
+
+		if (wq->stop)
+			break;
+
+		list_remove(&work->list);
+		pthread_mutex_unlock(&wq->lock);
+
+		work->fn(work->arg);
+
+		pthread_mutex_lock(&wq->lock);
+		list_add_tail(&wq->completed, &work->list);
+
+		/* a failed write can only mean that the counter is already
+		 * non-zero, so the waitset will see this completion anyway */
+		if (write(wq->event_fd, &val, sizeof(val)) != sizeof(val))
+			pb_debug_fn("eventfd write failed: %s\n",
+					strerror(errno));
+	}
+
+	pthread_mutex_unlock(&wq->lock);
+
+	return NULL;
+}
+
+static int workqueue_process(void *arg)
+{
+	struct workqueue *wq = arg;
+	struct work *work, *tmp;
+	struct list completed;
+	uint64_t val;
+	int rc;
+
+	rc = read(wq->event_fd, &val, sizeof(val));
+	if (rc != sizeof(val) && errno != EAGAIN)
+		pb_log_fn("eventfd read failed: %s\n", strerror(errno));
+
+	list_init(&completed);
+
+	pthread_mutex_lock(&wq->lock);
+	list_for_each_entry_safe(&wq->completed, work, tmp, list) {
+		list_remove(&work->list);
+		list_add_tail(&completed, &work->list);
+	}
+	pthread_mutex_unlock(&wq->lock);
+
+	list_for_each_entry_safe(&completed, work, tmp, list) {
+		list_remove(&work->list);
+		if (work->complete)
+			work->complete(work->arg);
+		talloc_free(work);
+	}
+
+	return 0;
+}
+
+static int workqueue_destroy(void *p)
+{
+	struct workqueue *wq = p;
+	unsigned int i;
+
+	pthread_mutex_lock(&wq->lock);
+	wq->stop = true;
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+
+	/* wait for any running work to finish, as its data may be freed
+	 * along with us. Items that never ran, or haven't been completed,
+	 * are dropped without their complete callback. */
+	for (i = 0; i < wq->n_threads; i++)
+		pthread_join(wq->threads[i], NULL);
+
+	if (wq->waiter)
+		waiter_remove(wq->waiter);
+	close(wq->event_fd);
+
+	pthread_cond_destroy(&wq->cond);
+	pthread_mutex_destroy(&wq->lock);
+
+	return 0;
+}
+
+struct workqueue *workqueue_create(void *ctx, struct waitset *set,
+		unsigned int n_workers)
+{
+	sigset_t mask, orig_mask;
+	struct workqueue *wq;
+	unsigned int i;
+	int rc;
+
+	assert(n_workers > 0);
+
+	wq = talloc_zero(ctx, struct workqueue);
+	if (!wq)
+		return NULL;
+
+	wq->waitset = set;
+	list_init(&wq->pending);
+	list_init(&wq->completed);
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+
+	wq->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wq->event_fd < 0) {
+		pb_log_fn("eventfd failed: %s\n", strerror(errno));
+		pthread_cond_destroy(&wq->cond);
+		pthread_mutex_destroy(&wq->lock);
+		talloc_free(wq);
+		return NULL;
+	}
+
+	talloc_set_destructor(wq, workqueue_destroy);
+
+	wq->waiter = waiter_register_io(set, wq->event_fd, WAIT_IN,
+			workqueue_process, wq);
+	if (!wq->waiter)
+		goto err;
+
+	wq->threads = talloc_array(wq, pthread_t, n_workers);
+
+	/* signals should only be handled by the main thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &orig_mask);
+
+	for (i = 0; i < n_workers; i++) {
+		rc = pthread_create(&wq->threads[i], NULL,
+				workqueue_thread, wq);
+		if (rc) {
+			pb_log_fn("pthread_create failed: %s\n", strerror(rc));
+			break;
+		}
+		wq->n_threads++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+
+	if (!wq->n_threads)
+		goto err;
+
+	return wq;
+
+err:
+	talloc_free(wq);
+	return NULL;
+}
+
+int workqueue_queue(struct workqueue *wq, work_fn fn,
+		work_complete_fn complete, void *arg)
+{
+	struct work *work;
+
+	work = talloc(wq, struct work);
+	if (!work)
+		return -1;
+
+	work->fn = fn;
+	work->complete = complete;
+	work->arg = arg;
+
+	pthread_mutex_lock(&wq->lock);
+	list_add_tail(&wq->pending, &work->list);
+	pthread_cond_signal(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+
+	return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#include <waiter/waiter.h>
+
+/* A pool of threads for running blocking operations (like mount(), or
+ * parsing a device's config files) off the event loop.
+ *
+ * A work item's fn is run in one of the pool's threads, then its complete
+ * callback is run from the waitset, in the thread that owns it. Since
+ * neither talloc nor the rest of our state is thread-safe, fn must only
+ * touch data that is private to the work item until complete is called.
+ */
+struct workqueue;
+
+typedef void (*work_fn)(void *arg);
+typedef void (*work_complete_fn)(void *arg);
+
+struct workqueue *workqueue_create(void *ctx, struct waitset *set,
+		unsigned int n_workers);
+
+int workqueue_queue(struct workqueue *wq, work_fn fn,
+		work_complete_fn complete, void *arg);
+
+#endif /* _WORKER_H */
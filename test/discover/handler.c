@@ -0,0 +1,122 @@
+#include <talloc/talloc.h>
+#include <types/types.h>
+
+#include "device-handler.h"
+#include "platform.h"
+#include "sysinfo.h"
+
+/* The server's view of the rest of pb-discover: no devices or plugins, and
+ * default config and system info */
+
+static struct system_info test_sysinfo = {
+	.type = "test",
+};
+
+static struct config test_config;
+
+const struct system_info *system_info_get(void)
+{
+	return &test_sysinfo;
+}
+
+const struct config *config_get(void)
+{
+	return &test_config;
+}
+
+int device_handler_get_device_count(const struct device_handler *handler)
+{
+	(void)handler;
+	return 0;
+}
+
+const struct discover_device *device_handler_get_device(
+	const struct device_handler *handler, unsigned int index)
+{
+	(void)handler;
+	(void)index;
+	return NULL;
+}
+
+int device_handler_get_plugin_count(const struct device_handler *handler)
+{
+	(void)handler;
+	return 0;
+}
+
+const struct plugin_option *device_handler_get_plugin(
+	const struct device_handler *handler, unsigned int index)
+{
+	(void)handler;
+	(void)index;
+	return NULL;
+}
+
+char *device_handler_resolve_stats_dump(void *ctx,
+		struct device_handler *handler)
+{
+	(void)handler;
+	return talloc_strdup(ctx, "");
+}
+
+void device_handler_boot(struct device_handler *handler, bool change_default,
+		struct boot_command *cmd)
+{
+	(void)handler;
+	(void)change_default;
+	(void)cmd;
+}
+
+void device_handler_cancel_default(struct device_handler *handler)
+{
+	(void)handler;
+}
+
+void device_handler_reinit(struct device_handler *handler)
+{
+	(void)handler;
+}
+
+void device_handler_update_config(struct device_handler *handler,
+		struct config *config)
+{
+	(void)handler;
+	(void)config;
+}
+
+void device_handler_process_url(struct device_handler *handler,
+		const char *url, const char *mac, const char *ip)
+{
+	(void)handler;
+	(void)url;
+	(void)mac;
+	(void)ip;
+}
+
+void device_handler_install_plugin(struct device_handler *handler,
+		const char *plugin_file)
+{
+	(void)handler;
+	(void)plugin_file;
+}
+
+void device_handler_apply_temp_autoboot(struct device_handler *handler,
+		struct autoboot_option *opt)
+{
+	(void)handler;
+	(void)opt;
+}
+
+void device_handler_open_encrypted_dev(struct device_handler *handler,
+		char *password, char *device_id)
+{
+	(void)handler;
+	(void)password;
+	(void)device_id;
+}
+
+int platform_set_password(const char *hash)
+{
+	(void)hash;
+	return 0;
+}
@@ -0,0 +1,176 @@
+#include <err.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <log/log.h>
+#include <pb-protocol/pb-protocol.h>
+#include <talloc/talloc.h>
+#include <types/types.h>
+#include <waiter/waiter.h>
+
+#include "discover-server.h"
+
+/* How long our clients take to send their HELLO. This is long enough that
+ * it won't be waiting when the server accepts the connection, but well
+ * within the time that the server waits for it. */
+#define HELLO_DELAY_MS		50
+
+static struct waitset *waitset;
+
+static int test_timeout(void *arg)
+{
+	(void)arg;
+	errx(EXIT_FAILURE, "timed out waiting for the server");
+}
+
+/* Read the next message from the server, running the server until there
+ * is one */
+static struct pb_protocol_message *read_message(void *ctx, int fd)
+{
+	struct pb_protocol_message *message;
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (poll(&pfd, 1, 0) != 1)
+		waiter_poll(waitset);
+
+	message = pb_protocol_read_message(ctx, fd);
+	if (!message)
+		errx(EXIT_FAILURE, "can't read message from server");
+
+	return message;
+}
+
+static void check_action(struct pb_protocol_message *message,
+		enum pb_protocol_action action)
+{
+	if (message->action != action)
+		errx(EXIT_FAILURE, "got action 0x%x, expected 0x%x",
+				message->action, action);
+}
+
+static int client_connect(void *ctx)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		err(EXIT_FAILURE, "socket");
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, PB_SOCKET_PATH);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		err(EXIT_FAILURE, "connect");
+
+	/* every client is told whether it can make changes first */
+	check_action(read_message(ctx, fd), PB_PROTOCOL_ACTION_AUTHENTICATE);
+
+	return fd;
+}
+
+static void client_send_hello(void *ctx, int fd, uint32_t session,
+		uint64_t seq)
+{
+	struct pb_protocol_message *message;
+	struct pb_protocol_hello hello;
+	int len;
+
+	hello.capabilities = PB_PROTOCOL_CAP_SNAPSHOT |
+			PB_PROTOCOL_CAP_SEQUENCE;
+	hello.max_payload = PB_PROTOCOL_MAX_PAYLOAD_SIZE;
+	hello.session = session;
+	hello.seq = seq;
+
+	len = pb_protocol_hello_len();
+	message = pb_protocol_create_message(ctx, PB_PROTOCOL_ACTION_HELLO,
+			len);
+	pb_protocol_serialise_hello(&hello, message->payload, len);
+
+	if (pb_protocol_write_message(fd, message))
+		errx(EXIT_FAILURE, "can't send hello");
+}
+
+static void read_hello(void *ctx, int fd, struct pb_protocol_hello *hello)
+{
+	struct pb_protocol_message *message;
+
+	message = read_message(ctx, fd);
+	check_action(message, PB_PROTOCOL_ACTION_HELLO);
+
+	if (pb_protocol_deserialise_hello(hello, message))
+		errx(EXIT_FAILURE, "invalid hello from server");
+}
+
+int main(void)
+{
+	struct discover_server *server;
+	struct pb_protocol_hello hello;
+	struct status status;
+	uint32_t session;
+	uint64_t seq;
+	void *ctx;
+	int fd;
+
+	ctx = talloc_new(NULL);
+	pb_log_init(stderr);
+
+	waitset = waitset_create(ctx);
+	waiter_register_timeout(waitset, 10000, test_timeout, NULL);
+
+	server = discover_server_init(waitset);
+	if (!server)
+		errx(EXIT_FAILURE, "can't start server");
+
+	/* a client that sends its HELLO after connecting gets our state as a
+	 * snapshot */
+	fd = client_connect(ctx);
+	usleep(HELLO_DELAY_MS * 1000);
+	client_send_hello(ctx, fd, 0, 0);
+
+	read_hello(ctx, fd, &hello);
+	check_action(read_message(ctx, fd), PB_PROTOCOL_ACTION_SNAPSHOT);
+
+	session = hello.session;
+	seq = hello.seq;
+	close(fd);
+
+	/* once it reconnects, it resumes from where it left off */
+	memset(&status, 0, sizeof(status));
+	status.type = STATUS_INFO;
+	status.message = "missed";
+	discover_server_notify_boot_status(server, &status);
+
+	fd = client_connect(ctx);
+	usleep(HELLO_DELAY_MS * 1000);
+	client_send_hello(ctx, fd, session, seq);
+
+	read_hello(ctx, fd, &hello);
+	if (hello.session != session || hello.seq != seq)
+		errx(EXIT_FAILURE, "client wasn't resumed");
+
+	check_action(read_message(ctx, fd), PB_PROTOCOL_ACTION_STATUS);
+	check_action(read_message(ctx, fd), PB_PROTOCOL_ACTION_SEQUENCE);
+	close(fd);
+
+	/* older clients send nothing, and get our state as individual
+	 * messages */
+	fd = client_connect(ctx);
+	check_action(read_message(ctx, fd), PB_PROTOCOL_ACTION_SYSTEM_INFO);
+	check_action(read_message(ctx, fd), PB_PROTOCOL_ACTION_CONFIG);
+	close(fd);
+
+	talloc_free(server);
+	talloc_free(ctx);
+	unlink(PB_SOCKET_PATH);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,612 @@
+/*
+ * Measure the cost of serialising and deserialising pb-protocol messages,
+ * and of sending them over a socket. Devices, boot options, configs and
+ * sysinfo are generated at random (from a fixed seed) in two profiles:
+ * "realistic", sized like a typical system, and "extreme", with long
+ * strings and many entries, so that some messages are sent chunked.
+ *
+ * Each case prints one line of key=value results:
+ *   bytes:	mean payload size
+ *   ser_ns, de_ns: mean time to serialise / deserialise one message
+ *   enc_ns:	mean time to build one message with a reused encoder
+ *   ser_mbps, enc_mbps, de_mbps: payload throughput, in MB/s
+ *   de_allocs:	talloc blocks created per deserialised message
+ *   rt_us, rt_mbps: per-message time and throughput for writing messages
+ *		to a socketpair, and reading and deserialising them in a
+ *		child process
+ *
+ * Usage: bench-pb-protocol [iterations] [seed]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <pb-protocol/pb-protocol.h>
+#include <talloc/talloc.h>
+
+/* objects generated for each case; iterations cycle through these */
+#define BENCH_POOL_SIZE	32
+
+enum bench_profile {
+	PROFILE_REALISTIC,
+	PROFILE_EXTREME,
+};
+
+static const char *profile_names[] = {
+	[PROFILE_REALISTIC] = "realistic",
+	[PROFILE_EXTREME] = "extreme",
+};
+
+struct bench_kind {
+	const char	*name;
+	enum pb_protocol_action action;
+	void		*(*create)(void *ctx, enum bench_profile profile);
+	int		(*len)(const void *obj);
+	int		(*serialise)(const void *obj, char *buf, int len);
+	void		(*encode)(struct pb_protocol_encoder *enc,
+				const void *obj);
+	void		*(*deserialise)(void *ctx,
+				const struct pb_protocol_message *message);
+};
+
+static unsigned int rng_state;
+
+static unsigned int rng(void)
+{
+	/* xorshift32 */
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static unsigned int rng_range(unsigned int min, unsigned int max)
+{
+	return min + rng() % (max - min + 1);
+}
+
+static char *rand_str(void *ctx, unsigned int min, unsigned int max)
+{
+	static const char chars[] =
+		"abcdefghijklmnopqrstuvwxyz0123456789-_=/. ";
+	unsigned int i, len;
+	char *str;
+
+	len = rng_range(min, max);
+	str = talloc_array(ctx, char, len + 1);
+	for (i = 0; i < len; i++)
+		str[i] = chars[rng() % (sizeof(chars) - 1)];
+	str[len] = '\0';
+
+	return str;
+}
+
+/* a string of a typical length in the realistic profile, or a long one */
+static char *profile_str(void *ctx, enum bench_profile profile,
+		unsigned int max)
+{
+	if (profile == PROFILE_EXTREME)
+		return rand_str(ctx, 1024, 8192);
+	return rand_str(ctx, 4, max);
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *device_create(void *ctx, enum bench_profile profile)
+{
+	struct device *dev;
+
+	dev = talloc_zero(ctx, struct device);
+	dev->id = profile_str(dev, profile, 16);
+	dev->type = rng() % DEVICE_TYPE_UNKNOWN;
+	dev->name = profile_str(dev, profile, 32);
+	dev->description = profile_str(dev, profile, 64);
+	dev->icon_file = profile_str(dev, profile, 48);
+	list_init(&dev->boot_options);
+
+	return dev;
+}
+
+static int device_len(const void *obj)
+{
+	return pb_protocol_device_len(obj);
+}
+
+static int device_serialise(const void *obj, char *buf, int len)
+{
+	return pb_protocol_serialise_device(obj, buf, len);
+}
+
+static void device_encode(struct pb_protocol_encoder *enc, const void *obj)
+{
+	pb_protocol_encode_device(enc, obj);
+}
+
+static void *device_deserialise(void *ctx,
+		const struct pb_protocol_message *message)
+{
+	struct device *dev = talloc_zero(ctx, struct device);
+	int rc;
+
+	rc = pb_protocol_deserialise_device(dev, message);
+	assert(!rc);
+	return dev;
+}
+
+static void *boot_option_create(void *ctx, enum bench_profile profile)
+{
+	struct boot_option *opt;
+
+	opt = talloc_zero(ctx, struct boot_option);
+	opt->device_id = profile_str(opt, profile, 16);
+	opt->id = profile_str(opt, profile, 48);
+	opt->name = profile_str(opt, profile, 48);
+	opt->description = profile_str(opt, profile, 128);
+	opt->icon_file = profile_str(opt, profile, 48);
+	opt->boot_image_file = profile_str(opt, profile, 64);
+	opt->initrd_file = profile_str(opt, profile, 64);
+	opt->dtb_file = rng() % 2 ? profile_str(opt, profile, 64) : NULL;
+	opt->args_sig_file = NULL;
+	opt->is_default = rng() % 2;
+
+	/* kernel command lines are the bulk of a boot option */
+	if (profile == PROFILE_EXTREME)
+		opt->boot_args = rand_str(opt, 8192, 32768);
+	else
+		opt->boot_args = rand_str(opt, 64, 512);
+
+	return opt;
+}
+
+static int boot_option_len(const void *obj)
+{
+	return pb_protocol_boot_option_len(obj);
+}
+
+static int boot_option_serialise(const void *obj, char *buf, int len)
+{
+	return pb_protocol_serialise_boot_option(obj, buf, len);
+}
+
+static void boot_option_encode(struct pb_protocol_encoder *enc, const void *obj)
+{
+	pb_protocol_encode_boot_option(enc, obj);
+}
+
+static void *boot_option_deserialise(void *ctx,
+		const struct pb_protocol_message *message)
+{
+	struct boot_option *opt = talloc_zero(ctx, struct boot_option);
+	int rc;
+
+	rc = pb_protocol_deserialise_boot_option(opt, message);
+	assert(!rc);
+	return opt;
+}
+
+static void *config_create(void *ctx, enum bench_profile profile)
+{
+	struct network_config *net;
+	struct config *config;
+	unsigned int i, n;
+
+	config = talloc_zero(ctx, struct config);
+	config->autoboot_enabled = true;
+	config->autoboot_timeout_sec = 10;
+	net = &config->network;
+
+	n = profile == PROFILE_EXTREME ? 512 : rng_range(1, 4);
+	net->n_interfaces = n;
+	net->interfaces = talloc_array(config, struct interface_config *, n);
+	for (i = 0; i < n; i++) {
+		struct interface_config *iface;
+
+		iface = talloc_zero(net->interfaces, struct interface_config);
+		iface->hwaddr[5] = i;
+		iface->method = rng() % 2 ? CONFIG_METHOD_STATIC :
+						CONFIG_METHOD_DHCP;
+		if (iface->method == CONFIG_METHOD_STATIC) {
+			iface->static_config.address =
+				rand_str(iface, 9, 18);
+			iface->static_config.gateway =
+				rand_str(iface, 7, 15);
+			iface->static_config.url =
+				profile_str(iface, profile, 64);
+		}
+		net->interfaces[i] = iface;
+	}
+
+	n = profile == PROFILE_EXTREME ? 64 : rng_range(1, 3);
+	net->n_dns_servers = n;
+	net->dns_servers = talloc_array(config, const char *, n);
+	for (i = 0; i < n; i++)
+		net->dns_servers[i] = rand_str(net->dns_servers, 7, 15);
+
+	n = profile == PROFILE_EXTREME ? 64 : rng_range(1, 4);
+	config->n_autoboot_opts = n;
+	config->autoboot_opts = talloc_zero_array(config,
+			struct autoboot_option, n);
+	for (i = 0; i < n; i++) {
+		if (rng() % 2) {
+			config->autoboot_opts[i].boot_type = BOOT_DEVICE_UUID;
+			config->autoboot_opts[i].uuid =
+				rand_str(config, 36, 36);
+		} else {
+			config->autoboot_opts[i].boot_type = BOOT_DEVICE_TYPE;
+			config->autoboot_opts[i].type = DEVICE_TYPE_DISK;
+		}
+	}
+
+	config->http_proxy = profile_str(config, profile, 32);
+	config->https_proxy = profile_str(config, profile, 32);
+
+	n = profile == PROFILE_EXTREME ? 64 : rng_range(1, 4);
+	config->n_consoles = n;
+	config->consoles = talloc_array(config, char *, n);
+	for (i = 0; i < n; i++)
+		config->consoles[i] = rand_str(config->consoles, 8, 24);
+
+	config->boot_console = rand_str(config, 8, 24);
+	config->lang = rand_str(config, 5, 5);
+
+	return config;
+}
+
+static int config_len(const void *obj)
+{
+	return pb_protocol_config_len(obj);
+}
+
+static int config_serialise(const void *obj, char *buf, int len)
+{
+	return pb_protocol_serialise_config(obj, buf, len);
+}
+
+static void config_encode(struct pb_protocol_encoder *enc, const void *obj)
+{
+	pb_protocol_encode_config(enc, obj);
+}
+
+static void *config_deserialise(void *ctx,
+		const struct pb_protocol_message *message)
+{
+	struct config *config = talloc_zero(ctx, struct config);
+	int rc;
+
+	rc = pb_protocol_deserialise_config(config, message);
+	assert(!rc);
+	return config;
+}
+
+static char **rand_str_array(void *ctx, unsigned int n,
+		enum bench_profile profile, unsigned int max)
+{
+	unsigned int i;
+	char **strs;
+
+	strs = talloc_array(ctx, char *, n);
+	for (i = 0; i < n; i++)
+		strs[i] = profile_str(strs, profile, max);
+
+	return strs;
+}
+
+static void *system_info_create(void *ctx, enum bench_profile profile)
+{
+	struct system_info *sysinfo;
+	bool extreme = profile == PROFILE_EXTREME;
+	unsigned int i, n;
+
+	sysinfo = talloc_zero(ctx, struct system_info);
+	sysinfo->type = profile_str(sysinfo, profile, 16);
+	sysinfo->identifier = profile_str(sysinfo, profile, 16);
+
+	sysinfo->n_primary = extreme ? 16 : 2;
+	sysinfo->platform_primary = rand_str_array(sysinfo,
+			sysinfo->n_primary, profile, 64);
+	sysinfo->n_other = extreme ? 16 : 2;
+	sysinfo->platform_other = rand_str_array(sysinfo,
+			sysinfo->n_other, profile, 64);
+	sysinfo->n_bmc_current = extreme ? 16 : 4;
+	sysinfo->bmc_current = rand_str_array(sysinfo,
+			sysinfo->n_bmc_current, profile, 32);
+	sysinfo->n_bmc_golden = extreme ? 16 : 4;
+	sysinfo->bmc_golden = rand_str_array(sysinfo,
+			sysinfo->n_bmc_golden, profile, 32);
+
+	n = extreme ? 256 : rng_range(1, 8);
+	sysinfo->n_interfaces = n;
+	sysinfo->interfaces = talloc_array(sysinfo, struct interface_info *,
+			n);
+	for (i = 0; i < n; i++) {
+		struct interface_info *if_info;
+
+		if_info = talloc_zero(sysinfo->interfaces,
+				struct interface_info);
+		if_info->hwaddr_size = HWADDR_SIZE;
+		if_info->hwaddr = talloc_zero_array(if_info, uint8_t,
+				HWADDR_SIZE);
+		if_info->hwaddr[5] = i;
+		if_info->name = rand_str(if_info, 3, 15);
+		if_info->link = rng() % 2;
+		if_info->address = rand_str(if_info, 7, 15);
+		if_info->address_v6 = rand_str(if_info, 16, 39);
+		sysinfo->interfaces[i] = if_info;
+	}
+
+	n = extreme ? 1024 : rng_range(1, 16);
+	sysinfo->n_blockdevs = n;
+	sysinfo->blockdevs = talloc_array(sysinfo, struct blockdev_info *, n);
+	for (i = 0; i < n; i++) {
+		struct blockdev_info *bd_info;
+
+		bd_info = talloc_zero(sysinfo->blockdevs,
+				struct blockdev_info);
+		bd_info->name = rand_str(bd_info, 3, 10);
+		bd_info->uuid = rand_str(bd_info, 36, 36);
+		bd_info->mountpoint = rand_str(bd_info, 16, 64);
+		sysinfo->blockdevs[i] = bd_info;
+	}
+
+	return sysinfo;
+}
+
+static int system_info_len(const void *obj)
+{
+	return pb_protocol_system_info_len(obj);
+}
+
+static int system_info_serialise(const void *obj, char *buf, int len)
+{
+	return pb_protocol_serialise_system_info(obj, buf, len);
+}
+
+static void system_info_encode(struct pb_protocol_encoder *enc, const void *obj)
+{
+	pb_protocol_encode_system_info(enc, obj);
+}
+
+static void *system_info_deserialise(void *ctx,
+		const struct pb_protocol_message *message)
+{
+	struct system_info *sysinfo = talloc_zero(ctx, struct system_info);
+	int rc;
+
+	rc = pb_protocol_deserialise_system_info(sysinfo, message);
+	assert(!rc);
+	return sysinfo;
+}
+
+static const struct bench_kind kinds[] = {
+	{
+		.name = "device",
+		.action = PB_PROTOCOL_ACTION_DEVICE_ADD,
+		.create = device_create,
+		.len = device_len,
+		.serialise = device_serialise,
+		.encode = device_encode,
+		.deserialise = device_deserialise,
+	},
+	{
+		.name = "boot_option",
+		.action = PB_PROTOCOL_ACTION_BOOT_OPTION_ADD,
+		.create = boot_option_create,
+		.len = boot_option_len,
+		.serialise = boot_option_serialise,
+		.encode = boot_option_encode,
+		.deserialise = boot_option_deserialise,
+	},
+	{
+		.name = "config",
+		.action = PB_PROTOCOL_ACTION_CONFIG,
+		.create = config_create,
+		.len = config_len,
+		.serialise = config_serialise,
+		.encode = config_encode,
+		.deserialise = config_deserialise,
+	},
+	{
+		.name = "sysinfo",
+		.action = PB_PROTOCOL_ACTION_SYSTEM_INFO,
+		.create = system_info_create,
+		.len = system_info_len,
+		.serialise = system_info_serialise,
+		.encode = system_info_encode,
+		.deserialise = system_info_deserialise,
+	},
+};
+
+static struct pb_protocol_message *bench_serialise(void *ctx,
+		const struct bench_kind *kind, const void *obj)
+{
+	struct pb_protocol_message *message;
+	int len, rc;
+
+	len = kind->len(obj);
+	message = pb_protocol_create_message(ctx, kind->action, len);
+	assert(message);
+	rc = kind->serialise(obj, message->payload, len);
+	assert(!rc);
+
+	return message;
+}
+
+/* Read and deserialise n messages from fd, then acknowledge with a single
+ * byte */
+static void bench_child(const struct bench_kind *kind, int fd, int n)
+{
+	struct pb_protocol_message *message;
+	struct pb_protocol_reader *reader;
+	void *ctx;
+	char c = 0;
+	int rc;
+
+	ctx = talloc_new(NULL);
+	reader = pb_protocol_reader_create(ctx, fd);
+	pb_protocol_reader_set_chunked_max(reader,
+			PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE);
+
+	while (n) {
+		rc = pb_protocol_reader_fill(reader);
+		assert(!rc);
+
+		while (n && !(rc = pb_protocol_reader_next(reader,
+						&message))) {
+			talloc_free(kind->deserialise(ctx, message));
+			n--;
+		}
+		assert(rc >= 0);
+	}
+
+	rc = write(fd, &c, 1);
+	assert(rc == 1);
+	talloc_free(ctx);
+	exit(EXIT_SUCCESS);
+}
+
+static double bench_roundtrip(const struct bench_kind *kind, void **objs,
+		int iterations)
+{
+	int fds[2], status, i, rc;
+	double start;
+	pid_t pid;
+	char c;
+
+	rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(!rc);
+
+	/* don't let the child repeat our earlier output */
+	fflush(stdout);
+
+	pid = fork();
+	assert(pid >= 0);
+	if (!pid) {
+		close(fds[0]);
+		bench_child(kind, fds[1], iterations);
+	}
+	close(fds[1]);
+
+	start = bench_now();
+
+	for (i = 0; i < iterations; i++) {
+		rc = pb_protocol_write_message(fds[0], bench_serialise(NULL,
+					kind, objs[i % BENCH_POOL_SIZE]));
+		assert(!rc);
+	}
+
+	rc = read(fds[0], &c, 1);
+	assert(rc == 1);
+
+	start = bench_now() - start;
+
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	assert(WIFEXITED(status) && !WEXITSTATUS(status));
+
+	return start;
+}
+
+static void bench_case(const struct bench_kind *kind,
+		enum bench_profile profile, int iterations)
+{
+	struct pb_protocol_message *messages[BENCH_POOL_SIZE], *message = NULL;
+	double t_ser, t_enc, t_de, t_rt, start, bytes;
+	void *objs[BENCH_POOL_SIZE], *obj;
+	struct pb_protocol_encoder *enc;
+	unsigned long allocs;
+	void *ctx;
+	int i;
+
+	ctx = talloc_new(NULL);
+
+	for (i = 0; i < BENCH_POOL_SIZE; i++)
+		objs[i] = kind->create(ctx, profile);
+
+	bytes = 0;
+	for (i = 0; i < iterations; i++)
+		bytes += kind->len(objs[i % BENCH_POOL_SIZE]);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++)
+		talloc_free(bench_serialise(ctx, kind,
+					objs[i % BENCH_POOL_SIZE]));
+	t_ser = bench_now() - start;
+
+	enc = pb_protocol_encoder_create(ctx);
+	assert(enc);
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		pb_protocol_encoder_start(enc, kind->action);
+		kind->encode(enc, objs[i % BENCH_POOL_SIZE]);
+		message = pb_protocol_encoder_message(enc);
+		assert(message);
+	}
+	t_enc = bench_now() - start;
+
+	for (i = 0; i < BENCH_POOL_SIZE; i++)
+		messages[i] = bench_serialise(ctx, kind, objs[i]);
+
+	/* the encoder must build the same payload as the serialiser */
+	i = (iterations - 1) % BENCH_POOL_SIZE;
+	assert(message->payload_len == messages[i]->payload_len);
+	assert(!memcmp(message->payload, messages[i]->payload,
+				message->payload_len));
+
+	allocs = 0;
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		obj = kind->deserialise(ctx, messages[i % BENCH_POOL_SIZE]);
+		allocs += talloc_total_blocks(obj);
+		talloc_free(obj);
+	}
+	t_de = bench_now() - start;
+
+	t_rt = bench_roundtrip(kind, objs, iterations);
+
+	printf("kind=%s profile=%s iterations=%d bytes=%.0f "
+			"ser_ns=%.0f ser_mbps=%.1f enc_ns=%.0f enc_mbps=%.1f "
+			"de_ns=%.0f de_mbps=%.1f "
+			"de_allocs=%.1f rt_us=%.2f rt_mbps=%.1f\n",
+			kind->name, profile_names[profile], iterations,
+			bytes / iterations,
+			t_ser * 1e9 / iterations, bytes / t_ser / 1e6,
+			t_enc * 1e9 / iterations, bytes / t_enc / 1e6,
+			t_de * 1e9 / iterations, bytes / t_de / 1e6,
+			(double)allocs / iterations,
+			t_rt * 1e6 / iterations, bytes / t_rt / 1e6);
+
+	talloc_free(ctx);
+}
+
+int main(int argc, char **argv)
+{
+	int iterations;
+	unsigned int i;
+
+	iterations = argc > 1 ? atoi(argv[1]) : 20000;
+	rng_state = argc > 2 ? strtoul(argv[2], NULL, 0) : 0x5eed;
+	if (!rng_state)
+		rng_state = 1;
+
+	for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+		bench_case(&kinds[i], PROFILE_REALISTIC, iterations);
+
+		/* extreme messages are ~100x larger */
+		bench_case(&kinds[i], PROFILE_EXTREME,
+				iterations / 100 ?: 1);
+	}
+
+	return EXIT_SUCCESS;
+}
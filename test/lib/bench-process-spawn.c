@@ -0,0 +1,92 @@
+/*
+ * Compare the cost of starting helper processes with fork() and exec(),
+ * against posix_spawn(). The parent's heap is inflated first, as the cost
+ * of fork() scales with the size of the parent's address space.
+ *
+ * Usage: bench-process-spawn [heap-size-mb] [iterations]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include <process/process.h>
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_run(const char **child_argv, int iterations, bool spawn)
+{
+	struct process *process;
+	double start;
+	int i, rc;
+
+	process_set_spawn(spawn);
+
+	start = bench_now();
+
+	for (i = 0; i < iterations; i++) {
+		process = process_create(NULL);
+		process->path = child_argv[0];
+		process->argv = child_argv;
+		process->keep_stdout = true;
+
+		rc = process_run_sync(process);
+		assert(!rc);
+		assert(process_exit_ok(process));
+
+		process_release(process);
+	}
+
+	return (bench_now() - start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+	double t_fork, t_spawn;
+	const char *child_argv[3];
+	struct waitset *waitset;
+	int heap_mb, iterations;
+	char *heap;
+	void *ctx;
+
+	if (argc == 2 && !strcmp(argv[1], "child"))
+		return EXIT_SUCCESS;
+
+	heap_mb = argc > 1 ? atoi(argv[1]) : 256;
+	iterations = argc > 2 ? atoi(argv[2]) : 200;
+
+	/* touch every page, so that they're all mapped */
+	heap = malloc((size_t)heap_mb << 20);
+	assert(heap);
+	memset(heap, 0x5a, (size_t)heap_mb << 20);
+
+	ctx = talloc_new(NULL);
+	waitset = waitset_create(ctx);
+	process_init(ctx, waitset, false);
+
+	child_argv[0] = argv[0];
+	child_argv[1] = "child";
+	child_argv[2] = NULL;
+
+	t_fork = bench_run(child_argv, iterations, false);
+	t_spawn = bench_run(child_argv, iterations, true);
+
+	printf("heap_mb=%d iterations=%d fork_us=%.1f spawn_us=%.1f "
+			"speedup=%.2f\n", heap_mb, iterations,
+			t_fork * 1e6, t_spawn * 1e6, t_fork / t_spawn);
+
+	talloc_free(ctx);
+	free(heap);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <pb-protocol/pb-protocol.h>
+#include <talloc/talloc.h>
+
+static void write_message(int fd, void *ctx, unsigned int action,
+		unsigned int len, char fill)
+{
+	struct pb_protocol_message *message;
+	int rc;
+
+	message = pb_protocol_create_message(ctx, action, len);
+	assert(message);
+	memset(message->payload, fill, len);
+
+	rc = pb_protocol_write_message(fd, message);
+	assert(!rc);
+}
+
+static void check_message(struct pb_protocol_message *message,
+		unsigned int action, unsigned int len, char fill)
+{
+	unsigned int i;
+
+	assert(message->action == action);
+	assert(message->payload_len == len);
+	for (i = 0; i < len; i++)
+		assert(message->payload[i] == fill);
+}
+
+/* Write the first frame of a chunked message to a new reader, and check
+ * that it's refused */
+static void check_chunked_rejected(void *ctx, const char *chunked,
+		unsigned int chunked_max)
+{
+	struct pb_protocol_message *message;
+	struct pb_protocol_reader *reader;
+	int pipefds[2], rc;
+	unsigned int pos;
+
+	rc = pipe(pipefds);
+	assert(!rc);
+
+	reader = pb_protocol_reader_create(ctx, pipefds[0]);
+	assert(reader);
+	if (chunked_max)
+		pb_protocol_reader_set_chunked_max(reader, chunked_max);
+
+	/* the frame is larger than the pipe will hold */
+	for (pos = 0;; pos += 32768) {
+		rc = write(pipefds[1], chunked + pos, 32768);
+		assert(rc == 32768);
+
+		rc = pb_protocol_reader_fill(reader);
+		assert(!rc);
+		rc = pb_protocol_reader_next(reader, &message);
+		if (rc != 1)
+			break;
+	}
+	assert(rc == -1);
+
+	talloc_free(reader);
+	close(pipefds[0]);
+	close(pipefds[1]);
+}
+
+int main(void)
+{
+	struct pb_protocol_message *message;
+	struct pb_protocol_reader *reader;
+	unsigned int len, pos, n;
+	int pipefds[2], rc;
+	char buf[5], *chunked;
+	void *ctx;
+
+	ctx = talloc_new(NULL);
+
+	rc = pipe(pipefds);
+	assert(!rc);
+
+	reader = pb_protocol_reader_create(ctx, pipefds[0]);
+	assert(reader);
+
+	/* nothing buffered yet */
+	rc = pb_protocol_reader_next(reader, &message);
+	assert(rc == 1);
+
+	/* several messages from one read, with odd payload lengths so that
+	 * some aren't aligned in the reader's buffer */
+	write_message(pipefds[1], ctx, 1, 0, 0);
+	write_message(pipefds[1], ctx, 2, 3, 'a');
+	write_message(pipefds[1], ctx, 3, 17, 'b');
+	write_message(pipefds[1], ctx, 4, 4, 'c');
+
+	rc = pb_protocol_reader_fill(reader);
+	assert(!rc);
+
+	rc = pb_protocol_reader_next(reader, &message);
+	assert(!rc);
+	check_message(message, 1, 0, 0);
+
+	rc = pb_protocol_reader_next(reader, &message);
+	assert(!rc);
+	check_message(message, 2, 3, 'a');
+
+	rc = pb_protocol_reader_next(reader, &message);
+	assert(!rc);
+	check_message(message, 3, 17, 'b');
+
+	rc = pb_protocol_reader_next(reader, &message);
+	assert(!rc);
+	check_message(message, 4, 4, 'c');
+
+	rc = pb_protocol_reader_next(reader, &message);
+	assert(rc == 1);
+
+	/* a large message, which may need more than one read */
+	write_message(pipefds[1], ctx, 5, 9, 'd');
+	write_message(pipefds[1], ctx, 6, PB_PROTOCOL_MAX_PAYLOAD_SIZE - 64,
+			'e');
+
+	rc = pb_protocol_reader_fill(reader);
+	assert(!rc);
+
+	rc = pb_protocol_reader_next(reader, &message);
+	assert(!rc);
+	check_message(message, 5, 9, 'd');
+
+	while ((rc = pb_protocol_reader_next(reader, &message)) == 1) {
+		rc = pb_protocol_reader_fill(reader);
+		assert(!rc);
+	}
+	assert(!rc);
+	check_message(message, 6, PB_PROTOCOL_MAX_PAYLOAD_SIZE - 64, 'e');
+
+	/* a message too large for a single frame, sent as CHUNK frames */
+	message = pb_protocol_create_message(ctx, 7,
+			3 * PB_PROTOCOL_MAX_PAYLOAD_SIZE + 5);
+	assert(message);
+	memset(message->payload, 'f', message->payload_len);
+
+	chunked = pb_protocol_encode_message(ctx, message, &len);
+	assert(chunked);
+	assert(len > 3 * PB_PROTOCOL_MAX_PAYLOAD_SIZE + 5);
+
+	/* which aren't accepted until chunking has been negotiated, or if
+	 * they'd be larger than we'll take */
+	check_chunked_rejected(ctx, chunked, 0);
+	check_chunked_rejected(ctx, chunked, PB_PROTOCOL_MAX_PAYLOAD_SIZE);
+
+	pb_protocol_reader_set_chunked_max(reader,
+			PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE);
+
+	for (pos = 0;;) {
+		rc = pb_protocol_reader_next(reader, &message);
+		if (rc != 1)
+			break;
+
+		/* no more than the pipe will hold */
+		n = len - pos < 32768 ? len - pos : 32768;
+		if (n) {
+			rc = write(pipefds[1], chunked + pos, n);
+			assert(rc == (int)n);
+			pos += n;
+		}
+
+		rc = pb_protocol_reader_fill(reader);
+		assert(!rc);
+	}
+	assert(!rc);
+	assert(pos == len);
+	check_message(message, 7, 3 * PB_PROTOCOL_MAX_PAYLOAD_SIZE + 5, 'f');
+
+	rc = pb_protocol_reader_next(reader, &message);
+	assert(rc == 1);
+
+	/* a header with an invalid length */
+	memset(buf, 0xff, sizeof(buf));
+	rc = write(pipefds[1], buf, sizeof(buf));
+	assert(rc == sizeof(buf));
+	rc = write(pipefds[1], buf, sizeof(buf));
+	assert(rc == sizeof(buf));
+
+	rc = pb_protocol_reader_fill(reader);
+	assert(!rc);
+	rc = pb_protocol_reader_next(reader, &message);
+	assert(rc == -1);
+
+	/* EOF */
+	close(pipefds[1]);
+	rc = pb_protocol_reader_fill(reader);
+	assert(rc == -1);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <pb-protocol/pb-protocol.h>
+#include <talloc/talloc.h>
+
+#define N_RECORDS	100
+#define RECORD_LEN	1000
+
+int main(void)
+{
+	struct pb_protocol_message *snapshot, *state, *record = NULL;
+	struct pb_protocol_state_header *hdr;
+	unsigned int i, offset, map_len;
+	char *buf;
+	void *ctx;
+	int rc;
+
+	ctx = talloc_new(NULL);
+
+	/* a snapshot larger than a single message, grown as records are
+	 * appended */
+	snapshot = pb_protocol_create_snapshot(ctx);
+	assert(snapshot);
+
+	for (i = 0; i < N_RECORDS; i++) {
+		buf = pb_protocol_snapshot_append(&snapshot, i, RECORD_LEN);
+		assert(buf);
+		memset(buf, i, RECORD_LEN);
+	}
+
+	assert(pb_protocol_snapshot_n_records(snapshot) == N_RECORDS);
+	assert(snapshot->payload_len > PB_PROTOCOL_MAX_PAYLOAD_SIZE);
+
+	/* publish it as an export segment would */
+	map_len = sizeof(*hdr) + snapshot->payload_len;
+	hdr = talloc_zero_size(ctx, map_len);
+	hdr->magic = PB_PROTOCOL_STATE_MAGIC;
+	hdr->version = PB_PROTOCOL_STATE_VERSION;
+	hdr->seq = 2;
+	hdr->size = map_len;
+	hdr->payload_len = snapshot->payload_len;
+	memcpy(hdr + 1, snapshot->payload, snapshot->payload_len);
+
+	state = NULL;
+	rc = pb_protocol_read_state(ctx, hdr, map_len, &state);
+	assert(!rc);
+	assert(state->action == PB_PROTOCOL_ACTION_SNAPSHOT);
+	assert(pb_protocol_snapshot_n_records(state) == N_RECORDS);
+
+	offset = 0;
+	for (i = 0; i < N_RECORDS; i++) {
+		rc = pb_protocol_snapshot_next_record(ctx, state, &offset,
+				&record);
+		assert(!rc);
+		assert(record->action == i);
+		assert(record->payload_len == RECORD_LEN);
+		assert(record->payload[RECORD_LEN - 1] == (char)i);
+	}
+
+	rc = pb_protocol_snapshot_next_record(ctx, state, &offset, &record);
+	assert(rc == 1);
+
+	/* a payload that doesn't fit the mapping */
+	rc = pb_protocol_read_state(ctx, hdr, map_len - 1, &state);
+	assert(rc == -1);
+
+	/* mid-update */
+	hdr->seq = 3;
+	rc = pb_protocol_read_state(ctx, hdr, map_len, &state);
+	assert(rc == -1);
+
+	/* replaced by a new segment */
+	hdr->seq = 4;
+	hdr->stale = 1;
+	rc = pb_protocol_read_state(ctx, hdr, map_len, &state);
+	assert(rc == 1);
+
+	/* not an export segment */
+	hdr->magic = 0;
+	rc = pb_protocol_read_state(ctx, hdr, map_len, &state);
+	assert(rc == -1);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <process/process.h>
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+#define N_CHILDREN 32
+
+static int n_exited;
+
+static void exit_cb(struct process *process)
+{
+	assert(WIFEXITED(process->exit_status));
+	assert(WEXITSTATUS(process->exit_status) == 42);
+	assert(process->stdout_len == strlen("forty two\n"));
+	n_exited++;
+}
+
+int main(int argc, char **argv)
+{
+	struct process *processes[N_CHILDREN];
+	const char *child_argv[3];
+	struct waitset *waitset;
+	void *ctx;
+	int i, rc;
+
+	if (argc == 2 && !strcmp(argv[1], "child")) {
+		printf("forty two\n");
+		return 42;
+	}
+
+	ctx = talloc_new(NULL);
+
+	waitset = waitset_create(ctx);
+
+	process_init(ctx, waitset, false);
+
+	child_argv[0] = argv[0];
+	child_argv[1] = "child";
+	child_argv[2] = NULL;
+
+	/* start all of the children before polling, so that their exits
+	 * are likely to be coalesced */
+	for (i = 0; i < N_CHILDREN; i++) {
+		processes[i] = process_create(ctx);
+		processes[i]->path = child_argv[0];
+		processes[i]->argv = child_argv;
+		processes[i]->keep_stdout = true;
+		processes[i]->exit_cb = exit_cb;
+
+		rc = process_run_async(processes[i]);
+		assert(!rc);
+	}
+
+	while (n_exited < N_CHILDREN)
+		waiter_poll(waitset);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
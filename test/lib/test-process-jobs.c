@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <process/process.h>
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+static int n_exited;
+
+static void exit_cb(struct process *process)
+{
+	if (process->cancelled) {
+		assert(!process->pid);
+		assert(!process_exit_ok(process));
+	} else {
+		assert(process_exit_ok(process));
+	}
+	n_exited++;
+}
+
+static struct process *create_job(void *ctx, const char **argv)
+{
+	struct process *process;
+
+	process = process_create(ctx);
+	process->path = argv[0];
+	process->argv = argv;
+	process->exit_cb = exit_cb;
+
+	return process;
+}
+
+int main(int argc, char **argv)
+{
+	struct process *load1, *load2, *plugin1, *plugin2, *boot;
+	const char *child_argv[3];
+	struct waitset *waitset;
+	char *stats;
+	void *ctx;
+	int rc;
+
+	if (argc == 2 && !strcmp(argv[1], "child"))
+		return EXIT_SUCCESS;
+
+	ctx = talloc_new(NULL);
+
+	waitset = waitset_create(ctx);
+
+	process_init(ctx, waitset, false);
+
+	process_job_set_max(2);
+	process_job_set_limit(PROCESS_JOB_BOOT, 0, 0);
+	process_job_set_limit(PROCESS_JOB_LOAD, 1, 0);
+	process_job_set_limit(PROCESS_JOB_PLUGIN, 1, 0);
+
+	child_argv[0] = argv[0];
+	child_argv[1] = "child";
+	child_argv[2] = NULL;
+
+	load1 = create_job(ctx, child_argv);
+	load2 = create_job(ctx, child_argv);
+	plugin1 = create_job(ctx, child_argv);
+	plugin2 = create_job(ctx, child_argv);
+	boot = create_job(ctx, child_argv);
+
+	/* the first load fills its class, the first plugin fills the
+	 * procset, and the rest have to wait */
+	rc = process_run_async_job(load1, PROCESS_JOB_LOAD);
+	assert(!rc);
+	rc = process_run_async_job(load2, PROCESS_JOB_LOAD);
+	assert(!rc);
+	rc = process_run_async_job(plugin1, PROCESS_JOB_PLUGIN);
+	assert(!rc);
+	rc = process_run_async_job(plugin2, PROCESS_JOB_PLUGIN);
+	assert(!rc);
+	rc = process_run_async_job(boot, PROCESS_JOB_BOOT);
+	assert(!rc);
+
+	assert(load1->pid);
+	assert(!load2->pid);
+	assert(plugin1->pid);
+	assert(!plugin2->pid);
+	assert(!boot->pid);
+
+	process_stop_async(plugin2);
+
+	/* the boot job is submitted last, but gets the first free slot */
+	while (!boot->pid)
+		waiter_poll(waitset);
+
+	assert(!load2->pid || n_exited >= 2);
+
+	while (n_exited < 5)
+		waiter_poll(waitset);
+
+	assert(load2->pid);
+	assert(!plugin2->pid);
+
+	stats = process_job_stats_dump(ctx);
+	assert(strstr(stats, "\nload "));
+	assert(strstr(stats, "\nboot "));
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
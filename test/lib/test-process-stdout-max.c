@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <process/process.h>
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+#define N_LINES		20000
+#define STDOUT_MAX	1024
+
+static int do_child(void)
+{
+	int i;
+
+	/* progress-meter style updates, then a final line */
+	for (i = 0; i < N_LINES; i++)
+		printf("\rprogress %d", i);
+	printf("\ndone\n");
+	return 0;
+}
+
+struct test {
+	bool	exited;
+	int	n_lines;
+	int	last_progress;
+	char	*stdout_buf;
+	int	stdout_len;
+};
+
+static int stdout_cb(void *arg)
+{
+	struct process_info *procinfo = arg;
+	struct process *process = procinfo_get_process(procinfo);
+	struct test *test = process->data;
+	char *lines, *line, *saveptr = NULL;
+	int rc, n;
+
+	rc = process_process_stdout(procinfo, &lines);
+	if (rc || !lines)
+		return rc;
+
+	/* we should only ever see complete lines */
+	n = strlen(lines);
+	assert(n);
+	assert(lines[n - 1] == '\r' || lines[n - 1] == '\n');
+
+	for (line = strtok_r(lines, "\r\n", &saveptr); line;
+			line = strtok_r(NULL, "\r\n", &saveptr)) {
+		if (sscanf(line, "progress %d", &n) == 1) {
+			assert(n == test->last_progress + 1);
+			test->last_progress = n;
+		}
+		test->n_lines++;
+	}
+
+	return 0;
+}
+
+static void exit_cb(struct process *process)
+{
+	struct test *test = process->data;
+
+	assert(process_exit_ok(process));
+
+	test->exited = true;
+	test->stdout_len = process->stdout_len;
+	test->stdout_buf = talloc_steal(test, process->stdout_buf);
+}
+
+int main(int argc, char **argv)
+{
+	struct waitset *waitset;
+	struct process *process;
+	const char *child_argv[3];
+	struct test *test;
+
+	if (argc == 2 && !strcmp(argv[1], "child"))
+		return do_child();
+
+	test = talloc_zero(NULL, struct test);
+	test->last_progress = -1;
+
+	waitset = waitset_create(test);
+
+	process_init(test, waitset, false);
+
+	child_argv[0] = argv[0];
+	child_argv[1] = "child";
+	child_argv[2] = NULL;
+
+	process = process_create(test);
+	process->path = child_argv[0];
+	process->argv = child_argv;
+	process->keep_stdout = true;
+	process->stdout_max = STDOUT_MAX;
+	process->stdout_cb = stdout_cb;
+	process->exit_cb = exit_cb;
+	process->data = test;
+
+	process_run_async(process);
+
+	while (!test->exited)
+		waiter_poll(waitset);
+
+	assert(test->last_progress == N_LINES - 1);
+	assert(test->n_lines == N_LINES + 1);
+
+	/* only the tail of the output is kept */
+	assert(test->stdout_len <= 4 * STDOUT_MAX);
+	assert(test->stdout_len >= (int)strlen("done\n"));
+	assert(!strcmp(test->stdout_buf + test->stdout_len - strlen("done\n"),
+				"done\n"));
+
+	talloc_free(test);
+
+	return EXIT_SUCCESS;
+}
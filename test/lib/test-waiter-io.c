@@ -0,0 +1,119 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+struct io_test {
+	int	fd;
+	int	n_calls;
+	bool	drain;
+	bool	remove;
+};
+
+static int io_cb(void *arg)
+{
+	struct io_test *test = arg;
+	char buf[16];
+	ssize_t rc;
+
+	test->n_calls++;
+
+	if (test->drain) {
+		rc = read(test->fd, buf, sizeof(buf));
+		assert(rc > 0);
+	}
+
+	return test->remove ? 1 : 0;
+}
+
+int main(void)
+{
+	struct io_test a, b, c;
+	struct waitset *waitset;
+	struct waiter *waiter, *waiter_b, *waiter_c;
+	int pipefds[2], rc;
+	void *ctx;
+
+	ctx = talloc_new(NULL);
+
+	waitset = waitset_create(ctx);
+	assert(waitset);
+
+	rc = pipe(pipefds);
+	assert(!rc);
+
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	a.fd = b.fd = pipefds[0];
+
+	/* two waiters on the same fd should both be woken */
+	waiter = waiter_register_io(waitset, pipefds[0], WAIT_IN, io_cb, &a);
+	assert(waiter);
+	waiter_b = waiter_register_io(waitset, pipefds[0], WAIT_IN, io_cb, &b);
+	assert(waiter_b);
+
+	rc = write(pipefds[1], "x", 1);
+	assert(rc == 1);
+
+	waiter_poll(waitset);
+	assert(a.n_calls == 1);
+	assert(b.n_calls == 1);
+
+	/* registrations persist over waiter_poll calls */
+	waiter_poll(waitset);
+	assert(a.n_calls == 2);
+	assert(b.n_calls == 2);
+
+	/* a removed waiter is no longer called */
+	waiter_remove(waiter);
+	b.drain = true;
+	waiter_poll(waitset);
+	assert(a.n_calls == 2);
+	assert(b.n_calls == 3);
+
+	/* a non-zero return from the callback removes the waiter */
+	rc = write(pipefds[1], "x", 1);
+	assert(rc == 1);
+	b.remove = true;
+	waiter_poll(waitset);
+	assert(b.n_calls == 4);
+
+	rc = write(pipefds[1], "x", 1);
+	assert(rc == 1);
+	waiter_register_timeout(waitset, 0, io_cb, &a);
+	waiter_poll(waitset);
+	assert(a.n_calls == 3);
+	assert(b.n_calls == 4);
+
+	/* close an fd without removing its waiter, and reuse the number
+	 * for a new registration */
+	memset(&a, 0, sizeof(a));
+	a.fd = pipefds[0];
+	waiter = waiter_register_io(waitset, pipefds[0], WAIT_IN, io_cb, &a);
+	close(pipefds[0]);
+	close(pipefds[1]);
+
+	rc = pipe(pipefds);
+	assert(!rc);
+
+	memset(&c, 0, sizeof(c));
+	c.fd = pipefds[0];
+	c.drain = true;
+	waiter_c = waiter_register_io(waitset, pipefds[0], WAIT_IN, io_cb, &c);
+	assert(waiter_c);
+	waiter_remove(waiter);
+
+	rc = write(pipefds[1], "x", 1);
+	assert(rc == 1);
+	waiter_poll(waitset);
+	assert(a.n_calls == 0);
+	assert(c.n_calls == 1);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
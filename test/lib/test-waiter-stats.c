@@ -0,0 +1,50 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+static int n_calls;
+
+static int stats_timeout_cb(void *arg)
+{
+	(void)arg;
+	n_calls++;
+	return 0;
+}
+
+int main(void)
+{
+	struct waitset *waitset;
+	char *stats, *line;
+	void *ctx;
+
+	ctx = talloc_new(NULL);
+
+	waitset = waitset_create(ctx);
+	assert(waitset);
+
+	waitset_set_slow_threshold(waitset, 0);
+
+	waiter_register_timeout(waitset, 0, stats_timeout_cb, NULL);
+	waiter_register_timeout(waitset, 0, (waiter_cb)stats_timeout_cb, NULL);
+
+	while (n_calls < 2)
+		waiter_poll(waitset);
+
+	stats = waitset_stats_dump(ctx, waitset);
+	assert(stats);
+
+	/* both registrations are accounted to the one callback, with any
+	 * cast stripped from the name */
+	line = strstr(stats, "\nstats_timeout_cb ");
+	assert(line);
+	line += strlen("\nstats_timeout_cb ");
+	assert(!strstr(line, "stats_timeout_cb"));
+	assert(strtoul(line, NULL, 10) == 2);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <waiter/waiter.h>
+#include <talloc/talloc.h>
+
+#define N_TIMERS 64
+
+static int fired[N_TIMERS + 1];
+static int n_fired;
+static struct waitset *waitset;
+
+static int timeout_cb(void *arg)
+{
+	int id = (long)arg;
+
+	fired[n_fired++] = id;
+	return 0;
+}
+
+static int rearm_cb(void *arg)
+{
+	(void)arg;
+
+	fired[n_fired++] = -1;
+
+	/* a zero-delay timer registered from a timer callback must not
+	 * run in the same pass */
+	waiter_register_timeout(waitset, 0, timeout_cb, (void *)0l);
+	return 0;
+}
+
+int main(void)
+{
+	struct waiter *waiters[N_TIMERS];
+	int i, n_removed;
+	void *ctx;
+
+	ctx = talloc_new(NULL);
+
+	waitset = waitset_create(ctx);
+	assert(waitset);
+
+	/* register timers in a scrambled order of expiry */
+	for (i = 0; i < N_TIMERS; i++) {
+		int id = (i * 37) % N_TIMERS + 1;
+		waiters[id - 1] = waiter_register_timeout(waitset, id,
+				timeout_cb, (void *)(long)id);
+		assert(waiters[id - 1]);
+	}
+
+	/* remove every third timer */
+	n_removed = 0;
+	for (i = 0; i < N_TIMERS; i += 3) {
+		waiter_remove(waiters[i]);
+		n_removed++;
+	}
+
+	n_fired = 0;
+	while (n_fired < N_TIMERS - n_removed)
+		waiter_poll(waitset);
+
+	assert(n_fired == N_TIMERS - n_removed);
+
+	/* timers must fire in expiry order, and removed timers not at all */
+	for (i = 0; i < n_fired; i++) {
+		assert(fired[i] % 3 != 1);
+		if (i > 0)
+			assert(fired[i] > fired[i - 1]);
+	}
+
+	n_fired = 0;
+	waiter_register_timeout(waitset, 0, rearm_cb, NULL);
+	waiter_poll(waitset);
+	assert(n_fired == 1 && fired[0] == -1);
+
+	waiter_poll(waitset);
+	assert(n_fired == 2 && fired[1] == 0);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
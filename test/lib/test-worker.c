@@ -0,0 +1,93 @@
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <waiter/waiter.h>
+#include <worker/worker.h>
+#include <talloc/talloc.h>
+
+#define N_ITEMS		32
+#define N_WORKERS	4
+
+struct item {
+	int		idx;
+	int		result;
+	pthread_t	thread;
+	bool		complete;
+};
+
+static pthread_t main_thread;
+static int n_complete;
+
+static void work(void *arg)
+{
+	struct item *item = arg;
+
+	/* finish out of order */
+	usleep((N_ITEMS - item->idx) * 1000);
+
+	item->thread = pthread_self();
+	item->result = item->idx * 2;
+}
+
+static void complete(void *arg)
+{
+	struct item *item = arg;
+
+	assert(pthread_equal(pthread_self(), main_thread));
+	assert(!pthread_equal(item->thread, main_thread));
+	assert(item->result == item->idx * 2);
+	assert(!item->complete);
+
+	item->complete = true;
+	n_complete++;
+}
+
+int main(void)
+{
+	struct item items[N_ITEMS];
+	struct workqueue *wq;
+	struct waitset *waitset;
+	void *ctx;
+	int i, rc;
+
+	ctx = talloc_new(NULL);
+	main_thread = pthread_self();
+
+	waitset = waitset_create(ctx);
+
+	wq = workqueue_create(ctx, waitset, N_WORKERS);
+	assert(wq);
+
+	memset(items, 0, sizeof(items));
+
+	for (i = 0; i < N_ITEMS; i++) {
+		items[i].idx = i;
+		rc = workqueue_queue(wq, work, complete, &items[i]);
+		assert(!rc);
+	}
+
+	while (n_complete < N_ITEMS)
+		waiter_poll(waitset);
+
+	for (i = 0; i < N_ITEMS; i++)
+		assert(items[i].complete);
+
+	/* freeing the queue with work outstanding waits for running items,
+	 * and drops the rest */
+	for (i = 0; i < N_ITEMS; i++) {
+		items[i].complete = false;
+		rc = workqueue_queue(wq, work, complete, &items[i]);
+		assert(!rc);
+	}
+
+	talloc_free(wq);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
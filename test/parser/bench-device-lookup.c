@@ -0,0 +1,108 @@
+/*
+ * Time device lookups by id, uuid, label and serial, and the resolution of
+ * devpath resources, against a large set of synthetic devices.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+
+#include <talloc/talloc.h>
+
+#include "parser-test.h"
+#include "resource.h"
+
+#define N_DEVICES	10000
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_report(const char *name, double start, int n)
+{
+	printf("%-16s %8.3f us/op\n", name, (bench_now() - start) * 1e6 / n);
+}
+
+void run_test(struct parser_test *test)
+{
+	struct discover_device *devs[N_DEVICES], *dev;
+	struct discover_boot_option *opt;
+	struct resource *res;
+	char name[32], *str;
+	double start;
+	bool resolved;
+	int i;
+
+	start = bench_now();
+	for (i = 0; i < N_DEVICES; i++) {
+		sprintf(name, "bench%d", i);
+		dev = test_create_device(test, name);
+		dev->uuid = talloc_asprintf(dev, "uuid-%08x", i);
+		dev->label = talloc_asprintf(dev, "label%d", i);
+		discover_device_set_param(dev, "ID_SERIAL",
+				talloc_asprintf(dev, "serial%d", i));
+		device_handler_add_device(test->handler, dev);
+		devs[i] = dev;
+	}
+	bench_report("add", start, N_DEVICES);
+
+	start = bench_now();
+	for (i = 0; i < N_DEVICES; i++) {
+		dev = device_lookup_by_id(test->handler, devs[i]->device->id);
+		assert(dev == devs[i]);
+	}
+	bench_report("lookup id", start, N_DEVICES);
+
+	start = bench_now();
+	for (i = 0; i < N_DEVICES; i++) {
+		dev = device_lookup_by_uuid(test->handler, devs[i]->uuid);
+		assert(dev == devs[i]);
+	}
+	bench_report("lookup uuid", start, N_DEVICES);
+
+	start = bench_now();
+	for (i = 0; i < N_DEVICES; i++) {
+		dev = device_lookup_by_label(test->handler, devs[i]->label);
+		assert(dev == devs[i]);
+	}
+	bench_report("lookup label", start, N_DEVICES);
+
+	start = bench_now();
+	for (i = 0; i < N_DEVICES; i++) {
+		dev = device_lookup_by_serial(test->handler,
+				discover_device_get_param(devs[i], "ID_SERIAL"));
+		assert(dev == devs[i]);
+	}
+	bench_report("lookup serial", start, N_DEVICES);
+
+	start = bench_now();
+	for (i = 0; i < N_DEVICES; i++) {
+		dev = device_lookup_by_uuid(test->handler, "no-such-uuid");
+		assert(!dev);
+	}
+	bench_report("lookup miss", start, N_DEVICES);
+
+	opt = discover_boot_option_create(test->ctx, test->ctx->device);
+	start = bench_now();
+	for (i = 0; i < N_DEVICES; i++) {
+		str = talloc_asprintf(opt, "label=%s:/vmlinux", devs[i]->label);
+		res = create_devpath_resource(opt, test->ctx->device, str);
+		resolved = res->resolved;
+		if (!resolved)
+			resolved = resolve_devpath_resource(test->handler, res);
+		assert(resolved && res->resolved);
+	}
+	bench_report("resolve devpath", start, N_DEVICES);
+
+	start = bench_now();
+	for (i = 0; i < N_DEVICES; i++)
+		device_handler_remove(test->handler, devs[i]);
+	bench_report("remove", start, N_DEVICES);
+
+	dev = device_lookup_by_label(test->handler, "label0");
+	assert(!dev);
+}
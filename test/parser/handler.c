@@ -19,9 +19,10 @@ void discover_server_notify_device_add(struct discover_server *server,
 }
 
 void discover_server_notify_boot_option_add(struct discover_server *server,
-		struct boot_option *option)
+		struct device *device, struct boot_option *option)
 {
 	(void)server;
+	(void)device;
 	(void)option;
 }
 
@@ -80,12 +81,6 @@ void parser_init(void)
 {
 }
 
-void iterate_parsers(struct discover_context *ctx)
-{
-	(void)ctx;
-	assert(false);
-}
-
 struct boot_task *boot(void *ctx, struct discover_boot_option *opt,
 		struct boot_command *cmd, int dry_run,
 		boot_status_fn status_fn, void *status_arg)
@@ -58,3 +58,11 @@ void network_requery_device(struct network *network,
 	(void)network;
 	(void)dev;
 }
+
+void network_dhcp_lease(struct network *network, const uint8_t *hwaddr,
+		bool ipv6)
+{
+	(void)network;
+	(void)hwaddr;
+	(void)ipv6;
+}
@@ -4,10 +4,12 @@
 #include <stdlib.h>
 
 #include "device-handler.h"
+#include "option-cache.h"
 #include "resource.h"
 
 struct parser_test {
 	struct device_handler *handler;
+	struct waitset *waitset;
 	struct discover_context *ctx;
 	struct list files;
 };
@@ -30,6 +32,13 @@ void test_read_conf_file(struct parser_test *test, const char *filename,
 
 int test_run_parser(struct parser_test *test, const char *parser_name);
 
+/* Discover each of @devs through the device handler, with @parser_name as
+ * the only parser, and wait for all of the discover jobs to complete. The
+ * parsers run concurrently in the handler's workers, and the boot options
+ * found are left on each device's boot_options list. */
+void test_discover_devices(struct parser_test *test, const char *parser_name,
+		struct discover_device **devs, unsigned int n_devs);
+
 void test_hotplug_device(struct parser_test *test, struct discover_device *dev);
 void test_remove_device(struct parser_test *test, struct discover_device *dev);
 
@@ -42,6 +51,14 @@ void test_add_file_data(struct parser_test *test, struct discover_device *dev,
 void test_add_dir(struct parser_test *test, struct discover_device *dev,
 		const char *dirname);
 
+/* Give a file a new mtime, leaving its contents as they are */
+void test_touch_file(struct parser_test *test, struct discover_device *dev,
+		const char *filename);
+
+/* Replace test->ctx with a new context for dev, as if dev had just been
+ * mounted. The old context and its boot options are freed. */
+void test_new_context(struct parser_test *test, struct discover_device *dev);
+
 void test_set_event_source(struct parser_test *test);
 void test_set_event_param(struct event *event, const char *name,
 		const char *value);
@@ -149,4 +166,16 @@ void __check_file_contents(struct parser_test *test,
 #define check_file_contents(test, dev, filename, buf, len) \
 	__check_file_contents(test, dev, filename, buf, len, __FILE__, __LINE__)
 
+/**
+ * Mount @dev again in a new test context, and check whether @cache replays
+ * the options that it has for @dev (@replayed is true), or leaves them to
+ * the parsers.
+ */
+void __check_option_cache_replay(struct parser_test *test,
+		struct option_cache *cache, struct discover_device *dev,
+		bool replayed, const char *file, int line);
+#define check_option_cache_replay(test, cache, dev, replayed) \
+	__check_option_cache_replay(test, cache, dev, replayed, \
+			__FILE__, __LINE__)
+
 #endif /* PARSER_TEST_H */
@@ -0,0 +1,76 @@
+#include <err.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <talloc/talloc.h>
+#include <waiter/waiter.h>
+
+#include "parser-test.h"
+
+#if 0 /* PARSER_EMBEDDED_CONFIG */
+set os_name=Fedora
+blscfg
+#endif
+
+void run_test(struct parser_test *test)
+{
+	char path[] = "/tmp/pb-option-cache-XXXXXX";
+	struct discover_device *dev = test->ctx->device;
+	struct discover_boot_option *opt;
+	struct option_cache *cache;
+	struct waitset *waitset;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		err(EXIT_FAILURE, "mkstemp");
+	close(fd);
+
+	waitset = waitset_create(test);
+	dev->uuid = talloc_strdup(dev, "0a1b2c3d");
+
+	test_add_dir(test, dev, "/loader/entries");
+
+	test_add_file_string(test, dev,
+			     "/loader/entries/6c063c8e48904f2684abde8eea303f41-4.14.18-300.fc28.x86_64.conf",
+			     "title $os_name (4.14.18-300.fc28.x86_64) 28 (Twenty Eight)\n"
+			     "linux /vmlinuz-4.14.18-300.fc28.x86_64\n"
+			     "initrd /initramfs-4.14.18-300.fc28.x86_64.img\n"
+			     "options root=/dev/mapper/fedora-root ro rd.lvm.lv=fedora/root\n");
+
+	test_read_conf_embedded(test, "/boot/grub2/grub.cfg");
+
+	cache = option_cache_init(test, waitset, path);
+
+	test_run_parser(test, "grub2");
+	check_boot_option_count(test->ctx, 1);
+	option_cache_update(cache, test->ctx);
+
+	check_option_cache_replay(test, cache, dev, true);
+	check_boot_option_count(test->ctx, 1);
+
+	/* a new entry changes the directory's mtime, even though none of the
+	 * files that the parser read have changed */
+	test_add_file_string(test, dev,
+			     "/loader/entries/6c063c8e48904f2684abde8eea303f41-4.15.2-302.fc28.x86_64.conf",
+			     "title $os_name (4.15.2-302.fc28.x86_64) 28 (Twenty Eight)\n"
+			     "linux /vmlinuz-4.15.2-302.fc28.x86_64\n"
+			     "initrd /initramfs-4.15.2-302.fc28.x86_64.img\n"
+			     "options root=/dev/mapper/fedora-root ro rd.lvm.lv=fedora/root\n\n");
+
+	check_option_cache_replay(test, cache, dev, false);
+
+	test_run_parser(test, "grub2");
+	check_boot_option_count(test->ctx, 2);
+	option_cache_update(cache, test->ctx);
+
+	check_option_cache_replay(test, cache, dev, true);
+	check_boot_option_count(test->ctx, 2);
+	opt = get_boot_option(test->ctx, 0);
+	check_name(opt, "Fedora (4.15.2-302.fc28.x86_64) 28 (Twenty Eight)");
+	check_resolved_local_resource(opt->boot_image, dev,
+			"/vmlinuz-4.15.2-302.fc28.x86_64");
+
+	talloc_free(cache);
+	unlink(path);
+}
@@ -0,0 +1,80 @@
+#include <err.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <talloc/talloc.h>
+#include <waiter/waiter.h>
+
+#include "parser-test.h"
+
+/* config_a and config_b are the same size */
+static const char config_a[] =
+	"linux='/vmlinux initrd=/initrd arg1=value1 arg2'\n";
+static const char config_b[] =
+	"linux='/vmlinux initrd=/initrd arg1=value2 arg2'\n";
+static const char config_c[] =
+	"linux='/vmlinux initrd=/initrd arg1=value1'\n";
+
+static void parse(struct parser_test *test, struct option_cache *cache)
+{
+	test_run_parser(test, "kboot");
+	option_cache_update(cache, test->ctx);
+}
+
+void run_test(struct parser_test *test)
+{
+	char path[] = "/tmp/pb-option-cache-XXXXXX";
+	struct discover_device *dev = test->ctx->device;
+	struct discover_boot_option *opt;
+	struct option_cache *cache;
+	struct waitset *waitset;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		err(EXIT_FAILURE, "mkstemp");
+	close(fd);
+
+	waitset = waitset_create(test);
+	dev->uuid = talloc_strdup(dev, "0a1b2c3d");
+
+	cache = option_cache_init(test, waitset, path);
+
+	test_read_conf_data(test, "/kboot.conf", config_a);
+	parse(test, cache);
+
+	/* new contents, same size */
+	test_read_conf_data(test, "/kboot.conf", config_b);
+	check_option_cache_replay(test, cache, dev, false);
+	check_boot_option_count(test->ctx, 0);
+
+	parse(test, cache);
+	check_boot_option_count(test->ctx, 1);
+	check_args(get_boot_option(test->ctx, 0), "arg1=value2 arg2");
+
+	/* new size */
+	test_read_conf_data(test, "/kboot.conf", config_c);
+	check_option_cache_replay(test, cache, dev, false);
+	parse(test, cache);
+
+	/* only the latest parse is kept */
+	talloc_free(cache);
+	cache = option_cache_init(test, waitset, path);
+
+	check_option_cache_replay(test, cache, dev, true);
+	check_boot_option_count(test->ctx, 1);
+	opt = get_boot_option(test->ctx, 0);
+	check_name(opt, "linux");
+	check_args(opt, "arg1=value1");
+
+	/* a config file appears where the parser looked for one before */
+	test_add_file_string(test, dev, "/etc/kboot.conf",
+			"other='/vmlinux-other'\n");
+	check_option_cache_replay(test, cache, dev, false);
+
+	parse(test, cache);
+	check_boot_option_count(test->ctx, 2);
+
+	talloc_free(cache);
+	unlink(path);
+}
@@ -0,0 +1,100 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <file/file.h>
+#include <talloc/talloc.h>
+#include <waiter/waiter.h>
+
+#include "parser-test.h"
+
+static const char config[] =
+	"linux='/vmlinux initrd=/initrd arg1=value1 arg2'\n";
+
+static void write_cache(const char *path, char *buf, int len)
+{
+	if (replace_file(path, buf, len))
+		errx(EXIT_FAILURE, "can't write %s", path);
+}
+
+void run_test(struct parser_test *test)
+{
+	char path[] = "/tmp/pb-option-cache-XXXXXX";
+	struct discover_device *dev_a, *dev_b;
+	struct option_cache *cache;
+	struct waitset *waitset;
+	int fd, len;
+	char *buf;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		err(EXIT_FAILURE, "mkstemp");
+	close(fd);
+
+	waitset = waitset_create(test);
+
+	dev_a = test->ctx->device;
+	dev_a->uuid = talloc_strdup(dev_a, "0a1b2c3d");
+	dev_b = test_create_device(test, "sdb1");
+	dev_b->uuid = talloc_strdup(dev_b, "4e5f6a7b");
+
+	test_add_file_string(test, dev_a, "/kboot.conf", config);
+	test_add_file_string(test, dev_b, "/kboot.conf", config);
+
+	/* entries are written newest first: b, then a */
+	cache = option_cache_init(test, waitset, path);
+	test_run_parser(test, "kboot");
+	option_cache_update(cache, test->ctx);
+	test_new_context(test, dev_b);
+	test_run_parser(test, "kboot");
+	option_cache_update(cache, test->ctx);
+	talloc_free(cache);
+
+	if (read_file(test, path, &buf, &len) || len < 16)
+		errx(EXIT_FAILURE, "option cache not written");
+
+	cache = option_cache_init(test, waitset, path);
+	check_option_cache_replay(test, cache, dev_a, true);
+	check_option_cache_replay(test, cache, dev_b, true);
+	talloc_free(cache);
+
+	/* truncated in the last entry: we keep the entries before it */
+	write_cache(path, buf, len - 1);
+	cache = option_cache_init(test, waitset, path);
+	check_option_cache_replay(test, cache, dev_a, false);
+	check_option_cache_replay(test, cache, dev_b, true);
+	talloc_free(cache);
+
+	/* truncated in the header */
+	write_cache(path, buf, 6);
+	cache = option_cache_init(test, waitset, path);
+	check_option_cache_replay(test, cache, dev_b, false);
+	talloc_free(cache);
+
+	/* written by another version of petitboot: the package version
+	 * follows the magic, the format version and the string's length */
+	buf[12] ^= 0xff;
+	write_cache(path, buf, len);
+	cache = option_cache_init(test, waitset, path);
+	check_option_cache_replay(test, cache, dev_b, false);
+	talloc_free(cache);
+	buf[12] ^= 0xff;
+
+	/* lengths that run past the end of the file */
+	memset(buf + len / 2, 0xff, len - len / 2);
+	write_cache(path, buf, len);
+	cache = option_cache_init(test, waitset, path);
+	check_option_cache_replay(test, cache, dev_a, false);
+
+	/* the next parse replaces the corrupt file */
+	test_run_parser(test, "kboot");
+	option_cache_update(cache, test->ctx);
+	talloc_free(cache);
+
+	cache = option_cache_init(test, waitset, path);
+	check_option_cache_replay(test, cache, dev_a, true);
+	talloc_free(cache);
+
+	unlink(path);
+}
@@ -0,0 +1,78 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <talloc/talloc.h>
+#include <waiter/waiter.h>
+
+#include "parser-test.h"
+
+/* Each device's boot option carries its args twice, in the args and the
+ * description, so the cache's 128KiB cap only holds a few of the devices'
+ * entries */
+#define N_DEVICES	32
+#define ARGS_LEN	8192
+
+void run_test(struct parser_test *test)
+{
+	char path[] = "/tmp/pb-option-cache-XXXXXX";
+	struct discover_device *devs[N_DEVICES];
+	struct option_cache *cache;
+	struct waitset *waitset;
+	struct stat statbuf;
+	char *args, *config;
+	int fd, i;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		err(EXIT_FAILURE, "mkstemp");
+	close(fd);
+
+	waitset = waitset_create(test);
+
+	args = talloc_array(test, char, ARGS_LEN + 1);
+	memset(args, 'x', ARGS_LEN);
+	args[ARGS_LEN] = '\0';
+	config = talloc_asprintf(test, "linux='/vmlinux %s'\n", args);
+
+	cache = option_cache_init(test, waitset, path);
+
+	for (i = 0; i < N_DEVICES; i++) {
+		devs[i] = test_create_device(test,
+				talloc_asprintf(test, "sd%d", i));
+		devs[i]->uuid = talloc_asprintf(devs[i], "%08x", i);
+		test_add_file_data(test, devs[i], "/kboot.conf",
+				config, strlen(config));
+
+		test_new_context(test, devs[i]);
+		test_run_parser(test, "kboot");
+		check_boot_option_count(test->ctx, 1);
+		option_cache_update(cache, test->ctx);
+	}
+
+	/* replaying the oldest entry makes it the most recently used */
+	check_option_cache_replay(test, cache, devs[0], true);
+	talloc_free(cache);
+
+	if (stat(path, &statbuf))
+		err(EXIT_FAILURE, "stat %s", path);
+	if (statbuf.st_size > 128 * 1024)
+		errx(EXIT_FAILURE, "option cache is %ld bytes",
+				(long)statbuf.st_size);
+
+	cache = option_cache_init(test, waitset, path);
+
+	check_option_cache_replay(test, cache, devs[0], true);
+	check_args(get_boot_option(test->ctx, 0), args);
+	check_option_cache_replay(test, cache, devs[N_DEVICES - 1], true);
+	check_option_cache_replay(test, cache, devs[N_DEVICES - 4], true);
+
+	/* the least recently used entries were dropped */
+	check_option_cache_replay(test, cache, devs[1], false);
+	check_option_cache_replay(test, cache, devs[N_DEVICES / 2], false);
+
+	talloc_free(cache);
+	unlink(path);
+}
@@ -0,0 +1,83 @@
+#include <err.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <talloc/talloc.h>
+#include <waiter/waiter.h>
+
+#include "parser-test.h"
+#include "parser.h"
+
+static const char config[] =
+	"linux='/vmlinux initrd=/initrd arg1=value1 arg2'\n";
+
+static off_t file_size(const char *path)
+{
+	struct stat statbuf;
+
+	if (stat(path, &statbuf))
+		err(EXIT_FAILURE, "stat %s", path);
+
+	return statbuf.st_size;
+}
+
+void run_test(struct parser_test *test)
+{
+	char path[] = "/tmp/pb-option-cache-XXXXXX";
+	struct discover_device *dev = test->ctx->device;
+	struct discover_boot_option *opt;
+	struct option_cache *cache;
+	struct waitset *waitset;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		err(EXIT_FAILURE, "mkstemp");
+	close(fd);
+
+	waitset = waitset_create(test);
+	dev->uuid = talloc_strdup(dev, "0a1b2c3d");
+
+	test_read_conf_data(test, "/kboot.conf", config);
+
+	cache = option_cache_init(test, waitset, path);
+	check_option_cache_replay(test, cache, dev, false);
+
+	test_run_parser(test, "kboot");
+	option_cache_update(cache, test->ctx);
+
+	/* the cache isn't written until the waitset runs */
+	if (file_size(path) != 0)
+		errx(EXIT_FAILURE, "option cache written before the waitset ran");
+
+	waiter_poll(waitset);
+
+	if (file_size(path) == 0)
+		errx(EXIT_FAILURE, "option cache not written");
+
+	/* load the cache that we've just written */
+	talloc_free(cache);
+	cache = option_cache_init(test, waitset, path);
+
+	check_option_cache_replay(test, cache, dev, true);
+	check_boot_option_count(test->ctx, 1);
+	opt = get_boot_option(test->ctx, 0);
+
+	check_name(opt, "linux");
+	check_resolved_local_resource(opt->boot_image, dev, "/vmlinux");
+	check_resolved_local_resource(opt->initrd, dev, "/initrd");
+	check_args(opt, "arg1=value1 arg2");
+
+	if (opt->source != parser_lookup("kboot"))
+		errx(EXIT_FAILURE, "replayed option has the wrong parser");
+
+	/* a different filesystem on the same device */
+	dev->uuid = talloc_strdup(dev, "4e5f6a7b");
+
+	check_option_cache_replay(test, cache, dev, false);
+	check_boot_option_count(test->ctx, 0);
+
+	talloc_free(cache);
+	unlink(path);
+}
@@ -0,0 +1,59 @@
+#include <err.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <talloc/talloc.h>
+#include <waiter/waiter.h>
+
+#include "parser-test.h"
+
+static const char config[] =
+	"linux='/vmlinux initrd=/initrd arg1=value1 arg2'\n";
+
+void run_test(struct parser_test *test)
+{
+	char path[] = "/tmp/pb-option-cache-XXXXXX";
+	struct discover_device *dev = test->ctx->device;
+	struct discover_boot_option *opt;
+	struct option_cache *cache;
+	struct waitset *waitset;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		err(EXIT_FAILURE, "mkstemp");
+	close(fd);
+
+	waitset = waitset_create(test);
+	dev->uuid = talloc_strdup(dev, "0a1b2c3d");
+
+	test_read_conf_data(test, "/kboot.conf", config);
+
+	cache = option_cache_init(test, waitset, path);
+	test_run_parser(test, "kboot");
+	option_cache_update(cache, test->ctx);
+	talloc_free(cache);
+
+	/* the config is rewritten with the same contents: its hash still
+	 * matches, so the cached options are good */
+	test_touch_file(test, dev, "/kboot.conf");
+
+	cache = option_cache_init(test, waitset, path);
+	check_option_cache_replay(test, cache, dev, true);
+
+	check_boot_option_count(test->ctx, 1);
+	opt = get_boot_option(test->ctx, 0);
+	check_name(opt, "linux");
+	check_args(opt, "arg1=value1 arg2");
+
+	/* the entry is written back with the new mtime, and still replays
+	 * once the cache has been reloaded */
+	talloc_free(cache);
+	cache = option_cache_init(test, waitset, path);
+
+	check_option_cache_replay(test, cache, dev, true);
+	check_boot_option_count(test->ctx, 1);
+
+	talloc_free(cache);
+	unlink(path);
+}
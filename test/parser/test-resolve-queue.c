@@ -0,0 +1,106 @@
+
+#include <string.h>
+#include <assert.h>
+
+#include <talloc/talloc.h>
+
+#include "parser-test.h"
+#include "resolve-queue.h"
+
+#define N_EXTRA	200
+
+static void check_woken(struct resolve_queue *queue,
+		struct discover_boot_option **expected, int n_expected)
+{
+	struct discover_boot_option **opts;
+	int i, n;
+
+	n = resolve_queue_take_woken(queue, queue, &opts);
+	assert(n == n_expected);
+
+	for (i = 0; i < n; i++)
+		assert(opts[i] == expected[i]);
+
+	talloc_free(opts);
+}
+
+void run_test(struct parser_test *test)
+{
+	struct discover_boot_option *a, *b, *c, *d, *extra[N_EXTRA];
+	struct discover_device *dev;
+	struct resolve_queue *queue;
+	char *dep, *stats;
+	int i;
+
+	queue = resolve_queue_create(test, test->handler);
+
+	a = discover_boot_option_create(test->ctx, test->ctx->device);
+	b = discover_boot_option_create(test->ctx, test->ctx->device);
+	c = discover_boot_option_create(test->ctx, test->ctx->device);
+	d = discover_boot_option_create(test->ctx, test->ctx->device);
+
+	resolve_queue_add(queue, a, "uuid-a");
+	resolve_queue_add(queue, b, "label-b");
+	resolve_queue_add(queue, c, NULL);
+	resolve_queue_add(queue, d, "sdb1");
+	assert(resolve_queue_length(queue) == 4);
+
+	/* nothing is woken until a device is added */
+	check_woken(queue, NULL, 0);
+
+	/* a matches by uuid; c has no dependency, so is always woken. Options
+	 * are returned most recently queued first. */
+	dev = test_create_device(test, "sda1");
+	dev->uuid = "uuid-a";
+	resolve_queue_wake(queue, dev);
+	check_woken(queue, (struct discover_boot_option *[]){ c, a }, 2);
+
+	/* taken options stay queued until resolved or re-added */
+	assert(resolve_queue_length(queue) == 4);
+	resolve_queue_remove(queue, a);
+	resolve_queue_add(queue, c, NULL);
+	assert(resolve_queue_length(queue) == 3);
+
+	/* b matches by label, d by id */
+	dev = test_create_device(test, "sdb1");
+	dev->label = "label-b";
+	resolve_queue_wake(queue, dev);
+	check_woken(queue, (struct discover_boot_option *[]){ d, c, b }, 3);
+
+	/* b moves to a new dependency, keeping its place in the queue */
+	resolve_queue_add(queue, b, "uuid-b");
+	resolve_queue_add(queue, c, NULL);
+	resolve_queue_add(queue, d, "sdb1");
+
+	/* freed options leave the queue */
+	talloc_free(d);
+	assert(resolve_queue_length(queue) == 2);
+
+	/* enough dependencies to grow the hash table */
+	for (i = 0; i < N_EXTRA; i++) {
+		extra[i] = discover_boot_option_create(test->ctx,
+				test->ctx->device);
+		dep = talloc_asprintf(extra[i], "extra%d", i);
+		resolve_queue_add(queue, extra[i], dep);
+	}
+	assert(resolve_queue_length(queue) == 2 + N_EXTRA);
+
+	dev = test_create_device(test, "extra42");
+	dev->uuid = "uuid-b";
+	resolve_queue_wake(queue, dev);
+	check_woken(queue,
+		(struct discover_boot_option *[]){ extra[42], c, b }, 3);
+
+	resolve_queue_remove(queue, b);
+	resolve_queue_remove(queue, c);
+	resolve_queue_remove(queue, extra[42]);
+	assert(resolve_queue_length(queue) == N_EXTRA - 1);
+
+	stats = resolve_queue_stats_dump(test, queue);
+	assert(strstr(stats, "199 queued"));
+	assert(strstr(stats, "4 resolved"));
+
+	/* options may outlive the queue */
+	talloc_free(queue);
+	talloc_free(extra[0]);
+}
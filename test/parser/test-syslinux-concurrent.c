@@ -0,0 +1,74 @@
+#include <err.h>
+#include <string.h>
+
+#include <talloc/talloc.h>
+
+#include "parser-test.h"
+
+/* Parse two devices' syslinux configs at once, in the discover workers.
+ * Each config has its own global APPEND, which must only end up in that
+ * config's boot options. */
+
+#define N_LABELS	512
+#define N_ROUNDS	32
+
+static void add_config(struct parser_test *test, struct discover_device *dev,
+		const char *append)
+{
+	char *buf;
+	int i;
+
+	buf = talloc_asprintf(test, "APPEND %s\n\n", append);
+
+	for (i = 0; i < N_LABELS; i++)
+		buf = talloc_asprintf_append(buf,
+				"LABEL %s-%d\n"
+				"KERNEL /vmlinuz-%d\n"
+				"APPEND quiet\n\n",
+				dev->device->id, i, i);
+
+	test_add_file_data(test, dev, "/syslinux/syslinux.cfg",
+			buf, strlen(buf));
+	talloc_free(buf);
+}
+
+static void check_options(struct discover_device *dev, const char *append)
+{
+	struct discover_boot_option *opt, *tmp;
+	char *args;
+	int n = 0;
+
+	args = talloc_asprintf(dev, "%s quiet", append);
+
+	list_for_each_entry_safe(&dev->boot_options, opt, tmp, list) {
+		check_args(opt, args);
+		list_remove(&opt->list);
+		talloc_free(opt);
+		n++;
+	}
+
+	if (n != N_LABELS)
+		errx(EXIT_FAILURE, "%s: found %d boot options, expected %d",
+				dev->device->id, n, N_LABELS);
+
+	talloc_free(args);
+}
+
+void run_test(struct parser_test *test)
+{
+	struct discover_device *devs[2];
+	int i;
+
+	devs[0] = test_create_device(test, "sda");
+	devs[1] = test_create_device(test, "sdb");
+
+	add_config(test, devs[0], "console=ttyS0 root=/dev/sda2");
+	add_config(test, devs[1], "console=hvc0 root=/dev/sdb2");
+
+	for (i = 0; i < N_ROUNDS; i++) {
+		test_discover_devices(test, "syslinux", devs, 2);
+
+		check_options(devs[0], "console=ttyS0 root=/dev/sda2");
+		check_options(devs[1], "console=hvc0 root=/dev/sdb2");
+	}
+}
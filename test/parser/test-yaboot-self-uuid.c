@@ -0,0 +1,58 @@
+/* An option that depends on its own device must still be resolved, even
+ * though the device is added before the option is queued */
+
+#include <assert.h>
+
+#include "parser-test.h"
+#include "resolve-queue.h"
+
+#if 0 /* PARSER_EMBEDDED_CONFIG */
+default=
+
+image=uuid=9d3b7d44-2f1a-4c5e-a0b6-6f1e3c2d8a17:/vmlinux
+	label=linux
+#endif
+
+void run_test(struct parser_test *test)
+{
+	struct discover_boot_option *opt, **opts;
+	struct discover_context *ctx;
+	struct discover_device *dev;
+	struct resolve_queue *queue;
+	bool resolved;
+	int n;
+
+	ctx = test->ctx;
+
+	/* a newly-discovered device, which isn't added until its options are
+	 * committed */
+	dev = test_create_device(test, "self");
+	dev->uuid = "9d3b7d44-2f1a-4c5e-a0b6-6f1e3c2d8a17";
+	ctx->device = dev;
+
+	test_read_conf_embedded(test, "/etc/yaboot.conf");
+
+	test_run_parser(test, "yaboot");
+
+	check_boot_option_count(ctx, 1);
+	opt = get_boot_option(ctx, 0);
+
+	check_name(opt, "linux");
+	check_unresolved_resource(opt->boot_image);
+
+	/* commit the context: the device is added, waking anything waiting
+	 * for it, and then the option is queued */
+	queue = resolve_queue_create(test, test->handler);
+	device_handler_add_device(test->handler, dev);
+	resolve_queue_wake(queue, dev);
+	resolve_queue_add(queue, opt,
+			devpath_resource_dependency(opt->boot_image));
+
+	n = resolve_queue_take_woken(queue, test, &opts);
+	assert(n == 1);
+	assert(opts[0] == opt);
+
+	resolved = resolve_devpath_resource(test->handler, opt->boot_image);
+	assert(resolved);
+	check_resolved_local_resource(opt->boot_image, dev, "/vmlinux");
+}
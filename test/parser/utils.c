@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <ctype.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -11,6 +12,7 @@
 #include <talloc/talloc.h>
 #include <types/types.h>
 #include <url/url.h>
+#include <waiter/waiter.h>
 
 #include "device-handler.h"
 #include "parser.h"
@@ -36,11 +38,30 @@ struct test_file {
 	const char		*name;
 	void			*data;
 	int			size;
+	struct timespec		mtime;
 	struct list_item	list;
 };
 
+/* The files that the parsers have looked at through a context, for
+ * parser_walk_files() */
+struct parser_file_cache {
+	struct list	accesses;
+	bool		incomplete;
+};
+
+struct test_access {
+	struct list_item	list;
+	const char		*filename;
+	struct test_file	*file;
+	bool			read;
+};
+
 STATIC_LIST(parsers);
 
+/* Files' mtimes come from this clock, which ticks on each change, so that
+ * each version of a file has a different mtime */
+static time_t test_clock;
+
 void __register_parser(struct parser *parser)
 {
 	struct p_item* i = talloc(NULL, struct p_item);
@@ -119,7 +140,8 @@ struct parser_test *test_init(void)
 
 	test = talloc_zero(NULL, struct parser_test);
 	platform_init(NULL);
-	test->handler = device_handler_init(NULL, NULL, 0);
+	test->waitset = waitset_create(test);
+	test->handler = device_handler_init(NULL, test->waitset, 0);
 	test->ctx = test_create_context(test);
 	list_init(&test->files);
 
@@ -173,6 +195,40 @@ void test_read_conf_file(struct parser_test *test, const char *filename,
 	test_add_file_data(test, test->ctx->device, conf_file, buf, size);
 }
 
+static struct test_file *test_lookup_file(struct parser_test *test,
+		struct discover_device *dev, const char *filename)
+{
+	struct test_file *file;
+
+	list_for_each_entry(&test->files, file, list) {
+		if (file->dev == dev && !strcmp(file->name, filename))
+			return file;
+	}
+
+	return NULL;
+}
+
+static void test_file_changed(struct parser_test *test, struct test_file *file)
+{
+	struct test_file *dir;
+	const char *sep;
+
+	file->mtime.tv_sec = ++test_clock;
+
+	/* as on a real filesystem, adding a file changes its directory */
+	sep = strrchr(file->name, '/');
+	if (!sep || sep == file->name)
+		return;
+
+	list_for_each_entry(&test->files, dir, list) {
+		if (dir->dev == file->dev && dir->type == TEST_DIR &&
+				strlen(dir->name) == (size_t)(sep - file->name) &&
+				!strncmp(dir->name, file->name,
+					sep - file->name))
+			dir->mtime.tv_sec = test_clock;
+	}
+}
+
 void test_add_file_data(struct parser_test *test, struct discover_device *dev,
 		const char *filename, const void *data, int size)
 {
@@ -185,6 +241,7 @@ void test_add_file_data(struct parser_test *test, struct discover_device *dev,
 	file->data = talloc_memdup(test, data, size);
 	file->size = size;
 	list_add(&test->files, &file->list);
+	test_file_changed(test, file);
 }
 
 void test_add_dir(struct parser_test *test, struct discover_device *dev,
@@ -200,6 +257,90 @@ void test_add_dir(struct parser_test *test, struct discover_device *dev,
 	 * path> ]" sees that the file has non-zero size. */
 	file->size = 1;
 	list_add(&test->files, &file->list);
+	test_file_changed(test, file);
+}
+
+void test_touch_file(struct parser_test *test, struct discover_device *dev,
+		const char *filename)
+{
+	struct test_file *file;
+
+	file = test_lookup_file(test, dev, filename);
+	if (!file)
+		errx(EXIT_FAILURE, "%s: no file '%s'", __func__, filename);
+
+	file->mtime.tv_sec = ++test_clock;
+}
+
+void test_new_context(struct parser_test *test, struct discover_device *dev)
+{
+	struct discover_context *ctx;
+
+	ctx = talloc_zero(test, struct discover_context);
+	assert(ctx);
+
+	list_init(&ctx->boot_options);
+	ctx->device = dev;
+	ctx->test_data = test;
+	ctx->handler = test->handler;
+
+	talloc_free(test->ctx);
+	test->ctx = ctx;
+}
+
+static struct parser_file_cache *file_cache(struct discover_context *ctx)
+{
+	if (!ctx->file_cache) {
+		ctx->file_cache = talloc_zero(ctx, struct parser_file_cache);
+		list_init(&ctx->file_cache->accesses);
+	}
+
+	return ctx->file_cache;
+}
+
+static void test_note_access(struct discover_context *ctx,
+		struct discover_device *dev, const char *filename,
+		struct test_file *file, bool read)
+{
+	struct parser_file_cache *cache = file_cache(ctx);
+	struct test_access *access;
+
+	if (dev != ctx->device) {
+		cache->incomplete = true;
+		return;
+	}
+
+	list_for_each_entry(&cache->accesses, access, list) {
+		if (!strcmp(access->filename, filename))
+			goto found;
+	}
+
+	access = talloc_zero(cache, struct test_access);
+	access->filename = talloc_strdup(access, filename);
+	list_add_tail(&cache->accesses, &access->list);
+
+found:
+	access->file = file;
+	access->read |= read;
+}
+
+static void test_file_stat(struct test_file *file, struct stat *statbuf)
+{
+	memset(statbuf, 0, sizeof(*statbuf));
+	statbuf->st_size = (off_t)file->size;
+	statbuf->st_mtim = file->mtime;
+	switch (file->type) {
+	case TEST_FILE:
+		statbuf->st_mode = S_IFREG;
+		break;
+	case TEST_DIR:
+		statbuf->st_mode = S_IFDIR;
+		break;
+	default:
+		fprintf(stderr, "%s: bad test file mode %d!", __func__,
+			file->type);
+		exit(EXIT_FAILURE);
+	}
 }
 
 void test_set_event_source(struct parser_test *test)
@@ -234,9 +375,11 @@ int parser_request_file(struct discover_context *ctx,
 		if (file->type != TEST_FILE)
 			continue;
 
+		test_note_access(ctx, dev, filename, file, true);
+
 		/* the read_file() interface always adds a trailing null
 		 * for string-safety; do the same here */
-		tmp = talloc_array(test, char, file->size + 1);
+		tmp = talloc_array(ctx, char, file->size + 1);
 		memcpy(tmp, file->data, file->size);
 		tmp[file->size] = '\0';
 		*buf = tmp;
@@ -244,6 +387,8 @@ int parser_request_file(struct discover_context *ctx,
 		return 0;
 	}
 
+	test_note_access(ctx, dev, filename, NULL, true);
+
 	return -1;
 }
 
@@ -260,23 +405,16 @@ int parser_stat_path(struct discover_context *ctx,
 		if (path && strcmp(file->name, path))
 			continue;
 
-		statbuf->st_size = (off_t)file->size;
-		switch (file->type) {
-		case TEST_FILE:
-			statbuf->st_mode = S_IFREG;
-			break;
-		case TEST_DIR:
-			statbuf->st_mode = S_IFDIR;
-			break;
-		default:
-			fprintf(stderr, "%s: bad test file mode %d!", __func__,
-				file->type);
-			exit(EXIT_FAILURE);
-		}
+		if (path)
+			test_note_access(ctx, dev, path, file, false);
 
+		test_file_stat(file, statbuf);
 		return 0;
 	}
 
+	if (path)
+		test_note_access(ctx, dev, path, NULL, false);
+
 	return -1;
 }
 
@@ -306,6 +444,8 @@ int parser_replace_file(struct discover_context *ctx,
 
 	file->data = talloc_memdup(test, buf, len);
 	file->size = len;
+	test_file_changed(test, file);
+	file_cache(ctx)->incomplete = true;
 	return 0;
 }
 
@@ -319,8 +459,13 @@ int parser_scandir(struct discover_context *ctx, const char *dirname,
 	struct test_file *f;
 	char *filename;
 	struct dirent **dirents = NULL, **new_dirents;
+	struct stat statbuf;
 	int n = 0, namelen;
 
+	/* as with the real parser_scandir, the directory's stat result
+	 * stands in for the listing */
+	parser_stat_path(ctx, ctx->device, dirname, &statbuf);
+
 	list_for_each_entry(&test->files, f, list) {
 		if (f->dev != ctx->device)
 			continue;
@@ -451,6 +596,8 @@ int parser_request_url(struct discover_context *ctx, struct pb_url *url,
 	struct test_file *file;
 	char *tmp;
 
+	file_cache(ctx)->incomplete = true;
+
 	list_for_each_entry(&test->files, file, list) {
 		if (file->dev)
 			continue;
@@ -460,7 +607,7 @@ int parser_request_url(struct discover_context *ctx, struct pb_url *url,
 
 		/* the read_file() interface always adds a trailing null
 		 * for string-safety; do the same here */
-		tmp = talloc_array(test, char, file->size + 1);
+		tmp = talloc_array(ctx, char, file->size + 1);
 		memcpy(tmp, file->data, file->size);
 		tmp[file->size] = '\0';
 		*buf = tmp;
@@ -471,18 +618,105 @@ int parser_request_url(struct discover_context *ctx, struct pb_url *url,
 	return -1;
 }
 
-int test_run_parser(struct parser_test *test, const char *parser_name)
+static struct parser *test_find_parser(const char *parser_name)
 {
 	struct p_item* i;
 
 	list_for_each_entry(&parsers, i, list) {
-		if (strcmp(i->parser->name, parser_name))
+		if (!strcmp(i->parser->name, parser_name))
+			return i->parser;
+	}
+
+	errx(EXIT_FAILURE, "parser '%s' not found", parser_name);
+}
+
+int test_run_parser(struct parser_test *test, const char *parser_name)
+{
+	test->ctx->parser = test_find_parser(parser_name);
+	return test->ctx->parser->parse(test->ctx);
+}
+
+/* The test and parser for the device handler's discover jobs; see
+ * test_discover_devices() */
+static struct parser_test *discover_test;
+static struct parser *discover_parser;
+
+/* Called from the discover workers. Committing the context is stubbed out,
+ * so move the options to the device here, where the test can find them; the
+ * device isn't used by anything else until the job completes. */
+void iterate_parsers(struct discover_context *ctx)
+{
+	struct discover_boot_option *opt, *tmp;
+
+	assert(discover_parser);
+
+	ctx->test_data = discover_test;
+	ctx->parser = discover_parser;
+	discover_parser->parse(ctx);
+
+	list_for_each_entry_safe(&ctx->boot_options, opt, tmp, list) {
+		list_remove(&opt->list);
+		list_add_tail(&ctx->device->boot_options, &opt->list);
+		talloc_steal(ctx->device, opt);
+	}
+}
+
+void test_discover_devices(struct parser_test *test, const char *parser_name,
+		struct discover_device **devs, unsigned int n_devs)
+{
+	unsigned int i;
+
+	discover_test = test;
+	discover_parser = test_find_parser(parser_name);
+
+	for (i = 0; i < n_devs; i++)
+		device_handler_discover(test->handler, devs[i]);
+
+	for (i = 0; i < n_devs; i++)
+		while (devs[i]->discover_job)
+			waiter_poll(test->waitset);
+
+	discover_parser = NULL;
+}
+
+struct parser *parser_lookup(const char *name)
+{
+	struct p_item *i;
+
+	list_for_each_entry(&parsers, i, list) {
+		if (!strcmp(i->parser->name, name))
+			return i->parser;
+	}
+
+	return NULL;
+}
+
+int parser_walk_files(struct discover_context *ctx, parser_file_cb cb,
+		void *arg)
+{
+	struct test_access *access;
+	struct stat statbuf;
+
+	if (!ctx->file_cache)
+		return 0;
+
+	if (ctx->file_cache->incomplete)
+		return -1;
+
+	list_for_each_entry(&ctx->file_cache->accesses, access, list) {
+		if (!access->file) {
+			memset(&statbuf, 0, sizeof(statbuf));
+			cb(ctx, access->filename, -1, &statbuf, NULL, 0, arg);
 			continue;
-		test->ctx->parser = i->parser;
-		return i->parser->parse(test->ctx);
+		}
+
+		test_file_stat(access->file, &statbuf);
+		cb(ctx, access->filename, 0, &statbuf,
+			access->read ? access->file->data : NULL,
+			access->file->size, arg);
 	}
 
-	errx(EXIT_FAILURE, "%s: parser '%s' not found", __func__, parser_name);
+	return 0;
 }
 
 bool resource_resolve(struct device_handler *handler, struct parser *parser,
@@ -748,3 +982,14 @@ void __check_file_contents(struct parser_test *test,
 		exit(EXIT_FAILURE);
 	}
 }
+
+void __check_option_cache_replay(struct parser_test *test,
+		struct option_cache *cache, struct discover_device *dev,
+		bool replayed, const char *file, int line)
+{
+	test_new_context(test, dev);
+
+	if (option_cache_replay(cache, test->ctx) != replayed)
+		errx(EXIT_FAILURE, "%s:%d: Options were %sreplayed from the "
+				"cache", file, line, replayed ? "not " : "");
+}
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 
 #include <sys/socket.h>
@@ -17,22 +18,67 @@
 
 #include <talloc/talloc.h>
 #include <log/log.h>
+#include <file/file.h>
+#include <waiter/waiter.h>
 
 #include "discover-client.h"
 #include "pb-protocol/pb-protocol.h"
 
+/* How long to wait between attempts to reconnect to the server.
+ *
+ * We reconnect by ourselves because the server disconnects clients that
+ * fall too far behind; without this, a UI that stalled for a moment would
+ * stay stale until it was restarted, and the server's journal is sized so
+ * that such a client can then resume. A restarted server is handled the
+ * same way. Retrying is just a connect() each second, the same interval
+ * that petitboot-nc polls for the server at startup. */
+#define RECONNECT_DELAY_MS	1000
+
 struct discover_client {
 	int fd;
+	struct waitset *waitset;
+	struct waiter *waiter;
+	struct waiter *reconnect_waiter;
+	struct pb_protocol_reader *reader;
 	struct discover_client_ops ops;
 	int n_devices;
 	struct device **devices;
+	struct system_info *sysinfo;
 	bool authenticated;
+	/* the largest payload the server will accept */
+	unsigned int max_payload;
+	/* the server's session, and the last event we have seen from it */
+	uint32_t session;
+	uint64_t seq;
+	/* we have reconnected, and don't yet know whether the server will
+	 * resume our session or send its full state */
+	bool resyncing;
+	/* copies of the messages for the state that we hand off to the UI,
+	 * so that we can save it to ops.state_file */
+	struct pb_protocol_message *config_msg;
+	struct pb_protocol_message **plugin_msgs;
+	unsigned int n_plugin_msgs;
+	/* state loaded from ops.state_file, with the records from
+	 * saved_offset not yet added */
+	struct pb_protocol_message *saved_state;
+	unsigned int saved_offset;
 };
 
+static void discover_client_save_state(struct discover_client *client);
+
 static int discover_client_destructor(void *arg)
 {
 	struct discover_client *client = arg;
 
+	if (client->ops.state_file)
+		discover_client_save_state(client);
+
+	if (client->reconnect_waiter)
+		waiter_remove(client->reconnect_waiter);
+
+	if (client->waiter)
+		waiter_remove(client->waiter);
+
 	if (client->fd >= 0)
 		close(client->fd);
 
@@ -129,10 +175,23 @@ static void plugin_option_add(struct discover_client *client,
 
 static void plugins_remove(struct discover_client *client)
 {
+	talloc_free(client->plugin_msgs);
+	client->plugin_msgs = NULL;
+	client->n_plugin_msgs = 0;
+
 	if (client->ops.plugins_remove)
 		client->ops.plugins_remove(client->ops.cb_arg);
 }
 
+/* Drop our state before the server sends all of it again */
+static void clear_state(struct discover_client *client)
+{
+	while (client->n_devices)
+		device_remove(client, client->devices[0]->id);
+
+	plugins_remove(client);
+}
+
 void discover_client_enumerate(struct discover_client *client)
 {
 	struct boot_option *opt;
@@ -165,6 +224,104 @@ static void update_sysinfo(struct discover_client *client,
 		client->ops.update_sysinfo(sysinfo, client->ops.cb_arg);
 }
 
+static int find_interface(struct system_info *sysinfo,
+		const struct interface_info *if_info)
+{
+	unsigned int i;
+
+	for (i = 0; i < sysinfo->n_interfaces; i++) {
+		struct interface_info *tmp = sysinfo->interfaces[i];
+
+		if (tmp->hwaddr_size == if_info->hwaddr_size &&
+				!memcmp(tmp->hwaddr, if_info->hwaddr,
+					if_info->hwaddr_size))
+			return i;
+	}
+
+	return -1;
+}
+
+static int find_blockdev(struct system_info *sysinfo,
+		const struct blockdev_info *bd_info)
+{
+	unsigned int i;
+
+	if (!bd_info->name)
+		return -1;
+
+	for (i = 0; i < sysinfo->n_blockdevs; i++) {
+		struct blockdev_info *tmp = sysinfo->blockdevs[i];
+
+		if (tmp->name && !strcmp(tmp->name, bd_info->name))
+			return i;
+	}
+
+	return -1;
+}
+
+/* Apply a single change to an array of interface_info or blockdev_info
+ * pointers. Adds and updates replace any existing entry, so that we stay
+ * consistent with the server if a change is repeated. */
+static void apply_change(struct system_info *sysinfo, void ***entries,
+		unsigned int *n_entries, int idx,
+		enum system_info_change_type type, void *entry)
+{
+	if (type == SYSTEM_INFO_CHANGE_REMOVE) {
+		if (idx < 0)
+			return;
+
+		talloc_free((*entries)[idx]);
+		(*n_entries)--;
+		memmove(&(*entries)[idx], &(*entries)[idx + 1],
+				(*n_entries - idx) * sizeof((*entries)[0]));
+		return;
+	}
+
+	talloc_steal(sysinfo, entry);
+
+	if (idx >= 0) {
+		talloc_free((*entries)[idx]);
+		(*entries)[idx] = entry;
+		return;
+	}
+
+	(*n_entries)++;
+	*entries = talloc_realloc(sysinfo, *entries, void *, *n_entries);
+	(*entries)[*n_entries - 1] = entry;
+}
+
+static void update_sysinfo_changes(struct discover_client *client,
+		struct system_info_update *update)
+{
+	struct system_info *sysinfo = client->sysinfo;
+	unsigned int i;
+
+	/* we can only apply changes to the full sysinfo from the server */
+	if (!sysinfo) {
+		pb_log_fn("sysinfo update before sysinfo?\n");
+		return;
+	}
+
+	for (i = 0; i < update->n_changes; i++) {
+		struct system_info_change *change = &update->changes[i];
+
+		if (change->interface)
+			apply_change(sysinfo, (void ***)&sysinfo->interfaces,
+					&sysinfo->n_interfaces,
+					find_interface(sysinfo,
+						change->interface),
+					change->type, change->interface);
+		else
+			apply_change(sysinfo, (void ***)&sysinfo->blockdevs,
+					&sysinfo->n_blockdevs,
+					find_blockdev(sysinfo,
+						change->blockdev),
+					change->type, change->blockdev);
+	}
+
+	update_sysinfo(client, sysinfo);
+}
+
 static void update_config(struct discover_client *client,
 		struct config *config)
 {
@@ -172,29 +329,46 @@ static void update_config(struct discover_client *client,
 		client->ops.update_config(config, client->ops.cb_arg);
 }
 
-static int discover_client_process(void *arg)
+static void loop_stats(struct discover_client *client, const char *stats)
+{
+	if (client->ops.loop_stats)
+		client->ops.loop_stats(stats, client->ops.cb_arg);
+}
+
+static void handle_snapshot(struct discover_client *client, void *ctx,
+		const struct pb_protocol_message *snapshot);
+
+static struct pb_protocol_message *copy_message(void *ctx,
+		const struct pb_protocol_message *message)
+{
+	return talloc_memdup(ctx, message,
+			sizeof(*message) + message->payload_len);
+}
+
+static void handle_message(struct discover_client *client, void *ctx,
+		const struct pb_protocol_message *message)
 {
-	struct discover_client *client = arg;
-	struct pb_protocol_message *message;
 	struct auth_message *auth_msg;
 	struct plugin_option *p_opt;
+	struct system_info_update *sysinfo_update;
 	struct system_info *sysinfo;
 	struct boot_option *opt;
 	struct status *status;
 	struct config *config;
 	struct device *dev;
-	char *dev_id;
-	void *ctx;
+	struct pb_protocol_hello hello;
+	char *dev_id, *stats;
 	int rc;
 
-	/* We use a temporary context for processing one message; persistent
-	 * data is re-parented to the client in the callbacks. */
-	ctx = talloc_new(client);
-
-	message = pb_protocol_read_message(ctx, client->fd);
-
-	if (!message)
-		return -1;
+	/* After reconnecting, anything other than the server's HELLO or
+	 * authentication response means that it is sending its full state */
+	if (client->resyncing &&
+			message->action != PB_PROTOCOL_ACTION_HELLO &&
+			message->action != PB_PROTOCOL_ACTION_AUTHENTICATE) {
+		pb_log("Server state not resumed; resynchronising\n");
+		clear_state(client);
+		client->resyncing = false;
+	}
 
 	switch (message->action) {
 	case PB_PROTOCOL_ACTION_DEVICE_ADD:
@@ -204,7 +378,7 @@ static int discover_client_process(void *arg)
 		rc = pb_protocol_deserialise_device(dev, message);
 		if (rc) {
 			pb_log_fn("no device?\n");
-			goto out;
+			return;
 		}
 
 		device_add(client, dev);
@@ -215,7 +389,7 @@ static int discover_client_process(void *arg)
 		rc = pb_protocol_deserialise_boot_option(opt, message);
 		if (rc) {
 			pb_log_fn("no boot_option?\n");
-			goto out;
+			return;
 		}
 
 		boot_option_add(client, opt);
@@ -224,7 +398,7 @@ static int discover_client_process(void *arg)
 		dev_id = pb_protocol_deserialise_string(ctx, message);
 		if (!dev_id) {
 			pb_log_fn("no device id?\n");
-			goto out;
+			return;
 		}
 		device_remove(client, dev_id);
 		break;
@@ -234,7 +408,7 @@ static int discover_client_process(void *arg)
 		rc = pb_protocol_deserialise_boot_status(status, message);
 		if (rc) {
 			pb_log_fn("invalid status message?\n");
-			goto out;
+			return;
 		}
 		update_status(client, status);
 		break;
@@ -244,17 +418,34 @@ static int discover_client_process(void *arg)
 		rc = pb_protocol_deserialise_system_info(sysinfo, message);
 		if (rc) {
 			pb_log_fn("invalid sysinfo message?\n");
-			goto out;
+			return;
 		}
+		talloc_free(client->sysinfo);
+		client->sysinfo = talloc_steal(client, sysinfo);
 		update_sysinfo(client, sysinfo);
 		break;
+	case PB_PROTOCOL_ACTION_SYSTEM_INFO_UPDATE:
+		sysinfo_update = talloc_zero(ctx, struct system_info_update);
+
+		rc = pb_protocol_deserialise_system_info_update(sysinfo_update,
+				message);
+		if (rc) {
+			pb_log_fn("invalid sysinfo update message?\n");
+			return;
+		}
+		update_sysinfo_changes(client, sysinfo_update);
+		break;
 	case PB_PROTOCOL_ACTION_CONFIG:
 		config = talloc_zero(ctx, struct config);
 
 		rc = pb_protocol_deserialise_config(config, message);
 		if (rc) {
 			pb_log_fn("invalid config message?\n");
-			goto out;
+			return;
+		}
+		if (client->ops.state_file) {
+			talloc_free(client->config_msg);
+			client->config_msg = copy_message(client, message);
 		}
 		update_config(client, config);
 		break;
@@ -264,9 +455,17 @@ static int discover_client_process(void *arg)
 		rc = pb_protocol_deserialise_plugin_option(p_opt, message);
 		if (rc) {
 			pb_log_fn("no plugin_option?\n");
-			goto out;
+			return;
 		}
 
+		if (client->ops.state_file) {
+			client->plugin_msgs = talloc_realloc(client,
+					client->plugin_msgs,
+					struct pb_protocol_message *,
+					client->n_plugin_msgs + 1);
+			client->plugin_msgs[client->n_plugin_msgs++] =
+				copy_message(client->plugin_msgs, message);
+		}
 		plugin_option_add(client, p_opt);
 		break;
 	case PB_PROTOCOL_ACTION_PLUGINS_REMOVE:
@@ -279,46 +478,408 @@ static int discover_client_process(void *arg)
 		if (rc || auth_msg->op != AUTH_MSG_RESPONSE) {
 			pb_log("%s: invalid auth message? (%d)\n",
 					__func__, rc);
-			goto out;
+			return;
 		}
 
 		pb_log("Client %sauthenticated by server\n",
 				client->authenticated ? "" : "un");
 		client->authenticated = auth_msg->authenticated;
 		break;
+	case PB_PROTOCOL_ACTION_LOOP_STATS:
+		stats = pb_protocol_deserialise_string(ctx, message);
+		if (!stats) {
+			pb_log_fn("no loop stats?\n");
+			return;
+		}
+		loop_stats(client, stats);
+		break;
+	case PB_PROTOCOL_ACTION_SNAPSHOT:
+		handle_snapshot(client, ctx, message);
+		break;
+	case PB_PROTOCOL_ACTION_HELLO:
+		rc = pb_protocol_deserialise_hello(&hello, message);
+		if (rc) {
+			pb_log_fn("invalid hello message?\n");
+			return;
+		}
+		if (hello.capabilities & PB_PROTOCOL_CAP_CHUNKED &&
+				hello.max_payload > client->max_payload)
+			client->max_payload = hello.max_payload;
+
+		if (!(hello.capabilities & PB_PROTOCOL_CAP_SEQUENCE))
+			break;
+
+		/* The server resumes our session by replying with the
+		 * sequence number we sent; otherwise, its full state
+		 * follows. */
+		if (client->resyncing) {
+			if (hello.session == client->session &&
+					hello.seq == client->seq)
+				pb_log("Resumed server session at %" PRIu64
+						"\n", client->seq);
+			else
+				clear_state(client);
+			client->resyncing = false;
+		}
+
+		client->session = hello.session;
+		client->seq = hello.seq;
+		break;
+	case PB_PROTOCOL_ACTION_SEQUENCE:
+		rc = pb_protocol_deserialise_sequence(&client->seq, message);
+		if (rc) {
+			pb_log_fn("invalid sequence message?\n");
+			return;
+		}
+		break;
 	default:
 		pb_log_fn("unknown action %d\n", message->action);
 	}
+}
+
+/* A snapshot carries a set of messages from the server's current state, so
+ * we handle each record as if it had been sent on its own. */
+static void handle_snapshot(struct discover_client *client, void *ctx,
+		const struct pb_protocol_message *snapshot)
+{
+	struct pb_protocol_message *record = NULL;
+	unsigned int offset = 0;
+	int rc;
+
+	for (;;) {
+		rc = pb_protocol_snapshot_next_record(ctx, snapshot, &offset,
+				&record);
+		if (rc) {
+			if (rc < 0)
+				pb_log_fn("invalid snapshot message?\n");
+			break;
+		}
+
+		if (record->action == PB_PROTOCOL_ACTION_SNAPSHOT) {
+			pb_log_fn("nested snapshot?\n");
+			break;
+		}
+
+		handle_message(client, ctx, record);
+	}
+}
+
+/* Save our state to ops.state_file, as the payload of a snapshot message
+ * that starts with a HELLO record for where we are in the server's
+ * session, and a SUBSCRIBE record for what the state covers. The other
+ * records are in the order that the server sends its state. */
+static void discover_client_save_state(struct discover_client *client)
+{
+	struct pb_protocol_subscription sub;
+	struct pb_protocol_message *state;
+	struct pb_protocol_hello hello;
+	struct boot_option *opt;
+	struct device *dev;
+	unsigned int i;
+	char *buf;
+	int j, len;
+
+	/* our state is only complete, and current as of seq, once we're
+	 * synced with a session */
+	if (!client->session || client->resyncing || client->saved_state)
+		return;
+
+	state = pb_protocol_create_snapshot(client);
+	if (!state)
+		return;
+
+	hello.capabilities = PB_PROTOCOL_CAP_SEQUENCE;
+	hello.max_payload = 0;
+	hello.session = client->session;
+	hello.seq = client->seq;
+
+	len = pb_protocol_hello_len();
+	buf = pb_protocol_snapshot_append(&state, PB_PROTOCOL_ACTION_HELLO,
+			len);
+	if (!buf)
+		goto out;
+	pb_protocol_serialise_hello(&hello, buf, len);
+
+	sub.classes = client->ops.subscriptions;
+	sub.device_types = client->ops.device_types;
+
+	len = pb_protocol_subscription_len();
+	buf = pb_protocol_snapshot_append(&state,
+			PB_PROTOCOL_ACTION_SUBSCRIBE, len);
+	if (!buf)
+		goto out;
+	pb_protocol_serialise_subscription(&sub, buf, len);
+
+	if (client->sysinfo) {
+		len = pb_protocol_system_info_len(client->sysinfo);
+		buf = pb_protocol_snapshot_append(&state,
+				PB_PROTOCOL_ACTION_SYSTEM_INFO, len);
+		if (!buf)
+			goto out;
+		pb_protocol_serialise_system_info(client->sysinfo, buf, len);
+	}
+
+	if (client->config_msg && pb_protocol_snapshot_append_message(&state,
+				client->config_msg))
+		goto out;
+
+	for (j = 0; j < client->n_devices; j++) {
+		dev = client->devices[j];
+
+		len = pb_protocol_device_len(dev);
+		buf = pb_protocol_snapshot_append(&state,
+				PB_PROTOCOL_ACTION_DEVICE_ADD, len);
+		if (!buf)
+			goto out;
+		pb_protocol_serialise_device(dev, buf, len);
+
+		/* boot_option_add() adds options to the head of the list, so
+		 * go backwards to add them again in the same order */
+		for (opt = list_entry(dev->boot_options.head.prev,
+					struct boot_option, list,
+					&dev->boot_options);
+				opt; opt = list_prev_entry(&dev->boot_options,
+					opt, list)) {
+			len = pb_protocol_boot_option_len(opt);
+			buf = pb_protocol_snapshot_append(&state,
+					PB_PROTOCOL_ACTION_BOOT_OPTION_ADD,
+					len);
+			if (!buf)
+				goto out;
+			pb_protocol_serialise_boot_option(opt, buf, len);
+		}
+	}
+
+	for (i = 0; i < client->n_plugin_msgs; i++)
+		if (pb_protocol_snapshot_append_message(&state,
+					client->plugin_msgs[i]))
+			goto out;
+
+	if (replace_file(client->ops.state_file, state->payload,
+				state->payload_len))
+		pb_log("Failed to save state to %s\n", client->ops.state_file);
 
 out:
+	talloc_free(state);
+}
+
+/* Load the state saved by an earlier client run as our user, if it covers
+ * the same subscriptions as ours. Its records are added when we're first
+ * polled, as the UI may not be ready for them yet. */
+static void discover_client_load_state(struct discover_client *client)
+{
+	struct pb_protocol_message *state, *record = NULL;
+	struct pb_protocol_subscription sub;
+	struct pb_protocol_hello hello;
+	unsigned int offset = 0;
+	char *buf;
+	int len;
+
+	if (read_file_owned(client, client->ops.state_file, &buf, &len))
+		return;
+
+	state = talloc_size(client, sizeof(*state) + len);
+	state->action = PB_PROTOCOL_ACTION_SNAPSHOT;
+	state->payload_len = len;
+	memcpy(state->payload, buf, len);
+	talloc_free(buf);
+
+	if (pb_protocol_snapshot_next_record(state, state, &offset, &record) ||
+			record->action != PB_PROTOCOL_ACTION_HELLO ||
+			pb_protocol_deserialise_hello(&hello, record))
+		goto err;
+
+	if (pb_protocol_snapshot_next_record(state, state, &offset, &record) ||
+			record->action != PB_PROTOCOL_ACTION_SUBSCRIBE ||
+			pb_protocol_deserialise_subscription(&sub, record))
+		goto err;
+
+	if (sub.classes != client->ops.subscriptions ||
+			sub.device_types != client->ops.device_types)
+		goto err;
+
+	talloc_free(record);
+	client->saved_state = state;
+	client->saved_offset = offset;
+	client->session = hello.session;
+	client->seq = hello.seq;
+
+	/* the server will tell us whether this is still current */
+	client->resyncing = true;
+	return;
+
+err:
+	pb_debug("Ignoring saved state in %s\n", client->ops.state_file);
+	talloc_free(state);
+}
+
+/* Add the records from the state that we loaded at startup */
+static void discover_client_restore_state(struct discover_client *client)
+{
+	struct pb_protocol_message *record = NULL;
+	bool resyncing = client->resyncing;
+	void *ctx;
+
+	ctx = talloc_new(client);
+
+	/* these are our own state, rather than the server's full state */
+	client->resyncing = false;
+
+	while (!pb_protocol_snapshot_next_record(ctx, client->saved_state,
+				&client->saved_offset, &record))
+		handle_message(client, ctx, record);
+
+	client->resyncing = resyncing;
+
 	talloc_free(ctx);
+	talloc_free(client->saved_state);
+	client->saved_state = NULL;
+}
+
+static int discover_client_reconnect(void *arg);
+
+static void discover_client_disconnect(struct discover_client *client)
+{
+	if (client->waiter) {
+		waiter_remove(client->waiter);
+		client->waiter = NULL;
+	}
+
+	if (client->fd >= 0) {
+		close(client->fd);
+		client->fd = -1;
+	}
+
+	talloc_free(client->reader);
+	client->reader = NULL;
+}
+
+static void discover_client_schedule_reconnect(struct discover_client *client)
+{
+	client->reconnect_waiter = waiter_register_timeout(client->waitset,
+			RECONNECT_DELAY_MS, discover_client_reconnect, client);
+}
+
+static int discover_client_process(void *arg)
+{
+	struct discover_client *client = arg;
+	struct pb_protocol_message *message;
+	void *ctx;
+	int rc;
+
+	if (client->saved_state)
+		discover_client_restore_state(client);
+
+	rc = pb_protocol_reader_fill(client->reader);
+	if (rc)
+		goto err_disconnect;
+
+	while (!(rc = pb_protocol_reader_next(client->reader, &message))) {
+		/* We use a temporary context for processing one message;
+		 * persistent data is re-parented to the client in the
+		 * callbacks. */
+		ctx = talloc_new(client);
+		handle_message(client, ctx, message);
+		talloc_free(ctx);
+	}
+
+	if (rc < 0)
+		goto err_disconnect;
 
 	return 0;
+
+err_disconnect:
+	/* Our waiter is removed when we return non-zero */
+	pb_log("Lost connection to server; reconnecting\n");
+	client->waiter = NULL;
+	discover_client_disconnect(client);
+	discover_client_schedule_reconnect(client);
+	return -1;
 }
 
-struct discover_client* discover_client_init(struct waitset *waitset,
-	const struct discover_client_ops *ops, void *cb_arg)
+static int discover_client_write_message(struct discover_client *client,
+		struct pb_protocol_message *message)
 {
-	struct discover_client *client;
-	struct sockaddr_un addr;
+	if (client->fd < 0) {
+		pb_log_fn("not connected to server\n");
+		talloc_free(message);
+		return -1;
+	}
 
-	client = talloc(NULL, struct discover_client);
-	if (!client)
-		return NULL;
+	if (message->payload_len > client->max_payload) {
+		pb_log_fn("message too large for server (%u/%u bytes)\n",
+				message->payload_len, client->max_payload);
+		talloc_free(message);
+		return -1;
+	}
 
-	memcpy(&client->ops, ops, sizeof(client->ops));
-	client->ops.cb_arg = cb_arg;
+	return pb_protocol_write_message(client->fd, message);
+}
+
+static int discover_client_send_hello(struct discover_client *client)
+{
+	struct pb_protocol_message *message;
+	struct pb_protocol_hello hello;
+	int len;
+
+	len = pb_protocol_hello_len();
+
+	message = pb_protocol_create_message(client,
+			PB_PROTOCOL_ACTION_HELLO, len);
+	if (!message)
+		return -1;
+
+	hello.capabilities = PB_PROTOCOL_CAP_SNAPSHOT |
+			PB_PROTOCOL_CAP_CHUNKED |
+			PB_PROTOCOL_CAP_SEQUENCE;
+	hello.max_payload = PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE;
+	hello.session = client->session;
+	hello.seq = client->seq;
+
+	pb_protocol_serialise_hello(&hello, message->payload, len);
+
+	return discover_client_write_message(client, message);
+}
+
+static int discover_client_send_subscription(struct discover_client *client)
+{
+	struct pb_protocol_message *message;
+	struct pb_protocol_subscription sub;
+	int len;
+
+	len = pb_protocol_subscription_len();
+
+	message = pb_protocol_create_message(client,
+			PB_PROTOCOL_ACTION_SUBSCRIBE, len);
+	if (!message)
+		return -1;
+
+	sub.classes = client->ops.subscriptions;
+	sub.device_types = client->ops.device_types ?:
+				PB_PROTOCOL_DEVICE_TYPES_ALL;
+
+	pb_protocol_serialise_subscription(&sub, message->payload, len);
+
+	return discover_client_write_message(client, message);
+}
+
+static int discover_client_connect(struct discover_client *client)
+{
+	struct sockaddr_un addr;
 
 	client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (client->fd < 0) {
 		pb_log_fn("socket: %s\n", strerror(errno));
-		goto out_err;
+		return -1;
 	}
 
-	talloc_set_destructor(client, discover_client_destructor);
+	client->reader = pb_protocol_reader_create(client, client->fd);
+	if (!client->reader)
+		goto out_err;
 
-	client->n_devices = 0;
-	client->devices = NULL;
+	/* we tell the server that we can take chunked messages */
+	pb_protocol_reader_set_chunked_max(client->reader,
+			PB_PROTOCOL_MAX_CHUNKED_PAYLOAD_SIZE);
 
 	addr.sun_family = AF_UNIX;
 	strcpy(addr.sun_path, PB_SOCKET_PATH);
@@ -328,8 +889,96 @@ struct discover_client* discover_client_init(struct waitset *waitset,
 		goto out_err;
 	}
 
-	waiter_register_io(waitset, client->fd, WAIT_IN,
-			discover_client_process, client);
+	/* The server may have restarted, and will tell us again what it can
+	 * accept */
+	client->max_payload = PB_PROTOCOL_MAX_PAYLOAD_SIZE;
+
+	/* Subscriptions apply to the initial state too, so go first. We
+	 * only send one if we're filtering, as older servers don't know
+	 * about them. */
+	if (client->ops.subscriptions && discover_client_send_subscription(
+				client))
+		goto out_err;
+
+	/* Ask for our initial state as snapshot messages, tell the server
+	 * we can handle chunked messages, and where we are in its session
+	 * if we have been connected before. Older servers will log and
+	 * ignore this. */
+	if (discover_client_send_hello(client))
+		goto out_err;
+
+	client->waiter = waiter_register_io(client->waitset, client->fd,
+			WAIT_IN, discover_client_process, client);
+
+	return 0;
+
+out_err:
+	discover_client_disconnect(client);
+	return -1;
+}
+
+static int discover_client_reconnect(void *arg)
+{
+	struct discover_client *client = arg;
+
+	client->reconnect_waiter = NULL;
+
+	if (discover_client_connect(client)) {
+		discover_client_schedule_reconnect(client);
+		return 0;
+	}
+
+	pb_log("Reconnected to server\n");
+
+	/* Authentication is per-connection */
+#ifdef CRYPT_SUPPORT
+	client->authenticated = false;
+#endif
+	client->resyncing = true;
+
+	return 0;
+}
+
+struct discover_client* discover_client_init(struct waitset *waitset,
+	const struct discover_client_ops *ops, void *cb_arg)
+{
+	struct discover_client *client;
+
+	client = talloc(NULL, struct discover_client);
+	if (!client)
+		return NULL;
+
+	memcpy(&client->ops, ops, sizeof(client->ops));
+	client->ops.cb_arg = cb_arg;
+
+	if (!client->ops.subscriptions && client->ops.device_types)
+		client->ops.subscriptions = PB_PROTOCOL_SUB_ALL;
+
+	client->fd = -1;
+	client->waitset = waitset;
+	client->waiter = NULL;
+	client->reconnect_waiter = NULL;
+	client->reader = NULL;
+	client->n_devices = 0;
+	client->devices = NULL;
+	client->sysinfo = NULL;
+	client->max_payload = PB_PROTOCOL_MAX_PAYLOAD_SIZE;
+	client->session = 0;
+	client->seq = 0;
+	client->resyncing = false;
+	client->config_msg = NULL;
+	client->plugin_msgs = NULL;
+	client->n_plugin_msgs = 0;
+	client->saved_state = NULL;
+	client->saved_offset = 0;
+
+	talloc_set_destructor(client, discover_client_destructor);
+
+	if (client->ops.state_file)
+		discover_client_load_state(client);
+
+	if (discover_client_connect(client))
+		goto out_err;
 
 	/* Assume this client can't make changes if crypt support is enabled */
 #ifdef CRYPT_SUPPORT
@@ -401,7 +1050,7 @@ int discover_client_boot(struct discover_client *client,
 	pb_protocol_serialise_boot_command(&boot_command,
 			message->payload, len);
 
-	rc = pb_protocol_write_message(client->fd, message);
+	rc = discover_client_write_message(client, message);
 
 	return rc;
 }
@@ -416,7 +1065,7 @@ int discover_client_cancel_default(struct discover_client *client)
 	if (!message)
 		return -1;
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_reinit(struct discover_client *client)
@@ -429,7 +1078,7 @@ int discover_client_send_reinit(struct discover_client *client)
 	if (!message)
 		return -1;
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_config(struct discover_client *client,
@@ -447,7 +1096,7 @@ int discover_client_send_config(struct discover_client *client,
 
 	pb_protocol_serialise_config(config, message->payload, len);
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_url(struct discover_client *client,
@@ -465,7 +1114,7 @@ int discover_client_send_url(struct discover_client *client,
 
 	pb_protocol_serialise_url(url, message->payload, len);
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_plugin_install(struct discover_client *client,
@@ -483,7 +1132,20 @@ int discover_client_send_plugin_install(struct discover_client *client,
 
 	pb_protocol_serialise_url(file, message->payload, len);
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
+}
+
+int discover_client_send_loop_stats_request(struct discover_client *client)
+{
+	struct pb_protocol_message *message;
+
+	message = pb_protocol_create_message(client,
+			PB_PROTOCOL_ACTION_LOOP_STATS, 0);
+
+	if (!message)
+		return -1;
+
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_temp_autoboot(struct discover_client *client,
@@ -501,7 +1163,7 @@ int discover_client_send_temp_autoboot(struct discover_client *client,
 
 	pb_protocol_serialise_temp_autoboot(opt, message->payload, len);
 
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_authenticate(struct discover_client *client,
@@ -525,7 +1187,7 @@ int discover_client_send_authenticate(struct discover_client *client,
 	pb_protocol_serialise_authenticate(&auth_msg, message->payload, len);
 
 	pb_log("sending auth message..\n");
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_set_password(struct discover_client *client,
@@ -550,7 +1212,7 @@ int discover_client_send_set_password(struct discover_client *client,
 	pb_protocol_serialise_authenticate(&auth_msg, message->payload, len);
 
 	pb_log("sending auth message..\n");
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
 
 int discover_client_send_open_luks_device(struct discover_client *client,
@@ -575,5 +1237,5 @@ int discover_client_send_open_luks_device(struct discover_client *client,
 	pb_protocol_serialise_authenticate(&auth_msg, message->payload, len);
 
 	pb_log("sending auth message..\n");
-	return pb_protocol_write_message(client->fd, message);
+	return discover_client_write_message(client, message);
 }
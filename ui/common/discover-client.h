@@ -24,15 +24,37 @@ struct pb_plugin_data {
  * @device_add: PB_PROTOCOL_ACTION_ADD event callback.
  * @device_remove: PB_PROTOCOL_ACTION_REMOVE event callback.
  * @cb_arg: Client managed convenience variable passed to callbacks.
+ * @subscriptions: Mask of PB_PROTOCOL_SUB_* classes of notification to
+ *  receive from the server, or zero for all of them.
+ * @device_types: Mask of PB_PROTOCOL_DEVICE_TYPE() bits, for the devices
+ *  (and their boot options) to receive, or zero for all types.
+ * @state_file: If set, the client saves its state there when it is
+ *  destroyed, and the next client to start resumes the server's session
+ *  from it. A state file is only loaded if it is owned by the client's
+ *  user, and nobody else can write to it.
  *
  * The discover client holds talloc references to the devices (and the
  * devices' boot options), so callbacks may store boot options and devices
  * as long as the client remains allocated.
  *
- * The status and system_info structs are allocated by the client,
- * and will be free()ed after the callback is invoked. If the callback
- * stores these structures for usage beyond the duration of the callback,
- * it must talloc_steal() them.
+ * The status struct is allocated by the client, and will be free()ed after
+ * the callback is invoked. If the callback stores this structure for usage
+ * beyond the duration of the callback, it must talloc_steal() it.
+ *
+ * The system_info struct is the client's own copy, which is updated in
+ * place as changes arrive from the server; update_sysinfo is called after
+ * each change. Callbacks may keep a pointer to it (but not to its
+ * interfaces or blockdevs) while the client remains allocated, but must
+ * not steal or free it.
+ *
+ * If the connection to the server is lost, the client reconnects in the
+ * background. Where the server still has the events we missed, it sends
+ * just those; otherwise, devices and plugins are removed (through
+ * device_remove and plugins_remove) before the server's full state is
+ * added again. A client started with a saved state_file behaves the same
+ * way, with the saved devices, boot options, plugins, system info and
+ * config added (through the usual callbacks) once the client is first
+ * polled; status messages aren't saved.
  */
 
 struct discover_client_ops {
@@ -45,7 +67,11 @@ struct discover_client_ops {
 	void (*update_status)(struct status *status, void *arg);
 	void (*update_sysinfo)(struct system_info *sysinfo, void *arg);
 	void (*update_config)(struct config *sysinfo, void *arg);
+	void (*loop_stats)(const char *stats, void *arg);
 	void *cb_arg;
+	unsigned int subscriptions;
+	unsigned int device_types;
+	const char *state_file;
 };
 
 struct discover_client *discover_client_init(struct waitset *waitset,
@@ -117,6 +143,11 @@ int discover_client_send_set_password(struct discover_client *client,
 int discover_client_send_open_luks_device(struct discover_client *client,
 		char *password, char *device_id);
 
+/* Request the server's event loop callback statistics; the response is
+ * delivered through ops->loop_stats. Like other non-read-only actions, this
+ * needs a root or authenticated client. */
+int discover_client_send_loop_stats_request(struct discover_client *client);
+
 /* send a temporary autoboot override */
 int discover_client_send_temp_autoboot(struct discover_client *client,
 		const struct autoboot_option *opt);
@@ -53,6 +53,11 @@
 extern const struct help_text main_menu_help_text;
 extern const struct help_text plugin_menu_help_text;
 
+/* Our copy of pb-discover's state, kept between runs. This is in
+ * pb-discover's root-owned directory, rather than /tmp, so that no other
+ * user can give us a state to load. */
+#define CUI_STATE_FILE (LOCAL_STATE_DIR "/petitboot/ui-state")
+
 static bool cui_detached = false;
 
 static struct pmenu *main_menu_init(struct cui *cui);
@@ -1539,7 +1544,7 @@ static void cui_update_mm_title(struct cui *cui)
 static void cui_update_sysinfo(struct system_info *sysinfo, void *arg)
 {
 	struct cui *cui = cui_from_arg(arg);
-	cui->sysinfo = talloc_steal(cui, sysinfo);
+	cui->sysinfo = sysinfo;
 
 	/* if we're currently displaying the system info screen, inform it
 	 * of the updated information. */
@@ -1796,6 +1801,7 @@ static struct discover_client_ops cui_client_ops = {
 	.update_status = cui_update_status,
 	.update_sysinfo = cui_update_sysinfo,
 	.update_config = cui_update_config,
+	.state_file = CUI_STATE_FILE,
 };
 
 /* cui_server_wait - Connect to the discover server.
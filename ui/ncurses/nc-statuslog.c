@@ -36,7 +36,7 @@ static const int max_status_entry = 10000;
 struct statuslog {
 	struct list		status;
 	int			n_status;
-	bool			truncated;
+	unsigned long		n_dropped;
 };
 
 struct statuslog_screen {
@@ -48,7 +48,7 @@ struct statuslog *statuslog_init(struct cui *cui)
 	struct statuslog *sl;
 
 	sl = talloc(cui, struct statuslog);
-	sl->truncated = false;
+	sl->n_dropped = 0;
 	sl->n_status = 0;
 	list_init(&sl->status);
 
@@ -67,8 +67,15 @@ void statuslog_append_steal(struct cui *cui, struct statuslog *statuslog,
 	list_add_tail(&statuslog->status, &entry->list);
 
 	if (statuslog->n_status >= max_status_entry) {
-		list_remove(&statuslog->status.head);
-		statuslog->truncated = true;
+		struct statuslog_entry *old;
+
+		old = list_entry(statuslog->status.head.next,
+				struct statuslog_entry, list,
+				&statuslog->status);
+		list_remove(&old->list);
+		talloc_free(old->status);
+		talloc_free(old);
+		statuslog->n_dropped++;
 		statuslog->n_status--;
 	}
 
@@ -93,6 +100,12 @@ struct statuslog_screen *statuslog_screen_init(struct cui *cui,
 	title = _("Petitboot status log");
 
 	text_screen_init(&screen->text_scr, cui, title, on_exit);
+
+	if (cui->statuslog->n_dropped)
+		text_screen_append_line(&screen->text_scr,
+				_("(%lu earlier status messages not shown)"),
+				cui->statuslog->n_dropped);
+
 	list_for_each_entry(&cui->statuslog->status, entry, list) {
 		text_screen_append_line(&screen->text_scr, "%s",
 				entry->status->message);
@@ -115,12 +115,19 @@ static void print_sysinfo(struct system_info *sysinfo,
 	}
 }
 
+static void print_loop_stats(const char *stats,
+	void __attribute__((unused)) *arg)
+{
+	printf("loop stats:\n%s", stats);
+}
+
 static struct discover_client_ops client_ops = {
 	.device_add = print_device_add,
 	.boot_option_add = print_boot_option_add,
 	.device_remove = print_device_remove,
 	.update_status = print_status,
 	.update_sysinfo = print_sysinfo,
+	.loop_stats = print_loop_stats,
 };
 
 int main(void)
@@ -134,6 +141,8 @@ int main(void)
 	if (!client)
 		return -1;
 
+	discover_client_send_loop_stats_request(client);
+
 	for (;;) {
 		int rc;
 